@@ -56,6 +56,32 @@ else
 	echo "#undef HAVE_SYS_SELECT_H" >>include/config.h
 fi
 
+echo "Checking for epoll"
+$CC -c -o build/testfile.o $CFLAGS build/test-epoll.c 1>/dev/null 2>&1
+if test $? -eq 0; then
+	$CC -o build/testfile $CFLAGS build/testfile.o 1>/dev/null 2>&1
+	if test $? -eq 0; then
+		echo "#define HAVE_EPOLL 1" >>include/config.h
+	else
+		echo "#undef HAVE_EPOLL" >>include/config.h
+	fi
+else
+	echo "#undef HAVE_EPOLL" >>include/config.h
+fi
+
+echo "Checking for poll"
+$CC -c -o build/testfile.o $CFLAGS build/test-poll.c 1>/dev/null 2>&1
+if test $? -eq 0; then
+	$CC -o build/testfile $CFLAGS build/testfile.o 1>/dev/null 2>&1
+	if test $? -eq 0; then
+		echo "#define HAVE_POLL 1" >>include/config.h
+	else
+		echo "#undef HAVE_POLL" >>include/config.h
+	fi
+else
+	echo "#undef HAVE_POLL" >>include/config.h
+fi
+
 echo "Checking for u_int32_t typedef"
 $CC -c -o build/testfile.o $CFLAGS build/test-uint.c 1>/dev/null 2>&1
 if test $? -eq 0; then
@@ -98,12 +124,23 @@ fi
 
 
 # This is experimental for 4.3.x
-echo "Checking for POSIX binary tree functions"
-$CC -c -o build/testfile.o $CFLAGS build/test-bintree.c 1>/dev/null 2>&1
-if test $? -eq 0; then
-	echo "#define HAVE_BINARY_TREE 1" >>include/config.h
-else
+if test "$XTREEBACKEND" = "hash"; then
+	echo "Using the hashed skiplist for tree storage"
 	echo "#undef HAVE_BINARY_TREE" >>include/config.h
+	echo "#define HAVE_XTREE_HASH 1" >>include/config.h
+elif test "$XTREEBACKEND" = "array"; then
+	echo "Using the sorted array for tree storage"
+	echo "#undef HAVE_BINARY_TREE" >>include/config.h
+	echo "#undef HAVE_XTREE_HASH" >>include/config.h
+else
+	echo "Checking for POSIX binary tree functions"
+	$CC -c -o build/testfile.o $CFLAGS build/test-bintree.c 1>/dev/null 2>&1
+	if test $? -eq 0; then
+		echo "#define HAVE_BINARY_TREE 1" >>include/config.h
+	else
+		echo "#undef HAVE_BINARY_TREE" >>include/config.h
+	fi
+	echo "#undef HAVE_XTREE_HASH" >>include/config.h
 fi
 
 # Assume IPv4 is always supported (at least for now :-))
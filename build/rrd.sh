@@ -3,6 +3,7 @@
 	RRDDEF=""
 	RRDINC=""
 	RRDLIB=""
+	RRDLIBNAME="rrd"
 	PNGLIB=""
 	ZLIB=""
 	for DIR in /opt/rrdtool* /usr/local/rrdtool* /usr/local /usr/pkg /usr /opt/csw /opt/sfw /usr/sfw
@@ -126,6 +127,29 @@
 		echo "ERROR: Linking with RRDtool fails"
 		RRDOK="NO"
 	fi
+
+	# The RRD writer threads in xymond_rrd need a librrd that is thread-safe:
+	# The plain librrd from RRDtool 1.5 and later, or librrd_th from RRDtool 1.4
+	if test "$RRDOK" = "YES" -a "$RRDDEF" = "-DRRDTOOL14 -DRRDTOOL12"; then
+		echo "Checking for a thread-safe RRDtool library ..."
+		OS=`uname -s | sed -e's@/@_@g'` $MAKE -f Makefile.test-rrd clean
+		OS=`uname -s | sed -e's@/@_@g'` RRDDEF="$RRDDEF" RRDINC="$INCOPT" RRDLIB="$LIBOPT" PNGLIB="$PNGLIB" $MAKE -f Makefile.test-rrd test-threadsafe 2>/dev/null
+		if test $? -eq 0; then
+			echo "RRDtool 1.5 or later, librrd is thread-safe"
+			RRDDEF="$RRDDEF -DRRDTOOL_THREADSAFE"
+		else
+			OS=`uname -s | sed -e's@/@_@g'` $MAKE -f Makefile.test-rrd clean
+			OS=`uname -s | sed -e's@/@_@g'` RRDDEF="$RRDDEF" RRDINC="$INCOPT" $MAKE -f Makefile.test-rrd test-compile 2>/dev/null
+			OS=`uname -s | sed -e's@/@_@g'` RRDLIB="$LIBOPT" PNGLIB="$PNGLIB" $MAKE -f Makefile.test-rrd test-link-th 2>/dev/null
+			if test $? -eq 0; then
+				echo "Using the thread-safe librrd_th"
+				RRDDEF="$RRDDEF -DRRDTOOL_THREADSAFE"
+				RRDLIBNAME="rrd_th"
+			else
+				echo "No thread-safe RRDtool library, xymond_rrd cannot use writer threads"
+			fi
+		fi
+	fi
 	OS=`uname -s | sed -e's@/@_@g'` $MAKE -f Makefile.test-rrd clean
 	cd ..
 
@@ -0,0 +1,16 @@
+#include <sys/types.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+int main(int argc, char *argv[])
+{
+	int fd;
+	struct epoll_event ev;
+
+	fd = epoll_create(16);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	epoll_ctl(fd, EPOLL_CTL_ADD, 0, &ev);
+	return epoll_wait(fd, &ev, 1, 0);
+}
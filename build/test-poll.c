@@ -0,0 +1,12 @@
+#include <sys/types.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+int main(int argc, char *argv[])
+{
+	struct pollfd pfd;
+
+	pfd.fd = 0; pfd.events = POLLIN; pfd.revents = 0;
+	return poll(&pfd, 1, 0);
+}
@@ -26,6 +26,10 @@ int main(int argc, char *argv[])
 	rrd_clear_error();
 #ifdef RRDTOOL14
 	result = rrd_flushcached(pcount, rrdargs); printf("%d", result);
+#endif
+#ifdef TEST_THREADSAFE
+	/* rrd_create_r2() appeared in RRDtool 1.5, where the plain librrd became thread-safe */
+	printf("%p", (void *)rrd_create_r2);
 #endif
 	rrd_clear_error();
 #ifdef RRDTOOL12
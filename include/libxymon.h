@@ -80,10 +80,12 @@ typedef struct strbuffer_t {
 #include "../lib/reportlog.h"
 
 #include "../lib/availability.h"
+#include "../lib/binboard.h"
 #include "../lib/calc.h"
 #include "../lib/cgi.h"
 #include "../lib/color.h"
 #include "../lib/compression.h"
+#include "../lib/checkpoint.h"
 #include "../lib/crondate.h"
 #include "../lib/clientlocal.h"
 #include "../lib/digest.h"
@@ -92,6 +94,7 @@ typedef struct strbuffer_t {
 #include "../lib/errormsg.h"
 #include "../lib/files.h"
 #include "../lib/xymonrrd.h"
+#include "../lib/histogram.h"
 #include "../lib/holidays.h"
 #include "../lib/ipaccess.h"
 #include "../lib/loadalerts.h"
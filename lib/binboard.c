@@ -0,0 +1,338 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* This is a library module, part of libxymon.                                */
+/* It contains routines for writing and reading the binary format of the      */
+/* "xymondboard" response, requested with "format=binary".                    */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@storner.dk>                 */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+static char rcsid[] = "$Id$";
+
+/*
+ * Layout:
+ *
+ *   Header:   BINBOARD_MAGIC, u16 (little-endian) column count.
+ *   Rows:     'R' followed by one value for each column, in the order the
+ *             fields were requested.
+ *   End:      'E' after the last row. A response without it is incomplete.
+ *   Values:   'n' (a NULL value)
+ *             'i' varint value, zigzag-encoded - colors, timestamps, counters
+ *             's' varint length, the string and a NUL
+ *             'd' like 's', and the string is also the next entry in the
+ *                 string table. The first entry has id 0.
+ *             'r' varint id of a string table entry
+ *
+ * A varint holds 7 bits in each byte, least significant first, with the
+ * high bit set on all but the last byte. So a color is 2 bytes, and a
+ * timestamp 6 bytes.
+ *
+ * Host names, test names and other strings that repeat on many rows are
+ * sent once with 'd', and after that only as an 'r' reference. All strings
+ * in the buffer are NUL-terminated, so the reader hands out pointers into
+ * the buffer instead of copying them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libxymon.h"
+
+#define BINBOARD_MAGICSZ 14
+#define BINBOARD_HEADERSZ (BINBOARD_MAGICSZ + 2)
+
+struct binboard_writer_t {
+	void *strings;			/* String table: The string is the key, its id is the data */
+	unsigned long stringcount;
+};
+
+typedef struct binboard_value_t {
+	char *str;
+	long long val;
+} binboard_value_t;
+
+struct binboard_reader_t {
+	char *buf, *end, *pos;
+	int columns, done;
+	binboard_value_t *values;
+	char **strings;
+	unsigned long stringcount, stringsz;
+};
+
+
+static void put_le(unsigned char *p, unsigned long long val, int bytes)
+{
+	int i;
+
+	for (i = 0; (i < bytes); i++) { p[i] = (val & 0xFF); val >>= 8; }
+}
+
+static unsigned long long get_le(const char *p, int bytes)
+{
+	unsigned long long val = 0;
+	int i;
+
+	for (i = bytes-1; (i >= 0); i--) val = (val << 8) | (unsigned char)p[i];
+	return val;
+}
+
+static void addvarint(strbuffer_t *buf, char tag, unsigned long long val)
+{
+	unsigned char v[11];
+	int n = 0;
+
+	if (tag) v[n++] = tag;
+	while (val >= 0x80) { v[n++] = (val & 0x7F) | 0x80; val >>= 7; }
+	v[n++] = val;
+	addtobufferraw(buf, (char *)v, n);
+}
+
+static char *getvarint(char *p, char *end, unsigned long long *val)
+{
+	/* Returns a pointer to the byte after the varint, or NULL if it is invalid */
+	int shift;
+
+	*val = 0;
+	for (shift = 0; ((p < end) && (shift < 64)); shift += 7, p++) {
+		*val |= ((unsigned long long)(*p & 0x7F) << shift);
+		if ((*p & 0x80) == 0) return p+1;
+	}
+
+	return NULL;
+}
+
+
+binboard_writer_t *binboard_newwriter(void)
+{
+	binboard_writer_t *w;
+
+	w = (binboard_writer_t *)calloc(1, sizeof(binboard_writer_t));
+	w->strings = xtreeNew(strcmp);
+
+	return w;
+}
+
+void binboard_header(binboard_writer_t *w, strbuffer_t *buf, int columns)
+{
+	unsigned char hdr[BINBOARD_HEADERSZ];
+
+	memcpy(hdr, BINBOARD_MAGIC, BINBOARD_MAGICSZ);
+	put_le(hdr+BINBOARD_MAGICSZ, columns, 2);
+	addtobufferraw(buf, (char *)hdr, sizeof(hdr));
+}
+
+void binboard_row(binboard_writer_t *w, strbuffer_t *buf)
+{
+	addtobufferraw(buf, "R", 1);
+}
+
+static void addstring(strbuffer_t *buf, char tag, char *s)
+{
+	size_t len = strlen(s);
+
+	addvarint(buf, tag, len);
+	addtobufferraw(buf, s, len+1);
+}
+
+void binboard_addstr(binboard_writer_t *w, strbuffer_t *buf, char *s)
+{
+	if (s) addstring(buf, 's', s);
+	else addtobufferraw(buf, "n", 1);
+}
+
+void binboard_addname(binboard_writer_t *w, strbuffer_t *buf, char *s)
+{
+	xtreePos_t handle;
+
+	if (!s) {
+		addtobufferraw(buf, "n", 1);
+		return;
+	}
+
+	handle = xtreeFind(w->strings, s);
+	if (handle == xtreeEnd(w->strings)) {
+		xtreeAdd(w->strings, strdup(s), (void *)w->stringcount);
+		w->stringcount++;
+		addstring(buf, 'd', s);
+		return;
+	}
+
+	addvarint(buf, 'r', (unsigned long)xtreeData(w->strings, handle));
+}
+
+void binboard_addint(binboard_writer_t *w, strbuffer_t *buf, long long val)
+{
+	/* Zigzag encoding, so small negative numbers are also short */
+	addvarint(buf, 'i', ((unsigned long long)val << 1) ^ (unsigned long long)(val >> 63));
+}
+
+void binboard_end(binboard_writer_t *w, strbuffer_t *buf)
+{
+	addtobufferraw(buf, "E", 1);
+}
+
+void binboard_freewriter(binboard_writer_t *w)
+{
+	xtreePos_t handle;
+
+	if (!w) return;
+
+	for (handle = xtreeFirst(w->strings); (handle != xtreeEnd(w->strings)); handle = xtreeNext(w->strings, handle)) {
+		char *key = (char *)xtreeKey(w->strings, handle);
+		xfree(key);
+	}
+	xtreeDestroy(w->strings);
+	xfree(w);
+}
+
+
+int binboard_isbinary(char *buf, size_t len)
+{
+	return (buf && (len >= BINBOARD_HEADERSZ) && (memcmp(buf, BINBOARD_MAGIC, BINBOARD_MAGICSZ) == 0));
+}
+
+binboard_reader_t *binboard_open(char *buf, size_t len)
+{
+	binboard_reader_t *r;
+
+	if (!binboard_isbinary(buf, len)) {
+		errprintf("Not a binary board response\n");
+		return NULL;
+	}
+
+	r = (binboard_reader_t *)calloc(1, sizeof(binboard_reader_t));
+	r->buf = buf;
+	r->end = buf + len;
+	r->pos = buf + BINBOARD_HEADERSZ;
+	r->columns = get_le(buf + BINBOARD_MAGICSZ, 2);
+	r->values = (binboard_value_t *)calloc(r->columns + 1, sizeof(binboard_value_t));
+
+	return r;
+}
+
+int binboard_columns(binboard_reader_t *r)
+{
+	return r->columns;
+}
+
+int binboard_next(binboard_reader_t *r)
+{
+	char *p = r->pos;
+	unsigned long long v;
+	int i;
+
+	if (r->done) return 0;
+
+	if (p >= r->end) {
+		errprintf("Binary board response is incomplete\n");
+		goto stop;
+	}
+	if (*p == 'E') goto stop;
+	if (*p != 'R') goto corrupt;
+	p++;
+
+	for (i = 0; (i < r->columns); i++) {
+		binboard_value_t *val = &r->values[i];
+		char tag;
+
+		if (p >= r->end) goto corrupt;
+		tag = *(p++);
+		val->str = NULL;
+		val->val = 0;
+
+		switch (tag) {
+		  case 'n': break;
+		  case 'i':
+			if ((p = getvarint(p, r->end, &v)) == NULL) goto corrupt;
+			val->val = (long long)(v >> 1) ^ -(long long)(v & 1);
+			break;
+		  case 'r':
+			if (((p = getvarint(p, r->end, &v)) == NULL) || (v >= r->stringcount)) goto corrupt;
+			val->str = r->strings[v];
+			break;
+		  case 's':
+		  case 'd':
+			if (((p = getvarint(p, r->end, &v)) == NULL) || (v >= (r->end - p)) || (*(p + v) != '\0')) goto corrupt;
+			val->str = p;
+			if (tag == 'd') {
+				if (r->stringcount == r->stringsz) {
+					r->stringsz += 1024;
+					r->strings = (char **)realloc(r->strings, r->stringsz * sizeof(char *));
+				}
+				r->strings[r->stringcount++] = p;
+			}
+			p += v + 1;
+			break;
+		  default: goto corrupt;
+		}
+	}
+
+	r->pos = p;
+	return 1;
+
+corrupt:
+	errprintf("Corrupt binary board response at offset %ld\n", (long)(r->pos - r->buf));
+stop:
+	r->done = 1;
+	return 0;
+}
+
+char *binboard_str(binboard_reader_t *r, int idx)
+{
+	if ((idx < 0) || (idx >= r->columns)) return NULL;
+	return r->values[idx].str;
+}
+
+long long binboard_int(binboard_reader_t *r, int idx)
+{
+	if ((idx < 0) || (idx >= r->columns)) return 0;
+	return r->values[idx].val;
+}
+
+void binboard_close(binboard_reader_t *r)
+{
+	if (!r) return;
+
+	if (r->strings) xfree(r->strings);
+	xfree(r->values);
+	xfree(r);
+}
+
+
+#ifdef STANDALONE
+int main(int argc, char *argv[])
+{
+	strbuffer_t *inbuf;
+	binboard_reader_t *r;
+	char buf[4096];
+	size_t n;
+	int i;
+
+	/* Dump a binary board response read from stdin, e.g. "xymon 127.0.0.1 'xymondboard format=binary' | binboard" */
+	inbuf = newstrbuffer(0);
+	while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) addtobufferraw(inbuf, buf, n);
+
+	r = binboard_open(STRBUF(inbuf), STRBUFLEN(inbuf));
+	if (r == NULL) return 1;
+
+	while (binboard_next(r)) {
+		for (i = 0; (i < binboard_columns(r)); i++) {
+			if (i > 0) printf("|");
+			if (binboard_str(r, i)) printf("%s", nlencode(binboard_str(r, i)));
+			else printf("%lld", binboard_int(r, i));
+		}
+		printf("\n");
+	}
+
+	binboard_close(r);
+	freestrbuffer(inbuf);
+	return 0;
+}
+#endif
+
@@ -0,0 +1,37 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+#ifndef __BINBOARD_H__
+#define __BINBOARD_H__
+
+#define BINBOARD_MAGIC "XYMONBOARD-B1\n"
+
+typedef struct binboard_writer_t binboard_writer_t;
+typedef struct binboard_reader_t binboard_reader_t;
+
+extern binboard_writer_t *binboard_newwriter(void);
+extern void binboard_header(binboard_writer_t *w, strbuffer_t *buf, int columns);
+extern void binboard_row(binboard_writer_t *w, strbuffer_t *buf);
+extern void binboard_addstr(binboard_writer_t *w, strbuffer_t *buf, char *s);
+extern void binboard_addname(binboard_writer_t *w, strbuffer_t *buf, char *s);
+extern void binboard_addint(binboard_writer_t *w, strbuffer_t *buf, long long val);
+extern void binboard_end(binboard_writer_t *w, strbuffer_t *buf);
+extern void binboard_freewriter(binboard_writer_t *w);
+
+extern int binboard_isbinary(char *buf, size_t len);
+extern binboard_reader_t *binboard_open(char *buf, size_t len);
+extern int binboard_columns(binboard_reader_t *r);
+extern int binboard_next(binboard_reader_t *r);
+extern char *binboard_str(binboard_reader_t *r, int idx);
+extern long long binboard_int(binboard_reader_t *r, int idx);
+extern void binboard_close(binboard_reader_t *r);
+
+#endif
+
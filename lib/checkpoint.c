@@ -0,0 +1,455 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* This is a library module, part of libxymon.                                */
+/* It contains routines for writing and reading the binary xymond checkpoint  */
+/* files.                                                                     */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@storner.dk>                 */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+static char rcsid[] = "$Id$";
+
+/*
+ * File layout (all integers are little-endian):
+ *
+ *   Header (32 bytes):  CHK_MAGIC padded with NUL's to 16 bytes,
+ *                       u32 file kind, u32 reserved, u64 generation.
+ *   Blocks:             u32 length, followed by that many bytes holding a
+ *                       "compress:TYPE SIZE\n<data>" buffer - the same format
+ *                       used for compressed network messages.
+ *   Block data:         A sequence of records. Each record is
+ *                       u32 record length (incl. this header), u16 record type,
+ *                       u16 field count, and then the fields.
+ *   Fields:             's' u32 length, the string and a NUL
+ *                       'n' (a NULL string)
+ *                       'i' i64 value
+ *
+ * A journal is appended to one block at a time, so a crash while writing
+ * leaves at most one incomplete block at the end of the file. The reader
+ * stops when it hits one, and everything before it is still usable.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "libxymon.h"
+
+#define CHK_HEADERSZ 32
+#define CHK_MAGICSZ 16
+#define CHK_BLOCKSIZE (256*1024)
+
+struct chkwriter_t {
+	FILE *fd;
+	char *fn;
+	enum compressiontype_t ctype;
+	strbuffer_t *blk;
+	size_t recstart;
+	int fieldcount;
+	int error;		/* errno of a failed write, or -1 if the data could not be compressed */
+};
+
+struct chkreader_t {
+	int fd;
+	char *map;
+	size_t mapsz, filepos;
+	enum chkfile_t kind;
+	unsigned long long generation;
+	strbuffer_t *ubuf;
+	char *blk;
+	size_t blksz, blkpos;
+	int fieldcount;
+	char *fields[CHK_MAXFIELDS];
+};
+
+
+static void put_le(unsigned char *p, unsigned long long val, int bytes)
+{
+	int i;
+
+	for (i = 0; (i < bytes); i++) { p[i] = (val & 0xFF); val >>= 8; }
+}
+
+static unsigned long long get_le(const char *p, int bytes)
+{
+	unsigned long long val = 0;
+	int i;
+
+	for (i = bytes-1; (i >= 0); i--) val = (val << 8) | (unsigned char)p[i];
+	return val;
+}
+
+
+int chk_isbinary(char *fn)
+{
+	FILE *fd;
+	char buf[CHK_MAGICSZ];
+	int result = 0;
+
+	fd = fopen(fn, "r");
+	if (fd == NULL) return 0;
+	if (fread(buf, 1, sizeof(buf), fd) == sizeof(buf)) result = (memcmp(buf, CHK_MAGIC, strlen(CHK_MAGIC)) == 0);
+	fclose(fd);
+
+	return result;
+}
+
+
+chkwriter_t *chk_create(char *fn, enum chkfile_t kind, unsigned long long generation, enum compressiontype_t ctype)
+{
+	chkwriter_t *w;
+	unsigned char hdr[CHK_HEADERSZ];
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, CHK_MAGIC, strlen(CHK_MAGIC));
+	put_le(hdr+16, kind, 4);
+	put_le(hdr+24, generation, 8);
+
+	w = (chkwriter_t *)calloc(1, sizeof(chkwriter_t));
+	w->fd = fopen(fn, "w");
+	if (w->fd == NULL) {
+		errprintf("Cannot create checkpoint file %s: %s\n", fn, strerror(errno));
+		xfree(w);
+		return NULL;
+	}
+
+	if (fwrite(hdr, 1, sizeof(hdr), w->fd) != sizeof(hdr)) w->error = errno;
+
+	w->fn = strdup(fn);
+	w->ctype = ((ctype == COMP_UNKNOWN) ? COMP_PLAIN : ctype);
+	w->blk = newstrbuffer(CHK_BLOCKSIZE + 4096);
+
+	return w;
+}
+
+
+void chk_begin(chkwriter_t *w, enum chkrecord_t rectype)
+{
+	unsigned char hdr[8];
+
+	/* Length and field count are filled in by chk_end() */
+	put_le(hdr, 0, 4);
+	put_le(hdr+4, rectype, 2);
+	put_le(hdr+6, 0, 2);
+
+	w->recstart = STRBUFLEN(w->blk);
+	w->fieldcount = 0;
+	strbuf_addtobuffer(w->blk, (char *)hdr, sizeof(hdr));
+}
+
+void chk_addstr(chkwriter_t *w, const char *s)
+{
+	unsigned char hdr[5];
+	size_t len;
+
+	w->fieldcount++;
+
+	if (s == NULL) {
+		strbuf_addtobuffer(w->blk, "n", 1);
+		return;
+	}
+
+	len = strlen(s);
+	hdr[0] = 's';
+	put_le(hdr+1, len, 4);
+	strbuf_addtobuffer(w->blk, (char *)hdr, sizeof(hdr));
+	strbuf_addtobuffer(w->blk, (char *)s, len+1);	/* Include the NUL, so the reader can use it directly */
+}
+
+void chk_addint(chkwriter_t *w, long long val)
+{
+	unsigned char buf[9];
+
+	w->fieldcount++;
+	buf[0] = 'i';
+	put_le(buf+1, (unsigned long long)val, 8);
+	strbuf_addtobuffer(w->blk, (char *)buf, sizeof(buf));
+}
+
+
+static void chk_writeblock(chkwriter_t *w)
+{
+	unsigned char lenbuf[4];
+
+	if (STRBUFLEN(w->blk) == 0) return;
+	if (w->error) {
+		/* The file is useless anyway, don't bother */
+		clearstrbuffer(w->blk);
+		return;
+	}
+
+	if (w->ctype == COMP_PLAIN) {
+		/* No need to copy the data just to put a header in front of it */
+		char hdr[64];
+
+		sprintf(hdr, "compress:%s %zu\n", comptype2str(COMP_PLAIN), STRBUFLEN(w->blk));
+		put_le(lenbuf, strlen(hdr) + STRBUFLEN(w->blk), 4);
+		if ( (fwrite(lenbuf, 1, sizeof(lenbuf), w->fd) != sizeof(lenbuf)) ||
+		     (fwrite(hdr, 1, strlen(hdr), w->fd) != strlen(hdr)) ||
+		     (fwrite(STRBUF(w->blk), 1, STRBUFLEN(w->blk), w->fd) != STRBUFLEN(w->blk)) ) w->error = errno;
+	}
+	else {
+		strbuffer_t *cbuf = compress_message_to_strbuffer(w->ctype, STRBUF(w->blk), STRBUFLEN(w->blk), NULL, NULL);
+
+		if (cbuf == NULL) {
+			errprintf("Cannot compress checkpoint data for %s using %s\n", w->fn, comptype2str(w->ctype));
+			w->error = -1;
+		}
+		else {
+			put_le(lenbuf, STRBUFLEN(cbuf), 4);
+			if ( (fwrite(lenbuf, 1, sizeof(lenbuf), w->fd) != sizeof(lenbuf)) ||
+			     (fwrite(STRBUF(cbuf), 1, STRBUFLEN(cbuf), w->fd) != STRBUFLEN(cbuf)) ) w->error = errno;
+			freestrbuffer(cbuf);
+		}
+	}
+
+	clearstrbuffer(w->blk);
+}
+
+void chk_end(chkwriter_t *w)
+{
+	char *rec = STRBUF(w->blk) + w->recstart;
+
+	put_le((unsigned char *)rec, STRBUFLEN(w->blk) - w->recstart, 4);
+	put_le((unsigned char *)rec+6, w->fieldcount, 2);
+
+	if (STRBUFLEN(w->blk) >= CHK_BLOCKSIZE) chk_writeblock(w);
+}
+
+int chk_flush(chkwriter_t *w, int dosync)
+{
+	chk_writeblock(w);
+	if (!w->error && (fflush(w->fd) == EOF)) w->error = errno;
+	if (!w->error && dosync && (fsync(fileno(w->fd)) == -1)) w->error = errno;
+
+	if (w->error > 0) errprintf("I/O error while writing checkpoint file %s: %s\n", w->fn, strerror(w->error));
+	return (w->error ? -1 : 0);
+}
+
+int chk_close(chkwriter_t *w, int dosync)
+{
+	int result;
+
+	result = chk_flush(w, dosync);
+	if (fclose(w->fd) == EOF) {
+		errprintf("I/O error while closing checkpoint file %s: %s\n", w->fn, strerror(errno));
+		result = -1;
+	}
+
+	freestrbuffer(w->blk);
+	xfree(w->fn);
+	xfree(w);
+
+	return result;
+}
+
+
+chkreader_t *chk_open(char *fn)
+{
+	chkreader_t *r;
+	struct stat st;
+
+	r = (chkreader_t *)calloc(1, sizeof(chkreader_t));
+	r->fd = open(fn, O_RDONLY);
+	if ((r->fd == -1) || (fstat(r->fd, &st) == -1)) {
+		errprintf("Cannot access checkpoint file %s: %s\n", fn, strerror(errno));
+		goto failed;
+	}
+
+	if (st.st_size < CHK_HEADERSZ) {
+		errprintf("Checkpoint file %s is truncated\n", fn);
+		goto failed;
+	}
+
+	/* Private writable mapping, so callers may modify the strings we hand out */
+	r->mapsz = st.st_size;
+	r->map = mmap(NULL, r->mapsz, PROT_READ|PROT_WRITE, MAP_PRIVATE, r->fd, 0);
+	if (r->map == MAP_FAILED) {
+		errprintf("Cannot map checkpoint file %s: %s\n", fn, strerror(errno));
+		r->map = NULL;
+		goto failed;
+	}
+
+	if (memcmp(r->map, CHK_MAGIC, strlen(CHK_MAGIC)) != 0) {
+		errprintf("%s is not a binary checkpoint file\n", fn);
+		goto failed;
+	}
+
+	r->kind = get_le(r->map+16, 4);
+	r->generation = get_le(r->map+24, 8);
+	r->filepos = CHK_HEADERSZ;
+
+	return r;
+
+failed:
+	chk_closeread(r);
+	return NULL;
+}
+
+enum chkfile_t chk_kind(chkreader_t *r)
+{
+	return r->kind;
+}
+
+unsigned long long chk_generation(chkreader_t *r)
+{
+	return r->generation;
+}
+
+
+static int chk_nextblock(chkreader_t *r)
+{
+	size_t len, datalen, expandedsz;
+	char *payload, *eoln, ctypestr[20];
+	enum compressiontype_t ctype;
+
+	if (r->filepos == r->mapsz) return 0;
+
+	if ((r->filepos + 4) > r->mapsz) goto torn;
+	len = get_le(r->map + r->filepos, 4);
+	if ((r->filepos + 4 + len) > r->mapsz) goto torn;
+
+	payload = r->map + r->filepos + 4;
+	eoln = memchr(payload, '\n', (len < 64) ? len : 64);
+	if (!eoln || (sscanf(payload, "compress:%19s %zu", ctypestr, &expandedsz) != 2)) goto corrupt;
+	ctype = parse_compressiontype(ctypestr);
+	datalen = len - (eoln + 1 - payload);
+
+	if (ctype == COMP_PLAIN) {
+		/* Use the data directly from the file mapping */
+		if (expandedsz != datalen) goto corrupt;
+		r->blk = eoln + 1;
+	}
+	else {
+		if (r->ubuf == NULL) r->ubuf = newstrbuffer(expandedsz + 1);
+		clearstrbuffer(r->ubuf);
+		if ((STRBUFSZ(r->ubuf) < (expandedsz + 1)) && (strbuffergrow(r->ubuf, expandedsz + 1 - STRBUFSZ(r->ubuf)) == -1)) goto corrupt;
+		if (uncompress_message(ctype, eoln+1, datalen, expandedsz, r->ubuf, NULL) == NULL) goto corrupt;
+		if (STRBUFLEN(r->ubuf) != expandedsz) goto corrupt;
+		r->blk = STRBUF(r->ubuf);
+	}
+
+	r->blksz = expandedsz;
+	r->blkpos = 0;
+	r->filepos += 4 + len;
+	return 1;
+
+torn:
+	errprintf("Checkpoint file has an incomplete block at offset %zu, ignoring the rest\n", r->filepos);
+	return 0;
+
+corrupt:
+	errprintf("Checkpoint file has a corrupt block at offset %zu, ignoring the rest\n", r->filepos);
+	return 0;
+}
+
+int chk_next(chkreader_t *r)
+{
+	char *rec, *p, *recend;
+	size_t reclen;
+	int rectype, nfields, i;
+
+	while ((r->blkpos + 8) > r->blksz) {
+		if (!chk_nextblock(r)) return 0;
+	}
+
+	rec = r->blk + r->blkpos;
+	reclen = get_le(rec, 4);
+	rectype = get_le(rec+4, 2);
+	nfields = get_le(rec+6, 2);
+	if ((reclen < 8) || ((r->blkpos + reclen) > r->blksz)) goto corrupt;
+
+	recend = rec + reclen;
+	p = rec + 8;
+	r->fieldcount = 0;
+	for (i = 0; (i < nfields); i++) {
+		if (p >= recend) goto corrupt;
+		if (i < CHK_MAXFIELDS) { r->fields[i] = p; r->fieldcount++; }
+
+		switch (*p) {
+		  case 'n': p += 1; break;
+		  case 'i': p += 9; break;
+		  case 's':
+			if (((p + 5) > recend) || (get_le(p+1, 4) >= (recend - p - 5))) goto corrupt;
+			p += 5 + get_le(p+1, 4) + 1;
+			break;
+		  default: goto corrupt;
+		}
+	}
+	if (p != recend) goto corrupt;
+
+	r->blkpos += reclen;
+	return rectype;
+
+corrupt:
+	errprintf("Corrupt record in checkpoint file block ending at offset %zu, skipping the rest of the block\n", r->filepos);
+	r->blkpos = r->blksz;
+	return chk_next(r);
+}
+
+int chk_fieldcount(chkreader_t *r)
+{
+	return r->fieldcount;
+}
+
+char *chk_str(chkreader_t *r, int idx)
+{
+	if ((idx < 0) || (idx >= r->fieldcount) || (*r->fields[idx] != 's')) return NULL;
+	return r->fields[idx] + 5;
+}
+
+long long chk_int(chkreader_t *r, int idx)
+{
+	if ((idx < 0) || (idx >= r->fieldcount) || (*r->fields[idx] != 'i')) return 0;
+	return (long long)get_le(r->fields[idx] + 1, 8);
+}
+
+void chk_closeread(chkreader_t *r)
+{
+	if (r->map) munmap(r->map, r->mapsz);
+	if (r->fd != -1) close(r->fd);
+	if (r->ubuf) freestrbuffer(r->ubuf);
+	xfree(r);
+}
+
+
+#ifdef STANDALONE
+int main(int argc, char *argv[])
+{
+	chkreader_t *r;
+	int rectype, i;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s CHECKPOINTFILE\n", argv[0]);
+		return 1;
+	}
+
+	r = chk_open(argv[1]);
+	if (r == NULL) return 1;
+
+	printf("Kind %d, generation %llu\n", chk_kind(r), chk_generation(r));
+	while ((rectype = chk_next(r)) != 0) {
+		printf("%d:", rectype);
+		for (i = 0; (i < chk_fieldcount(r)); i++) {
+			if (chk_str(r, i)) printf(" [%s]", nlencode(chk_str(r, i)));
+			else printf(" %lld", chk_int(r, i));
+		}
+		printf("\n");
+	}
+
+	chk_closeread(r);
+	return 0;
+}
+#endif
+
@@ -0,0 +1,47 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#define CHK_MAGIC "XYMONDCHK-V2\n"
+
+/* File kinds: A full snapshot, or a journal of changes since the snapshot */
+enum chkfile_t { CHK_SNAPSHOT = 1, CHK_JOURNAL = 2 };
+
+/* Record types used by xymond, and by the xymond_rrd update journal */
+enum chkrecord_t { CHK_REC_LOG = 1, CHK_REC_ACK, CHK_REC_TASK, CHK_REC_TASKRESET, CHK_REC_RRDUPDATE };
+
+#define CHK_MAXFIELDS 32
+
+typedef struct chkwriter_t chkwriter_t;
+typedef struct chkreader_t chkreader_t;
+
+extern int chk_isbinary(char *fn);
+
+extern chkwriter_t *chk_create(char *fn, enum chkfile_t kind, unsigned long long generation, enum compressiontype_t ctype);
+extern void chk_begin(chkwriter_t *w, enum chkrecord_t rectype);
+extern void chk_addstr(chkwriter_t *w, const char *s);
+extern void chk_addint(chkwriter_t *w, long long val);
+extern void chk_end(chkwriter_t *w);
+extern int chk_flush(chkwriter_t *w, int dosync);
+extern int chk_close(chkwriter_t *w, int dosync);
+
+extern chkreader_t *chk_open(char *fn);
+extern enum chkfile_t chk_kind(chkreader_t *r);
+extern unsigned long long chk_generation(chkreader_t *r);
+extern int chk_next(chkreader_t *r);
+extern int chk_fieldcount(chkreader_t *r);
+extern char *chk_str(chkreader_t *r, int idx);
+extern long long chk_int(chkreader_t *r, int idx);
+extern void chk_closeread(chkreader_t *r);
+
+#endif
+
@@ -164,22 +164,12 @@ void uncompress_stream_done(void *s)
 }
 
 
-strbuffer_t *uncompress_to_my_buffer(const char *msg, size_t msglen, strbuffer_t *dbuf)
+/* Does not log anything - on failure the reason is left in errtxt */
+static strbuffer_t *inflate_to_buffer(z_stream *strm, const char *msg, size_t msglen, strbuffer_t *dbuf, int *zresult, char *errtxt, size_t errtxtsz)
 {
-	static z_stream *strm = NULL;
 	int n;
 	size_t nbytes, avbytes;
 
-
-	if (!msglen) return NULL;
-	if (!strm) {
-		strm = uncompress_stream_init();
-		if (!strm) return NULL;
-	}
-	else {
-		inflateReset(strm);	/* We'll reuse the strm struct */
-	}
-
 	do {
 		strm->avail_in = msglen;
 		strm->next_in = (char *)msg;
@@ -197,8 +187,6 @@ strbuffer_t *uncompress_to_my_buffer(const char *msg, size_t msglen, strbuffer_t
 
 			switch (n) {
 			  case Z_STREAM_ERROR:
-				xfree(strm); strm = NULL;
-				goto done;
 			  case Z_NEED_DICT:
 			  case Z_DATA_ERROR:
 			  case Z_MEM_ERROR:
@@ -210,17 +198,59 @@ strbuffer_t *uncompress_to_my_buffer(const char *msg, size_t msglen, strbuffer_t
 	} while (n != Z_STREAM_END);
 
 done:
+	*zresult = n;
 	if (n == Z_STREAM_END) {
 		dbgprintf("Inflated message from %d to %d bytes (%d %%)\n", msglen, STRBUFLEN(dbuf), 100*STRBUFLEN(dbuf)/msglen-100);
 		return dbuf;
 	}
 	else {
-		errprintf("ERROR %d zlib-inflating %zu bytes message\n", n, msglen);
+		snprintf(errtxt, errtxtsz, "ERROR %d zlib-inflating %zu bytes message\n", n, msglen);
 		return NULL;
 	}
 }
 
 
+strbuffer_t *uncompress_to_my_buffer(const char *msg, size_t msglen, strbuffer_t *dbuf)
+{
+	static z_stream *strm = NULL;
+	strbuffer_t *result;
+	int n;
+	char errtxt[100];
+
+	if (!msglen) return NULL;
+	if (!strm) {
+		strm = uncompress_stream_init();
+		if (!strm) return NULL;
+	}
+	else {
+		inflateReset(strm);	/* We'll reuse the strm struct */
+	}
+
+	result = inflate_to_buffer(strm, msg, msglen, dbuf, &n, errtxt, sizeof(errtxt));
+	if (!result) errprintf("%s", errtxt);
+	if (n == Z_STREAM_ERROR) { xfree(strm); strm = NULL; }
+
+	return result;
+}
+
+
+/* Same, but with a stream from uncompress_stream_init() so each thread can have its own */
+strbuffer_t *uncompress_stream_buffer(void *s, const char *msg, size_t msglen, strbuffer_t *dbuf)
+{
+	strbuffer_t *result;
+	int n;
+	char errtxt[100];
+
+	if (!msglen) return NULL;
+	inflateReset((z_stream *)s);
+
+	result = inflate_to_buffer((z_stream *)s, msg, msglen, dbuf, &n, errtxt, sizeof(errtxt));
+	if (!result) errprintf("%s", errtxt);
+
+	return result;
+}
+
+
 /* Compatibility, but with saner memory management */
 strbuffer_t *uncompress_buffer(const char *msg, size_t msglen, char *prestring)
 {
@@ -247,21 +277,29 @@ strbuffer_t *uncompress_buffer(const char *msg, size_t msglen, char *prestring)
  * If coming from xymond, it's already parsed the "compress:xyz 12345\n" header
  */
 
-strbuffer_t *uncompress_message(enum compressiontype_t ctype, const char *datasrc, size_t datasz, size_t expandedsz, strbuffer_t *deststrbuffer, void *buffermemory)
+/*
+ * uncompress_message_r() never logs anything, so it can be used from a thread - if
+ * it fails, the reason is in errtxt. For COMP_ZLIB, buffermemory should then be the
+ * thread's own stream from uncompress_stream_init().
+ */
+strbuffer_t *uncompress_message_r(enum compressiontype_t ctype, const char *datasrc, size_t datasz, size_t expandedsz, strbuffer_t *deststrbuffer, void *buffermemory, char *errtxt, size_t errtxtsz)
 {
 
 	if (ctype == COMP_LZO) {
 		static int lzo_inited = 0;
 		int result;
 
-		if (!lzo_inited && (lzo_init() != LZO_E_OK)) {
-			errprintf("uncompress_message(): Could not do LZO init!\n");
-			return NULL;
+		if (!lzo_inited) {
+			if (lzo_init() != LZO_E_OK) {
+				snprintf(errtxt, errtxtsz, "uncompress_message(): Could not do LZO init!\n");
+				return NULL;
+			}
+			lzo_inited = 1;
 		}
 
 		result = lzo1x_decompress(datasrc, datasz, STRBUF(deststrbuffer), (lzo_uintp)&expandedsz, NULL);
 		if (result != LZO_E_OK) {
-			errprintf("LZO_decompression failed!\n");
+			snprintf(errtxt, errtxtsz, "LZO_decompression failed!\n");
 			return NULL;
 		}
 		dbgprintf(" - lzo_decompressed %zd bytes into %zd\n", datasz, expandedsz);
@@ -274,7 +312,7 @@ strbuffer_t *uncompress_message(enum compressiontype_t ctype, const char *datasr
 
 		newsize = LZ4_decompress_safe_partial(datasrc, STRBUFEND(deststrbuffer), datasz, expandedsz, expandedsz);
 		if (newsize <= 0) {
-			errprintf("LZ4_decompression failed!\n");
+			snprintf(errtxt, errtxtsz, "LZ4_decompression failed!\n");
 			return NULL;
 		}
 		dbgprintf(" - lz4_decompressed %zd bytes into %d\n", datasz, newsize);
@@ -283,20 +321,56 @@ strbuffer_t *uncompress_message(enum compressiontype_t ctype, const char *datasr
 	}
 #endif
 	else if (ctype == COMP_ZLIB) {
-		// this should be more generic
-		return uncompress_to_my_buffer(datasrc, datasz, deststrbuffer);
+		z_stream *strm = (z_stream *)buffermemory;
+		strbuffer_t *result;
+		int n;
+
+		if (!datasz) {
+			snprintf(errtxt, errtxtsz, "Empty zlib-compressed message\n");
+			return NULL;
+		}
+
+		/* No stream from the caller: use a temporary one, not the shared static one */
+		if (strm) inflateReset(strm);
+		else if ((strm = uncompress_stream_init()) == NULL) {
+			snprintf(errtxt, errtxtsz, "Cannot initialize zlib stream\n");
+			return NULL;
+		}
+
+		result = inflate_to_buffer(strm, datasrc, datasz, deststrbuffer, &n, errtxt, errtxtsz);
+		if (!buffermemory) uncompress_stream_done(strm);
+		return result;
 	}
 	else if (ctype == COMP_PLAIN) {
 		strbuf_addtobuffer(deststrbuffer, (char *)datasrc, datasz);
 		return deststrbuffer;
 	}
 	else {
-		errprintf("uncompress_message(): don't know how to decompress %s yet... sorry\n", comptype2str(ctype));
+		snprintf(errtxt, errtxtsz, "uncompress_message(): don't know how to decompress %s yet... sorry\n", comptype2str(ctype));
 		return NULL;
 	}
 }
 
 
+strbuffer_t *uncompress_message(enum compressiontype_t ctype, const char *datasrc, size_t datasz, size_t expandedsz, strbuffer_t *deststrbuffer, void *buffermemory)
+{
+	strbuffer_t *result;
+	char errtxt[200];
+
+	if (ctype == COMP_ZLIB) {
+		// this should be more generic
+		if (buffermemory) return uncompress_stream_buffer(buffermemory, datasrc, datasz, deststrbuffer);
+		return uncompress_to_my_buffer(datasrc, datasz, deststrbuffer);
+	}
+
+	*errtxt = '\0';
+	result = uncompress_message_r(ctype, datasrc, datasz, expandedsz, deststrbuffer, buffermemory, errtxt, sizeof(errtxt));
+	if (!result && *errtxt) errprintf("%s", errtxt);
+
+	return result;
+}
+
+
 strbuffer_t *compress_message_to_strbuffer(enum compressiontype_t ctype, const char *datasrc, size_t datasz, strbuffer_t *deststrbuffer, void *buffermemory)
 {
 	char compressionhdr[30];
@@ -23,10 +23,12 @@ extern const char * comptype2str(enum compressiontype_t ctype);
 extern void *setup_compression_opts(void);
 
 extern strbuffer_t *uncompress_message(enum compressiontype_t ctype, const char *datasrc, size_t datasz, size_t expandedsz, strbuffer_t *deststrbuffer, void *buffermemory);
+extern strbuffer_t *uncompress_message_r(enum compressiontype_t ctype, const char *datasrc, size_t datasz, size_t expandedsz, strbuffer_t *deststrbuffer, void *buffermemory, char *errtxt, size_t errtxtsz);
 
 extern void *uncompress_stream_init(void);
 extern strbuffer_t *uncompress_stream_data(void *s, char *cmsg, size_t clen);
 extern void uncompress_stream_done(void *s);
+extern strbuffer_t *uncompress_stream_buffer(void *s, const char *msg, size_t msglen, strbuffer_t *dbuf);
 
 extern strbuffer_t *uncompress_to_my_buffer(const char *msg, size_t msglen, strbuffer_t *buf);
 extern strbuffer_t *uncompress_buffer(const char *msg, size_t msglen, char *prestring);
@@ -0,0 +1,146 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* This is a library module, part of libxymon.                                */
+/* It contains routines for collecting values - typically latencies in        */
+/* microseconds - in log-linear histograms.                                   */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@storner.dk>                 */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+static char rcsid[] = "$Id$";
+
+/*
+ * Values below 8 each have a bucket of their own. Above that, every power
+ * of 2 is split into 8 buckets of equal width, so a bucket is never more
+ * than 12.5% wide. That is fine for latencies, and it keeps a histogram
+ * at a fixed size (about 2.5 KB) no matter how many values go into it.
+ *
+ * Adding a value only increments counters, with atomic operations so
+ * several threads can update the same histogram.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libxymon.h"
+
+static int bucketnum(unsigned long long val)
+{
+	int msb, group;
+
+	if (val < HISTOGRAM_SUBBUCKETS) return (int)val;
+
+	for (msb = HISTOGRAM_SUBBITS; ((val >> (msb+1)) != 0); msb++) ;
+	group = msb - HISTOGRAM_SUBBITS + 1;
+	if (group >= HISTOGRAM_GROUPS) return (HISTOGRAM_BUCKETS - 1);
+
+	return (group * HISTOGRAM_SUBBUCKETS) + ((val >> (msb - HISTOGRAM_SUBBITS)) & (HISTOGRAM_SUBBUCKETS - 1));
+}
+
+unsigned long long histogram_bucketlow(int bucket)
+{
+	/* The lowest value that goes into this bucket */
+	int group = (bucket / HISTOGRAM_SUBBUCKETS);
+	int sub = (bucket % HISTOGRAM_SUBBUCKETS);
+
+	if (group == 0) return sub;
+
+	return ((unsigned long long)(HISTOGRAM_SUBBUCKETS + sub) << (group - 1));
+}
+
+static unsigned long long buckethigh(int bucket)
+{
+	if (bucket == (HISTOGRAM_BUCKETS - 1)) return (unsigned long long)-1;
+
+	return histogram_bucketlow(bucket + 1) - 1;
+}
+
+histogram_t *histogram_new(char *name)
+{
+	histogram_t *h;
+
+	h = (histogram_t *)calloc(1, sizeof(histogram_t));
+	h->name = strdup(name);
+	h->min = (unsigned long long)-1;
+
+	return h;
+}
+
+void histogram_add(histogram_t *h, unsigned long long val)
+{
+	unsigned long long old;
+
+	__sync_fetch_and_add(&h->buckets[bucketnum(val)], 1);
+	__sync_fetch_and_add(&h->sum, val);
+	__sync_fetch_and_add(&h->count, 1);
+
+	while (((old = h->max) < val) && !__sync_bool_compare_and_swap(&h->max, old, val)) ;
+	while (((old = h->min) > val) && !__sync_bool_compare_and_swap(&h->min, old, val)) ;
+}
+
+void histogram_reset(histogram_t *h)
+{
+	memset((void *)h->buckets, 0, sizeof(h->buckets));
+	h->count = h->sum = h->max = 0;
+	h->min = (unsigned long long)-1;
+}
+
+unsigned long long histogram_percentile(histogram_t *h, double pct)
+{
+	/* The highest value in the bucket holding the "pct" percentile, but no more than the max. */
+	unsigned long long rank, seen = 0;
+	int i;
+
+	if (h->count == 0) return 0;
+
+	rank = (unsigned long long)((pct / 100.0) * h->count + 0.5);
+	if (rank < 1) rank = 1;
+	if (rank > h->count) rank = h->count;
+
+	for (i = 0; (i < HISTOGRAM_BUCKETS); i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) return ((buckethigh(i) < h->max) ? buckethigh(i) : h->max);
+	}
+
+	return h->max;
+}
+
+void histogram_free(histogram_t *h)
+{
+	if (!h) return;
+
+	xfree(h->name);
+	xfree(h);
+}
+
+
+#ifdef STANDALONE
+int main(int argc, char *argv[])
+{
+	histogram_t *h;
+	char buf[128];
+	int i;
+
+	/* Read numbers from stdin, one per line, and show their distribution */
+	h = histogram_new("stdin");
+	while (fgets(buf, sizeof(buf), stdin)) histogram_add(h, strtoull(buf, NULL, 10));
+
+	printf("count %llu sum %llu min %llu max %llu\n", h->count, h->sum, (h->count ? h->min : 0), h->max);
+	printf("p50 %llu p90 %llu p99 %llu p99.9 %llu\n",
+		histogram_percentile(h, 50.0), histogram_percentile(h, 90.0),
+		histogram_percentile(h, 99.0), histogram_percentile(h, 99.9));
+	for (i = 0; (i < HISTOGRAM_BUCKETS); i++) {
+		if (h->buckets[i]) printf("%llu-%llu: %lu\n", histogram_bucketlow(i), buckethigh(i), h->buckets[i]);
+	}
+
+	histogram_free(h);
+	return 0;
+}
+#endif
+
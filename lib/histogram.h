@@ -0,0 +1,33 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon monitor library.                                                     */
+/*                                                                            */
+/* Copyright (C) 2002-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#define HISTOGRAM_SUBBITS	3			/* 8 buckets per power of 2, i.e. within 12.5% */
+#define HISTOGRAM_SUBBUCKETS	(1 << HISTOGRAM_SUBBITS)
+#define HISTOGRAM_GROUPS	38			/* Values up to 2^40 */
+#define HISTOGRAM_BUCKETS	(HISTOGRAM_GROUPS * HISTOGRAM_SUBBUCKETS)
+
+typedef struct histogram_t {
+	char *name;
+	volatile unsigned long long count, sum, min, max;
+	volatile unsigned long buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+extern histogram_t *histogram_new(char *name);
+extern void histogram_add(histogram_t *h, unsigned long long val);
+extern void histogram_reset(histogram_t *h);
+extern unsigned long long histogram_percentile(histogram_t *h, double pct);
+extern unsigned long long histogram_bucketlow(int bucket);
+extern void histogram_free(histogram_t *h);
+
+#endif
+
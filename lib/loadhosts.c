@@ -44,6 +44,7 @@ static namelist_t *defaulthost = NULL;
 static char *xmh_item_key[XMH_LAST];
 static char *xmh_item_name[XMH_LAST];
 static int xmh_item_isflag[XMH_LAST];
+static int xmh_item_keylen[XMH_LAST];
 static int configloaded = 0;
 static void * rbhosts;
 static void * rbclients;
@@ -201,6 +202,65 @@ static void xmh_item_list_setup(void)
 
 	for (bi = 0; (bi < XMH_LAST); bi++) 
 		if (xmh_item_name[bi]) xmh_item_isflag[bi] = (strncmp(xmh_item_name[bi], "XMH_FLAG_", 9) == 0);
+
+	for (bi = 0; (bi < XMH_LAST); bi++) 
+		xmh_item_keylen[bi] = (xmh_item_key[bi] ? strlen(xmh_item_key[bi]) : 0);
+}
+
+
+/*
+ * Each host has an index with one byte per item: The element holding the
+ * item, XMH_IDX_NONE if it is not set, or XMH_IDX_DEFAULT plus the element
+ * of the ".default." host that the item is inherited from. Hosts with more
+ * than XMH_IDX_MAXELEMS elements have no index and are searched instead.
+ */
+#define XMH_IDX_NONE		0xFF
+#define XMH_IDX_DEFAULT		0x80
+#define XMH_IDX_LARRD		0x40	/* TRENDS given with the LARRD: tag from Xymon 4.0.4 and earlier */
+#define XMH_IDX_MAXELEMS	0x3F
+
+static void xmh_build_itemidx(namelist_t *host)
+{
+	int i;
+	enum xmh_item_t item;
+	unsigned char *defidx = NULL;
+
+	xmh_item_list_setup();
+	if (host->itemidx) xfree(host->itemidx);
+
+	if (host->defaulthost && (strcasecmp(host->hostname, ".default.") != 0)) {
+		defidx = host->defaulthost->itemidx;
+		if (!defidx) return;
+	}
+
+	for (i = 0; (host->elems[i]); i++) ;
+	if (i > XMH_IDX_MAXELEMS) return;
+
+	host->itemidx = (unsigned char *)malloc(XMH_LAST);
+	memset(host->itemidx, XMH_IDX_NONE, XMH_LAST);
+
+	/* The first element matching the key wins */
+	for (i = 0; (host->elems[i]); i++) {
+		int c = tolower((unsigned char)*host->elems[i]);
+
+		for (item = 0; (item < XMH_LAST); item++) {
+			if ((host->itemidx[item] != XMH_IDX_NONE) || !xmh_item_keylen[item]) continue;
+			if (tolower((unsigned char)*xmh_item_key[item]) != c) continue;
+			if (strncasecmp(host->elems[i], xmh_item_key[item], xmh_item_keylen[item]) == 0) host->itemidx[item] = i;
+		}
+	}
+
+	if (host->itemidx[XMH_TRENDS] == XMH_IDX_NONE) {
+		for (i = 0; (host->elems[i] && strncasecmp(host->elems[i], "LARRD:", 6)); i++) ;
+		if (host->elems[i]) host->itemidx[XMH_TRENDS] = (XMH_IDX_LARRD | i);
+	}
+
+	if (defidx) {
+		for (item = 0; (item < XMH_LAST); item++) {
+			if ((host->itemidx[item] == XMH_IDX_NONE) && (defidx[item] != XMH_IDX_NONE))
+				host->itemidx[item] = (XMH_IDX_DEFAULT | defidx[item]);
+		}
+	}
 }
 
 
@@ -212,6 +272,16 @@ static char *xmh_find_item(namelist_t *host, enum xmh_item_t item)
 	if (item == XMH_LAST) return NULL;	/* Unknown item requested */
 	if (host == NULL) return NULL;	/* Unknown item requested */
 
+	if (host->itemidx) {
+		unsigned char idx = host->itemidx[item];
+
+		if (idx == XMH_IDX_NONE) return NULL;
+		if (xmh_item_isflag[item]) return xmh_item_key[item];
+
+		return (((idx & XMH_IDX_DEFAULT) ? host->defaulthost : host)->elems[idx & XMH_IDX_MAXELEMS] + 
+			((idx & XMH_IDX_LARRD) ? 6 : xmh_item_keylen[item]));
+	}
+
 	xmh_item_list_setup();
 	i = 0;
 	while (host->elems[i] && strncasecmp(host->elems[i], xmh_item_key[item], strlen(xmh_item_key[item]))) i++;
@@ -250,6 +320,7 @@ void freenamelist(namelist_t *rec)
 	if (rec->osname != NULL)	xfree(rec->osname);
 	if (rec->allelems != NULL)	xfree(rec->allelems);
 	if (rec->elems != NULL)		xfree(rec->elems);
+	if (rec->itemidx != NULL)	xfree(rec->itemidx);
 	if (rec->data != NULL)		xfree(rec->data);
 	return;
 }
@@ -365,6 +436,173 @@ static void build_hosttree(void)
 	dbgprintf(" <- build_hosttree\n");
 }
 
+
+/*
+ * Every load of hosts.cfg rebuilds the host list, but most of the time
+ * only a few hosts have actually changed. To let the caller act on just
+ * those, keep a signature of each host's definition from the previous load
+ * and compare the new load against it.
+ */
+typedef struct hostchangerec_t {
+	char *hostname;
+	enum hostchange_t change;
+} hostchangerec_t;
+
+typedef struct hostsig_t {
+	char *hostname;
+	int listidx;
+	unsigned long sig;
+} hostsig_t;
+
+static hostsig_t *hostsigs = NULL;		/* Sorted by hostname */
+static int hostsigcount = 0;
+static char *hostsignames = NULL;		/* Storage for the hostnames in hostsigs */
+static hostchangerec_t *hostchanges = NULL;
+static int hostchangecount = 0, hostchangesz = 0, hostchangeidx = 0;
+static int hostchangetotals[HOST_CHANGED+1];
+
+static unsigned long sighash(unsigned long h, char *s)
+{
+	/* FNV-1a, with the terminating NUL included so "ab"+"c" differs from "a"+"bc" */
+	if (s) do { h = (h ^ (unsigned char)*s) * 16777619UL; } while (*(s++));
+	return h;
+}
+
+static unsigned long hostsignature(namelist_t *host)
+{
+	unsigned long h = 2166136261UL;
+	int i;
+
+	h = sighash(h, host->ip);
+	h = sighash(h, host->page->pagepath);
+	h = sighash(h, host->page->pagetitle);
+	h = sighash(h, host->groupid);
+	h = sighash(h, host->dgname);
+	for (i = 0; (host->elems[i]); i++) h = sighash(h, host->elems[i]);
+
+	/* Tags on the ".default." host apply to this host also */
+	if (host->defaulthost) {
+		for (i = 0; (host->defaulthost->elems[i]); i++) h = sighash(h, host->defaulthost->elems[i]);
+	}
+
+	return h;
+}
+
+static int hostsig_compare(const void *v1, const void *v2)
+{
+	hostsig_t *s1 = (hostsig_t *)v1;
+	hostsig_t *s2 = (hostsig_t *)v2;
+	int result = strcasecmp(s1->hostname, s2->hostname);
+
+	return (result ? result : (s1->listidx - s2->listidx));
+}
+
+static void clear_hostchanges(void)
+{
+	int i;
+
+	for (i = 0; (i < hostchangecount); i++) xfree(hostchanges[i].hostname);
+	hostchangecount = hostchangeidx = 0;
+	memset(hostchangetotals, 0, sizeof(hostchangetotals));
+}
+
+static void add_hostchange(char *hostname, enum hostchange_t change)
+{
+	if (hostchangecount == hostchangesz) {
+		hostchangesz += 1024;
+		hostchanges = (hostchangerec_t *)realloc(hostchanges, hostchangesz * sizeof(hostchangerec_t));
+	}
+
+	hostchanges[hostchangecount].hostname = strdup(hostname);
+	hostchanges[hostchangecount].change = change;
+	hostchangecount++;
+	hostchangetotals[change]++;
+}
+
+static void diff_hostlist(void)
+{
+	hostsig_t *newsigs;
+	char *newnames, *p;
+	int newcount, count, namesz, i, o, n;
+	namelist_t *walk;
+
+	clear_hostchanges();
+
+	for (walk = namehead, count = namesz = 0; (walk); walk = walk->next, count++) namesz += strlen(walk->hostname) + 1;
+	newsigs = (hostsig_t *)malloc((count + 1) * sizeof(hostsig_t));
+	p = newnames = (char *)malloc(namesz + 1);
+	for (walk = namehead, i = 0; (walk); walk = walk->next, i++) {
+		strcpy(p, walk->hostname);
+		newsigs[i].hostname = p;
+		newsigs[i].listidx = i;
+		newsigs[i].sig = hostsignature(walk);
+		p += strlen(p) + 1;
+	}
+
+	/*
+	 * If a host is listed more than once, the first entry is the one hostinfo() returns.
+	 * The other entries still matter (e.g. their pages are in XMH_ALLPAGEPATHS), so 
+	 * fold their signatures into the first one, in the order they are listed.
+	 */
+	qsort(newsigs, count, sizeof(hostsig_t), hostsig_compare);
+	for (i = newcount = 0; (i < count); i++) {
+		if ((newcount > 0) && (strcasecmp(newsigs[newcount-1].hostname, newsigs[i].hostname) == 0)) {
+			newsigs[newcount-1].sig = (newsigs[newcount-1].sig ^ newsigs[i].sig) * 16777619UL;
+			continue;
+		}
+		newsigs[newcount++] = newsigs[i];
+	}
+
+	/* Both lists are sorted, so one pass through them finds all of the differences */
+	o = n = 0;
+	while ((o < hostsigcount) || (n < newcount)) {
+		int result;
+
+		if (o == hostsigcount) result = 1;
+		else if (n == newcount) result = -1;
+		else result = strcasecmp(hostsigs[o].hostname, newsigs[n].hostname);
+
+		if (result < 0) {
+			add_hostchange(hostsigs[o++].hostname, HOST_REMOVED);
+		}
+		else if (result > 0) {
+			add_hostchange(newsigs[n++].hostname, HOST_ADDED);
+		}
+		else {
+			if (hostsigs[o].sig != newsigs[n].sig) add_hostchange(newsigs[n].hostname, HOST_CHANGED);
+			o++; n++;
+		}
+	}
+
+	if (hostsigs) xfree(hostsigs);
+	if (hostsignames) xfree(hostsignames);
+	hostsigs = newsigs;
+	hostsigcount = newcount;
+	hostsignames = newnames;
+
+	dbgprintf("hosts.cfg changes: %d added, %d removed, %d changed\n",
+		  hostchangetotals[HOST_ADDED], hostchangetotals[HOST_REMOVED], hostchangetotals[HOST_CHANGED]);
+}
+
+int hostlist_changes(int *added, int *removed, int *changed)
+{
+	/* The hosts that changed in the last load_hostnames() that parsed the files */
+	if (added) *added = hostchangetotals[HOST_ADDED];
+	if (removed) *removed = hostchangetotals[HOST_REMOVED];
+	if (changed) *changed = hostchangetotals[HOST_CHANGED];
+
+	return hostchangecount;
+}
+
+char *hostchange_walk(int first, enum hostchange_t *change)
+{
+	if (first) hostchangeidx = 0;
+	if (hostchangeidx >= hostchangecount) return NULL;
+
+	if (change) *change = hostchanges[hostchangeidx].change;
+	return hostchanges[hostchangeidx++].hostname;
+}
+
 #include "loadhosts_file.c"
 #include "loadhosts_net.c"
 
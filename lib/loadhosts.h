@@ -118,6 +118,7 @@ typedef struct namelist_t {
 
 	char *allelems;		/* Storage for data pointed to by elems */
 	char **elems;		/* List of pointers to the elements of the entry */
+	unsigned char *itemidx;	/* Index into elems for each XMH_ item, built when the host is loaded */
 
 	/*
 	 * The following are pre-parsed elements.
@@ -129,6 +130,8 @@ typedef struct namelist_t {
 	time_t notbefore, notafter; /* NOTBEFORE and NOTAFTER tags as time_t values */
 } namelist_t;
 
+enum hostchange_t { HOST_ADDED, HOST_REMOVED, HOST_CHANGED };
+
 extern void freenamelist(namelist_t *rec);
 extern int load_hostnames(char *hostsfn, char *extrainclude, int fqdn);
 extern int load_hostinfo(char *hostname);
@@ -152,6 +155,8 @@ extern void *first_host(void);
 extern void *next_host(void *currenthost, int wantclones);
 extern void xmh_set_item(void *host, enum xmh_item_t item, void *value);
 extern char *xmh_item_multi(void *host, enum xmh_item_t item);
+extern int hostlist_changes(int *added, int *removed, int *changed);
+extern char *hostchange_walk(int first, enum hostchange_t *change);
 
 #endif
 
@@ -161,6 +161,7 @@ int load_hostnames(char *hostsfn, char *extrainclude, int fqdn)
 	/* Any modifications at all ? */
 	if (prepresult == 1) {
 		dbgprintf("No files modified, skipping reload of %s\n", hostsfn);
+		clear_hostchanges();
 		return 1;
 	}
 
@@ -409,6 +410,7 @@ int load_hostnames(char *hostsfn, char *extrainclude, int fqdn)
 			}
 
 			newitem->elems[elemidx] = NULL;
+			xmh_build_itemidx(newitem);
 
 			/* See if this host is defined before */
 			handle = xtreeFind(htree, newitem->hostname);
@@ -500,6 +502,7 @@ nextline:
 	xtreeDestroy(htree);
 
 	build_hosttree();
+	diff_hostlist();
 
 	return 0;
 }
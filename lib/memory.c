@@ -152,3 +152,80 @@ char *xresultbuf(int maxsz)
 	return result;
 }
 
+/*
+ * A bump allocator for scratch memory that is only needed while handling 
+ * one request. Memory from xarena_alloc() cannot be freed individually; 
+ * everything is released at once with xarena_reset(). When a request needs
+ * more than the arena holds, the extra memory is malloc'ed and the arena 
+ * grows to that size when it is reset, so in steady state there are no 
+ * calls to malloc() at all. This is not thread-safe.
+ */
+
+#define XARENA_ALIGN(N) (((N) + 7) & ~((size_t)7))
+
+xarena_t *xarena_new(size_t blocksz)
+{
+	xarena_t *arena = (xarena_t *)calloc(1, sizeof(xarena_t));
+
+	arena->blocksz = XARENA_ALIGN(blocksz ? blocksz : 4096);
+	arena->block = (char *)xmalloc(arena->blocksz);
+	arena->heapallocs = 1;
+
+	return arena;
+}
+
+void *xarena_alloc(xarena_t *arena, size_t size)
+{
+	void *result;
+
+	size = XARENA_ALIGN(size ? size : 1);
+	arena->allocs++;
+
+	if ((arena->used + size) <= arena->blocksz) {
+		result = arena->block + arena->used;
+		arena->used += size;
+	}
+	else {
+		xmemory_t *extra = (xmemory_t *)xmalloc(sizeof(xmemory_t) + size);
+
+		extra->sdata = (char *)(extra + 1);
+		extra->ssize = size;
+		extra->next = arena->overflow;
+		arena->overflow = extra;
+		arena->overflowsz += size;
+		arena->heapallocs++;
+		result = extra->sdata;
+	}
+
+	return result;
+}
+
+char *xarena_strdup(xarena_t *arena, const char *s)
+{
+	size_t len = strlen(s);
+	char *result = (char *)xarena_alloc(arena, len+1);
+
+	memcpy(result, s, len+1);
+	return result;
+}
+
+void xarena_reset(xarena_t *arena)
+{
+	if (arena->overflow) {
+		/* Did not fit; make the block big enough for this request */
+		while (arena->overflow) {
+			xmemory_t *zombie = arena->overflow;
+
+			arena->overflow = arena->overflow->next;
+			xfree(zombie);
+		}
+
+		xfree(arena->block);
+		arena->blocksz = XARENA_ALIGN(arena->used + arena->overflowsz);
+		arena->block = (char *)xmalloc(arena->blocksz);
+		arena->heapallocs++;
+		arena->overflowsz = 0;
+	}
+
+	arena->used = 0;
+}
@@ -17,6 +17,15 @@ typedef struct xmemory_t {
 	struct xmemory_t *next;
 } xmemory_t;
 
+typedef struct xarena_t {
+	char *block;
+	size_t blocksz, used;
+	xmemory_t *overflow;		/* Allocations that did not fit in the block */
+	size_t overflowsz;
+	unsigned long allocs;		/* Number of xarena_alloc() calls */
+	unsigned long heapallocs;	/* Number of malloc() calls made by the arena */
+} xarena_t;
+
 extern const char *xfreenullstr;
 
 extern void add_to_memlist(void *ptr, size_t memsize);
@@ -35,6 +44,11 @@ extern char *xstrncpy(char *dest, const char *src, size_t maxlen);
 extern int   xsprintf(char *dest, const char *fmt, ...);
 extern char *xresultbuf(int maxsz);
 
+extern xarena_t *xarena_new(size_t blocksz);
+extern void *xarena_alloc(xarena_t *arena, size_t size);
+extern char *xarena_strdup(xarena_t *arena, const char *s);
+extern void xarena_reset(xarena_t *arena);
+
 
 /*
  * This defines an "xfree()" macro, which checks for freeing of
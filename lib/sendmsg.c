@@ -46,7 +46,7 @@ static char rcsid[] = "$Id$";
 /* These commands go to all Xymon servers */
 static char *multircptcmds[] = { "status", "combo", "extcombo", "compress", "combodata", "data", "notify", "enable", "disable", "drop", "rename", "client", "clientsubmit", "dummy", NULL };
 /* These commands require a response -- Note: bare 'schedule', xymond* and hobbitd* are caught specially */
-static char *responsecmds[] = { "client", "hostinfo", "query", "config", "clientconfig", "download", "clientlog", "ping", "proxyping", "pullclient", "ghostlist", "multisrclist", "senderstats", NULL };
+static char *responsecmds[] = { "client", "hostinfo", "query", "config", "clientconfig", "download", "clientlog", "ping", "proxyping", "pullclient", "ghostlist", "multisrclist", "senderstats", "xymondstats", NULL };
 static char errordetails[1024];
 
 /* Stuff for combo message handling */
@@ -68,11 +68,13 @@ static int bfqids[10];			/* queue ID storage */
 static int rotatebfq = 0;		/* rotate among destination bfq's? */
 static int currentbfq = 0;		/* current bfq */
 static int max_backfeedsz = 16384;
+static xymond_bfring_t *bfring = NULL;	/* Backfeed ring, if xymond has one */
 #define ASSUMELARGEMEM 0		/* Reserve and persist larger buffer sizes instead of growing slowly */
 
 static char *comboofsstr = NULL;
 static size_t comboofssz = 0;
 static unsigned int *combooffsets = NULL;
+static struct iovec *combomsgs = NULL;
 
 #define USERBUFSZ 4096
 
@@ -256,9 +258,9 @@ static enum conn_cbresult_t client_callback(tcpconn_t *connection, enum conn_cal
 					fwrite(outstart, outlen, 1, rec->response->respfd);
 				}
 				else {
-					*(outstart + outlen) = '\0';
-					addtobuffer(rec->response->respstr, outstart);
-					if (!rec->response->fullresponse && strchr(outstart, '\n'))
+					/* The response may be binary, e.g. a "xymondboard format=binary" */
+					strbuf_addtobuffer(rec->response->respstr, outstart, outlen);
+					if (!rec->response->fullresponse && memchr(outstart, '\n', outlen))
 						conn_close_connection(connection, NULL);
 				}
 			}
@@ -452,28 +454,17 @@ static int sendtoall(char *msg, size_t msglen, int timeout, mytarget_t **targets
 
 	/* Loop to process data */
 	do {
-		fd_set fdread, fdwrite;
-		int n;
-		struct timeval tmo;
-
-		maxfd = conn_fdset(&fdread, &fdwrite);
-
-		if (maxfd > 0) {
-			if (timeout) { tmo.tv_sec = 1; tmo.tv_usec = 0; }
-
-			n = select(maxfd+1, &fdread, &fdwrite, NULL, (timeout ? &tmo : NULL));
-			if (n < 0) {
-				if (errno != EINTR) {
-					if (cbuf) freestrbuffer(cbuf);
-					return 1;
-				}
+		/* Waits 1 second at most if there is a timeout, forever if not */
+		maxfd = conn_process(timeout ? 1000 : -1);
+		if (maxfd < 0) {
+			if (errno != EINTR) {
+				if (cbuf) freestrbuffer(cbuf);
+				return 1;
 			}
-
-			conn_process_active(&fdread, &fdwrite);
 		}
 
 		conn_trimactive();
-	} while (conn_active() && (maxfd > 0));
+	} while (conn_active() && (maxfd != 0));
 
 	if (cbuf) freestrbuffer(cbuf);
 
@@ -600,9 +591,11 @@ int sendmessage_init_local(void)
 	dbgprintf("sendmessage_init_local: backfeedqueuenumber is %d, XYMON_SENDBFQ is %s\n", backfeedqueuenumber, (bfqoverride ? bfqoverride : "<NULL>") );
 
 	if (!bfqoverride) { 
-		/* Nothing special */
+		/* Nothing special. Use the backfeed ring if xymond has one, and keep the queue as a fallback */
+		bfring = setup_bfring(CHAN_CLIENT, 0);
 		backfeedqueue = setup_feedback_queue(backfeedqueuenumber, CHAN_CLIENT);
-		return (backfeedqueue == -1) ? -1 : max_backfeedsz;
+		if (bfring) dbgprintf(" - using the backfeed ring\n");
+		return ((backfeedqueue == -1) && !bfring) ? -1 : max_backfeedsz;
 	}
 
 
@@ -631,9 +624,33 @@ int sendmessage_init_local(void)
 
 void sendmessage_finish_local(void)
 {
+	if (bfring) { close_bfring(bfring, CHAN_CLIENT); bfring = NULL; }
         close_feedback_queue(backfeedqueue, CHAN_CLIENT);
 }
 
+static int bfring_send(struct iovec *msgs, int count)
+{
+	/* Post messages via the backfeed ring. Returns 1 if they were posted. */
+	int tries = 0;
+
+	if (!bfring) return 0;
+
+	if (bfring->closed) {
+		/* xymond was restarted; pick up the new ring if there is one */
+		close_bfring(bfring, CHAN_CLIENT);
+		bfring = setup_bfring(CHAN_CLIENT, 0);
+		if (!bfring) return 0;
+	}
+
+	/* If the ring is full, give xymond a moment to catch up before falling back */
+	do {
+		if (bfring_post(bfring, msgs, count) == count) return 1;
+		if (tries < SENDRETRIES) usleep(10000);
+	} while (tries++ < SENDRETRIES);
+
+	return 0;
+}
+
 sendresult_t sendmessage_local(char *msg, size_t msglen)
 {
 	int n, done = 0, tries = 0;
@@ -647,6 +664,15 @@ sendresult_t sendmessage_local(char *msg, size_t msglen)
 
 	if ((!msg) || (!msglen)) return XYMONSEND_EREADERROR;
 
+	if (bfring && (msglen <= max_backfeedsz)) {
+		/* The ring takes the message as-is, so no need to compress it */
+		struct iovec iov;
+
+		iov.iov_base = msg;
+		iov.iov_len = msglen;
+		if (bfring_send(&iov, 1)) return XYMONSEND_OK;
+	}
+
 	if (backfeedqueue == -1) {
 		errprintf("sendmessage_local: no backfeed queue present; falling back to normal send\n");
 		return sendmessage_safe(msg, msglen, NULL, XYMON_TIMEOUT, NULL);
@@ -854,6 +880,12 @@ char *getsendreturnstr(sendreturn_t *s, int takeover)
 	return result;
 }
 
+size_t getsendreturnlen(sendreturn_t *s)
+{
+	/* Length of the response, for binary data. Call before getsendreturnstr() takes it over */
+	if (!s || !s->respstr) return 0;
+	return STRBUFLEN(s->respstr);
+}
 
 /* Like sendmessage, but given a strbuffer -- safer if we're passing around binary/compressed data */
 sendresult_t sendmessage_buffer(strbuffer_t *msgbuf, char *recipient, int timeout, sendreturn_t *response)
@@ -886,6 +918,7 @@ static void combo_params(void)
 	comboofssz = (1 + 10)*maxmsgspercombo;
 	comboofsstr = (char *)malloc(comboofssz+1);
 	combooffsets = (unsigned int *)malloc((maxmsgspercombo+1)*sizeof(unsigned int));
+	combomsgs = (struct iovec *)malloc(maxmsgspercombo*sizeof(struct iovec));
 }
 
 void combo_start(void)
@@ -921,6 +954,20 @@ static void combo_flush(void)
 	if (!xymonmsgqueued) return;
 	dbgprintf("Flushing combo message\n");
 
+	if (combo_is_local && bfring) {
+		/* The ring takes all of the messages in one go, so there is no need for an extcombo */
+		for (i = 0; (i < xymonmsgqueued); i++) {
+			combomsgs[i].iov_base = STRBUF(xymonmsg) + combooffsets[i];
+			combomsgs[i].iov_len = combooffsets[i+1] - combooffsets[i];
+		}
+
+		if (bfring_send(combomsgs, xymonmsgqueued)) {
+			dbgprintf("Posted %d messages via the backfeed ring\n", xymonmsgqueued);
+			combo_start_local();
+			return;
+		}
+	}
+
 	outp = strchr(STRBUF(xymonmsg), ' ');
 	for (i = 0; (i <= xymonmsgqueued); i++) {
 		outp += sprintf(outp, " %d", combooffsets[i]);
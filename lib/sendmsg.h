@@ -60,6 +60,7 @@ extern sendresult_t sendmessage_buffer(strbuffer_t *msgbuf, char *recipient, int
 extern sendreturn_t *newsendreturnbuf(int fullresponse, FILE *respfd);
 extern void freesendreturnbuf(sendreturn_t *s);
 extern char *getsendreturnstr(sendreturn_t *s, int takeover);
+extern size_t getsendreturnlen(sendreturn_t *s);
 
 extern void combo_start(void);
 extern void combo_end(void);
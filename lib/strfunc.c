@@ -296,3 +296,67 @@ strbuffer_t *replacetext(char *original, char *oldtext, char *newtext)
 	return result;
 }
 
+/*
+ * A pool of shared, reference-counted strings. Use it for short strings that
+ * many records hold the same value of, e.g. sender addresses and group lists.
+ * The pooled strings must not be modified.
+ */
+typedef struct strpoolitem_t {
+	int refcount;
+	char *key;	/* The tree key; a separate copy, since xtreeDelete() may free it */
+	char str[1];
+} strpoolitem_t;
+
+static void *strpool = NULL;
+
+char *strpool_get(char *s)
+{
+	xtreePos_t handle;
+	strpoolitem_t *item;
+
+	if (s == NULL) return NULL;
+
+	if (strpool == NULL) strpool = xtreeNew(strcmp);
+
+	handle = xtreeFind(strpool, s);
+	if (handle != xtreeEnd(strpool)) {
+		item = (strpoolitem_t *)xtreeData(strpool, handle);
+	}
+	else {
+		item = (strpoolitem_t *)malloc(sizeof(strpoolitem_t) + strlen(s));
+		item->refcount = 0;
+		strcpy(item->str, s);
+		item->key = strdup(s);
+		xtreeAdd(strpool, item->key, item);
+	}
+
+	item->refcount++;
+	return item->str;
+}
+
+void strpool_release(char *s)
+{
+	strpoolitem_t *item;
+
+	if (s == NULL) return;
+
+	item = (strpoolitem_t *)(s - offsetof(strpoolitem_t, str));
+	if (--item->refcount > 0) return;
+
+	xtreeDelete(strpool, item->str);
+#ifndef HAVE_BINARY_TREE
+	xfree(item->key);
+#endif
+	xfree(item);
+}
+
+int strpool_update(char **current, char *s)
+{
+	/* Point *current at the pooled copy of s. Returns 1 if the value changed */
+	if ((*current == s) || (*current && s && (strcmp(*current, s) == 0))) return 0;
+
+	strpool_release(*current);
+	*current = strpool_get(s);
+	return 1;
+}
+
@@ -29,6 +29,9 @@ extern void strbufferuse(strbuffer_t *buf, size_t bytes);
 extern char *htmlquoted(char *s);
 extern char *prehtmlquoted(char *s);
 extern strbuffer_t *replacetext(char *original, char *oldtext, char *newtext);
+extern char *strpool_get(char *s);
+extern void strpool_release(char *s);
+extern int strpool_update(char **current, char *s);
 
 #define SBUF_DEFINE(NAME) char *NAME = NULL; size_t NAME##_buflen = 0;
 #define STATIC_SBUF_DEFINE(NAME) static char *NAME = NULL; static size_t NAME##_buflen = 0;
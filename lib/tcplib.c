@@ -41,6 +41,12 @@ static char rcsid[] = "$Id: tcplib.c 7271 2013-08-11 09:43:16Z storner $";
 #include "config.h"
 #include "tcplib.h"
 
+#if defined(HAVE_EPOLL)
+#include <sys/epoll.h>
+#elif defined(HAVE_POLL)
+#include <poll.h>
+#endif
+
 /* How many connections to accept on each loop */
 static int max_accepts = 0;
 
@@ -68,10 +74,26 @@ static tcpconn_t *lsocks = NULL;
 /* Active connections list */
 static tcpconn_t *conns = NULL;
 
+/* What a connection wants to do next, see conn_interest() */
+#define CONN_WANT_READ	1
+#define CONN_WANT_WRITE	2
+#define CONN_WANT_NOTHING 4	/* Registered with epoll, but currently idle */
+
+#ifdef HAVE_EPOLL
+static int epollfd = -1;
+static pid_t epollpid = 0;		/* The epoll instance is not usable in a child process */
+static struct epoll_event *epollevents = NULL;
+static int epolleventcount = 0;
+static int epollcount = 0;		/* Sockets registered for reading and/or writing */
+static tcpconn_t **checklist = NULL;	/* Connections whose interest may have changed, see conn_recheck() */
+static int checkcount = 0, checksize = 0;
+#endif
+
 enum io_action_t { IO_READ, IO_WRITE };
 
 void (*userinfo)(time_t, const char *id, char *msg) = NULL;
 enum infolevel_t userinfolevel = INFO_WARN;
+static void (*userwait)(int waiting) = NULL;
 
 char *conn_callback_names[CONN_CB_CLEANUP+1] = {
 	"New connection",
@@ -119,6 +141,12 @@ void conn_register_infohandler(void (*cb)(time_t, const char *id, char *msg), en
 	userinfolevel = level;
 }
 
+void conn_register_waithandler(void (*cb)(int waiting))
+{
+	/* "cb" is called with 1 just before conn_process() waits for I/O, and with 0 when the wait is over */
+	userwait = cb;
+}
+
 void conn_info(const char *funcid, enum infolevel_t level, const char *fmt, ...)
 {
 	char timestr[30];
@@ -433,6 +461,16 @@ static void conn_cleanup(tcpconn_t *conn)
 	conn->ctx = NULL;
 #endif
 
+#ifdef HAVE_EPOLL
+	/* 
+	 * Must remove it explicitly: If a child process has a copy of the socket,
+	 * close() does not remove it from the epoll set.
+	 */
+	if ((conn->sock > 0) && conn->pollevents && (epollpid == getpid())) epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->sock, NULL);
+	if (conn->pollevents & (CONN_WANT_READ | CONN_WANT_WRITE)) epollcount--;
+	conn->pollevents = 0;
+#endif
+
 	if (conn->sock > 0) { close(conn->sock); conn->sock = -1; }
 	if (conn->peer) { free(conn->peer); conn->peer = NULL; }
 	conn->elapsedus = conn_elapsedus(&conn->starttime, NULL);
@@ -577,6 +615,7 @@ int conn_listen(int backlog, int maxlifetime,
 		}
 		else {
 			conn_info(funcid, INFO_INFO, "Listening on IPv6 %s\n", conn_print_address(ls));
+			ls->listener = 1;
 			ls->next = lsocks;
 			lsocks = ls;
 		}
@@ -603,6 +642,7 @@ int conn_listen(int backlog, int maxlifetime,
 		}
 		else {
 			conn_info(funcid, INFO_INFO, "Listening on IPv4 %s\n", conn_print_address(ls));
+			ls->listener = 1;
 			ls->next = lsocks;
 			lsocks = ls;
 		}
@@ -862,6 +902,7 @@ tcpconn_t *conn_accept(tcpconn_t *ls)
 		conn_getntimer(&newconn->starttime);
 		newconn->next = conns;
 		conns = newconn;
+		conn_recheck(newconn);
 		conn_info(funcid, INFO_INFO, "Incoming connection from %s\n", conn_print_address(newconn));
 	}
 
@@ -1041,6 +1082,9 @@ int conn_trimactive(void)
 		}
 		else {
 			current->usercallback(current, CONN_CB_CLEANUP, current->userdata);
+#ifdef HAVE_EPOLL
+			if (current->checkidx) checklist[current->checkidx-1] = NULL;
+#endif
 			free(current);
 		}
 	}
@@ -1065,17 +1109,71 @@ void add_fd(int sock, fd_set *fds, int *maxfd)
 
 
 /*
- * Setup the FD sets for select(). Simple enough when reading/writing data,
+ * Find out what a connection is waiting for. Simple enough when reading/writing data,
  * but the other states have special needs.
  *
  * readcheck() and writecheck() are callback-routines where application signals
  * that it wants to read/write data.
  */
+static int conn_interest(tcpconn_t *walk)
+{
+	int wantread, wantwrite;
+
+	switch (walk->connstate) {
+	  case CONN_CLOSING:
+	  case CONN_DEAD:
+		break;
+
+	  case CONN_PLAINTEXT:
+	  case CONN_SSL_READY:
+		wantread = (walk->usercallback(walk, CONN_CB_READCHECK, walk->userdata) == CONN_CBRESULT_OK);
+		wantwrite = (walk->usercallback(walk, CONN_CB_WRITECHECK, walk->userdata) == CONN_CBRESULT_OK);
+		if (!wantread && !wantwrite) {
+			/* Must be done with this socket */
+			walk->connstate = CONN_CLOSING;
+			conn_cleanup(walk);
+		}
+		return ((wantread ? CONN_WANT_READ : 0) | (wantwrite ? CONN_WANT_WRITE : 0));
+
+	  case CONN_SSL_INIT:
+		/*
+		 * Starting an SSL handshake, we want to read or write data.
+		 * 
+		 * NOTE: This really should not happen, since all SSL I/O
+		 * operations explicitly call try_ssl_X(), which invokes the
+		 * SSL I/O operation and then changes state to CONN_SSL_X_READ/WRITE
+		 */
+		return (CONN_WANT_READ | CONN_WANT_WRITE);
+
+	  case CONN_SSL_ACCEPT_READ:
+	  case CONN_SSL_CONNECT_READ:
+	  case CONN_SSL_STARTTLS_READ:
+	  case CONN_SSL_READ:
+		/* We're doing SSL handshake and the library needs to read data */
+		return CONN_WANT_READ;
+
+	  case CONN_SSL_ACCEPT_WRITE:
+	  case CONN_SSL_CONNECT_WRITE:
+	  case CONN_SSL_STARTTLS_WRITE:
+	  case CONN_SSL_WRITE:
+		/* We're doing SSL handshake and the library needs to write data */
+	  case CONN_SSL_CONNECTING:
+	  case CONN_PLAINTEXT_CONNECTING:
+		/* We're waiting for an outbound connection to complete = ready for writing */
+		return CONN_WANT_WRITE;
+	}
+
+	return 0;
+}
+
+/*
+ * Setup the FD sets for select().
+ */
 int conn_fdset(fd_set *fdread, fd_set *fdwrite)
 {
 	const char *funcid = "conn_fdset";
 
-	int maxfd, wantread, wantwrite;
+	int maxfd, want;
 	tcpconn_t *walk;
 
 	clear_fdsets(fdread, fdwrite, &maxfd);
@@ -1085,53 +1183,9 @@ int conn_fdset(fd_set *fdread, fd_set *fdwrite)
 	}
 
 	for (walk = conns; (walk); walk = walk->next) {
-		switch (walk->connstate) {
-		  case CONN_CLOSING:
-		  case CONN_DEAD:
-			break;
-
-		  case CONN_PLAINTEXT:
-		  case CONN_SSL_READY:
-			wantread = (walk->usercallback(walk, CONN_CB_READCHECK, walk->userdata) == CONN_CBRESULT_OK); if (wantread) add_fd(walk->sock, fdread, &maxfd);
-			wantwrite = (walk->usercallback(walk, CONN_CB_WRITECHECK, walk->userdata) == CONN_CBRESULT_OK); if (wantwrite) add_fd(walk->sock, fdwrite, &maxfd);
-			if (!wantread && !wantwrite) {
-				/* Must be done with this socket */
-				walk->connstate = CONN_CLOSING;
-				conn_cleanup(walk);
-			}
-			break;
-
-		  case CONN_SSL_INIT:
-			/*
-			 * Starting an SSL handshake, we want to read or write data.
-			 * 
-			 * NOTE: This really should not happen, since all SSL I/O
-			 * operations explicitly call try_ssl_X(), which invokes the
-			 * SSL I/O operation and then changes state to CONN_SSL_X_READ/WRITE
-			 */
-			add_fd(walk->sock, fdread, &maxfd);
-			add_fd(walk->sock, fdwrite, &maxfd);
-			break;
-
-		  case CONN_SSL_ACCEPT_READ:
-		  case CONN_SSL_CONNECT_READ:
-		  case CONN_SSL_STARTTLS_READ:
-		  case CONN_SSL_READ:
-			/* We're doing SSL handshake and the library needs to read data */
-			add_fd(walk->sock, fdread, &maxfd);
-			break;
-
-		  case CONN_SSL_ACCEPT_WRITE:
-		  case CONN_SSL_CONNECT_WRITE:
-		  case CONN_SSL_STARTTLS_WRITE:
-		  case CONN_SSL_WRITE:
-			/* We're doing SSL handshake and the library needs to write data */
-		  case CONN_SSL_CONNECTING:
-		  case CONN_PLAINTEXT_CONNECTING:
-			/* We're waiting for an outbound connection to complete = ready for writing */
-			add_fd(walk->sock, fdwrite, &maxfd);
-			break;
-		}
+		want = conn_interest(walk);
+		if (want & CONN_WANT_READ) add_fd(walk->sock, fdread, &maxfd);
+		if (want & CONN_WANT_WRITE) add_fd(walk->sock, fdwrite, &maxfd);
 	}
 
 	return maxfd;
@@ -1139,8 +1193,8 @@ int conn_fdset(fd_set *fdread, fd_set *fdwrite)
 
 
 /*
- * Do a cycle of all the active connections after select() has found out
- * which connections are doing something.
+ * Handle I/O on one connection, after select() or poll() has found out
+ * it is doing something.
  *
  * The userread() callback gets invoked when there is data to read from the socket.
  * It is passed the connection-specific data-pointer, and the callback-routine must
@@ -1154,81 +1208,112 @@ int conn_fdset(fd_set *fdread, fd_set *fdwrite)
  * is handled here; since we do async I/O, the connect() call is also asynchronous and
  * a new connection shows up here as being ready for writing.
  */
-void conn_process_active(fd_set *fdread, fd_set *fdwrite)
+static void conn_handle_io(tcpconn_t *walk, int canread, int canwrite)
 {
-	const char *funcid = "conn_process_active";
-	tcpconn_t *walk;
+	const char *funcid = "conn_handle_io";
 	int connres;
 	socklen_t connressize;
-	struct timespec tnow;
-	
-#ifdef DEBUG
-	conn_info(funcid, INFO_DEBUG, "Processing all active connections\n");
-#endif
-	conn_getntimer(&tnow);
+	enum conn_cbresult_t cbres = CONN_CBRESULT_OK;
 
-	for (walk = conns; (walk); walk = walk->next) {
-		enum conn_cbresult_t cbres = CONN_CBRESULT_OK;
+	if (walk->connstate == CONN_DEAD) return;
 
-		if (walk->connstate == CONN_DEAD) continue;
-		if (FD_ISSET(walk->sock, fdread)) {
-			cbres = walk->usercallback(walk, CONN_CB_READ, walk->userdata);
-			if (walk->connstate == CONN_DEAD) continue;
+	/* What the application wants to do next may change now */
+	conn_recheck(walk);
 
-			if (cbres == CONN_CBRESULT_STARTTLS)
-				conn_starttls(walk);
-		}
+	if (canread) {
+		cbres = walk->usercallback(walk, CONN_CB_READ, walk->userdata);
+		if (walk->connstate == CONN_DEAD) return;
 
-		if (walk->connstate == CONN_DEAD) continue;
-		if (FD_ISSET(walk->sock, fdwrite)) {
-			switch (walk->connstate) {
-			  case CONN_PLAINTEXT_CONNECTING:
-			  case CONN_SSL_CONNECTING:
-				/* We have the connect() result now */
-				connressize = sizeof(connres);
-				getsockopt(walk->sock, SOL_SOCKET, SO_ERROR, &connres, &connressize);
-				if (connres != 0) {
-					walk->errcode = connres;
-					conn_info(funcid, INFO_DEBUG, "connect() to %s failed: status %d\n", 
-						  conn_print_address(walk), connres);
-					walk->usercallback(walk, CONN_CB_CONNECT_FAILED, walk->userdata);
-					conn_cleanup(walk);
+		if (cbres == CONN_CBRESULT_STARTTLS)
+			conn_starttls(walk);
+	}
+
+	if (walk->connstate == CONN_DEAD) return;
+	if (canwrite) {
+		switch (walk->connstate) {
+		  case CONN_PLAINTEXT_CONNECTING:
+		  case CONN_SSL_CONNECTING:
+			/* We have the connect() result now */
+			connressize = sizeof(connres);
+			getsockopt(walk->sock, SOL_SOCKET, SO_ERROR, &connres, &connressize);
+			if (connres != 0) {
+				walk->errcode = connres;
+				conn_info(funcid, INFO_DEBUG, "connect() to %s failed: status %d\n", 
+					  conn_print_address(walk), connres);
+				walk->usercallback(walk, CONN_CB_CONNECT_FAILED, walk->userdata);
+				conn_cleanup(walk);
+			}
+			else {
+				walk->usercallback(walk, CONN_CB_CONNECT_COMPLETE, walk->userdata);
+				if (walk->connstate == CONN_PLAINTEXT_CONNECTING) {
+					walk->connstate = CONN_PLAINTEXT;
 				}
 				else {
-					walk->usercallback(walk, CONN_CB_CONNECT_COMPLETE, walk->userdata);
-					if (walk->connstate == CONN_PLAINTEXT_CONNECTING) {
-						walk->connstate = CONN_PLAINTEXT;
-					}
-					else {
-						/* Connected, but havent done SSL handshake yet */
-						try_ssl_connect(walk);
-					}
-
-					if ((walk->connstate == CONN_PLAINTEXT) || (walk->connstate == CONN_SSL_READY)) {
-						if (walk->usercallback(walk, CONN_CB_WRITECHECK, walk->userdata) == CONN_CBRESULT_OK)
-							cbres = walk->usercallback(walk, CONN_CB_WRITE, walk->userdata);
-					}
+					/* Connected, but havent done SSL handshake yet */
+					try_ssl_connect(walk);
 				}
-				break;
 
-			  default:
-				cbres = walk->usercallback(walk, CONN_CB_WRITE, walk->userdata);
-				break;
+				if ((walk->connstate == CONN_PLAINTEXT) || (walk->connstate == CONN_SSL_READY)) {
+					if (walk->usercallback(walk, CONN_CB_WRITECHECK, walk->userdata) == CONN_CBRESULT_OK)
+						cbres = walk->usercallback(walk, CONN_CB_WRITE, walk->userdata);
+				}
 			}
+			break;
 
-			if (walk->connstate == CONN_DEAD) continue;
-
-			if (cbres == CONN_CBRESULT_STARTTLS)
-				conn_starttls(walk);
+		  default:
+			cbres = walk->usercallback(walk, CONN_CB_WRITE, walk->userdata);
+			break;
 		}
 
+		if (walk->connstate == CONN_DEAD) return;
+
+		if (cbres == CONN_CBRESULT_STARTTLS)
+			conn_starttls(walk);
+	}
+}
+
+static void conn_check_timeouts(void)
+{
+	tcpconn_t *walk;
+	struct timespec tnow;
+
+	conn_getntimer(&tnow);
+	for (walk = conns; (walk); walk = walk->next) {
+		if (walk->connstate == CONN_DEAD) continue;
+
 		if (walk->maxlifetime && (conn_elapsedus(&walk->starttime, &tnow) > walk->maxlifetime)) {
 			walk->usercallback(walk, CONN_CB_TIMEOUT, walk->userdata);
+			conn_recheck(walk);
 		}
-		continue;
 	}
 }
 
+/*
+ * Do a cycle of all the active connections after select() has found out
+ * which connections are doing something.
+ */
+void conn_process_active(fd_set *fdread, fd_set *fdwrite)
+{
+	const char *funcid = "conn_process_active";
+	tcpconn_t *walk;
+	
+#ifdef DEBUG
+	conn_info(funcid, INFO_DEBUG, "Processing all active connections\n");
+#endif
+
+	for (walk = conns; (walk); walk = walk->next) {
+		if (walk->connstate == CONN_DEAD) continue;
+		conn_handle_io(walk, FD_ISSET(walk->sock, fdread), FD_ISSET(walk->sock, fdwrite));
+	}
+
+	conn_check_timeouts();
+}
+
+static void conn_accept_all(tcpconn_t *ls, int *acceptcount)
+{
+	while (conn_accept(ls) && (++(*acceptcount) < max_accepts)) ;
+}
+
 /*
  * Handle listener sockets - i.e. pick up all inbound connections.
  */
@@ -1242,12 +1327,227 @@ void conn_process_listeners(fd_set *fdread)
 	conn_info(funcid, INFO_DEBUG, "Processing all listen-sockets\n");
 #endif
 	for (walk = lsocks; (walk); walk = walk->next) {
-		if (FD_ISSET(walk->sock, fdread)) {
-			while (conn_accept(walk) && (++acceptcount < max_accepts)) ;
+		if (FD_ISSET(walk->sock, fdread)) conn_accept_all(walk, &acceptcount);
+	}
+}
+
+
+/*
+ * Wait up to timeoutms milliseconds (-1: forever) for I/O on the listeners 
+ * and active connections, and handle it. This does the same as conn_fdset(), 
+ * select(), conn_process_active() and conn_process_listeners(), but uses
+ * epoll() or poll() where available so there is no FD_SETSIZE limit.
+ *
+ * Returns the number of sockets we waited for (0 if there were none, and 
+ * then we do not wait), or -1 if the wait failed (see errno).
+ */
+#if !defined(HAVE_EPOLL)
+void conn_recheck(tcpconn_t *conn)
+{
+	/* poll() and select() ask every connection what it wants on each pass */
+}
+#endif
+
+#if defined(HAVE_EPOLL)
+
+/*
+ * With epoll, the sockets stay registered between calls, and we only ask a
+ * connection what it wants to do (conn_interest(), i.e. the READCHECK and
+ * WRITECHECK callbacks) when that may have changed: When it is new, and 
+ * after its I/O or timeout callbacks. An application that changes what it 
+ * wants to do with a connection at any other time must call conn_recheck().
+ */
+void conn_recheck(tcpconn_t *conn)
+{
+	if (conn->checkidx) return;
+
+	if (checkcount == checksize) {
+		checksize += 256;
+		checklist = (tcpconn_t **)realloc(checklist, checksize * sizeof(tcpconn_t *));
+	}
+	checklist[checkcount++] = conn;
+	conn->checkidx = checkcount;
+}
+
+static void conn_epoll_update(tcpconn_t *conn, int want)
+{
+	struct epoll_event ev;
+	int op;
+
+	if (!want) want = CONN_WANT_NOTHING;
+	if (want == conn->pollevents) return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ((want & CONN_WANT_READ) ? EPOLLIN : 0) | ((want & CONN_WANT_WRITE) ? EPOLLOUT : 0);
+	ev.data.ptr = conn;
+
+	op = (conn->pollevents ? EPOLL_CTL_MOD : EPOLL_CTL_ADD);
+	if ((epoll_ctl(epollfd, op, conn->sock, &ev) == -1) && (op == EPOLL_CTL_ADD) && (errno == EEXIST)) {
+		epoll_ctl(epollfd, EPOLL_CTL_MOD, conn->sock, &ev);
+	}
+
+	if (conn->pollevents & (CONN_WANT_READ | CONN_WANT_WRITE)) epollcount--;
+	if (want & (CONN_WANT_READ | CONN_WANT_WRITE)) epollcount++;
+	conn->pollevents = want;
+}
+
+int conn_process(int timeoutms)
+{
+	const char *funcid = "conn_process";
+	tcpconn_t *walk;
+	int want, n, i, acceptcount = 0;
+
+	if (epollpid != getpid()) {
+		/* First time, or we are a child process that inherited the parent's epoll instance */
+		if (epollfd != -1) close(epollfd);
+		epollfd = epoll_create(1024);
+		if (epollfd == -1) {
+			conn_info(funcid, INFO_ERROR, "Cannot create epoll instance: %s\n", strerror(errno));
+			return -1;
+		}
+		fcntl(epollfd, F_SETFD, FD_CLOEXEC);
+		epollpid = getpid();
+
+		epollcount = 0;
+		for (walk = lsocks; (walk); walk = walk->next) walk->pollevents = 0;
+		for (walk = conns; (walk); walk = walk->next) {
+			walk->pollevents = 0;
+			conn_recheck(walk);
 		}
 	}
+
+	for (walk = lsocks; (walk); walk = walk->next) {
+		if (walk->sock <= 0) continue;
+		conn_epoll_update(walk, CONN_WANT_READ);	/* No-op once registered */
+	}
+	for (i = 0; (i < checkcount); i++) {
+		walk = checklist[i];
+		if (!walk) continue;	/* Freed by conn_trimactive() */
+
+		walk->checkidx = 0;
+		want = conn_interest(walk);
+		if (walk->sock <= 0) continue;	/* conn_interest() may have closed it */
+		conn_epoll_update(walk, want);
+	}
+	checkcount = 0;
+
+	if (epollcount == 0) return 0;
+
+	if (epollcount > epolleventcount) {
+		epolleventcount = epollcount + 64;
+		epollevents = (struct epoll_event *)realloc(epollevents, epolleventcount * sizeof(struct epoll_event));
+	}
+
+	if (userwait) userwait(1);
+	n = epoll_wait(epollfd, epollevents, epolleventcount, timeoutms);
+	if (userwait) userwait(0);
+	if (n == -1) return -1;
+
+	for (i = 0; (i < n); i++) {
+		tcpconn_t *conn = (tcpconn_t *)epollevents[i].data.ptr;
+		int err = (epollevents[i].events & (EPOLLERR | EPOLLHUP));
+
+		if (conn->listener) {
+			if (acceptcount < max_accepts) conn_accept_all(conn, &acceptcount);
+		}
+		else {
+			/* Errors show up as readable/writable, so the callback sees the failing read or write */
+			conn_handle_io(conn, 
+				       ((epollevents[i].events & EPOLLIN) || (err && (conn->pollevents & CONN_WANT_READ))),
+				       ((epollevents[i].events & EPOLLOUT) || (err && (conn->pollevents & CONN_WANT_WRITE))));
+		}
+	}
+
+	conn_check_timeouts();
+
+	return epollcount;
 }
 
+#elif defined(HAVE_POLL)
+
+int conn_process(int timeoutms)
+{
+	static struct pollfd *pfds = NULL;
+	static tcpconn_t **pconns = NULL;
+	static int pfdsize = 0;
+	tcpconn_t *walk;
+	int count = 0, want, n, i, acceptcount = 0;
+
+	for (walk = lsocks, n = 0; (walk); walk = walk->next) n++;
+	for (walk = conns; (walk); walk = walk->next) n++;
+	if (n > pfdsize) {
+		pfdsize = n + 64;
+		pfds = (struct pollfd *)realloc(pfds, pfdsize * sizeof(struct pollfd));
+		pconns = (tcpconn_t **)realloc(pconns, pfdsize * sizeof(tcpconn_t *));
+	}
+
+	for (walk = lsocks; (walk); walk = walk->next) {
+		if (walk->sock <= 0) continue;
+		pfds[count].fd = walk->sock; pfds[count].events = POLLIN; pfds[count].revents = 0;
+		pconns[count++] = walk;
+	}
+	for (walk = conns; (walk); walk = walk->next) {
+		want = conn_interest(walk);
+		if (!want || (walk->sock <= 0)) continue;
+		pfds[count].fd = walk->sock; pfds[count].revents = 0;
+		pfds[count].events = ((want & CONN_WANT_READ) ? POLLIN : 0) | ((want & CONN_WANT_WRITE) ? POLLOUT : 0);
+		pconns[count++] = walk;
+	}
+
+	if (count == 0) return 0;
+
+	if (userwait) userwait(1);
+	n = poll(pfds, count, timeoutms);
+	if (userwait) userwait(0);
+	if (n == -1) return -1;
+
+	for (i = 0; ((i < count) && (n > 0)); i++) {
+		int err = (pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL));
+
+		if (pfds[i].revents == 0) continue;
+		n--;
+
+		if (pconns[i]->listener) {
+			if (acceptcount < max_accepts) conn_accept_all(pconns[i], &acceptcount);
+		}
+		else {
+			/* Errors show up as readable/writable, so the callback sees the failing read or write */
+			conn_handle_io(pconns[i], 
+				       ((pfds[i].revents & POLLIN) || (err && (pfds[i].events & POLLIN))),
+				       ((pfds[i].revents & POLLOUT) || (err && (pfds[i].events & POLLOUT))));
+		}
+	}
+
+	conn_check_timeouts();
+
+	return count;
+}
+
+#else
+
+int conn_process(int timeoutms)
+{
+	fd_set fdread, fdwrite;
+	struct timeval tmo;
+	int maxfd, n;
+
+	maxfd = conn_fdset(&fdread, &fdwrite);
+	if (maxfd < 0) return 0;
+
+	if (timeoutms >= 0) { tmo.tv_sec = timeoutms / 1000; tmo.tv_usec = (timeoutms % 1000) * 1000; }
+	if (userwait) userwait(1);
+	n = select(maxfd+1, &fdread, &fdwrite, NULL, ((timeoutms >= 0) ? &tmo : NULL));
+	if (userwait) userwait(0);
+	if (n == -1) return -1;
+
+	conn_process_active(&fdread, &fdwrite);
+	conn_process_listeners(&fdread);
+
+	return (maxfd + 1);
+}
+
+#endif
+
 
 #ifdef HAVE_OPENSSL
 /* 
@@ -1636,6 +1936,7 @@ tcpconn_t *conn_prepare_connection(char *ip, int portnumber, enum conn_socktype_
 		conn_getntimer(&newconn->starttime);
 		newconn->next = conns;
 		conns = newconn;
+		conn_recheck(newconn);
 	}
 
 	return newconn;
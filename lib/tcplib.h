@@ -63,6 +63,9 @@ typedef struct tcpconn_t {
 	long elapsedus;
 	void *userdata;
 	enum conn_cbresult_t (*usercallback)(struct tcpconn_t *, enum conn_callback_t, void *);
+	int listener;				/* Set for listener sockets */
+	int pollevents;				/* Events registered with epoll, if used */
+	int checkidx;				/* Position+1 in the epoll re-check list, see conn_recheck() */
 	struct tcpconn_t *next;
 #ifdef HAVE_OPENSSL
 	SSL_CTX *ctx;
@@ -87,6 +90,7 @@ extern void add_fd(int sock, fd_set *fds, int *maxfd);
 
 
 extern void conn_register_infohandler(void (*cb)(time_t, const char *id, char *msg), enum infolevel_t level);
+extern void conn_register_waithandler(void (*cb)(int waiting));
 
 extern void conn_init_server(int backlog, int maxlifetime,
 			     char *certfn, char *keyfn, char *rootcafn, int requireclientcert,
@@ -101,6 +105,8 @@ extern tcpconn_t *conn_prepare_connection(char *ip, int portnumber, enum conn_so
 extern int conn_fdset(fd_set *fdread, fd_set *fdwrite);
 extern void conn_process_listeners(fd_set *fdread);
 extern void conn_process_active(fd_set *fdread, fd_set *fdwrite);
+extern int conn_process(int timeoutms);
+extern void conn_recheck(tcpconn_t *conn);
 extern int conn_read(tcpconn_t *conn, void *buf, size_t sz);
 extern int conn_write(tcpconn_t *conn, void *buf, size_t count);
 extern int conn_starttls(tcpconn_t *conn);
@@ -14,7 +14,7 @@
 static char rcsid[] = "$Id: files.c 6712 2011-07-31 21:01:52Z storner $";
 
 #include "config.h"
-#ifdef HAVE_BINARY_TREE
+#if defined(HAVE_BINARY_TREE) || defined(XTREE_BENCH_POSIX)
 #define _GNU_SOURCE
 #endif
 
@@ -23,6 +23,7 @@ static char rcsid[] = "$Id: files.c 6712 2011-07-31 21:01:52Z storner $";
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <sys/time.h>
 
 #include "errormsg.h"
 #include "memory.h"
@@ -236,6 +237,276 @@ void *xtreeData(void *treehandle, xtreePos_t pos)
 	return pos ? ((treerec_t *)pos)->userdata : NULL;
 }
 
+#elif defined(HAVE_XTREE_HASH)
+
+/*
+ * Hashed skiplist backend.
+ *
+ * Records are kept in a skiplist ordered by the tree compare-function,
+ * so inserts and deletes are O(log n) and xtreeNext() just follows the
+ * bottom-level link. For trees using strcmp or strcasecmp as the compare
+ * function, lookups go through a hash table and are O(1); other compare
+ * functions fall back to searching the skiplist.
+ *
+ * Like the sorted-array backend, the keys belong to the caller. xtreeDelete()
+ * and xtreeDestroy() never free them.
+ */
+
+#define XTREE_MAXLEVEL 24
+#define XTREE_INITIAL_HASHSZ 64
+
+enum xtreehash_t { XTREE_HASH_NONE, XTREE_HASH_EXACT, XTREE_HASH_NOCASE };
+
+typedef struct treerec_t {
+	char *key;
+	void *userdata;
+	unsigned int hashval;
+	struct treerec_t *hashnext;
+	int levels;
+	struct treerec_t *next[1];	/* Really "levels" entries */
+} treerec_t;
+
+typedef struct xtree_t {
+	int (*compare)(const char *a, const char *b);
+	enum xtreehash_t hashmode;
+	treerec_t **hashtable;
+	unsigned int hashsz, count;
+	unsigned int rndstate;
+	int level;
+	treerec_t *head;
+} xtree_t;
+
+static treerec_t *newrec(int levels)
+{
+	treerec_t *rec;
+
+	rec = (treerec_t *)calloc(1, sizeof(treerec_t) + (levels - 1)*sizeof(treerec_t *));
+	if (rec) rec->levels = levels;
+	return rec;
+}
+
+static unsigned int xtree_hash(xtree_t *mytree, const char *key)
+{
+	/* FNV-1a. Fold case for trees using strcasecmp */
+	unsigned int h = 2166136261U;
+	const unsigned char *p;
+
+	if (mytree->hashmode == XTREE_HASH_NOCASE) {
+		for (p = (const unsigned char *)key; (*p); p++) { h ^= (unsigned int)tolower(*p); h *= 16777619U; }
+	}
+	else {
+		for (p = (const unsigned char *)key; (*p); p++) { h ^= (unsigned int)*p; h *= 16777619U; }
+	}
+
+	return h;
+}
+
+static int randomlevel(xtree_t *mytree)
+{
+	int lvl = 1;
+	unsigned int r;
+
+	/* xorshift32 - we just need something cheap and reproducible */
+	r = mytree->rndstate;
+	r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+	mytree->rndstate = r;
+
+	/* Each level has 1/4 of the records in the level below */
+	while (((r & 3) == 0) && (lvl < XTREE_MAXLEVEL)) { lvl++; r >>= 2; }
+
+	return lvl;
+}
+
+static void rehash(xtree_t *mytree, unsigned int newsz)
+{
+	treerec_t **newtable, *walk;
+	unsigned int i;
+
+	newtable = (treerec_t **)calloc(newsz, sizeof(treerec_t *));
+	for (walk = mytree->head->next[0]; (walk); walk = walk->next[0]) {
+		i = (walk->hashval & (newsz - 1));
+		walk->hashnext = newtable[i];
+		newtable[i] = walk;
+	}
+
+	free(mytree->hashtable);
+	mytree->hashtable = newtable;
+	mytree->hashsz = newsz;
+}
+
+/* Find the record with a key, and (optionally) the records right before it at each level */
+static treerec_t *skipsearch(xtree_t *mytree, char *key, treerec_t **update)
+{
+	treerec_t *walk = mytree->head;
+	int lvl;
+
+	for (lvl = mytree->level - 1; (lvl >= 0); lvl--) {
+		while (walk->next[lvl] && (mytree->compare(walk->next[lvl]->key, key) < 0)) walk = walk->next[lvl];
+		if (update) update[lvl] = walk;
+	}
+
+	walk = walk->next[0];
+	return (walk && (mytree->compare(walk->key, key) == 0)) ? walk : NULL;
+}
+
+void *xtreeNew(int(*xtreeCompare)(const char *a, const char *b))
+{
+	xtree_t *newtree;
+
+	newtree = (xtree_t *)calloc(1, sizeof(xtree_t));
+	newtree->compare = xtreeCompare;
+	newtree->rndstate = 2463534242U;
+	newtree->level = 1;
+	newtree->head = newrec(XTREE_MAXLEVEL);
+
+	if (xtreeCompare == strcmp) newtree->hashmode = XTREE_HASH_EXACT;
+	else if (xtreeCompare == strcasecmp) newtree->hashmode = XTREE_HASH_NOCASE;
+	else newtree->hashmode = XTREE_HASH_NONE;
+
+	if (newtree->hashmode != XTREE_HASH_NONE) {
+		newtree->hashsz = XTREE_INITIAL_HASHSZ;
+		newtree->hashtable = (treerec_t **)calloc(newtree->hashsz, sizeof(treerec_t *));
+	}
+
+	return newtree;
+}
+
+void xtreeDestroy(void *treehandle)
+{
+	xtree_t *mytree = (xtree_t *)treehandle;
+	treerec_t *walk, *zombie;
+
+	if (treehandle == NULL) return;
+
+	walk = mytree->head->next[0];
+	while (walk) {
+		zombie = walk;
+		walk = walk->next[0];
+		free(zombie);
+	}
+
+	if (mytree->hashtable) free(mytree->hashtable);
+	free(mytree->head);
+	free(mytree);
+}
+
+xtreePos_t xtreeFind(void *treehandle, char *key)
+{
+	xtree_t *mytree = (xtree_t *)treehandle;
+	treerec_t *walk;
+	unsigned int h;
+
+	/* Does tree exist ? Is it empty? */
+	if ((treehandle == NULL) || (mytree->count == 0) || (key == NULL)) return NULL;
+
+	if (mytree->hashmode == XTREE_HASH_NONE) return skipsearch(mytree, key, NULL);
+
+	h = xtree_hash(mytree, key);
+	for (walk = mytree->hashtable[h & (mytree->hashsz - 1)]; (walk); walk = walk->hashnext) {
+		if ((walk->hashval == h) && (mytree->compare(walk->key, key) == 0)) return walk;
+	}
+
+	return NULL;
+}
+
+xtreePos_t xtreeFirst(void *treehandle)
+{
+	xtree_t *mytree = (xtree_t *)treehandle;
+
+	if (treehandle == NULL) return NULL;
+
+	return mytree->head->next[0];
+}
+
+xtreePos_t xtreeNext(void *treehandle, xtreePos_t pos)
+{
+	return pos ? ((treerec_t *)pos)->next[0] : NULL;
+}
+
+char *xtreeKey(void *treehandle, xtreePos_t pos)
+{
+	return pos ? ((treerec_t *)pos)->key : NULL;
+}
+
+void *xtreeData(void *treehandle, xtreePos_t pos)
+{
+	return pos ? ((treerec_t *)pos)->userdata : NULL;
+}
+
+xtreeStatus_t xtreeAdd(void *treehandle, char *key, void *userdata)
+{
+	xtree_t *mytree = (xtree_t *)treehandle;
+	treerec_t *update[XTREE_MAXLEVEL];
+	treerec_t *rec;
+	int lvl, i;
+
+	if (treehandle == NULL) return XTREE_STATUS_NOTREE;
+
+	if (skipsearch(mytree, key, update)) return XTREE_STATUS_DUPLICATE_KEY;
+
+	lvl = randomlevel(mytree);
+	if (lvl > mytree->level) {
+		for (i = mytree->level; (i < lvl); i++) update[i] = mytree->head;
+		mytree->level = lvl;
+	}
+
+	rec = newrec(lvl);
+	if (rec == NULL) return XTREE_STATUS_MEM_EXHAUSTED;
+	rec->key = key;
+	rec->userdata = userdata;
+	for (i = 0; (i < lvl); i++) {
+		rec->next[i] = update[i]->next[i];
+		update[i]->next[i] = rec;
+	}
+	mytree->count++;
+
+	if (mytree->hashmode != XTREE_HASH_NONE) {
+		unsigned int n;
+
+		rec->hashval = xtree_hash(mytree, key);
+		n = (rec->hashval & (mytree->hashsz - 1));
+		rec->hashnext = mytree->hashtable[n];
+		mytree->hashtable[n] = rec;
+
+		/* Keep the load factor below 1 */
+		if (mytree->count > mytree->hashsz) rehash(mytree, 2*mytree->hashsz);
+	}
+
+	return XTREE_STATUS_OK;
+}
+
+void *xtreeDelete(void *treehandle, char *key)
+{
+	xtree_t *mytree = (xtree_t *)treehandle;
+	treerec_t *update[XTREE_MAXLEVEL];
+	treerec_t *zombie;
+	void *userdata;
+	int i;
+
+	if (treehandle == NULL) return NULL;
+	if (mytree->count == 0) return NULL;	/* Empty tree */
+
+	zombie = skipsearch(mytree, key, update);
+	if (zombie == NULL) return NULL;
+
+	for (i = 0; (i < zombie->levels); i++) update[i]->next[i] = zombie->next[i];
+	while ((mytree->level > 1) && (mytree->head->next[mytree->level - 1] == NULL)) mytree->level--;
+
+	if (mytree->hashmode != XTREE_HASH_NONE) {
+		treerec_t **hwalk;
+
+		hwalk = &mytree->hashtable[zombie->hashval & (mytree->hashsz - 1)];
+		while (*hwalk != zombie) hwalk = &((*hwalk)->hashnext);
+		*hwalk = zombie->hashnext;
+	}
+
+	mytree->count--;
+	userdata = zombie->userdata;
+	free(zombie);
+
+	return userdata;
+}
+
 #else
 
 typedef struct treerec_t {
@@ -560,3 +831,99 @@ int main(int argc, char **argv)
 #endif  // __GNUC__
 #endif
 
+
+#ifdef BENCHMARK
+/*
+ * Microbenchmark for the xtree backends. Build it with one of
+ * -DXTREE_BENCH_POSIX, -DXTREE_BENCH_ARRAY or -DXTREE_BENCH_HASH
+ * ("make tree-bench" in lib/ builds all three).
+ */
+
+#if defined(HAVE_BINARY_TREE)
+#define BACKENDNAME "tsearch"
+#elif defined(HAVE_XTREE_HASH)
+#define BACKENDNAME "hash"
+#else
+#define BACKENDNAME "array"
+#endif
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+	int count = 20000, rounds = 10;
+	int i, r, found;
+	char **keys;
+	void *th;
+	xtreePos_t n;
+	struct timeval start;
+	double tadd, tfind, twalk, tdel;
+
+	if (argc > 1) count = atoi(argv[1]);
+	if (argc > 2) rounds = atoi(argv[2]);
+	if ((count <= 0) || (rounds <= 0)) {
+		fprintf(stderr, "Usage: %s [KEYCOUNT [FINDROUNDS]]\n", argv[0]);
+		return 1;
+	}
+
+	/* Hostname-like keys, inserted in random order like hosts.cfg usually is */
+	keys = (char **)malloc(count * sizeof(char *));
+	for (i = 0; (i < count); i++) {
+		char buf[64];
+
+		snprintf(buf, sizeof(buf), "host%07d.example.com", i);
+		keys[i] = strdup(buf);
+	}
+	srandom(42);
+	for (i = count-1; (i > 0); i--) {
+		int j = random() % (i+1);
+		char *tmp = keys[i]; keys[i] = keys[j]; keys[j] = tmp;
+	}
+
+	th = xtreeNew(strcasecmp);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; (i < count); i++) xtreeAdd(th, keys[i], keys[i]);
+	tadd = elapsed(&start);
+
+	gettimeofday(&start, NULL);
+	for (r = 0, found = 0; (r < rounds); r++) {
+		for (i = 0; (i < count); i++) if (xtreeFind(th, keys[i]) != xtreeEnd(th)) found++;
+	}
+	tfind = elapsed(&start);
+	if (found != count*rounds) fprintf(stderr, "Lookup failed: Found %d of %d keys\n", found, count*rounds);
+
+	gettimeofday(&start, NULL);
+	for (r = 0, found = 0; (r < rounds); r++) {
+		for (n = xtreeFirst(th); (n != xtreeEnd(th)); n = xtreeNext(th, n)) found++;
+	}
+	twalk = elapsed(&start);
+	if (found != count*rounds) fprintf(stderr, "Walk failed: Saw %d of %d keys\n", found, count*rounds);
+
+	/* Delete every other key */
+	gettimeofday(&start, NULL);
+	for (i = 0; (i < count); i += 2) xtreeDelete(th, keys[i]);
+	tdel = elapsed(&start);
+
+	printf("%-8s %8d keys: add %8.3fs  find %8.3fs (%d rounds)  walk %8.3fs (%d rounds)  delete %8.3fs\n",
+		BACKENDNAME, count, tadd, tfind, rounds, twalk, rounds, tdel);
+
+	xtreeDestroy(th);
+	for (i = 0; (i < count); i++) {
+#ifdef HAVE_BINARY_TREE
+		/* The tsearch backend already freed the keys it deleted */
+		if ((i % 2) == 0) continue;
+#endif
+		free(keys[i]);
+	}
+	free(keys);
+
+	return 0;
+}
+#endif
@@ -22,6 +22,21 @@ typedef enum {
 	XTREE_STATUS_NOTREE
 } xtreeStatus_t;
 
+/*
+ * The benchmark build needs to select a backend regardless of what
+ * config.h says, so allow it to override the configured one.
+ */
+#if defined(XTREE_BENCH_POSIX)
+#define HAVE_BINARY_TREE 1
+#undef HAVE_XTREE_HASH
+#elif defined(XTREE_BENCH_ARRAY)
+#undef HAVE_BINARY_TREE
+#undef HAVE_XTREE_HASH
+#elif defined(XTREE_BENCH_HASH)
+#undef HAVE_BINARY_TREE
+#define HAVE_XTREE_HASH 1
+#endif
+
 #ifdef HAVE_BINARY_TREE
 typedef struct treerec_t {
 	char *key;
@@ -36,7 +51,7 @@ typedef struct xtree_t {
 } xtree_t;
 #endif
 
-#ifdef HAVE_BINARY_TREE
+#if defined(HAVE_BINARY_TREE) || defined(HAVE_XTREE_HASH)
 #define xtreeEnd(X) (NULL)
 typedef void *xtreePos_t;
 #else
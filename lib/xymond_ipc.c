@@ -15,6 +15,15 @@
 /* third semaphore is used as a simple counter to tell how many workers have  */
 /* attached to a channel.                                                     */
 /*                                                                            */
+/* Channels can also be set up to use a "ring" transport instead: A larger    */
+/* shared memory segment holding many messages, with a separate read cursor   */
+/* for each worker. The master daemon never waits for the workers here; a     */
+/* worker that falls too far behind skips ahead and counts the lost messages. */
+/*                                                                            */
+/* The backfeed ring works the other way around: Local programs post their   */
+/* messages for xymond in a shared memory ring, instead of using the SysV     */
+/* backfeed message queue.                                                    */
+/*                                                                            */
 /* Copyright (C) 2004-2011 Henrik Storner <henrik@hswn.dk>                    */
 /*                                                                            */
 /* This program is released under the GNU General Public License (GPL),       */
@@ -30,11 +39,21 @@ static char rcsid[] = "$Id$";
 #include <sys/sem.h>
 #include <sys/msg.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 #include "libxymon.h"
 
@@ -42,6 +61,24 @@ static char rcsid[] = "$Id$";
 
 #define FEEDBACKQUEUE_MODE 0620
 
+/* ftok() id's for the ring segments. Must not collide with the channel and backfeed queue id's */
+#define RING_KEYBASE 0x40
+
+/* Each record in the ring starts with this header. Records are 16-byte aligned */
+typedef struct ringrec_t {
+	unsigned long seq;
+	unsigned int len;
+	unsigned int pad;
+} ringrec_t;
+
+#define RINGALIGN(n) (((n) + 15) & ~((unsigned long)15))
+#define RINGHDRSZ (RINGALIGN(sizeof(ringrec_t)))
+#define RINGDATA(r) ((char *)(r) + RINGALIGN(sizeof(xymond_ring_t)))
+#define RINGWRAP 0xFFFFFFFF	/* Record length marking "continue at the start of the ring" */
+
+unsigned int ringchannels = 0;		/* Bitmask (1 << channelid) of channels using the ring */
+int ringslots = RING_DEFAULTSLOTS;	/* Ring size, in units of the channel message size */
+
 char *channelnames[C_LAST+1] = {
 	"",		/* First one is index 0 - not used */
 	"status", 
@@ -57,6 +94,333 @@ char *channelnames[C_LAST+1] = {
 	NULL
 };
 
+static void ring_wake(xymond_ring_t *ring)
+{
+	/* This is a full barrier, so the "waiters" check cannot be done before the post is visible */
+	__sync_fetch_and_add(&ring->wakeup, 1);
+	if (ring->waiters == 0) return;
+
+#ifdef __linux__
+	syscall(SYS_futex, &ring->wakeup, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static int ring_sleep(xymond_ring_t *ring, unsigned int wakeval, int timeoutms)
+{
+	/* Returns the number of milliseconds we have used up */
+#ifdef __linux__
+	struct timespec ts;
+
+	ts.tv_sec = timeoutms / 1000; ts.tv_nsec = (timeoutms % 1000) * 1000000;
+	syscall(SYS_futex, &ring->wakeup, FUTEX_WAIT, wakeval, &ts, NULL, 0);
+	return timeoutms;
+#else
+	/* No futex - just poll */
+	usleep(1000);
+	return 1;
+#endif
+}
+
+static void setup_ring(xymond_channel_t *chn, int role, char *xymonhome)
+{
+	key_t key;
+	int shmid, i;
+	xymond_ring_t *ring;
+
+	key = ftok(xymonhome, RING_KEYBASE + chn->channelid);
+	if (key == -1) {
+		errprintf("Could not generate ring key for %s channel: %s\n", channelnames[chn->channelid], strerror(errno));
+		return;
+	}
+
+	shmid = shmget(key, 0, 0);
+
+	if (role == CHAN_MASTER) {
+		unsigned long datasz, need, maxrec;
+
+		/* Always start with a fresh ring. Any left over from an earlier run is removed. */
+		if (shmid != -1) shmctl(shmid, IPC_RMID, NULL);
+		if ((ringchannels & (1 << chn->channelid)) == 0) return;
+
+		/*
+		 * A record is at most maxrec bytes, and when it does not fit before the end
+		 * of the ring there is a skip of less than that. With room for 2 records,
+		 * ring_postv() can always make room by overwriting only older records.
+		 */
+		if (ringslots < 2) ringslots = 2;
+		maxrec = RINGALIGN(RINGHDRSZ + 1024 * shbufsz(chn->channelid) + 1);
+		need = (unsigned long)ringslots * maxrec;
+		for (datasz = 1024; (datasz < need); datasz <<= 1) ;
+
+		shmid = shmget(key, RINGALIGN(sizeof(xymond_ring_t)) + datasz, IPC_CREAT | IPC_EXCL | 0600);
+		if (shmid == -1) {
+			errprintf("Could not create %s channel ring of %lu bytes, using semaphores: %s\n",
+				  channelnames[chn->channelid], datasz, strerror(errno));
+			return;
+		}
+
+		ring = (xymond_ring_t *)shmat(shmid, NULL, 0);
+		if (ring == (xymond_ring_t *)-1) {
+			errprintf("Could not attach %s channel ring, using semaphores: %s\n", channelnames[chn->channelid], strerror(errno));
+			shmctl(shmid, IPC_RMID, NULL);
+			return;
+		}
+
+		memset(ring, 0, sizeof(xymond_ring_t));
+		ring->version = RING_VERSION;
+		ring->datasz = datasz;
+		__sync_synchronize();
+		ring->magic = RING_MAGIC;
+		dbgprintf("Created %s channel ring with %lu bytes of data\n", channelnames[chn->channelid], datasz);
+	}
+	else {
+		pid_t mypid = getpid();
+		xymond_ringreader_t *me;
+
+		if (shmid == -1) return;	/* This channel uses the semaphores */
+
+		ring = (xymond_ring_t *)shmat(shmid, NULL, 0);
+		if (ring == (xymond_ring_t *)-1) {
+			errprintf("Could not attach %s channel ring: %s\n", channelnames[chn->channelid], strerror(errno));
+			return;
+		}
+
+		if ((ring->magic != RING_MAGIC) || (ring->version != RING_VERSION) || ring->closed) {
+			errprintf("Ignoring stale or incompatible %s channel ring\n", channelnames[chn->channelid]);
+			shmdt((void *)ring);
+			return;
+		}
+
+		/* Grab a free reader slot. If none are free, take over one whose owner has died. */
+		for (i = 0; ((i < RING_MAXREADERS) && !__sync_bool_compare_and_swap(&ring->readers[i].pid, 0, mypid)); i++) ;
+		if (i == RING_MAXREADERS) {
+			for (i = 0; (i < RING_MAXREADERS); i++) {
+				pid_t oldpid = ring->readers[i].pid;
+
+				if ((kill(oldpid, 0) == -1) && (errno == ESRCH) &&
+				    __sync_bool_compare_and_swap(&ring->readers[i].pid, oldpid, mypid)) break;
+			}
+		}
+		if (i == RING_MAXREADERS) {
+			errprintf("No free reader slots in %s channel ring\n", channelnames[chn->channelid]);
+			shmdt((void *)ring);
+			return;
+		}
+
+		/* Start with the next message posted. Read head before msgseq, see ring_receive() */
+		me = &ring->readers[i];
+		me->msgs = me->drops = 0;
+		me->tail = ring->head;
+		__sync_synchronize();
+		me->lastseq = ring->msgseq;
+		chn->ringslot = i;
+		dbgprintf("Attached to %s channel ring as reader %d\n", channelnames[chn->channelid], i);
+	}
+
+	chn->ringshmid = shmid;
+	chn->ring = ring;
+}
+
+int channelmask(char *chnlist, unsigned int *mask)
+{
+	/* Add the channels in a comma-separated list of channel names (or "all") to a bitmask */
+	char *lcopy, *tok;
+	int i, result = 0;
+
+	lcopy = strdup(chnlist);
+	tok = strtok(lcopy, ",");
+	while (tok) {
+		if (strcmp(tok, "all") == 0) {
+			for (i = C_STATUS; (i < C_FEEDBACK_QUEUE); i++) *mask |= (1 << i);
+		}
+		else {
+			for (i = C_STATUS; ((i < C_FEEDBACK_QUEUE) && strcmp(tok, channelnames[i])); i++) ;
+			if (i < C_FEEDBACK_QUEUE) *mask |= (1 << i);
+			else {
+				errprintf("Unknown channel name '%s'\n", tok);
+				result = -1;
+			}
+		}
+
+		tok = strtok(NULL, ",");
+	}
+	xfree(lcopy);
+
+	return result;
+}
+
+int ring_readercount(xymond_channel_t *chn)
+{
+	/*
+	 * A reader that died without detaching still holds its slot. We are called
+	 * for every message posted, so look for those at most once a second.
+	 */
+	xymond_ring_t *ring = chn->ring;
+	time_t now = gettimer();
+	int i, result = 0;
+
+	for (i = 0; (i < RING_MAXREADERS); i++) {
+		pid_t pid = ring->readers[i].pid;
+
+		if (pid == 0) continue;
+
+		if ((now != chn->ringreapcheck) && (kill(pid, 0) == -1) && (errno == ESRCH)) {
+			if (__sync_bool_compare_and_swap(&ring->readers[i].pid, pid, 0)) {
+				errprintf("Reader %d (pid %d) of the %s channel ring is gone, freeing its slot\n",
+					  i, (int)pid, channelnames[chn->channelid]);
+			}
+			continue;
+		}
+
+		result++;
+	}
+	chn->ringreapcheck = now;
+
+	return result;
+}
+
+void ring_postv(xymond_channel_t *chn, struct iovec *iov, int iovcnt)
+{
+	/*
+	 * Only the master posts, so there is no contention between writers.
+	 * "reserved" is advanced before we touch the data, so a reader that
+	 * copies a record can tell afterwards if we overwrote it meanwhile.
+	 * The message is gathered from the iov pieces, so the caller does not
+	 * have to put it together in a buffer first.
+	 */
+	xymond_ring_t *ring = chn->ring;
+	char *data = RINGDATA(ring);
+	unsigned long pos = ring->head;
+	unsigned long off = (pos & (ring->datasz - 1));
+	unsigned long need, oldest, skip = 0;
+	size_t msglen = 0, left;
+	char *p;
+	int i;
+	ringrec_t rec;
+
+	for (i = 0; (i < iovcnt); i++) msglen += iov[i].iov_len;
+	if (msglen > chn->maxsize) msglen = chn->maxsize;
+	need = RINGALIGN(RINGHDRSZ + msglen + 1);
+	if ((off + need) > ring->datasz) skip = ring->datasz - off;
+
+	/*
+	 * Step "oldest" past the records we are about to overwrite, so lagging readers know where to resume.
+	 * The ring sizing makes sure we never have to go past the head; stop there regardless.
+	 */
+	oldest = ring->oldest;
+	while ((oldest != pos) && (((pos + skip + need) - oldest) > ring->datasz)) {
+		unsigned long oldoff = (oldest & (ring->datasz - 1));
+
+		memcpy(&rec, data + oldoff, sizeof(rec));
+		if (rec.len == RINGWRAP) oldest += (ring->datasz - oldoff);
+		else oldest += RINGALIGN(RINGHDRSZ + rec.len + 1);
+	}
+	ring->oldest = oldest;
+	ring->reserved = pos + skip + need;
+	__sync_synchronize();
+
+	if (skip) {
+		rec.seq = 0; rec.len = RINGWRAP; rec.pad = 0;
+		memcpy(data + off, &rec, sizeof(rec));
+		off = 0;
+	}
+
+	rec.seq = ring->msgseq + 1; rec.len = msglen; rec.pad = 0;
+	memcpy(data + off, &rec, sizeof(rec));
+	p = data + off + RINGHDRSZ;
+	for (i = 0, left = msglen; ((i < iovcnt) && left); i++) {
+		size_t n = ((iov[i].iov_len < left) ? iov[i].iov_len : left);
+
+		memcpy(p, iov[i].iov_base, n);
+		p += n; left -= n;
+	}
+	*p = '\0';
+	ring->msgseq = rec.seq;
+
+	__sync_synchronize();
+	ring->head = pos + skip + need;
+	ring_wake(ring);
+}
+
+void ring_post(xymond_channel_t *chn, char *msg, size_t msglen)
+{
+	struct iovec iov;
+
+	iov.iov_base = msg; iov.iov_len = msglen;
+	ring_postv(chn, &iov, 1);
+}
+
+int ring_receive(xymond_channel_t *chn, char *buf, size_t bufsz, int timeoutms)
+{
+	/*
+	 * Copy the next message to buf, waiting up to timeoutms for one to arrive.
+	 * Returns the message length, 0 if nothing arrived, or -1 if the master has
+	 * closed the channel.
+	 */
+	xymond_ring_t *ring = chn->ring;
+	xymond_ringreader_t *me = &ring->readers[chn->ringslot];
+	char *data = RINGDATA(ring);
+	unsigned long mask = ring->datasz - 1;
+	int waited = 0;
+
+	while (!ring->closed) {
+		unsigned long tail = me->tail;
+		unsigned long head, off, newtail;
+		unsigned int wakeval;
+		size_t len = 0;
+		ringrec_t rec;
+
+		wakeval = ring->wakeup;
+		__sync_synchronize();
+		head = ring->head;
+		__sync_synchronize();
+
+		if (head == tail) {
+			if (waited >= timeoutms) return 0;
+
+			__sync_fetch_and_add(&ring->waiters, 1);
+			if (ring->head == tail) waited += ring_sleep(ring, wakeval, timeoutms - waited);
+			__sync_fetch_and_sub(&ring->waiters, 1);
+			continue;
+		}
+
+		if ((head - tail) > ring->datasz) goto overrun;
+
+		off = (tail & mask);
+		memcpy(&rec, data + off, sizeof(rec));
+		if (rec.len == RINGWRAP) {
+			newtail = tail + (ring->datasz - off);
+		}
+		else {
+			len = rec.len;
+			if (len > (ring->datasz - off - RINGHDRSZ)) len = ring->datasz - off - RINGHDRSZ;	/* Garbage */
+			if (len >= bufsz) len = bufsz - 1;
+			memcpy(buf, data + off + RINGHDRSZ, len);
+			*(buf + len) = '\0';
+			newtail = tail + RINGALIGN(RINGHDRSZ + rec.len + 1);
+		}
+
+		/* Did the master overwrite what we just copied? */
+		__sync_synchronize();
+		if ((ring->reserved - tail) > ring->datasz) goto overrun;
+
+		me->tail = newtail;
+		if (rec.len == RINGWRAP) continue;
+
+		if (rec.seq > (me->lastseq + 1)) me->drops += (rec.seq - me->lastseq - 1);
+		me->lastseq = rec.seq;
+		me->msgs++;
+		return len;
+
+overrun:
+		/* We have fallen a full ring behind. Skip to the oldest message still there; the gap is counted on the next one. */
+		dbgprintf("Reader %d fell behind on %s channel ring, skipping ahead\n", chn->ringslot, channelnames[chn->channelid]);
+		me->tail = ring->oldest;
+	}
+
+	return -1;
+}
+
 xymond_channel_t *setup_channel(enum msgchannels_t chnid, int role)
 {
 	key_t key;
@@ -88,6 +452,14 @@ xymond_channel_t *setup_channel(enum msgchannels_t chnid, int role)
 	newch->channelid = chnid;
 	newch->workmem = NULL;
 	newch->msgcount = 0;
+	newch->batchbuf = NULL;
+	newch->batchlen = 0;
+	newch->batchcount = 0;
+	newch->batchposts = 0;
+	newch->ringshmid = -1;
+	newch->ring = NULL;
+	newch->ringslot = -1;
+	newch->ringreapcheck = 0;
 	newch->shmid = shmget(key, bufsz, flags);
 	if (newch->shmid == -1) {
 		if (errno == ENOENT) { dbgprintf("Channel shared memory %d in %s doesn't exist (yet): %s\n", chnid, xymonhome, strerror(errno)); }
@@ -143,6 +515,9 @@ xymond_channel_t *setup_channel(enum msgchannels_t chnid, int role)
 		}
 	}
 
+	/* If there is (or should be) a ring for this channel, set it up. If not, we use the semaphores. */
+	setup_ring(newch, role, xymonhome);
+
 	return newch;
 }
 
@@ -150,6 +525,21 @@ void close_channel(xymond_channel_t *chn, int role)
 {
 	if (chn == NULL) return;
 
+	if (chn->ring) {
+		if (role == CHAN_MASTER) {
+			/* Tell the readers we are gone */
+			chn->ring->closed = 1;
+			ring_wake(chn->ring);
+		}
+		else if (chn->ringslot >= 0) {
+			chn->ring->readers[chn->ringslot].pid = 0;
+		}
+
+		shmdt((void *)chn->ring);
+		if (role == CHAN_MASTER) shmctl(chn->ringshmid, IPC_RMID, NULL);
+		chn->ring = NULL;
+	}
+
 	/* No need to de-register, this happens automatically because we registered with SEM_UNDO */
 
 	if (role == CHAN_MASTER) semctl(chn->semid, 0, IPC_RMID);
@@ -217,3 +607,392 @@ void close_feedback_queue(int queueid, int role)
 	}
 }
 
+
+/* ftok() id of the backfeed ring; the channel rings use RING_KEYBASE + channel id */
+#define BFRING_KEY (RING_KEYBASE + C_FEEDBACK_QUEUE)
+#define BFRING_MODE 0660
+#define BFRING_STALLSECS 10
+
+/*
+ * Each record in the backfeed ring starts with this header. A record is
+ * complete when "pos" holds its own position in the ring; until then it
+ * holds whatever was there before - the position of an older record one
+ * or more laps back, or 0 in a new segment. Positions start at datasz
+ * (see setup_bfring), so neither can be mistaken for the current one.
+ */
+typedef struct bfringrec_t {
+	volatile unsigned long pos;
+	unsigned int len;
+	unsigned int pad;
+} bfringrec_t;
+
+#define BFRINGHDRSZ (RINGALIGN(sizeof(bfringrec_t)))
+#define BFRINGDATA(r) ((char *)(r) + RINGALIGN(sizeof(xymond_bfring_t)))
+
+static int bfringshmid = -1;
+
+xymond_bfring_t *setup_bfring(int role, int slots)
+{
+	char *xymonhome = xgetenv("XYMONHOME");
+	key_t key;
+	int shmid;
+	xymond_bfring_t *ring;
+
+	key = ftok(xymonhome, BFRING_KEY);
+	if (key == -1) {
+		errprintf("Could not generate backfeed ring key: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	shmid = shmget(key, 0, 0);
+
+	if (role == CHAN_MASTER) {
+		unsigned long datasz, need, maxmsgsz = 1024*shbufsz(C_FEEDBACK_QUEUE);
+
+		/* Always start with a fresh ring */
+		if (shmid != -1) shmctl(shmid, IPC_RMID, NULL);
+
+		if (slots < 2) slots = 2;
+		need = (unsigned long)slots * maxmsgsz;
+		for (datasz = 1024; (datasz < need); datasz <<= 1) ;
+
+		shmid = shmget(key, RINGALIGN(sizeof(xymond_bfring_t)) + datasz, IPC_CREAT | IPC_EXCL | BFRING_MODE);
+		if (shmid == -1) {
+			errprintf("Could not create backfeed ring of %lu bytes: %s\n", datasz, strerror(errno));
+			return NULL;
+		}
+
+		ring = (xymond_bfring_t *)shmat(shmid, NULL, 0);
+		if (ring == (xymond_bfring_t *)-1) {
+			errprintf("Could not attach backfeed ring: %s\n", strerror(errno));
+			shmctl(shmid, IPC_RMID, NULL);
+			return NULL;
+		}
+
+		memset(ring, 0, sizeof(xymond_bfring_t));
+		ring->version = BFRING_VERSION;
+		ring->datasz = datasz;
+		ring->maxmsgsz = maxmsgsz - 1;
+		/* Not 0: a zero-filled record header must not look like a completed record at 0 */
+		ring->tail = ring->reserved = datasz;
+		__sync_synchronize();
+		ring->magic = BFRING_MAGIC;
+		bfringshmid = shmid;
+		dbgprintf("Created backfeed ring with %lu bytes of data\n", datasz);
+	}
+	else {
+		if (shmid == -1) return NULL;	/* xymond does not use the ring */
+
+		ring = (xymond_bfring_t *)shmat(shmid, NULL, 0);
+		if (ring == (xymond_bfring_t *)-1) {
+			errprintf("Could not attach backfeed ring: %s\n", strerror(errno));
+			return NULL;
+		}
+
+		if ((ring->magic != BFRING_MAGIC) || (ring->version != BFRING_VERSION) || ring->closed) {
+			dbgprintf("Ignoring stale or incompatible backfeed ring\n");
+			shmdt((void *)ring);
+			return NULL;
+		}
+	}
+
+	return ring;
+}
+
+void close_bfring(xymond_bfring_t *ring, int role)
+{
+	if (ring == NULL) return;
+
+	if (role == CHAN_MASTER) {
+		/* Writers see this and go back to the backfeed queue */
+		ring->closed = 1;
+		__sync_synchronize();
+	}
+
+	shmdt((void *)ring);
+	if ((role == CHAN_MASTER) && (bfringshmid != -1)) {
+		shmctl(bfringshmid, IPC_RMID, NULL);
+		bfringshmid = -1;
+	}
+}
+
+int bfring_post(xymond_bfring_t *ring, struct iovec *msgs, int count)
+{
+	/*
+	 * Post "count" messages as one batch: One reservation for all of them,
+	 * so they are also stored together. Returns the number of messages 
+	 * posted, i.e. "count" or 0 if there was no room.
+	 */
+	char *data = BFRINGDATA(ring);
+	unsigned long mask = ring->datasz - 1;
+	unsigned long pos, off, skip, total = 0;
+	bfringrec_t *rec;
+	int i;
+
+	if (ring->closed) return 0;
+
+	for (i = 0; (i < count); i++) {
+		size_t len = ((msgs[i].iov_len > ring->maxmsgsz) ? ring->maxmsgsz : msgs[i].iov_len);
+
+		total += RINGALIGN(BFRINGHDRSZ + len + 1);
+	}
+	if (total > (ring->datasz / 2)) return 0;
+
+	do {
+		pos = ring->reserved;
+		off = (pos & mask);
+		skip = (((off + total) > ring->datasz) ? (ring->datasz - off) : 0);
+
+		if (((pos + skip + total) - ring->tail) > ring->datasz) {
+			__sync_fetch_and_add(&ring->full, 1);
+			return 0;
+		}
+	} while (!__sync_bool_compare_and_swap(&ring->reserved, pos, pos + skip + total));
+
+	if (skip) {
+		/* Not enough room before the end of the ring, so the batch starts at the beginning */
+		rec = (bfringrec_t *)(data + off);
+		rec->len = RINGWRAP;
+		__sync_synchronize();
+		rec->pos = pos;
+		pos += skip;
+		off = 0;
+	}
+
+	for (i = 0; (i < count); i++) {
+		size_t len = ((msgs[i].iov_len > ring->maxmsgsz) ? ring->maxmsgsz : msgs[i].iov_len);
+
+		rec = (bfringrec_t *)(data + off);
+		rec->len = len;
+		memcpy(data + off + BFRINGHDRSZ, msgs[i].iov_base, len);
+		*(data + off + BFRINGHDRSZ + len) = '\0';
+		__sync_synchronize();
+		rec->pos = pos;
+
+		pos += RINGALIGN(BFRINGHDRSZ + len + 1);
+		off += RINGALIGN(BFRINGHDRSZ + len + 1);
+	}
+
+	__sync_fetch_and_add(&ring->posted, count);
+	return count;
+}
+
+char *bfring_receive(xymond_bfring_t *ring, size_t *msglen)
+{
+	/*
+	 * Returns the next message in the ring, or NULL if there is none ready.
+	 * The message stays in the ring - and may be modified by the caller - 
+	 * until bfring_release() is called.
+	 */
+	static unsigned long stalltail = 0, stallreserved = 0;
+	static time_t stallstart = 0;
+	char *data = BFRINGDATA(ring);
+	unsigned long mask = ring->datasz - 1;
+
+	while (ring->tail != ring->reserved) {
+		unsigned long tail = ring->tail;
+		bfringrec_t *rec = (bfringrec_t *)(data + (tail & mask));
+
+		if (rec->pos != tail) {
+			/*
+			 * Space is reserved, but the message is not there yet. The writer
+			 * is usually busy copying it in; if it never completes, the writer
+			 * died while doing so and we must skip what it reserved.
+			 */
+			time_t now = gettimer();
+
+			if ((stallstart == 0) || (stalltail != tail)) {
+				stalltail = tail;
+				stallreserved = ring->reserved;
+				stallstart = now;
+			}
+			else if ((now - stallstart) > BFRING_STALLSECS) {
+				errprintf("Backfeed ring message at %lu was never completed, skipping %lu bytes\n",
+					  tail, (stallreserved - tail));
+				ring->tail = stallreserved;
+				stallstart = 0;
+				continue;
+			}
+			return NULL;
+		}
+		stallstart = 0;
+		__sync_synchronize();
+
+		if (rec->len == RINGWRAP) {
+			ring->tail = tail + (ring->datasz - (tail & mask));
+			continue;
+		}
+
+		*msglen = rec->len;
+		return (data + (tail & mask) + BFRINGHDRSZ);
+	}
+
+	return NULL;
+}
+
+void bfring_release(xymond_bfring_t *ring)
+{
+	/* Done with the message from bfring_receive(), writers can use the space again */
+	unsigned long tail = ring->tail;
+	bfringrec_t *rec = (bfringrec_t *)(BFRINGDATA(ring) + (tail & (ring->datasz - 1)));
+
+	__sync_synchronize();
+	ring->tail = tail + RINGALIGN(BFRINGHDRSZ + rec->len + 1);
+}
+
+int bfring_pending(xymond_bfring_t *ring)
+{
+	return (ring->tail != ring->reserved);
+}
+
+#ifdef BENCHMARK
+/*
+ * Throughput of the semaphore handshake vs. the ring transport.
+ * The master side mimics posttochannel() in xymond, and the readers
+ * mimic the loop in xymond_channel. Uses the "user" channel, so
+ * do not run this while xymond is running with the same XYMONHOME.
+ */
+#include <sys/wait.h>
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void bench_reader(int useslow)
+{
+	xymond_channel_t *chn;
+	char *buf;
+	size_t bufsz = 1024*shbufsz(C_USER) + 1;
+	unsigned long count = 0;
+	struct sembuf s;
+	int done = 0;
+
+	chn = setup_channel(C_USER, CHAN_CLIENT);
+	if (chn == NULL) exit(1);
+	buf = (char *)malloc(bufsz);
+
+	while (!done) {
+		if (chn->ring) {
+			int n = ring_receive(chn, buf, bufsz, 1000);
+
+			if (n == -1) break;
+			if (n == 0) continue;
+		}
+		else {
+			s.sem_num = GOCLIENT; s.sem_op = -1; s.sem_flg = 0;
+			if (semop(chn->semid, &s, 1) == -1) {
+				if (errno == EINTR) continue;
+				break;
+			}
+			strcpy(buf, chn->channelbuf);
+			do {
+				s.sem_num = GOCLIENT; s.sem_op = 0; s.sem_flg = 0;
+			} while ((semop(chn->semid, &s, 1) == -1) && (errno == EINTR));
+			s.sem_num = BOARDBUSY; s.sem_op = -1; s.sem_flg = IPC_NOWAIT;
+			semop(chn->semid, &s, 1);
+		}
+
+		if (strncmp(buf, "@@shutdown", 10) == 0) done = 1;
+		else count++;
+
+		if (useslow) usleep(useslow);
+	}
+
+	if (chn->ring) {
+		xymond_ringreader_t *me = &chn->ring->readers[chn->ringslot];
+		printf("  reader %d: %lu messages, %lu dropped\n", (int)getpid(), count, me->drops);
+	}
+	else {
+		printf("  reader %d: %lu messages\n", (int)getpid(), count);
+	}
+	close_channel(chn, CHAN_CLIENT);
+	exit(0);
+}
+
+static void bench_post(xymond_channel_t *chn, char *msg, size_t msglen)
+{
+	struct sembuf s;
+	int clients;
+
+	if (chn->ring) {
+		ring_post(chn, msg, msglen);
+		return;
+	}
+
+	clients = semctl(chn->semid, CLIENTCOUNT, GETVAL);
+	do {
+		s.sem_num = BOARDBUSY; s.sem_op = 0; s.sem_flg = 0;
+	} while ((semop(chn->semid, &s, 1) == -1) && (errno == EINTR));
+	memcpy(chn->channelbuf, msg, msglen+1);
+	s.sem_num = BOARDBUSY; s.sem_op = clients; s.sem_flg = 0;
+	semop(chn->semid, &s, 1);
+	s.sem_num = GOCLIENT; s.sem_op = clients; s.sem_flg = 0;
+	semop(chn->semid, &s, 1);
+}
+
+static void bench_run(char *name, int usering, int messages, int readers, int msgsize, int slowusec)
+{
+	xymond_channel_t *chn;
+	char *msg;
+	int i;
+	struct timeval start;
+	double posttime, totaltime;
+
+	ringchannels = (usering ? (1 << C_USER) : 0);
+	chn = setup_channel(C_USER, CHAN_MASTER);
+	if (chn == NULL) exit(1);
+
+	printf("%s: %d messages of %d bytes, %d readers\n", name, messages, msgsize, readers);
+	for (i = 0; (i < readers); i++) {
+		pid_t pid;
+
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0) bench_reader(((i == 0) ? slowusec : 0));
+		else if (pid == -1) { errprintf("fork failed: %s\n", strerror(errno)); exit(1); }
+	}
+	while (semctl(chn->semid, CLIENTCOUNT, GETVAL) < readers) usleep(1000);
+
+	msg = (char *)malloc(msgsize + 1);
+	memset(msg, 'x', msgsize);
+	memcpy(msg, "@@user#1/bench|0.0|bench|bench\n", 31);
+	msg[msgsize] = '\0';
+
+	gettimeofday(&start, NULL);
+	for (i = 0; (i < messages); i++) bench_post(chn, msg, msgsize);
+	posttime = elapsed(&start);
+	bench_post(chn, "@@shutdown", 10);
+	while (wait(NULL) > 0) ;
+	totaltime = elapsed(&start);
+
+	printf("  master: %.3f s posting (%.0f msgs/s), %.3f s until readers done\n",
+		posttime, messages / posttime, totaltime);
+	fflush(stdout);
+
+	close_channel(chn, CHAN_MASTER);
+	xfree(msg);
+}
+
+int main(int argc, char *argv[])
+{
+	int messages = 100000, readers = 2, msgsize = 512, slowusec = 0;
+
+	if (argc > 1) messages = atoi(argv[1]);
+	if (argc > 2) readers = atoi(argv[2]);
+	if (argc > 3) msgsize = atoi(argv[3]);
+	if (argc > 4) slowusec = atoi(argv[4]);
+	if ((msgsize < 64) || (msgsize >= 1024*shbufsz(C_USER))) {
+		errprintf("Message size must be between 64 and %d\n", (int)(1024*shbufsz(C_USER) - 1));
+		return 1;
+	}
+
+	bench_run("semaphore", 0, messages, readers, msgsize, slowusec);
+	bench_run("ring", 1, messages, readers, msgsize, slowusec);
+
+	return 0;
+}
+#endif
@@ -11,6 +11,9 @@
 #ifndef __XYMOND_IPC_H__
 #define __XYMOND_IPC_H__
 
+#include <time.h>
+#include <sys/uio.h>
+
 #include "xymond_buffer.h"
 
 /* Semaphore numbers */
@@ -21,6 +24,65 @@
 #define CHAN_MASTER 0
 #define CHAN_CLIENT 1
 
+/*
+ * Ring transport. A channel can optionally carry its messages in a
+ * multi-slot shared-memory ring instead of the single channelbuf.
+ * The master appends records and never waits; each reader has its
+ * own cursor in the ring header and picks up records at its own pace.
+ * A reader that falls more than a full ring behind loses the oldest
+ * records, which is counted in its "drops" counter.
+ */
+#define RING_MAGIC		0x58524E47	/* "XRNG" */
+#define RING_VERSION		1
+#define RING_MAXREADERS		32
+#define RING_DEFAULTSLOTS	16
+
+typedef struct xymond_ringreader_t {
+	volatile pid_t pid;			/* 0 if the slot is free */
+	volatile unsigned long tail;		/* Ring offset of the next record to read */
+	volatile unsigned long lastseq;		/* Sequence number of the last record read */
+	volatile unsigned long msgs;		/* Records picked up by this reader */
+	volatile unsigned long drops;		/* Records overwritten before we got to them */
+} xymond_ringreader_t;
+
+typedef struct xymond_ring_t {
+	unsigned int magic;
+	unsigned int version;
+	unsigned long datasz;			/* Size of the data area; a power of 2 */
+	volatile unsigned long head;		/* End of the last published record */
+	volatile unsigned long reserved;	/* End of the record being written */
+	volatile unsigned long oldest;		/* Start of the oldest record not yet overwritten */
+	volatile unsigned long msgseq;		/* Sequence number of the last published record */
+	volatile unsigned int wakeup;		/* Bumped for each post; readers sleep on it */
+	volatile unsigned int waiters;		/* Number of readers sleeping */
+	volatile unsigned int closed;		/* Set by the master when shutting down */
+	xymond_ringreader_t readers[RING_MAXREADERS];
+} xymond_ring_t;
+
+/*
+ * Backfeed ring. A shared-memory alternative to the SysV backfeed queue,
+ * where any number of local programs post messages and xymond is the only
+ * reader. A writer claims space by atomically advancing "reserved", copies
+ * its messages in and then marks each record as complete. Nothing is ever
+ * overwritten: When the ring is full, the writer falls back to the backfeed
+ * queue or to TCP.
+ */
+#define BFRING_MAGIC		0x58424652	/* "XBFR" */
+#define BFRING_VERSION		1
+#define BFRING_DEFAULTSLOTS	16
+
+typedef struct xymond_bfring_t {
+	unsigned int magic;
+	unsigned int version;
+	unsigned long datasz;			/* Size of the data area; a power of 2 */
+	unsigned long maxmsgsz;			/* Largest message allowed (MAXMSG_BFQ) */
+	volatile unsigned long reserved;	/* End of the space claimed by writers */
+	volatile unsigned long tail;		/* Start of the first record xymond has not handled */
+	volatile unsigned long posted;		/* Messages posted */
+	volatile unsigned long full;		/* Posts refused because there was no room */
+	volatile unsigned int closed;		/* Set by xymond when shutting down */
+} xymond_bfring_t;
+
 typedef struct xymond_channel_t {
 	enum msgchannels_t channelid;
 	int shmid;
@@ -30,16 +92,40 @@ typedef struct xymond_channel_t {
 	size_t maxsize;
 	unsigned int seq;
 	unsigned long msgcount;
+	char *batchbuf;				/* Messages waiting to be posted together (master only) */
+	size_t batchlen;
+	int batchcount;
+	struct timespec batchstart;		/* When the first message in the batch was queued */
+	unsigned long batchposts;
+	int ringshmid;
+	xymond_ring_t *ring;			/* NULL if the channel uses the semaphore handshake */
+	int ringslot;				/* Our reader slot in the ring (clients only) */
+	time_t ringreapcheck;			/* When we last looked for dead readers (master only) */
 	struct xymond_channel_t *next;
 } xymond_channel_t;
 
 extern char *channelnames[];
+extern unsigned int ringchannels;
+extern int ringslots;
 
 extern xymond_channel_t *setup_channel(enum msgchannels_t chnname, int role);
 extern void close_channel(xymond_channel_t *chn, int role);
 
+extern int channelmask(char *chnlist, unsigned int *mask);
+extern int ring_readercount(xymond_channel_t *chn);
+extern void ring_post(xymond_channel_t *chn, char *msg, size_t msglen);
+extern void ring_postv(xymond_channel_t *chn, struct iovec *iov, int iovcnt);
+extern int ring_receive(xymond_channel_t *chn, char *buf, size_t bufsz, int timeoutms);
+
 extern int setup_feedback_queue(int bfqnum, int role);
 extern void close_feedback_queue(int queueid, int role);
 
+extern xymond_bfring_t *setup_bfring(int role, int slots);
+extern void close_bfring(xymond_bfring_t *ring, int role);
+extern int bfring_post(xymond_bfring_t *ring, struct iovec *msgs, int count);
+extern char *bfring_receive(xymond_bfring_t *ring, size_t *msglen);
+extern void bfring_release(xymond_bfring_t *ring);
+extern int bfring_pending(xymond_bfring_t *ring);
+
 #endif
 
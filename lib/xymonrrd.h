@@ -17,6 +17,7 @@
 typedef struct {
    char *svcname;
    char *xymonrrdname;
+   void *rrdhandler;	/* xymond_rrd: the handler for xymonrrdname, once it has been looked up */
 } xymonrrd_t;
 
 /* This is for displaying an RRD file. */
@@ -0,0 +1,312 @@
+/*----------------------------------------------------------------------------*/
+/* Xymon utility to convert xymond checkpoint files between the text (V1)     */
+/* and the binary (V2) format.                                                */
+/*                                                                            */
+/* Copyright (C) 2006-2011 Henrik Storner <henrik@hswn.dk>                    */
+/*                                                                            */
+/* This program is released under the GNU General Public License (GPL),       */
+/* version 2. See the file "COPYING" for details.                             */
+/*                                                                            */
+/*----------------------------------------------------------------------------*/
+
+static char rcsid[] = "$Id$";
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "libxymon.h"
+
+#define NO_COLOR (COL_COUNT)
+
+static void *rblogs = NULL;		/* Text for each HOST|TEST: The status line followed by its ack lines */
+static strbuffer_t *tasks = NULL;
+
+static char *colname(int color)
+{
+	return ((color == NO_COLOR) ? "none" : colorname(color));
+}
+
+static void addplain(strbuffer_t *buf, char *s)
+{
+	addtobuffer(buf, "|");
+	if (s) addtobuffer(buf, s);
+}
+
+static void addencoded(strbuffer_t *buf, char *s)
+{
+	addtobuffer(buf, "|");
+	if (s) addtobuffer(buf, nlencode(s));
+}
+
+static void addnumber(strbuffer_t *buf, long long val)
+{
+	char numstr[30];
+
+	sprintf(numstr, "|%d", (int)val);
+	addtobuffer(buf, numstr);
+}
+
+static void binary_records(chkreader_t *r)
+{
+	int rectype;
+	char *key;
+	xtreePos_t handle;
+	strbuffer_t *item;
+
+	while ((rectype = chk_next(r)) != 0) {
+		switch (rectype) {
+		  case CHK_REC_LOG:
+			if ((chk_fieldcount(r) < 19) || !chk_str(r, 1) || !chk_str(r, 2)) break;
+
+			key = (char *)malloc(strlen(chk_str(r, 1)) + strlen(chk_str(r, 2)) + 2);
+			sprintf(key, "%s|%s", chk_str(r, 1), chk_str(r, 2));
+			handle = xtreeFind(rblogs, key);
+			if (handle == xtreeEnd(rblogs)) {
+				item = newstrbuffer(0);
+				xtreeAdd(rblogs, key, item);
+			}
+			else {
+				/* A journal record replaces the one from the snapshot */
+				item = xtreeData(rblogs, handle);
+				clearstrbuffer(item);
+				xfree(key);
+			}
+
+			addtobuffer(item, "@@XYMONDCHK-V1");
+			addplain(item, chk_str(r, 0));
+			addplain(item, chk_str(r, 1));
+			addplain(item, chk_str(r, 2));
+			addplain(item, chk_str(r, 3));
+			addplain(item, colname(chk_int(r, 4)));
+			addplain(item, chk_str(r, 5));
+			addplain(item, colname(chk_int(r, 6)));
+			addnumber(item, chk_int(r, 7));
+			addnumber(item, chk_int(r, 8));
+			addnumber(item, chk_int(r, 9));
+			addnumber(item, chk_int(r, 10));
+			addnumber(item, chk_int(r, 11));
+			addplain(item, chk_str(r, 12));
+			addnumber(item, chk_int(r, 13));
+			addencoded(item, chk_str(r, 14));
+			addencoded(item, chk_str(r, 15));
+			addencoded(item, chk_str(r, 16));
+			addnumber(item, chk_int(r, 17));
+			addnumber(item, chk_int(r, 18));
+			addtobuffer(item, "\n");
+			break;
+
+		  case CHK_REC_ACK:
+			if ((chk_fieldcount(r) < 8) || !chk_str(r, 0) || !chk_str(r, 1)) break;
+
+			key = (char *)malloc(strlen(chk_str(r, 0)) + strlen(chk_str(r, 1)) + 2);
+			sprintf(key, "%s|%s", chk_str(r, 0), chk_str(r, 1));
+			handle = xtreeFind(rblogs, key);
+			xfree(key);
+			if (handle == xtreeEnd(rblogs)) break;
+
+			item = xtreeData(rblogs, handle);
+			addtobuffer(item, "@@XYMONDCHK-V1|.acklist.");
+			addtobuffer_many(item, "|", chk_str(r, 0), "|", chk_str(r, 1), NULL);
+			addnumber(item, chk_int(r, 2));
+			addnumber(item, chk_int(r, 3));
+			addnumber(item, chk_int(r, 4));
+			addnumber(item, chk_int(r, 5));
+			addtobuffer_many(item, "|", (chk_str(r, 6) ? chk_str(r, 6) : ""), "|", (chk_str(r, 7) ? chk_str(r, 7) : ""), "\n", NULL);
+			break;
+
+		  case CHK_REC_TASKRESET:
+			clearstrbuffer(tasks);
+			break;
+
+		  case CHK_REC_TASK:
+			if (chk_fieldcount(r) < 4) break;
+
+			addtobuffer(tasks, "@@XYMONDCHK-V1|.task.");
+			addnumber(tasks, chk_int(r, 0));
+			addnumber(tasks, chk_int(r, 1));
+			addplain(tasks, chk_str(r, 2));
+			addencoded(tasks, chk_str(r, 3));
+			addtobuffer(tasks, "\n");
+			break;
+		}
+	}
+}
+
+static int binary_to_text(char *infn, FILE *outfd)
+{
+	chkreader_t *r;
+	unsigned long long generation;
+	char *journalfn;
+	xtreePos_t handle;
+
+	r = chk_open(infn);
+	if (r == NULL) return 1;
+
+	rblogs = xtreeNew(strcmp);
+	tasks = newstrbuffer(0);
+
+	generation = chk_generation(r);
+	binary_records(r);
+	chk_closeread(r);
+
+	/* Include any changes from the journal that belongs to this snapshot */
+	journalfn = (char *)malloc(strlen(infn) + 10);
+	sprintf(journalfn, "%s.journal", infn);
+	if (access(journalfn, R_OK) == 0) {
+		r = chk_open(journalfn);
+		if (r && (chk_kind(r) == CHK_JOURNAL) && (chk_generation(r) == generation)) binary_records(r);
+		if (r) chk_closeread(r);
+	}
+	xfree(journalfn);
+
+	for (handle = xtreeFirst(rblogs); (handle != xtreeEnd(rblogs)); handle = xtreeNext(rblogs, handle)) {
+		strbuffer_t *item = xtreeData(rblogs, handle);
+		fwrite(STRBUF(item), 1, STRBUFLEN(item), outfd);
+	}
+	fwrite(STRBUF(tasks), 1, STRBUFLEN(tasks), outfd);
+
+	return 0;
+}
+
+static int text_to_binary(char *infn, char *outfn, enum compressiontype_t ctype)
+{
+	FILE *fd;
+	strbuffer_t *inbuf;
+	chkwriter_t *w;
+	char *fields[20], *item;
+	int i, count = 0;
+
+	fd = fopen(infn, "r");
+	if (fd == NULL) {
+		errprintf("Cannot open %s\n", infn);
+		return 1;
+	}
+
+	w = chk_create(outfn, CHK_SNAPSHOT, (unsigned long long)time(NULL), ctype);
+	if (w == NULL) return 1;
+
+	inbuf = newstrbuffer(0);
+	initfgets(fd);
+	while (unlimfgets(inbuf, fd)) {
+		if ( (strncmp(STRBUF(inbuf), "@@XYMONDCHK-V1|", 15) != 0) && (strncmp(STRBUF(inbuf), "@@HOBBITDCHK-V1|", 16) != 0) &&
+		     (strncmp(STRBUF(inbuf), "@@BBGENDCHK-V1|", 15) != 0) ) continue;
+
+		memset(fields, 0, sizeof(fields));
+		item = gettok(STRBUF(inbuf), "|\n"); i = 0;
+		while (item) {
+			if (i < 20) fields[i] = item;
+			item = gettok(NULL, "|\n"); i++;
+		}
+
+		if (fields[1] && (strcmp(fields[1], ".task.") == 0)) {
+			if (i < 6) continue;
+			nldecode(fields[5]);
+			chk_begin(w, CHK_REC_TASK);
+			chk_addint(w, atoi(fields[2]));
+			chk_addint(w, atoi(fields[3]));
+			chk_addstr(w, fields[4]);
+			chk_addstr(w, fields[5]);
+			chk_end(w);
+		}
+		else if (fields[1] && (strcmp(fields[1], ".acklist.") == 0)) {
+			if (i < 10) continue;
+			chk_begin(w, CHK_REC_ACK);
+			chk_addstr(w, fields[2]);
+			chk_addstr(w, fields[3]);
+			chk_addint(w, atoi(fields[4]));
+			chk_addint(w, atoi(fields[5]));
+			chk_addint(w, atoi(fields[6]));
+			chk_addint(w, atoi(fields[7]));
+			chk_addstr(w, fields[8]);
+			chk_addstr(w, fields[9]);
+			chk_end(w);
+		}
+		else if (fields[1] && (*fields[1] == '.')) {
+			continue;
+		}
+		else {
+			int color, oldcolor;
+
+			if ((i < 17) || (parse_color(fields[5]) == -1)) {
+				errprintf("Skipping invalid record for %s.%s\n", textornull(fields[2]), textornull(fields[3]));
+				continue;
+			}
+
+			color = parse_color(fields[5]);
+			oldcolor = parse_color(fields[7]); if (oldcolor == -1) oldcolor = NO_COLOR;
+			for (i = 15; (i <= 17); i++) if (fields[i]) nldecode(fields[i]);
+
+			chk_begin(w, CHK_REC_LOG);
+			chk_addstr(w, fields[1]);
+			chk_addstr(w, fields[2]);
+			chk_addstr(w, fields[3]);
+			chk_addstr(w, fields[4]);
+			chk_addint(w, color);
+			chk_addstr(w, fields[6]);
+			chk_addint(w, oldcolor);
+			for (i = 8; (i <= 12); i++) chk_addint(w, (fields[i] ? atoi(fields[i]) : 0));
+			chk_addstr(w, fields[13]);
+			chk_addint(w, (fields[14] ? atoi(fields[14]) : 0));
+			chk_addstr(w, fields[15]);
+			chk_addstr(w, fields[16]);
+			chk_addstr(w, fields[17]);
+			chk_addint(w, (fields[18] ? atoi(fields[18]) : 0));
+			chk_addint(w, (fields[19] ? atoi(fields[19]) : 0));
+			chk_end(w);
+			count++;
+		}
+	}
+
+	fclose(fd);
+	freestrbuffer(inbuf);
+	dbgprintf("Converted %d status logs\n", count);
+
+	return ((chk_close(w, 1) == 0) ? 0 : 1);
+}
+
+int main(int argc, char *argv[])
+{
+	int argi;
+	char *infn = NULL, *outfn = NULL;
+	enum compressiontype_t ctype = COMP_PLAIN;
+	FILE *outfd;
+	int result;
+
+	for (argi = 1; (argi < argc); argi++) {
+		if (argnmatch(argv[argi], "--compression=")) {
+			char *p = strchr(argv[argi], '=') + 1;
+			ctype = parse_compressiontype(p);
+			if (ctype == COMP_UNKNOWN) {
+				errprintf("Unknown compression type '%s'\n", p);
+				return 1;
+			}
+		}
+		else if (standardoption(argv[argi])) {
+			if (showhelp) return 0;
+		}
+		else if (!infn) infn = argv[argi];
+		else if (!outfn) outfn = argv[argi];
+	}
+
+	if (!infn || !outfn) {
+		fprintf(stderr, "Usage: %s [--compression=TYPE] INFILE OUTFILE\n", argv[0]);
+		fprintf(stderr, "A binary INFILE is converted to text, a text INFILE is converted to binary\n");
+		return 1;
+	}
+
+	if (!chk_isbinary(infn)) return text_to_binary(infn, outfn, ctype);
+
+	outfd = fopen(outfn, "w");
+	if (outfd == NULL) {
+		errprintf("Cannot create %s\n", outfn);
+		return 1;
+	}
+	result = binary_to_text(infn, outfd);
+	if (fclose(outfd) == EOF) result = 1;
+
+	return result;
+}
+
@@ -13,14 +13,21 @@ static char rcsid[] = "$Id$";
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <limits.h>
+#include <fcntl.h>
 #include <ctype.h>
 #include <errno.h>
 #include <utime.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
 
 #include <rrd.h>
 #include <pcre.h>
@@ -43,6 +50,9 @@ int use_rrd_cache = 1;         /* Use the cache by default */
 int no_rrd = 0;                /* Write to rrd by default */
 int cacheflushsz = 1;		/* Cache multipler set to 1x by default */
 int releasecachedelay = -1;	/* Don't start auto-flushing the cache right away */
+int rrdwriters = 0;		/* Number of RRD writer threads; 0 means updating from the main thread */
+int rrdwriterqueue = 1000;	/* How many RRD updates may be queued for each writer */
+int rrdflushrate = 0;		/* Flush scheduler: RRD files written per second; 0 means flush when forced */
 
 static int  processorfd = 0;
 static FILE *processorstream = NULL;
@@ -73,8 +83,16 @@ typedef struct updcacheitem_t {
 	char *vals[CACHESZ];
 	int updseq[CACHESZ];
 	time_t updtime[CACHESZ];
+	unsigned int writer;	/* Hash of the key. Picks the RRD writer thread, and the flush time */
+	time_t flushtime;	/* Flush scheduler: When the cached values are due to be written */
+	int flushidx;		/* Position+1 in the flush heap, 0 if not there */
+	int dscheck;		/* rrdcached: 0 = DS order not checked, 1 = same as template, 2 = use dsmap */
+	int dscount;
+	int *dsmap;		/* rrdcached: template position of each DS in the file, -1 if not in the template */
 } updcacheitem_t;
 
+static unsigned long cachedvalues = 0;	/* Number of values held in the update cache */
+
 static void * flushtree;
 static int have_flushtree = 0;
 typedef struct flushtree_t {
@@ -174,60 +192,999 @@ static void setupfn(char *format, char *param)
 	while ((p = strchr(rrdfn, ' ')) != NULL) *p = '_';
 }
 
-static void setupfn2(char *format, char *param1, char *param2)
+static void setupfn2(char *format, char *param1, char *param2)
+{
+	char *p;
+
+	while ((p = strchr(param2, '/')) != NULL) *p = ',';
+
+	memset(fnparams, 0, sizeof(fnparams));
+	fnparams[0] = param1;
+	fnparams[1] = param2;
+
+	snprintf(rrdfn, sizeof(rrdfn)-1, format, param1, param2);
+	rrdfn[sizeof(rrdfn)-1] = '\0';
+	while ((p = strchr(rrdfn, ' ')) != NULL) *p = '_';
+}
+
+static void setupfn3(char *format, char *param1, char *param2, char *param3)
+{
+	char *p;
+
+	memset(fnparams, 0, sizeof(fnparams));
+	fnparams[0] = param1;
+	fnparams[1] = param2;
+	fnparams[2] = param3;
+
+	snprintf(rrdfn, sizeof(rrdfn)-1, format, param1, param2, param3);
+	rrdfn[sizeof(rrdfn)-1] = '\0';
+	while ((p = strchr(rrdfn, ' ')) != NULL) *p = '_';
+
+	if (strlen(rrdfn) >= (NAME_MAX - 50)) {
+		/*
+		 * Filename is too long. Limit filename length
+		 * by replacing the last part of the filename
+		 * with an MD5 hash.
+		 */
+		char *hash = md5hash(rrdfn+(NAME_MAX-50));
+
+		sprintf(rrdfn+(NAME_MAX-50), "_%s.rrd", hash);
+	}
+}
+
+static void setupinterval(int intvl)
+{
+	rrdinterval = (intvl ? intvl : DEFAULT_RRD_INTERVAL);
+}
+
+/*
+ * The RRD writer pool.
+ *
+ * With "--writers=N", the rrd_update() calls are done by N threads while
+ * the main thread goes on parsing messages. Each RRD file is always handled
+ * by the same writer, picked by hashing its cache key, and each writer does
+ * its updates in the order they were queued - so the updates for a file are
+ * written in order. All of the cache handling stays on the main thread; a
+ * writer only gets the filename and the values to write, and hands back any
+ * error text for the main thread to log.
+ */
+typedef struct rrdwritejob_t {
+	updcacheitem_t *cacheitem;
+	char *filename;
+	char *template;
+	char *vals[CACHESZ+1];
+	int valcount;
+	int dosync;
+	char *sender;
+	char *errtxt;
+	struct timespec queuetime;
+	struct rrdwritejob_t *next;
+} rrdwritejob_t;
+
+typedef struct rrdwriter_t {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* Writer waits for jobs */
+	pthread_cond_t done;		/* Main thread waits for queue space, or for the queue to empty */
+	rrdwritejob_t *head, *tail;
+	int queued, maxqueued, busy, stop;
+	unsigned long updates;
+} rrdwriter_t;
+
+static rrdwriter_t *writerpool = NULL;
+static histogram_t *rrdwritelatency = NULL;
+static pthread_mutex_t rrdwriteerrlock = PTHREAD_MUTEX_INITIALIZER;
+static rrdwritejob_t *rrdwriteerrs = NULL;		/* Failed updates, for the main thread to log */
+static unsigned long rrdwritewaits = 0;			/* Times the main thread waited for a full queue */
+
+static unsigned int rrdwriter_hash(char *key)
+{
+	unsigned int h = 2166136261U;
+
+	for (; (*key); key++) h = (h ^ (unsigned char)tolower((unsigned char)*key)) * 16777619U;
+	return h;
+}
+
+static void free_rrdwritejob(rrdwritejob_t *job)
+{
+	int i;
+
+	for (i = 0; (i < job->valcount); i++) xfree(job->vals[i]);
+	xfree(job->filename);
+	if (job->sender) xfree(job->sender);
+	if (job->errtxt) xfree(job->errtxt);
+	xfree(job);
+}
+
+static int rrdwriter_update(rrdwritejob_t *job)
+{
+#ifdef RRDTOOL_THREADSAFE
+	/*
+	 * The _r variant does no getopt() parsing. RRDTOOL_THREADSAFE is set by
+	 * configure only when we link with a librrd that keeps the error text per
+	 * thread - RRDtool 1.5 or later, or librrd_th from RRDtool 1.4. The plain
+	 * librrd in 1.4 has one error text for all threads.
+	 */
+	rrd_clear_error();
+	return rrd_update_r(job->filename, job->template, job->valcount, (const char **)job->vals);
+#else
+	return -1;
+#endif
+}
+
+static void *rrdwriter_thread(void *arg)
+{
+	rrdwriter_t *writer = (rrdwriter_t *)arg;
+	rrdwritejob_t *job;
+
+	pthread_mutex_lock(&writer->lock);
+	while (!writer->stop || writer->head) {
+		if (!writer->head) {
+			pthread_cond_wait(&writer->work, &writer->lock);
+			continue;
+		}
+
+		job = writer->head;
+		writer->head = job->next;
+		if (!writer->head) writer->tail = NULL;
+		writer->busy = 1;
+		pthread_mutex_unlock(&writer->lock);
+
+		if (rrdwriter_update(job) != 0) {
+			job->errtxt = strdup(rrd_get_error());
+		}
+#if defined(LINUX) && defined(RRDTOOL12)
+		/* See flush_cached_updates() */
+		else if (job->dosync && !ext_rrd_cache) utimes(job->filename, NULL);
+#endif
+		histogram_add(rrdwritelatency, ntimerus(&job->queuetime, NULL));
+
+		if (job->errtxt) {
+			pthread_mutex_lock(&rrdwriteerrlock);
+			job->next = rrdwriteerrs;
+			rrdwriteerrs = job;
+			pthread_mutex_unlock(&rrdwriteerrlock);
+		}
+		else {
+			free_rrdwritejob(job);
+		}
+
+		pthread_mutex_lock(&writer->lock);
+		writer->busy = 0;
+		writer->queued--;
+		writer->updates++;
+		pthread_cond_signal(&writer->done);
+	}
+	pthread_mutex_unlock(&writer->lock);
+
+	return NULL;
+}
+
+int start_rrdwriters(void)
+{
+	sigset_t allsigs, oldsigs;
+	int i;
+
+	if (rrdwriters <= 0) return 0;
+
+#ifndef RRDTOOL_THREADSAFE
+	errprintf("RRD writer threads need a thread-safe RRDtool library (RRDtool 1.5 or later, or librrd_th), updating from the main thread\n");
+	rrdwriters = 0;
+	return 0;
+#endif
+	if (ext_rrd_cache) {
+		/* rrdcached already does the writing in the background */
+		errprintf("Not using RRD writer threads with an external rrdcached\n");
+		rrdwriters = 0;
+		return 0;
+	}
+
+	if (rrdwriterqueue < 1) rrdwriterqueue = 1;
+	rrdwritelatency = histogram_new("rrdwrite");
+	writerpool = (rrdwriter_t *)calloc(rrdwriters, sizeof(rrdwriter_t));
+
+	/* Signals must go to the main thread */
+	sigfillset(&allsigs);
+	pthread_sigmask(SIG_SETMASK, &allsigs, &oldsigs);
+	for (i = 0; (i < rrdwriters); i++) {
+		int err;
+
+		pthread_mutex_init(&writerpool[i].lock, NULL);
+		pthread_cond_init(&writerpool[i].work, NULL);
+		pthread_cond_init(&writerpool[i].done, NULL);
+		err = pthread_create(&writerpool[i].tid, NULL, rrdwriter_thread, &writerpool[i]);
+		if (err != 0) {
+			errprintf("Cannot start RRD writer thread: %s\n", strerror(err));
+			rrdwriters = i;
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+	logprintf("Started %d RRD writer threads\n", rrdwriters);
+	return rrdwriters;
+}
+
+void collect_rrdwriters(void)
+{
+	/* Log the failed updates, and have the files checked again the next time around */
+	rrdwritejob_t *job, *errs;
+
+	if (rrdwriters <= 0) return;
+
+	pthread_mutex_lock(&rrdwriteerrlock);
+	errs = rrdwriteerrs;
+	rrdwriteerrs = NULL;
+	pthread_mutex_unlock(&rrdwriteerrlock);
+
+	while (errs) {
+		job = errs;
+		errs = errs->next;
+
+		if (strstr(job->errtxt, "(minimum one second step)") != NULL) {
+			dbgprintf("RRD error updating %s from %s: %s\n", 
+				  job->filename, (job->sender ? job->sender : "unknown"), job->errtxt);
+		}
+		else {
+			errprintf("RRD error updating %s from %s: %s\n", 
+				  job->filename, (job->sender ? job->sender : "unknown"), job->errtxt);
+		}
+		job->cacheitem->fileok = 0;
+
+		free_rrdwritejob(job);
+	}
+}
+
+void drain_rrdwriters(void)
+{
+	/* Wait until all queued updates have been written */
+	int i;
+
+	for (i = 0; (i < rrdwriters); i++) {
+		rrdwriter_t *writer = &writerpool[i];
+
+		pthread_mutex_lock(&writer->lock);
+		while (writer->queued > 0) pthread_cond_wait(&writer->done, &writer->lock);
+		pthread_mutex_unlock(&writer->lock);
+	}
+
+	collect_rrdwriters();
+}
+
+void stop_rrdwriters(void)
+{
+	int i;
+
+	if (rrdwriters <= 0) return;
+
+	drain_rrdwriters();
+
+	for (i = 0; (i < rrdwriters); i++) {
+		pthread_mutex_lock(&writerpool[i].lock);
+		writerpool[i].stop = 1;
+		pthread_cond_signal(&writerpool[i].work);
+		pthread_mutex_unlock(&writerpool[i].lock);
+		pthread_join(writerpool[i].tid, NULL);
+	}
+
+	/* Any updates from now on are done by the main thread */
+	xfree(writerpool);
+	rrdwriters = 0;
+}
+
+static void queue_rrdwrite(updcacheitem_t *cacheitem, char *newdata, int dosync)
+{
+	rrdwriter_t *writer = &writerpool[cacheitem->writer % rrdwriters];
+	rrdwritejob_t *job;
+	int i;
+
+	job = (rrdwritejob_t *)calloc(1, sizeof(rrdwritejob_t));
+	job->cacheitem = cacheitem;
+	job->filename = strdup(filedir);
+	job->template = cacheitem->tpl->template;
+	job->dosync = dosync;
+
+	/* The job takes over the cached values */
+	for (i = 0; (i < cacheitem->valcount); i++) {
+		job->vals[job->valcount++] = cacheitem->vals[i];
+		cacheitem->vals[i] = NULL;
+	}
+	if (newdata) {
+		job->vals[job->valcount++] = strdup(newdata);
+		if (senderip) job->sender = strdup(senderip);
+	}
+	getntimer(&job->queuetime);
+
+	pthread_mutex_lock(&writer->lock);
+	if (writer->queued >= rrdwriterqueue) {
+		rrdwritewaits++;
+		while (writer->queued >= rrdwriterqueue) pthread_cond_wait(&writer->done, &writer->lock);
+	}
+	if (writer->tail) writer->tail->next = job; else writer->head = job;
+	writer->tail = job;
+	writer->queued++;
+	if (writer->queued > writer->maxqueued) writer->maxqueued = writer->queued;
+	pthread_cond_signal(&writer->work);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+#ifdef RRDTOOL14
+/*
+ * A client for the rrdcached protocol, used when RRDCACHED_ADDRESS is set.
+ *
+ * rrd_update() opens a request and waits for the reply for every update,
+ * so with rrdcached each RRD update is a round trip to the daemon. Instead,
+ * the updates are collected as "UPDATE file values..." lines and sent in
+ * BATCH mode over one persistent connection - up to RRDCACHED_BATCHSZ
+ * updates in one write, and one reply for the whole batch. A batch is sent
+ * when it is full, or at most RRDCACHED_BATCHAGE seconds after the first
+ * update went in. FLUSH requests are sent one at a time, waiting for the
+ * reply, after the pending batch.
+ *
+ * rrdcached has no templates, so the values are sent in the order of the
+ * datasets in the file. That is the template order for the files we create;
+ * for other files, dsmap tells where each value goes.
+ *
+ * If rrdcached cannot be reached, the updates go through rrd_update() as
+ * before, and we try to connect again after RRDCACHED_RETRY seconds. That
+ * includes the updates in a batch that could not be sent: They are written
+ * with rrd_update() right away, so they are not older than the updates that
+ * follow. The batch is never sent again - if it did reach rrdcached, the
+ * updates are just rejected as not newer than the last one.
+ */
+#define RRDCACHED_BATCHSZ 5000
+#define RRDCACHED_BATCHAGE 5
+#define RRDCACHED_RETRY 30
+#define RRDCACHED_TIMEOUT 30
+
+typedef struct rrdcached_cmd_t {
+	updcacheitem_t *cacheitem;
+	char *sender;
+	rrdtpldata_t *tpl;	/* The template and values, in case we must use rrd_update() */
+	int valcount;
+	char **vals;
+} rrdcached_cmd_t;
+
+static int rrdcached_fd = -1;
+static int rrdcached_isunix = 0;
+static time_t rrdcached_nextconnect = 0;
+static char *rrdcached_rrddir = NULL;		/* rrddir as it must be sent to rrdcached */
+static strbuffer_t *rrdcached_batch = NULL;
+static rrdcached_cmd_t *rrdcached_cmds = NULL;
+static int rrdcached_cmdcount = 0;
+static time_t rrdcached_batchtime = 0;
+static char rrdcached_rdbuf[8192];
+static int rrdcached_rdlen = 0;
+
+static void rrdcached_disconnect(void)
+{
+	if (rrdcached_fd != -1) close(rrdcached_fd);
+	rrdcached_fd = -1;
+	rrdcached_rdlen = 0;
+	rrdcached_nextconnect = gettimer() + RRDCACHED_RETRY;
+}
+
+static int rrdcached_connect(void)
+{
+	/* Returns 0 when we have a connection to rrdcached */
+	char *addr = getenv("RRDCACHED_ADDRESS");
+	struct timeval tmo;
+
+	if (rrdcached_fd != -1) return 0;
+	if (!addr || !*addr || (gettimer() < rrdcached_nextconnect)) return -1;
+
+	if ((strncmp(addr, "unix:", 5) == 0) || (*addr == '/')) {
+		struct sockaddr_un sun;
+		char *path = ((*addr == '/') ? addr : addr+5);
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, path, sizeof(sun.sun_path)-1);
+		rrdcached_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if ((rrdcached_fd != -1) && (connect(rrdcached_fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)) {
+			errprintf("Cannot connect to rrdcached at %s: %s\n", addr, strerror(errno));
+			close(rrdcached_fd); rrdcached_fd = -1;
+		}
+		rrdcached_isunix = 1;
+	}
+	else {
+		struct addrinfo hints, *ai, *walk;
+		char *host, *port, *p;
+		int res;
+
+		/* "host", "host:port", "[ipv6-address]:port" */
+		host = strdup(addr); port = NULL;
+		if (*host == '[') {
+			p = strchr(host, ']');
+			if (p) { *p = '\0'; if (*(p+1) == ':') port = p+2; }
+			memmove(host, host+1, strlen(host));
+		}
+		else if (((p = strchr(host, ':')) != NULL) && (strchr(p+1, ':') == NULL)) {
+			*p = '\0'; port = p+1;
+		}
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		res = getaddrinfo(host, (port ? port : "42217"), &hints, &ai);
+		if (res != 0) {
+			errprintf("Cannot find rrdcached address %s: %s\n", addr, gai_strerror(res));
+			ai = NULL;
+		}
+		for (walk = ai; (walk && (rrdcached_fd == -1)); walk = walk->ai_next) {
+			rrdcached_fd = socket(walk->ai_family, walk->ai_socktype, walk->ai_protocol);
+			if ((rrdcached_fd != -1) && (connect(rrdcached_fd, walk->ai_addr, walk->ai_addrlen) == -1)) {
+				close(rrdcached_fd); rrdcached_fd = -1;
+			}
+		}
+		if (ai && (rrdcached_fd == -1)) errprintf("Cannot connect to rrdcached at %s: %s\n", addr, strerror(errno));
+		if (ai) freeaddrinfo(ai);
+		xfree(host);
+		rrdcached_isunix = 0;
+	}
+
+	if (rrdcached_fd == -1) {
+		rrdcached_nextconnect = gettimer() + RRDCACHED_RETRY;
+		return -1;
+	}
+
+	tmo.tv_sec = RRDCACHED_TIMEOUT; tmo.tv_usec = 0;
+	setsockopt(rrdcached_fd, SOL_SOCKET, SO_RCVTIMEO, &tmo, sizeof(tmo));
+	setsockopt(rrdcached_fd, SOL_SOCKET, SO_SNDTIMEO, &tmo, sizeof(tmo));
+	rrdcached_rdlen = 0;
+
+	if (!rrdcached_rrddir) {
+		/*
+		 * Like librrd: A local rrdcached gets the real path of the file,
+		 * a remote one gets it relative to its base directory.
+		 */
+		char realdir[PATH_MAX];
+
+		if (!rrdcached_isunix) rrdcached_rrddir = strdup("");
+		else if (realpath(rrddir, realdir)) rrdcached_rrddir = strdup(realdir);
+		else rrdcached_rrddir = strdup(rrddir);
+	}
+
+	dbgprintf("Connected to rrdcached at %s\n", addr);
+	return 0;
+}
+
+static int rrdcached_write(char *buf, int len)
+{
+	int n;
+
+	while (len > 0) {
+		n = write(rrdcached_fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			errprintf("Error sending to rrdcached: %s\n", strerror(errno));
+			rrdcached_disconnect();
+			return -1;
+		}
+		buf += n; len -= n;
+	}
+
+	return 0;
+}
+
+static int rrdcached_readline(char *line, int linesz)
+{
+	/* Read one line of the reply, without the newline */
+	char *eoln;
+	int n;
+
+	while ((eoln = memchr(rrdcached_rdbuf, '\n', rrdcached_rdlen)) == NULL) {
+		if (rrdcached_rdlen == sizeof(rrdcached_rdbuf)) {
+			/* Overlong line, keep the start of it */
+			eoln = rrdcached_rdbuf + rrdcached_rdlen - 1;
+			break;
+		}
+
+		n = read(rrdcached_fd, rrdcached_rdbuf + rrdcached_rdlen, sizeof(rrdcached_rdbuf) - rrdcached_rdlen);
+		if ((n == -1) && (errno == EINTR)) continue;
+		if (n <= 0) {
+			errprintf("Error reading from rrdcached: %s\n", ((n == 0) ? "Connection closed" : strerror(errno)));
+			rrdcached_disconnect();
+			return -1;
+		}
+		rrdcached_rdlen += n;
+	}
+
+	n = eoln - rrdcached_rdbuf;
+	snprintf(line, linesz, "%.*s", n, rrdcached_rdbuf);
+	rrdcached_rdlen -= (n+1);
+	memmove(rrdcached_rdbuf, eoln+1, rrdcached_rdlen);
+
+	return 0;
+}
+
+static void rrdcached_addpath(strbuffer_t *buf, char *key)
+{
+	/* rrdcached splits the command at spaces, so they must be escaped */
+	char *p, *path;
+
+	if (*rrdcached_rrddir) addtobuffer(buf, rrdcached_rrddir);
+	path = ((*rrdcached_rrddir) ? key : (key + strspn(key, "/")));
+	while ((p = strpbrk(path, " \\")) != NULL) {
+		addtobufferraw(buf, path, (p - path));
+		addtobufferraw(buf, "\\", 1);
+		addtobufferraw(buf, p, 1);
+		path = p+1;
+	}
+	addtobuffer(buf, path);
+}
+
+static void rrdcached_dscheck(updcacheitem_t *cacheitem)
+{
+	/* Find out if the datasets in the file are in the template order */
+	rrd_info_t *info, *walk;
+	char *tplcopy, *tok, **tplnames = NULL;
+	int tplcount = 0, i, idx;
+
+	cacheitem->dscheck = 1;
+	info = rrd_info_r(filedir);
+	if (!info) return;
+
+	tplcopy = strdup(cacheitem->tpl->template);
+	for (tok = strtok(tplcopy, ":"); (tok); tok = strtok(NULL, ":")) {
+		tplnames = (char **)realloc(tplnames, (tplcount+1)*sizeof(char *));
+		tplnames[tplcount++] = tok;
+	}
+
+	cacheitem->dscount = 0;
+	for (walk = info; (walk); walk = walk->next) {
+		if ((strncmp(walk->key, "ds[", 3) == 0) && (walk->type == RD_I_CNT) && strstr(walk->key, "].index")) {
+			if ((int)walk->value.u_cnt >= cacheitem->dscount) cacheitem->dscount = walk->value.u_cnt + 1;
+		}
+	}
+	cacheitem->dsmap = (int *)malloc(cacheitem->dscount * sizeof(int));
+	for (i = 0; (i < cacheitem->dscount); i++) cacheitem->dsmap[i] = -1;
+
+	for (walk = info; (walk); walk = walk->next) {
+		char *dsend;
+
+		if ((strncmp(walk->key, "ds[", 3) != 0) || (walk->type != RD_I_CNT) || ((dsend = strstr(walk->key, "].index")) == NULL)) continue;
+
+		idx = walk->value.u_cnt;
+		for (i = 0; (i < tplcount); i++) {
+			if ((strlen(tplnames[i]) == (dsend - walk->key - 3)) && (strncmp(tplnames[i], walk->key+3, dsend - walk->key - 3) == 0)) {
+				cacheitem->dsmap[idx] = i;
+				break;
+			}
+		}
+	}
+	rrd_info_free(info);
+
+	for (i = 0; ((i < cacheitem->dscount) && (cacheitem->dsmap[i] == i)); i++) ;
+	if ((i < cacheitem->dscount) || (cacheitem->dscount != tplcount)) {
+		dbgprintf("Datasets in %s are not in template order %s\n", filedir, cacheitem->tpl->template);
+		cacheitem->dscheck = 2;
+	}
+	else {
+		xfree(cacheitem->dsmap);
+		cacheitem->dsmap = NULL;
+	}
+
+	xfree(tplcopy);
+	if (tplnames) xfree(tplnames);
+}
+
+static void rrdcached_addvalues(strbuffer_t *buf, updcacheitem_t *cacheitem, char *vals)
+{
+	char *copy, *tok, **tplvals = NULL;
+	int count = 0, i;
+
+	addtobufferraw(buf, " ", 1);
+	if (cacheitem->dscheck != 2) {
+		addtobuffer(buf, vals);
+		return;
+	}
+
+	/* Re-order the values from template order to the order of the datasets in the file */
+	copy = strdup(vals);
+	for (tok = strtok(copy, ":"); (tok); tok = strtok(NULL, ":")) {
+		tplvals = (char **)realloc(tplvals, (count+1)*sizeof(char *));
+		tplvals[count++] = tok;
+	}
+	if (count > 0) addtobuffer(buf, tplvals[0]);	/* The timestamp */
+	for (i = 0; (i < cacheitem->dscount); i++) {
+		int vidx = cacheitem->dsmap[i] + 1;
+
+		addtobufferraw(buf, ":", 1);
+		addtobuffer(buf, ((cacheitem->dsmap[i] >= 0) && (vidx < count)) ? tplvals[vidx] : "U");
+	}
+
+	xfree(copy);
+	if (tplvals) xfree(tplvals);
+}
+
+static void rrdcached_clearbatch(void)
+{
+	int i, j;
+
+	for (i = 0; (i < rrdcached_cmdcount); i++) {
+		rrdcached_cmd_t *cmd = &rrdcached_cmds[i];
+
+		if (cmd->sender) xfree(cmd->sender);
+		for (j = 0; (j < cmd->valcount); j++) xfree(cmd->vals[j]);
+		xfree(cmd->vals);
+	}
+	rrdcached_cmdcount = 0;
+	clearstrbuffer(rrdcached_batch);
+}
+
+static void rrdcached_fallback(void)
+{
+	/* The batch did not make it to rrdcached (or we cannot tell), so do the updates with rrd_update() */
+	char savedfiledir[PATH_MAX];
+	char **updparams = NULL;
+	int i, j, pcount;
+
+	errprintf("Doing %d batched updates without rrdcached\n", rrdcached_cmdcount);
+
+	/* We may be called while the caller is updating a file */
+	strcpy(savedfiledir, filedir);
+
+	for (i = 0; (i < rrdcached_cmdcount); i++) {
+		rrdcached_cmd_t *cmd = &rrdcached_cmds[i];
+
+		sprintf(filedir, "%s%s", rrddir, cmd->cacheitem->key);
+		updparams = (char **)realloc(updparams, (5 + cmd->valcount) * sizeof(char *));
+		pcount = 0;
+		updparams[pcount++] = "rrdupdate";
+		updparams[pcount++] = filedir;
+		updparams[pcount++] = "-t";
+		updparams[pcount++] = cmd->tpl->template;
+		for (j = 0; (j < cmd->valcount); j++) updparams[pcount++] = cmd->vals[j];
+		updparams[pcount] = NULL;
+
+		optind = opterr = 0; rrd_clear_error();
+		if (rrd_update(pcount, updparams) != 0) {
+			char *msg = rrd_get_error();
+
+			if (strstr(msg, "(minimum one second step)") != NULL) {
+				dbgprintf("RRD error updating %s from %s: %s\n", 
+					  filedir, (cmd->sender ? cmd->sender : "unknown"), msg);
+			}
+			else {
+				errprintf("RRD error updating %s from %s: %s\n", 
+					  filedir, (cmd->sender ? cmd->sender : "unknown"), msg);
+			}
+
+			/* check the file next time around */
+			cmd->cacheitem->fileok = 0;
+		}
+	}
+
+	strcpy(filedir, savedfiledir);
+	if (updparams) xfree(updparams);
+	rrdcached_clearbatch();
+}
+
+static void rrdcached_sendbatch(void)
+{
+	char line[1024];
+	int errcount, i;
+
+	if (rrdcached_cmdcount == 0) return;
+
+	/*
+	 * Any failure here means the connection is gone, and the updates that
+	 * follow go through rrd_update(). So the batch must be done now, too.
+	 */
+	if (rrdcached_connect() != 0) { rrdcached_fallback(); return; }
+
+	dbgprintf("Sending %d updates to rrdcached\n", rrdcached_cmdcount);
+	if ((rrdcached_write("BATCH\n", 6) != 0) || (rrdcached_readline(line, sizeof(line)) != 0)) { rrdcached_fallback(); return; }
+	if (atoi(line) != 0) {
+		errprintf("rrdcached refused the update batch: %s\n", line);
+		rrdcached_disconnect();
+		rrdcached_fallback();
+		return;
+	}
+	if ((rrdcached_write(STRBUF(rrdcached_batch), STRBUFLEN(rrdcached_batch)) != 0) || (rrdcached_write(".\n", 2) != 0)) {
+		rrdcached_fallback();
+		return;
+	}
+
+	/* The reply is "<N> errors", then a line "<command number> <error text>" for each error */
+	if (rrdcached_readline(line, sizeof(line)) != 0) { rrdcached_fallback(); return; }
+	errcount = atoi(line);
+	for (i = 0; (i < errcount); i++) {
+		rrdcached_cmd_t *cmd = NULL;
+		char *msg;
+		int cmdnum;
+
+		/* The batch is done; if the rest of the error list is lost, so be it */
+		if (rrdcached_readline(line, sizeof(line)) != 0) break;
+
+		cmdnum = strtol(line, &msg, 10);
+		msg += strspn(msg, " ");
+		if ((cmdnum >= 1) && (cmdnum <= rrdcached_cmdcount)) cmd = &rrdcached_cmds[cmdnum-1];
+
+		if (strstr(msg, "(minimum one second step)") != NULL) {
+			dbgprintf("RRD error updating %s%s from %s: %s\n", 
+				  rrddir, (cmd ? cmd->cacheitem->key : "/?"), ((cmd && cmd->sender) ? cmd->sender : "unknown"), msg);
+		}
+		else {
+			errprintf("RRD error updating %s%s from %s: %s\n", 
+				  rrddir, (cmd ? cmd->cacheitem->key : "/?"), ((cmd && cmd->sender) ? cmd->sender : "unknown"), msg);
+		}
+
+		/* check the file next time around */
+		if (cmd) cmd->cacheitem->fileok = 0;
+	}
+
+	rrdcached_clearbatch();
+}
+
+static int rrdcached_update(updcacheitem_t *cacheitem, char *newdata)
+{
+	/* Add the updates to the batch. Returns -1 if rrdcached is not available. */
+	rrdcached_cmd_t *cmd;
+	int i;
+
+	if (rrdcached_connect() != 0) return -1;
+
+	if (!rrdcached_batch) rrdcached_batch = newstrbuffer(0);
+	if ((rrdcached_cmdcount % 1024) == 0) {
+		rrdcached_cmds = (rrdcached_cmd_t *)realloc(rrdcached_cmds, (rrdcached_cmdcount + 1024) * sizeof(rrdcached_cmd_t));
+	}
+	if (rrdcached_cmdcount == 0) rrdcached_batchtime = gettimer();
+
+	if (!cacheitem->dscheck) rrdcached_dscheck(cacheitem);
+
+	addtobuffer(rrdcached_batch, "UPDATE ");
+	rrdcached_addpath(rrdcached_batch, cacheitem->key);
+	for (i = 0; (i < cacheitem->valcount); i++) rrdcached_addvalues(rrdcached_batch, cacheitem, cacheitem->vals[i]);
+	if (newdata) rrdcached_addvalues(rrdcached_batch, cacheitem, newdata);
+	addtobufferraw(rrdcached_batch, "\n", 1);
+
+	cmd = &rrdcached_cmds[rrdcached_cmdcount++];
+	cmd->cacheitem = cacheitem;
+	cmd->sender = ((newdata && senderip) ? strdup(senderip) : NULL);
+	cmd->tpl = cacheitem->tpl;
+	cmd->vals = (char **)malloc((cacheitem->valcount + 1) * sizeof(char *));
+	for (cmd->valcount = 0; (cmd->valcount < cacheitem->valcount); cmd->valcount++) {
+		cmd->vals[cmd->valcount] = strdup(cacheitem->vals[cmd->valcount]);
+	}
+	if (newdata) cmd->vals[cmd->valcount++] = strdup(newdata);
+
+	if (rrdcached_cmdcount >= RRDCACHED_BATCHSZ) rrdcached_sendbatch();
+
+	return 0;
+}
+
+static void rrdcached_flush(updcacheitem_t *cacheitem)
+{
+	/* Have rrdcached write the file to disk now, and wait for it */
+	strbuffer_t *cmd;
+	char line[1024];
+
+	if (rrdcached_connect() != 0) return;
+
+	cmd = newstrbuffer(0);
+	addtobuffer(cmd, "FLUSH ");
+	rrdcached_addpath(cmd, cacheitem->key);
+	addtobufferraw(cmd, "\n", 1);
+
+	if ((rrdcached_write(STRBUF(cmd), STRBUFLEN(cmd)) == 0) && (rrdcached_readline(line, sizeof(line)) == 0)) {
+		/* Unknown files are not an error - rrdcached may just not have any updates for it */
+		if ((atoi(line) < 0) && !strstr(line, "No such file")) errprintf("rrdcached flush of %s failed: %s\n", cacheitem->key, line);
+	}
+
+	freestrbuffer(cmd);
+}
+#endif
+
+void rrdcached_sendupdates(int force)
+{
+	/* Send the batched updates to rrdcached, if there are any */
+#ifdef RRDTOOL14
+	if ((rrdcached_cmdcount > 0) && (force || ((rrdcached_batchtime + RRDCACHED_BATCHAGE) <= gettimer()))) rrdcached_sendbatch();
+#endif
+}
+
+/*
+ * The update journal.
+ *
+ * With "--journal=FILENAME", every value that goes into the update cache
+ * is also appended to a journal file, so the cached updates survive a crash
+ * of xymond_rrd. So is a value that bypasses the cache but is queued for an
+ * RRD writer thread or for rrdcached, instead of being written right away. It is a checkpoint file (see lib/checkpoint.c) with one
+ * CHK_REC_RRDUPDATE record for each value: The cache key, the template,
+ * the timestamp and the values. The records are written and fsync'ed at most
+ * RRDJOURNAL_SYNCTIME seconds after they went into the cache.
+ *
+ * The journal only grows; values are not removed when they are flushed. When
+ * it holds more than RRDJOURNAL_MINRECS records and most of them have been
+ * written to the RRD files, a new journal is written with just the values
+ * still in the cache, and it replaces the old one.
+ *
+ * At startup, the journal left by the previous xymond_rrd is replayed in
+ * timestamp order and written to the RRD files before any new updates are
+ * handled. xymond_rrd holds a lock on the journal - and so does the child
+ * process flushing the cache when xymond_rrd shuts down - so a new xymond_rrd
+ * waits for the old flush to complete. When that flush is done the journal is
+ * emptied, so there is only something to replay after a crash.
+ */
+#define RRDJOURNAL_SYNCTIME 1
+#define RRDJOURNAL_MINRECS 100000
+
+static char *rrdjournalfn = NULL;
+static chkwriter_t *rrdjournal = NULL;
+static int rrdjournalfd = -1;		/* Holds the lock on the journal */
+static unsigned long rrdjournalrecs = 0;	/* Records in the current journal file */
+static int rrdjournaldirty = 0;
+static time_t rrdjournalsynctime = 0;
+
+typedef struct rrdjournalrec_t {
+	char *key, *template, *vals;
+	time_t updtime;
+	unsigned long recnum;
+} rrdjournalrec_t;
+
+typedef struct rrdjournalfile_t {
+	updcacheitem_t *cacheitem;
+	time_t lastupdate;
+} rrdjournalfile_t;
+
+static void rrdjournal_write(chkwriter_t *w, char *key, char *template, time_t updtime, char *vals)
+{
+	chk_begin(w, CHK_REC_RRDUPDATE);
+	chk_addstr(w, key);
+	chk_addstr(w, template);
+	chk_addint(w, updtime);
+	chk_addstr(w, vals);
+	chk_end(w);
+}
+
+static void rrdjournal_add(updcacheitem_t *cacheitem, time_t updtime, char *vals)
+{
+	if (!rrdjournal) return;
+
+	rrdjournal_write(rrdjournal, cacheitem->key, cacheitem->tpl->template, updtime, vals);
+	rrdjournalrecs++;
+	rrdjournaldirty = 1;
+}
+
+/*
+ * The flush scheduler.
+ *
+ * With "--flush-rate=N", the cached values of a file are not written when
+ * a counter says so, but at a flush time given to the file when a value goes
+ * into its empty cache. The flush time is at a fixed point in a window of
+ * (CACHESZ-1) update intervals, picked by the hash of the key - so the files
+ * are spread evenly over the window, and each file is written once in every
+ * window with a nearly full cache. Files that are due are written from
+ * rrdflush_run() in flush time order, at no more than N files per second.
+ * When more files are due than that, they wait - the flush lag - rather than
+ * making the disk queue longer.
+ *
+ * Files that must be written now - when the cache is full, or a graph has
+ * been requested for the host - are written right away. Those writes count
+ * against the rate, so the scheduled flushes make room for them.
+ */
+static updcacheitem_t **flushheap = NULL;
+static int flushheapcount = 0, flushheapsize = 0;
+static double flushtokens = 0.0;		/* How many files the scheduler may write now */
+static histogram_t *rrdflushlag = NULL;
+static unsigned long flushscheduled = 0, flushforced = 0, flushrequested = 0;
+
+static void flushsched_place(updcacheitem_t *cacheitem, int idx)
+{
+	flushheap[idx] = cacheitem;
+	cacheitem->flushidx = idx+1;
+}
+
+static void flushsched_up(int idx)
+{
+	updcacheitem_t *cacheitem = flushheap[idx];
+
+	while (idx > 0) {
+		int parent = (idx-1) / 2;
+
+		if (flushheap[parent]->flushtime <= cacheitem->flushtime) break;
+		flushsched_place(flushheap[parent], idx);
+		idx = parent;
+	}
+	flushsched_place(cacheitem, idx);
+}
+
+static void flushsched_down(int idx)
 {
-	char *p;
-
-	while ((p = strchr(param2, '/')) != NULL) *p = ',';
+	updcacheitem_t *cacheitem = flushheap[idx];
 
-	memset(fnparams, 0, sizeof(fnparams));
-	fnparams[0] = param1;
-	fnparams[1] = param2;
+	while (1) {
+		int child = 2*idx + 1;
 
-	snprintf(rrdfn, sizeof(rrdfn)-1, format, param1, param2);
-	rrdfn[sizeof(rrdfn)-1] = '\0';
-	while ((p = strchr(rrdfn, ' ')) != NULL) *p = '_';
+		if (child >= flushheapcount) break;
+		if (((child+1) < flushheapcount) && (flushheap[child+1]->flushtime < flushheap[child]->flushtime)) child++;
+		if (cacheitem->flushtime <= flushheap[child]->flushtime) break;
+		flushsched_place(flushheap[child], idx);
+		idx = child;
+	}
+	flushsched_place(cacheitem, idx);
 }
 
-static void setupfn3(char *format, char *param1, char *param2, char *param3)
+static void flushsched_add(updcacheitem_t *cacheitem, int interval)
 {
-	char *p;
-
-	memset(fnparams, 0, sizeof(fnparams));
-	fnparams[0] = param1;
-	fnparams[1] = param2;
-	fnparams[2] = param3;
+	time_t window = (CACHESZ-1) * interval;
+	time_t now = gettimer();
 
-	snprintf(rrdfn, sizeof(rrdfn)-1, format, param1, param2, param3);
-	rrdfn[sizeof(rrdfn)-1] = '\0';
-	while ((p = strchr(rrdfn, ' ')) != NULL) *p = '_';
+	if (cacheitem->flushidx) return;
 
-	if (strlen(rrdfn) >= (NAME_MAX - 50)) {
-		/*
-		 * Filename is too long. Limit filename length
-		 * by replacing the last part of the filename
-		 * with an MD5 hash.
-		 */
-		char *hash = md5hash(rrdfn+(NAME_MAX-50));
+	cacheitem->flushtime = now - (now % window) + (cacheitem->writer % window);
+	if (cacheitem->flushtime <= now) cacheitem->flushtime += window;
 
-		sprintf(rrdfn+(NAME_MAX-50), "_%s.rrd", hash);
+	if (flushheapcount == flushheapsize) {
+		flushheapsize = (flushheapsize ? 2*flushheapsize : 1024);
+		flushheap = (updcacheitem_t **)realloc(flushheap, flushheapsize * sizeof(updcacheitem_t *));
 	}
+	flushsched_place(cacheitem, flushheapcount++);
+	flushsched_up(flushheapcount-1);
 }
 
-static void setupinterval(int intvl)
+static void flushsched_remove(updcacheitem_t *cacheitem)
 {
-	rrdinterval = (intvl ? intvl : DEFAULT_RRD_INTERVAL);
+	int idx = cacheitem->flushidx - 1;
+
+	if (idx < 0) return;
+
+	cacheitem->flushidx = 0;
+	flushheapcount--;
+	if (idx == flushheapcount) return;
+
+	/* Move the last entry into the hole */
+	flushsched_place(flushheap[flushheapcount], idx);
+	flushsched_up(idx);
+	flushsched_down(flushheap[idx]->flushidx-1);
 }
 
-static int flush_cached_updates(updcacheitem_t *cacheitem, char *newdata, int dosync)
+static int flush_cached_updates(updcacheitem_t *cacheitem, char *newdata, time_t newtime, int dosync)
 {
-	/* Flush any updates we've cached */
+	/* Flush any updates we've cached, plus the new value from "newtime" if there is one */
 	char *updparams[5+CACHESZ+1] = { "rrdupdate", filedir, "-t", NULL, NULL, NULL, };
 	int i, pcount, result;
 
 	dbgprintf("Flushing '%s' with %d updates pending, template '%s'\n", 
 		  cacheitem->key, (newdata ? 1 : 0) + cacheitem->valcount, cacheitem->tpl->template);
 
+	/* All of the cached values are gone from the cache when we return */
+	cachedvalues -= cacheitem->valcount;
+	flushsched_remove(cacheitem);
+
+	/* Not before start_rrdwriters(): The journal is replayed with synchronous updates */
+	if (writerpool) {
+		/* Until a writer has done it, the new value is only in memory */
+		if (newdata) rrdjournal_add(cacheitem, newtime, newdata);
+		queue_rrdwrite(cacheitem, newdata, dosync);
+		for (i=0; (i < cacheitem->valcount); i++) {
+			cacheitem->updseq[i] = 0;
+			cacheitem->updtime[i] = 0;
+		}
+		cacheitem->valcount = 0;
+
+		/* Errors are reported later, by collect_rrdwriters() */
+		return 0;
+	}
+
+#ifdef RRDTOOL14
+	if (ext_rrd_cache && (rrdcached_update(cacheitem, newdata) == 0)) {
+		if (newdata) rrdjournal_add(cacheitem, newtime, newdata);
+		for (i=0; (i < cacheitem->valcount); i++) {
+			cacheitem->updseq[i] = 0;
+			cacheitem->updtime[i] = 0;
+			xfree(cacheitem->vals[i]);
+		}
+		cacheitem->valcount = 0;
+
+		/* Errors are reported when the batch has been sent */
+		rrdcached_sendupdates(0);
+		return 0;
+	}
+#endif
+
 	/* ISO C90: parameters cannot be used as initializers */
 	updparams[3] = cacheitem->tpl->template;
 
@@ -269,6 +1226,20 @@ static int flush_cached_updates(updcacheitem_t *cacheitem, char *newdata, int do
 	return result;
 }
 
+static updcacheitem_t *new_cacheitem(char *key, rrdtpldata_t *template)
+{
+	updcacheitem_t *cacheitem;
+
+	cacheitem = (updcacheitem_t *)calloc(1, sizeof(updcacheitem_t));
+	cacheitem->key = strdup(key);
+	cacheitem->tpl = template;
+	cacheitem->fileok = 0;
+	cacheitem->writer = rrdwriter_hash(cacheitem->key);
+	xtreeAdd(updcache, cacheitem->key, cacheitem);
+
+	return cacheitem;
+}
+
 static int create_and_update_rrd(char *hostname, char *testname, char *classname, char *pagepaths, char *creparams[], void *template)
 {
 	static int callcounter = 0;
@@ -322,15 +1293,17 @@ static int create_and_update_rrd(char *hostname, char *testname, char *classname
 				  (creparams[1] ? creparams[1] : "NULL"));
 			return -1;
 		}
-		cacheitem = (updcacheitem_t *)calloc(1, sizeof(updcacheitem_t));
-		cacheitem->key = strdup(updcachekey);
-		cacheitem->tpl = template;
-		cacheitem->fileok = 0;
-		xtreeAdd(updcache, cacheitem->key, cacheitem);
+		cacheitem = new_cacheitem(updcachekey, template);
 	}
 	else {
 		cacheitem = (updcacheitem_t *)xtreeData(updcache, handle);
 		if (!template) template = cacheitem->tpl;
+		else if ((template != cacheitem->tpl) && (cacheitem->valcount == 0)) {
+			/* Set up when replaying the journal. Use the template of the RRD handler from now on */
+			cacheitem->tpl = template;
+			cacheitem->dscheck = 0;
+			if (cacheitem->dsmap) xfree(cacheitem->dsmap);
+		}
 	}
 
 	/* If the RRD file doesn't exist, create it immediately */
@@ -485,21 +1458,33 @@ static int create_and_update_rrd(char *hostname, char *testname, char *classname
 	 * This can be modified with the cachemultiplier option to xymond_rrd.
 	 * We wait 10m (roughly 2 PDPs) after startup to give any previous xymond_rrd's
 	 * a chance to flush their caches first (since rrdtool can't handle out-of-order data well).
+	 * With a journal there is no wait, since startup waits for the previous flush to complete.
+	 *
+	 * With the flush scheduler, the cache is written when the file is due, so
+	 * there is no need for forcing updates through here.
 	 */
-	if (use_rrd_cache && ((++callcounter < cacheflushsz) || releasecachedelay) ) {
+	if (use_rrd_cache && ((rrdflushrate > 0) || (++callcounter < cacheflushsz) || releasecachedelay) ) {
 		if (cacheitem && (cacheitem->valcount < CACHESZ)) {
 			dbgprintf(" - %s: storing %zu bytes into seq %d (pos: %d/%d), at %d: %s\n", updcachekey, strlen(rrdvalues), seq, cacheitem->valcount, CACHESZ, updtime, rrdvalues);
 			cacheitem->updseq[cacheitem->valcount] = seq;
 			cacheitem->updtime[cacheitem->valcount] = updtime;
 			cacheitem->vals[cacheitem->valcount] = strdup(rrdvalues);
 			cacheitem->valcount += 1;
+			cachedvalues++;
+			rrdjournal_add(cacheitem, updtime, rrdvalues);
+			if (rrdflushrate > 0) flushsched_add(cacheitem, pollinterval);
 			return 0;
 		}
+		else if (rrdflushrate > 0) {
+			/* The cache filled up before the file was due */
+			flushforced++;
+			flushtokens -= 1.0;
+		}
 	}
 	else callcounter = 0;
 
 	/* At this point, we will commit the update to disk */
-	result = flush_cached_updates(cacheitem, rrdvalues, 0);
+	result = flush_cached_updates(cacheitem, rrdvalues, updtime, 0);
 	if (result != 0) {
 		char *msg = rrd_get_error();
 
@@ -532,9 +1517,11 @@ void rrdcacheflushall(void)
 		cacheitem = (updcacheitem_t *) xtreeData(updcache, handle);
 		if (cacheitem->valcount > 0) {
 			sprintf(filedir, "%s%s", rrddir, cacheitem->key);
-			flush_cached_updates(cacheitem, NULL, 0);
+			flush_cached_updates(cacheitem, NULL, 0, 0);
 		}
 	}
+
+	rrdcached_sendupdates(1);
 }
 
 void rrdcacheflushhost(char *hostname)
@@ -589,7 +1576,12 @@ void rrdcacheflushhost(char *hostname)
 			if (cacheitem->valcount > 0) {
 				dbgprintf("Flushing cache '%s'\n", cacheitem->key);
 				sprintf(filedir, "%s%s", rrddir, cacheitem->key);
-				flush_cached_updates(cacheitem, NULL, 1);
+				flush_cached_updates(cacheitem, NULL, 0, 1);
+				if (rrdflushrate > 0) {
+					/* Someone is waiting for this, so it goes ahead of the scheduled flushes */
+					flushrequested++;
+					flushtokens -= 1.0;
+				}
 			}
 			/* Fall through */
 
@@ -598,6 +1590,446 @@ void rrdcacheflushhost(char *hostname)
 			break;
 		}
 	}
+
+#ifdef RRDTOOL14
+	if (ext_rrd_cache && (rrdcached_fd != -1)) {
+		/* The updates are with rrdcached now. Have it write them to disk, so they show up on the graphs. */
+		rrdcached_sendupdates(1);
+
+		for (handle = xtreeFirst(updcache); (handle != xtreeEnd(updcache)); handle = xtreeNext(updcache, handle)) {
+			cacheitem = (updcacheitem_t *) xtreeData(updcache, handle);
+			if (strncasecmp(cacheitem->key, hostname, keylen) == 0) rrdcached_flush(cacheitem);
+		}
+	}
+#endif
+}
+
+static int rrdjournal_pending(void)
+{
+	/* Are there updates that are neither in the cache, nor written to the RRD files or rrdcached? */
+#ifdef RRDTOOL14
+	return (rrdcached_cmdcount > 0);
+#else
+	return 0;
+#endif
+}
+
+static void flush_cacheitem(updcacheitem_t *cacheitem, char *from)
+{
+	sprintf(filedir, "%s%s", rrddir, cacheitem->key);
+	if (flush_cached_updates(cacheitem, NULL, 0, 0) != 0) {
+		char *msg = rrd_get_error();
+
+		if (strstr(msg, "(minimum one second step)") != NULL) {
+			dbgprintf("RRD error updating %s from %s: %s\n", filedir, from, msg);
+		}
+		else {
+			errprintf("RRD error updating %s from %s: %s\n", filedir, from, msg);
+		}
+		cacheitem->fileok = 0;
+	}
+}
+
+static int rrdjournal_reccmp(const void *a, const void *b)
+{
+	rrdjournalrec_t *r1 = (rrdjournalrec_t *)a;
+	rrdjournalrec_t *r2 = (rrdjournalrec_t *)b;
+
+	if (r1->updtime != r2->updtime) return ((r1->updtime < r2->updtime) ? -1 : 1);
+	return ((r1->recnum < r2->recnum) ? -1 : ((r1->recnum > r2->recnum) ? 1 : 0));
+}
+
+static rrdtpldata_t *rrdjournal_template(void *tpltree, char *template)
+{
+	/* Setup the template as the RRD handler would have done it, from the DS names */
+	xtreePos_t handle;
+	rrdtpldata_t *result;
+	char **params, *tplcopy, *tok;
+	int count, i;
+
+	handle = xtreeFind(tpltree, template);
+	if (handle != xtreeEnd(tpltree)) return (rrdtpldata_t *)xtreeData(tpltree, handle);
+
+	count = 1; for (tok = template; ((tok = strchr(tok, ':')) != NULL); tok++) count++;
+	params = (char **)calloc(count+1, sizeof(char *));
+	tplcopy = strdup(template);
+	for (i = 0, tok = strtok(tplcopy, ":"); (tok && (i < count)); i++, tok = strtok(NULL, ":")) {
+		params[i] = (char *)malloc(strlen(tok) + 5);
+		sprintf(params[i], "DS:%s:", tok);
+	}
+
+	result = setup_template(params);
+	for (i = 0; (params[i]); i++) xfree(params[i]);
+	xfree(params);
+	xfree(tplcopy);
+
+	if (result->template == NULL) return NULL;
+	xtreeAdd(tpltree, result->template, result);
+	return result;
+}
+
+static void rrdjournal_replay(char *fn)
+{
+	chkreader_t *r;
+	rrdjournalrec_t *recs = NULL;
+	unsigned long reccount = 0, recsz = 0, replayed = 0, i;
+	void *tpltree, *filetree;
+	xtreePos_t handle;
+	rrdjournalfile_t *jfile;
+	updcacheitem_t *cacheitem;
+	int rectype, filecount = 0;
+
+	r = chk_open(fn);
+	if (r == NULL) return;
+
+	while ((rectype = chk_next(r)) != 0) {
+		if ((rectype != CHK_REC_RRDUPDATE) || (chk_fieldcount(r) < 4)) continue;
+		if (!chk_str(r, 0) || !chk_str(r, 1) || !chk_str(r, 3)) continue;
+
+		if (reccount == recsz) {
+			recsz += 10000;
+			recs = (rrdjournalrec_t *)realloc(recs, recsz * sizeof(rrdjournalrec_t));
+		}
+		/* Compressed blocks are uncompressed into a buffer that is re-used, so copy the strings */
+		recs[reccount].key = strdup(chk_str(r, 0));
+		recs[reccount].template = strdup(chk_str(r, 1));
+		recs[reccount].updtime = (time_t)chk_int(r, 2);
+		recs[reccount].vals = strdup(chk_str(r, 3));
+		recs[reccount].recnum = reccount;
+		reccount++;
+	}
+	chk_closeread(r);
+
+	if (reccount == 0) return;
+
+	/* rrdtool needs the updates for a file in time order; keep the journal order for identical timestamps */
+	qsort(recs, reccount, sizeof(rrdjournalrec_t), rrdjournal_reccmp);
+
+	if (updcache_keyofs == -1) {
+		updcache = xtreeNew(strcasecmp);
+		updcache_keyofs = strlen(rrddir);
+	}
+	tpltree = xtreeNew(strcmp);
+	filetree = xtreeNew(strcasecmp);
+
+	for (i = 0; (i < reccount); i++) {
+		handle = xtreeFind(filetree, recs[i].key);
+		if (handle == xtreeEnd(filetree)) {
+			rrdtpldata_t *template = rrdjournal_template(tpltree, recs[i].template);
+			char *lastparams[3] = { "rrdlast", filedir, NULL };
+
+			if (!template) continue;
+			jfile = (rrdjournalfile_t *)calloc(1, sizeof(rrdjournalfile_t));
+			jfile->cacheitem = new_cacheitem(recs[i].key, template);
+			xtreeAdd(filetree, jfile->cacheitem->key, jfile);
+			filecount++;
+
+			/*
+			 * The journal also has the updates that were written to the file
+			 * before xymond_rrd stopped, and rrdtool stops at the first update
+			 * that is not newer than the last one. So skip those.
+			 * With rrdcached, rrd_last() has it write the file first.
+			 */
+			sprintf(filedir, "%s%s", rrddir, recs[i].key);
+			optind = opterr = 0; rrd_clear_error();
+			jfile->lastupdate = rrd_last(2, lastparams);
+		}
+		else {
+			jfile = (rrdjournalfile_t *)xtreeData(filetree, handle);
+		}
+
+		if (recs[i].updtime <= jfile->lastupdate) continue;
+		jfile->lastupdate = recs[i].updtime;
+
+		cacheitem = jfile->cacheitem;
+		if (cacheitem->valcount == CACHESZ) flush_cacheitem(cacheitem, "journal");
+
+		cacheitem->updseq[cacheitem->valcount] = 0;
+		cacheitem->updtime[cacheitem->valcount] = recs[i].updtime;
+		cacheitem->vals[cacheitem->valcount] = recs[i].vals;
+		cacheitem->valcount++;
+		cachedvalues++;
+		recs[i].vals = NULL;
+		replayed++;
+	}
+
+	/* Write it all now, so the new updates come after these */
+	for (handle = xtreeFirst(updcache); (handle != xtreeEnd(updcache)); handle = xtreeNext(updcache, handle)) {
+		cacheitem = (updcacheitem_t *) xtreeData(updcache, handle);
+		if (cacheitem->valcount > 0) flush_cacheitem(cacheitem, "journal");
+	}
+	rrdcached_sendupdates(1);
+
+	logprintf("Replayed %lu cached updates for %d RRD files from journal %s\n", replayed, filecount, fn);
+
+	for (i = 0; (i < reccount); i++) {
+		xfree(recs[i].key);
+		xfree(recs[i].template);
+		if (recs[i].vals) xfree(recs[i].vals);
+	}
+	xfree(recs);
+	xtreeDestroy(tpltree);
+	for (handle = xtreeFirst(filetree); (handle != xtreeEnd(filetree)); handle = xtreeNext(filetree, handle)) {
+		jfile = (rrdjournalfile_t *)xtreeData(filetree, handle);
+		xfree(jfile);
+	}
+	xtreeDestroy(filetree);
+}
+
+int rrdjournal_open(char *fn)
+{
+	/* Lock the journal, replay what is left in it, and start a new one. Returns 0 if journaling. */
+	struct stat st;
+	int n;
+
+	rrdjournalfd = open(fn, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (rrdjournalfd == -1) {
+		errprintf("Cannot open RRD journal %s: %s\n", fn, strerror(errno));
+		return -1;
+	}
+
+	n = flock(rrdjournalfd, LOCK_EX|LOCK_NB);
+	if ((n == -1) && (errno == EWOULDBLOCK)) {
+		logprintf("Waiting for the previous xymond_rrd to finish flushing its cache to %s\n", fn);
+		do { n = flock(rrdjournalfd, LOCK_EX); } while ((n == -1) && (errno == EINTR));
+	}
+	if (n == -1) {
+		errprintf("Cannot lock RRD journal %s: %s\n", fn, strerror(errno));
+		close(rrdjournalfd); rrdjournalfd = -1;
+		return -1;
+	}
+
+	if ((fstat(rrdjournalfd, &st) == 0) && (st.st_size > 0)) rrdjournal_replay(fn);
+
+	/* This truncates the file we hold the lock on */
+	rrdjournal = chk_create(fn, CHK_JOURNAL, 0, COMP_PLAIN);
+	if (!rrdjournal) {
+		close(rrdjournalfd); rrdjournalfd = -1;
+		return -1;
+	}
+
+	rrdjournalfn = strdup(fn);
+	rrdjournalrecs = 0;
+	rrdjournalsynctime = gettimer();
+	return 0;
+}
+
+static void rrdjournal_compact(void)
+{
+	/* Write a new journal with only the values that are still in the cache */
+	char *tmpfn;
+	chkwriter_t *w;
+	int fd, i;
+	unsigned long count = 0;
+	xtreePos_t handle;
+	updcacheitem_t *cacheitem;
+
+	/* Values on their way to the RRD files must get there first */
+	drain_rrdwriters();
+	rrdcached_sendupdates(1);
+	if (rrdjournal_pending()) return;
+
+	tmpfn = (char *)malloc(strlen(rrdjournalfn) + 5);
+	sprintf(tmpfn, "%s.tmp", rrdjournalfn);
+	w = chk_create(tmpfn, CHK_JOURNAL, 0, COMP_PLAIN);
+	if (!w) {
+		xfree(tmpfn);
+		return;
+	}
+	fd = open(tmpfn, O_RDWR);
+	if ((fd == -1) || (flock(fd, LOCK_EX|LOCK_NB) == -1)) {
+		errprintf("Cannot lock new RRD journal %s: %s\n", tmpfn, strerror(errno));
+		goto failed;
+	}
+
+	for (handle = xtreeFirst(updcache); (handle != xtreeEnd(updcache)); handle = xtreeNext(updcache, handle)) {
+		cacheitem = (updcacheitem_t *) xtreeData(updcache, handle);
+		for (i = 0; (i < cacheitem->valcount); i++) {
+			rrdjournal_write(w, cacheitem->key, cacheitem->tpl->template, cacheitem->updtime[i], cacheitem->vals[i]);
+			count++;
+		}
+	}
+
+	if (chk_flush(w, 1) != 0) goto failed;
+	if (rename(tmpfn, rrdjournalfn) == -1) {
+		errprintf("Cannot rename %s to %s: %s\n", tmpfn, rrdjournalfn, strerror(errno));
+		goto failed;
+	}
+
+	dbgprintf("Compacted RRD journal from %lu to %lu records\n", rrdjournalrecs, count);
+	chk_close(rrdjournal, 0);
+	close(rrdjournalfd);
+	rrdjournal = w;
+	rrdjournalfd = fd;
+	rrdjournalrecs = count;
+	xfree(tmpfn);
+	return;
+
+failed:
+	chk_close(w, 0);
+	if (fd != -1) close(fd);
+	unlink(tmpfn);
+	xfree(tmpfn);
+}
+
+void rrdjournal_sync(int force)
+{
+	/* Write the journal records to disk, and compact the journal when it has grown too large */
+	time_t now;
+
+	if (!rrdjournal || !rrdjournaldirty) return;
+
+	now = gettimer();
+	if (!force && (now < (rrdjournalsynctime + RRDJOURNAL_SYNCTIME))) return;
+
+	rrdjournalsynctime = now;
+	rrdjournaldirty = 0;
+	if (chk_flush(rrdjournal, 1) != 0) {
+		errprintf("Stopped writing the RRD journal %s, cached updates will be lost if xymond_rrd crashes\n", rrdjournalfn);
+		chk_close(rrdjournal, 0);
+		rrdjournal = NULL;
+		return;
+	}
+
+	if ((rrdjournalrecs > RRDJOURNAL_MINRECS) && (rrdjournalrecs > 4*cachedvalues)) rrdjournal_compact();
+}
+
+void rrdjournal_close(void)
+{
+	/* Called when the cache has been flushed. The journal is then emptied, as there is nothing to replay. */
+	if (rrdjournalfd == -1) return;
+
+	if (rrdjournal_pending()) {
+		errprintf("Keeping the RRD journal %s, some updates could not be sent to rrdcached\n", rrdjournalfn);
+		return;
+	}
+
+	if (rrdjournal) chk_close(rrdjournal, 0);
+	rrdjournal = NULL;
+	if ((ftruncate(rrdjournalfd, 0) == -1) || (fsync(rrdjournalfd) == -1)) {
+		errprintf("Cannot empty the RRD journal %s: %s\n", rrdjournalfn, strerror(errno));
+	}
+	close(rrdjournalfd);
+	rrdjournalfd = -1;
+}
+
+void rrdflush_run(void)
+{
+	/* Write the files that are due, at no more than rrdflushrate files per second */
+	static struct timespec lastrun = { 0, 0 };
+	updcacheitem_t *cacheitem;
+	time_t now;
+
+	if ((rrdflushrate <= 0) || releasecachedelay) return;
+
+	if (lastrun.tv_sec) flushtokens += (rrdflushrate * (double)ntimerus(&lastrun, NULL)) / 1000000.0;
+	getntimer(&lastrun);
+
+	/* Allow no more than one second worth of writes in a burst, and don't let forced writes stop us for long */
+	if (flushtokens > rrdflushrate) flushtokens = rrdflushrate;
+	else if (flushtokens < -rrdflushrate) flushtokens = -rrdflushrate;
+
+	if (!rrdflushlag) rrdflushlag = histogram_new("rrdflushlag");
+
+	now = gettimer();
+	while ((flushheapcount > 0) && (flushtokens >= 1.0) && (flushheap[0]->flushtime <= now)) {
+		cacheitem = flushheap[0];
+		histogram_add(rrdflushlag, now - cacheitem->flushtime);
+		flush_cacheitem(cacheitem, "cache");	/* Removes it from the flush heap */
+		flushtokens -= 1.0;
+		flushscheduled++;
+	}
+}
+
+static int flushsched_backlog(int idx, time_t now)
+{
+	/* The number of files that are due, in the part of the heap starting at idx */
+	if ((idx >= flushheapcount) || (flushheap[idx]->flushtime > now)) return 0;
+
+	return 1 + flushsched_backlog(2*idx+1, now) + flushsched_backlog(2*idx+2, now);
+}
+
+void report_rrdstatus(void)
+{
+	/* Send a status with the writer queues and the flush scheduler backlog, and the latencies since the last report */
+	char *channel = getenv("XYMOND_CHANNELNAME");
+	strbuffer_t *msg, *details;
+	char line[1024];
+	int i, color = COL_GREEN;
+
+	if ((rrdwriters <= 0) && (rrdflushrate <= 0)) return;
+
+	details = newstrbuffer(0);
+
+	if (rrdwriters > 0) {
+		collect_rrdwriters();
+		if (rrdwritewaits > 0) color = COL_YELLOW;
+
+		snprintf(line, sizeof(line), "RRD writer threads: %d, queue limit %d per thread\n", rrdwriters, rrdwriterqueue);
+		addtobuffer(details, line);
+		if (rrdwritewaits > 0) {
+			snprintf(line, sizeof(line), "&yellow Parsing waited %lu times for a full writer queue\n", rrdwritewaits);
+			addtobuffer(details, line);
+		}
+		addtobuffer(details, "\nWriter  Queued  Max.queued   Updates\n");
+
+		for (i = 0; (i < rrdwriters); i++) {
+			rrdwriter_t *writer = &writerpool[i];
+
+			pthread_mutex_lock(&writer->lock);
+			snprintf(line, sizeof(line), "%6d  %6d  %10d  %8lu\n", i, writer->queued, writer->maxqueued, writer->updates);
+			writer->maxqueued = writer->queued;
+			writer->updates = 0;
+			pthread_mutex_unlock(&writer->lock);
+			addtobuffer(details, line);
+		}
+
+		snprintf(line, sizeof(line), "\nTime from queueing to written (ms): p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+			 histogram_percentile(rrdwritelatency, 50.0) / 1000.0, histogram_percentile(rrdwritelatency, 90.0) / 1000.0,
+			 histogram_percentile(rrdwritelatency, 99.0) / 1000.0, rrdwritelatency->max / 1000.0);
+		addtobuffer(details, line);
+		histogram_reset(rrdwritelatency);
+		rrdwritewaits = 0;
+	}
+
+	if (rrdflushrate > 0) {
+		time_t now = gettimer();
+		int backlog = flushsched_backlog(0, now);
+
+		if (!rrdflushlag) rrdflushlag = histogram_new("rrdflushlag");
+
+		if (rrdwriters > 0) addtobuffer(details, "\n");
+		snprintf(line, sizeof(line), "RRD flush scheduler: %d files per second, %d files with cached updates\n", rrdflushrate, flushheapcount);
+		addtobuffer(details, line);
+		if (rrdflushlag->max > DEFAULT_RRD_INTERVAL) {
+			color = COL_YELLOW;
+			snprintf(line, sizeof(line), "&yellow Files were written up to %llu seconds after they were due\n", rrdflushlag->max);
+			addtobuffer(details, line);
+		}
+		snprintf(line, sizeof(line), "Backlog: %d files due now, the oldest due %ld seconds ago\n",
+			 backlog, (long)(backlog ? (now - flushheap[0]->flushtime) : 0));
+		addtobuffer(details, line);
+		snprintf(line, sizeof(line), "Files written: %lu when due, %lu with a full cache, %lu for graphs\n",
+			 flushscheduled, flushforced, flushrequested);
+		addtobuffer(details, line);
+		snprintf(line, sizeof(line), "Flush lag (s): p50 %llu  p90 %llu  p99 %llu  max %llu\n",
+			 histogram_percentile(rrdflushlag, 50.0), histogram_percentile(rrdflushlag, 90.0),
+			 histogram_percentile(rrdflushlag, 99.0), rrdflushlag->max);
+		addtobuffer(details, line);
+		histogram_reset(rrdflushlag);
+		flushscheduled = flushforced = flushrequested = 0;
+	}
+
+	init_timestamp();
+	msg = newstrbuffer(0);
+	snprintf(line, sizeof(line), "status %s.rrd%s %s %s\n\n", 
+		 xgetenv("MACHINE"), (channel ? channel : ""), colorname(color), timestamp);
+	addtobuffer(msg, line);
+	addtostrbuffer(msg, details);
+
+	combo_add(msg);
+	freestrbuffer(details);
+	freestrbuffer(msg);
 }
 
 static int rrddatasets(char *hostname, char ***dsnames)
@@ -697,99 +2129,172 @@ static int rrddatasets(char *hostname, char ***dsnames)
 #include "rrd/do_devmon.c"
 
 
-void update_rrd(char *hostname, char *testname, char *msg, time_t tstamp, char *sender, xymonrrd_t *ldef, char *classname, char *pagepaths)
-{
+/*
+ * The RRD handlers, looked up by the test ID - the name that TEST2RRD maps
+ * the test to, or the testname itself. setup_rrdhandlers() puts them in a
+ * tree (a hash with the hashed xtree backend), with one entry for the ID
+ * and one for each alias. The --extra-tests IDs are added too. As before,
+ * an SNMP MIB definition wins over the handlers listed after "ifmib" and
+ * over the external handler, so only those - and IDs without a handler -
+ * are checked against the MIB definitions.
+ */
+typedef int (*rrdhandler_fn_t)(char *hostname, char *testname, char *classname, char *pagepaths, char *msg, time_t tstamp);
+
+typedef struct rrdhandler_t {
 	char *id;
+	rrdhandler_fn_t handler;
+	char *aliases[6];
+	int aftermibs;		/* Only used if the ID is not an SNMP MIB */
+} rrdhandler_t;
 
-	if (ldef) id = ldef->xymonrrdname; else id = testname;
-	senderip = sender;
+static int do_proccounts_rrd(char *hostname, char *testname, char *classname, char *pagepaths, char *msg, time_t tstamp)
+{
+	return do_counts_rrd("processes", hostname, testname, classname, pagepaths, msg, tstamp);
+}
+
+static int do_portcounts_rrd(char *hostname, char *testname, char *classname, char *pagepaths, char *msg, time_t tstamp)
+{
+	return do_counts_rrd("ports", hostname, testname, classname, pagepaths, msg, tstamp);
+}
+
+static int do_linecounts_rrd(char *hostname, char *testname, char *classname, char *pagepaths, char *msg, time_t tstamp)
+{
+	return do_derives_rrd("lines", hostname, testname, classname, pagepaths, msg, tstamp);
+}
 
-	if      (strcmp(id, "bbgen") == 0)       do_xymongen_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "xymongen") == 0)    do_xymongen_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "bbtest") == 0)      do_xymonnet_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "xymonnet") == 0)    do_xymonnet_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "bbproxy") == 0)     do_xymonproxy_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "xymonproxy") == 0)  do_xymonproxy_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "hobbitd") == 0)     do_xymond_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "xymond") == 0)      do_xymond_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "citrix") == 0)      do_citrix_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "ntpstat") == 0)     do_ntpstat_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-
-	else if (strcmp(id, "la") == 0)          do_la_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "disk") == 0)        do_disk_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "memory") == 0)      do_memory_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "netstat") == 0)     do_netstat_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "vmstat") == 0)      do_vmstat_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "iostat") == 0)      do_iostat_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "ifstat") == 0)      do_ifstat_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-
-	/* These two come from the filerstats2bb.pl script. The reports are in disk-format */
-	else if (strcmp(id, "inode") == 0)       do_disk_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "qtree") == 0)       do_disk_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-
-	else if (strcmp(id, "apache") == 0)      do_apache_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "sendmail") == 0)    do_sendmail_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "mailq") == 0)       do_mailq_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "iishealth") == 0)   do_iishealth_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "temperature") == 0) do_temperature_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-
-	else if (strcmp(id, "ncv") == 0)         do_ncv_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "tcp") == 0)         do_net_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-
-	else if (strcmp(id, "filesizes") == 0)   do_filesizes_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "proccounts") == 0)  do_counts_rrd("processes", hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "portcounts") == 0)  do_counts_rrd("ports", hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "linecounts") == 0)  do_derives_rrd("lines", hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "deltacounts") == 0) do_counts_rrd("deltalines", hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "trends") == 0)      do_trends_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-
-	else if (strcmp(id, "ifmib") == 0)       do_ifmib_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (is_snmpmib_rrd(id))             do_snmpmib_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+static int do_deltacounts_rrd(char *hostname, char *testname, char *classname, char *pagepaths, char *msg, time_t tstamp)
+{
+	return do_counts_rrd("deltalines", hostname, testname, classname, pagepaths, msg, tstamp);
+}
+
+static rrdhandler_t rrdhandlers[] = {
+	{ "xymongen",    do_xymongen_rrd,    { "bbgen", NULL } },
+	{ "xymonnet",    do_xymonnet_rrd,    { "bbtest", NULL } },
+	{ "xymonproxy",  do_xymonproxy_rrd,  { "bbproxy", NULL } },
+	{ "xymond",      do_xymond_rrd,      { "hobbitd", NULL } },
+	{ "citrix",      do_citrix_rrd,      { NULL } },
+	{ "ntpstat",     do_ntpstat_rrd,     { NULL } },
+
+	{ "la",          do_la_rrd,          { NULL } },
+	/* inode and qtree come from the filerstats2bb.pl script. The reports are in disk-format */
+	{ "disk",        do_disk_rrd,        { "inode", "qtree", NULL } },
+	{ "memory",      do_memory_rrd,      { NULL } },
+	{ "netstat",     do_netstat_rrd,     { NULL } },
+	{ "vmstat",      do_vmstat_rrd,      { NULL } },
+	{ "iostat",      do_iostat_rrd,      { NULL } },
+	{ "ifstat",      do_ifstat_rrd,      { NULL } },
+
+	{ "apache",      do_apache_rrd,      { NULL } },
+	{ "sendmail",    do_sendmail_rrd,    { NULL } },
+	{ "mailq",       do_mailq_rrd,       { NULL } },
+	{ "iishealth",   do_iishealth_rrd,   { NULL } },
+	{ "temperature", do_temperature_rrd, { NULL } },
+
+	{ "ncv",         do_ncv_rrd,         { NULL } },
+	{ "tcp",         do_net_rrd,         { NULL } },
+
+	{ "filesizes",   do_filesizes_rrd,   { NULL } },
+	{ "proccounts",  do_proccounts_rrd,  { NULL } },
+	{ "portcounts",  do_portcounts_rrd,  { NULL } },
+	{ "linecounts",  do_linecounts_rrd,  { NULL } },
+	{ "deltacounts", do_deltacounts_rrd, { NULL } },
+	{ "trends",      do_trends_rrd,      { NULL } },
+
+	{ "ifmib",       do_ifmib_rrd,       { NULL } },
 
 	/* z/OS, z/VSE, z/VM from Rich Smrcina */
-	else if (strcmp(id, "paging") == 0)      do_paging_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "mdc") == 0)         do_mdc_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "cics") == 0)        do_cics_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "getvis") == 0)      do_getvis_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "maxuser") == 0)     do_asid_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "nparts") == 0)      do_asid_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+	{ "paging",      do_paging_rrd,      { NULL }, 1 },
+	{ "mdc",         do_mdc_rrd,         { NULL }, 1 },
+	{ "cics",        do_cics_rrd,        { NULL }, 1 },
+	{ "getvis",      do_getvis_rrd,      { NULL }, 1 },
+	{ "maxuser",     do_asid_rrd,        { "nparts", NULL }, 1 },
 
 	/* 
 	 * These are from the hobbit-perl-client
 	 * NetApp check for netapp.pl, dbcheck.pl and beastat.pl scripts
 	 */
-	else if (strcmp(id, "xtstats") == 0)     do_netapp_extrastats_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "quotas") == 0)      do_disk_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "snapshot") == 0)    do_disk_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "TblSpace") == 0)    do_disk_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "stats") == 0)       do_netapp_stats_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "ops") == 0)         do_netapp_ops_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "cifs") == 0)        do_netapp_cifs_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "snaplist") == 0)    do_netapp_snaplist_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "snapmirr") == 0)    do_netapp_snapmirror_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "HitCache") == 0)    do_dbcheck_hitcache_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "Session") == 0)     do_dbcheck_session_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "RollBack") == 0)    do_dbcheck_rb_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "InvObj") == 0)      do_dbcheck_invobj_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "MemReq") == 0)      do_dbcheck_memreq_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "JVM") == 0)         do_beastat_jvm_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "JMS") == 0)         do_beastat_jms_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "JTA") == 0)         do_beastat_jta_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "ExecQueue") == 0)   do_beastat_exec_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
-	else if (strcmp(id, "JDBCConn") == 0)    do_beastat_jdbc_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+	{ "xtstats",     do_netapp_extrastats_rrd, { NULL }, 1 },
+	{ "quotas",      do_disk_rrd,              { "snapshot", "TblSpace", NULL }, 1 },
+	{ "stats",       do_netapp_stats_rrd,      { NULL }, 1 },
+	{ "ops",         do_netapp_ops_rrd,        { NULL }, 1 },
+	{ "cifs",        do_netapp_cifs_rrd,       { NULL }, 1 },
+	{ "snaplist",    do_netapp_snaplist_rrd,   { NULL }, 1 },
+	{ "snapmirr",    do_netapp_snapmirror_rrd, { NULL }, 1 },
+	{ "HitCache",    do_dbcheck_hitcache_rrd,  { NULL }, 1 },
+	{ "Session",     do_dbcheck_session_rrd,   { NULL }, 1 },
+	{ "RollBack",    do_dbcheck_rb_rrd,        { NULL }, 1 },
+	{ "InvObj",      do_dbcheck_invobj_rrd,    { NULL }, 1 },
+	{ "MemReq",      do_dbcheck_memreq_rrd,    { NULL }, 1 },
+	{ "JVM",         do_beastat_jvm_rrd,       { NULL }, 1 },
+	{ "JMS",         do_beastat_jms_rrd,       { NULL }, 1 },
+	{ "JTA",         do_beastat_jta_rrd,       { NULL }, 1 },
+	{ "ExecQueue",   do_beastat_exec_rrd,      { NULL }, 1 },
+	{ "JDBCConn",    do_beastat_jdbc_rrd,      { NULL }, 1 },
+
+	/* This is from the devmon SNMP collector */
+	{ "devmon",      do_devmon_rrd,      { NULL }, 1 },
+
+	{ NULL, NULL, { NULL } }
+};
+
+/* What an ID without a handler maps to, so TEST2RRD entries only need to be looked up once */
+static rrdhandler_t nohandler = { NULL, NULL, { NULL } };
+static rrdhandler_t externalhandler = { "external", do_external_rrd, { NULL }, 1 };
+
+static void * rrdhandlertree = NULL;
+
+void setup_rrdhandlers(void)
+{
+	rrdhandler_t *walk;
+	int i;
 
-	/*
-	 * This is from the devmon SNMP collector
-	 */
-	else if (strcmp(id, "devmon") == 0)      do_devmon_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+	rrdhandlertree = xtreeNew(strcmp);
+
+	for (walk = rrdhandlers; (walk->id); walk++) {
+		xtreeAdd(rrdhandlertree, walk->id, walk);
+		for (i = 0; (walk->aliases[i]); i++) xtreeAdd(rrdhandlertree, walk->aliases[i], walk);
+	}
 
-	else if (extids && exthandler) {
-		int i;
+	/* The built-in handlers take precedence over an external one */
+	if (extids && exthandler) {
+		for (i = 0; (extids[i]); i++) {
+			if (xtreeFind(rrdhandlertree, extids[i]) == xtreeEnd(rrdhandlertree))
+				xtreeAdd(rrdhandlertree, extids[i], &externalhandler);
+		}
+	}
+}
+
+static rrdhandler_t *find_rrdhandler(char *id)
+{
+	xtreePos_t handle;
+
+	if (!rrdhandlertree) setup_rrdhandlers();
+
+	handle = xtreeFind(rrdhandlertree, id);
+	return ((handle != xtreeEnd(rrdhandlertree)) ? (rrdhandler_t *)xtreeData(rrdhandlertree, handle) : &nohandler);
+}
 
-		for (i=0; (extids[i] && strcmp(extids[i], id)); i++) ;
+void update_rrd(char *hostname, char *testname, char *msg, time_t tstamp, char *sender, xymonrrd_t *ldef, char *classname, char *pagepaths)
+{
+	char *id;
+	rrdhandler_t *handler;
 
-		if (extids[i]) do_external_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+	if (ldef) {
+		/* Tests listed in TEST2RRD remember their handler */
+		id = ldef->xymonrrdname;
+		if (!ldef->rrdhandler) ldef->rrdhandler = find_rrdhandler(id);
+		handler = (rrdhandler_t *)ldef->rrdhandler;
 	}
+	else {
+		id = testname;
+		handler = find_rrdhandler(id);
+	}
+	senderip = sender;
+
+	/* The SNMP MIB's can be reloaded, so they are checked for each message - but only if needed */
+	if (handler->handler && !handler->aftermibs) handler->handler(hostname, testname, classname, pagepaths, msg, tstamp);
+	else if (is_snmpmib_rrd(id))               do_snmpmib_rrd(hostname, testname, classname, pagepaths, msg, tstamp);
+	else if (handler->handler)                 handler->handler(hostname, testname, classname, pagepaths, msg, tstamp);
 
 	senderip = NULL;
 }
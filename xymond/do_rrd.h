@@ -24,10 +24,24 @@ extern int releasecachedelay;
 extern int use_rrd_cache;
 extern int ext_rrd_cache;
 extern int no_rrd;
+extern int rrdwriters;
+extern int rrdwriterqueue;
+extern int rrdflushrate;
 extern void setup_exthandler(char *handlerpath, char *ids);
+extern void setup_rrdhandlers(void);
 extern void update_rrd(char *hostname, char *testname, char *restofmsg, time_t tstamp, char *sender, xymonrrd_t *ldef, char *classname, char *pagepaths);
 extern void rrdcacheflushall(void);
 extern void rrdcacheflushhost(char *hostname);
+extern void rrdcached_sendupdates(int force);
+extern int start_rrdwriters(void);
+extern void collect_rrdwriters(void);
+extern void drain_rrdwriters(void);
+extern void stop_rrdwriters(void);
+extern void report_rrdstatus(void);
+extern int rrdjournal_open(char *fn);
+extern void rrdjournal_sync(int force);
+extern void rrdjournal_close(void);
+extern void rrdflush_run(void);
 extern void setup_extprocessor(char *cmd);
 extern void shutdown_extprocessor(void);
 
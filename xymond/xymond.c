@@ -53,6 +53,7 @@ static char rcsid[] = "$Id$";
 #include <sys/shm.h>
 #include <sys/wait.h>
 #include <sys/msg.h>
+#include <pthread.h>
 
 #include "libxymon.h"
 
@@ -76,14 +77,11 @@ static char rcsid[] = "$Id$";
 /* How many subsequent messages 'modify' overrides are valid for - messages */
 #define DEFAULT_MODIFY_VALIDITY 3
 
-#define DEFAULT_PURPLE_INTERVAL 60
-int purplecheckinterval = DEFAULT_PURPLE_INTERVAL; /* Seconds - check for purples every 60s */
-
 #define DEFAULT_STATS_INTERVAL (5*60)
 int statsinterval = DEFAULT_STATS_INTERVAL;	/* Seconds - report xymond status every 5m */
 
 /* How long are sub-client messages valid */
-#define MAX_SUBCLIENT_LIFETIME ((DEFAULT_VALIDITY * 60) + (DEFAULT_PURPLE_INTERVAL*2)) /* 30 minutes + a bit */
+#define MAX_SUBCLIENT_LIFETIME ((DEFAULT_VALIDITY * 60) + 120)	/* 30 minutes + a bit */
 
 #define DEFAULT_FLAPCOUNT 5
 int flapcount = DEFAULT_FLAPCOUNT;
@@ -91,10 +89,14 @@ int flapthreshold = (DEFAULT_FLAPCOUNT+1)*5*60;	/* Seconds - if more than flapco
 
 #define DEFAULT_CHECKPOINT_INTERVAL 900
 int checkpointinterval = DEFAULT_CHECKPOINT_INTERVAL;	/* Seconds - how often to save checkpoint file */
+#define DEFAULT_CHECKPOINT_FULLINTERVAL 12
+int checkpointfullinterval = DEFAULT_CHECKPOINT_FULLINTERVAL;	/* Binary checkpoints: Journals between full snapshots */
 
 #define DEFAULT_RELOAD_INTERVAL 600
 int reloadinterval = DEFAULT_RELOAD_INTERVAL;	/* Seconds - how often to check hosts.cfg for changes */
 
+#define BFQBUDGETMAX 16		/* The backfeed portion grows to at most this many times BFQCHUNKSIZE */
+
 
 typedef struct ackinfo_t {
 	int level;
@@ -107,6 +109,7 @@ typedef struct ackinfo_t {
 typedef struct testinfo_t {
 	char *name;
 	int clientsave;
+	int id;			/* Index into the per-host logindex table, 0 if not indexed */
 } testinfo_t;
 
 enum modifytype_t { MODIFY_NORM, MODIFY_DOWN, MODIFY_UP };
@@ -136,9 +139,11 @@ typedef struct xymond_log_t {
 	time_t acktime;		/* time when test acknowledgement expires */
 	time_t redstart, yellowstart;
 	int maxackedcolor;	/* The most severe color that has been acked */
-	unsigned char *message;
+	unsigned char *message;	/* NULL while it is kept compressed, use log_message() */
 	unsigned char *line1;	/* The first line of the message, starting with color */
 	size_t msgsz;
+	char *zmessage;		/* The message with a "compress:TYPE SIZE" header, see --status-compression */
+	size_t zmsgsz;
 	unsigned char *dismsg, *ackmsg;
 	char *cookie;
 	time_t cookieexpires;
@@ -146,6 +151,9 @@ typedef struct xymond_log_t {
 	char  *modifierbuf;	/* nl-encoded list of all modifier messages (needed on channel posts, so we need it cached) */
 	ackinfo_t *acklist;	/* Holds list of acks */
 	unsigned long statuschangecount;
+	int expiryidx;		/* Position+1 in the expiry heap, 0 if not there */
+	int dirty;		/* Changed since the last binary checkpoint was written */
+	struct xymond_log_t *dirtynext;
 	struct xymond_log_t *next;
 } xymond_log_t;
 
@@ -162,9 +170,14 @@ typedef struct xymond_hostlist_t {
 	char *ip;
 	enum { H_NORMAL, H_SUMMARY } hosttype;
 	xymond_log_t *logs;
+	xymond_log_t **logindex;	/* Entries in logs list, indexed by the test id */
+	int logindexsize;
+	int colorcount[COL_COUNT+1];	/* Number of logs with each color, incl. NO_COLOR */
 	xymond_log_t *pinglog; /* Points to entry in logs list, but we need it often */
 	clientmsg_list_t *clientmsgs;
 	time_t clientmsgtstamp;
+	char *chnfields;	/* "CLASS|PAGEPATHS" for status channel messages, see status_hostfields() */
+	unsigned long chnfieldsgen;	/* hostsetgeneration when chnfields was made */
 } xymond_hostlist_t;
 
 typedef struct filecache_t {
@@ -184,6 +197,9 @@ void *rborigins;			/* The origins we have seen */
 void *rbcookies;			/* The cookies we use */
 void *rbfilecache;
 void *rbsenders;
+int lasttestid = 0;			/* The last id handed out to a test */
+unsigned long hostsetgeneration = 0;	/* Bumped whenever the hosts or their hosts.cfg data change */
+xarena_t *msgarena = NULL;		/* Scratch memory while handling a message */
 
 void *maintsenders = NULL;
 void *statussenders = NULL;
@@ -208,6 +224,9 @@ typedef struct conn_t {
 	int msgsz;
 	size_t buflen, bufsz;		/* Active and maximum length of buffer */
 	enum { NOTALK, RECEIVING, STARTTLSWAIT, RESPONDING } doingwhat;	/* Communications state (NOTALK, READING, RESPONDING) */
+	char **comboparts;		/* "combo" message already split by a parse thread */
+	int combopartcount;
+	struct boardcursor_t *board;	/* Rest of a xymondboard response, generated as it is sent */
 } conn_t;
 
 enum droprencmd_t { CMD_DROPHOST, CMD_DROPTEST, CMD_RENAMEHOST, CMD_RENAMETEST, CMD_DROPSTATE };
@@ -237,6 +256,10 @@ static int bfqchannels = 0;
 int bfqids[10];
 static char *bf_buf = NULL;
 static size_t bf_bufsz = 0;
+static xymond_bfring_t *bfring = NULL;		/* Backfeed ring, with --bfq-ring */
+static int bfringslots = 0;
+static int bfqbudget = 0;			/* Backfeed messages to handle before looking at TCP */
+static unsigned long netmsgcount = 0;		/* Messages received over the network */
 
 #define NO_COLOR (COL_COUNT)
 static char *colnames[COL_COUNT+1];
@@ -258,8 +281,18 @@ typedef struct multisrclist_t {
 void *rbmultisrc;
 
 enum ghosthandling_t ghosthandling = GH_LOG;
+static int renamedghosts = 0;			/* A host was renamed to a name not in hosts.cfg since the last reload */
 
 char *checkpointfn = NULL;
+enum { CHK_TEXT, CHK_BINARY } checkpointformat = CHK_TEXT;
+enum compressiontype_t checkpointcompression = COMP_PLAIN;
+enum compressiontype_t statuscompression = COMP_PLAIN;	/* Keep status messages compressed in memory */
+int statuscompressmin = 1024;				/* ... if they are at least this large */
+chkwriter_t *checkpointjournal = NULL;
+unsigned long long checkpointgeneration = 0;
+int checkpointsincefull = 0;
+int checkpointfull = 1;				/* Next binary checkpoint must be a full snapshot */
+struct xymond_log_t *dirtylogs = NULL;		/* Logs to include in the next checkpoint journal */
 FILE *dbgfd = NULL;
 char *dbghost = NULL;
 time_t boottimer = 0;
@@ -274,6 +307,20 @@ typedef struct xymond_statistics_t {
 	unsigned long netcount, bfqcount;
 } xymond_statistics_t;
 
+/*
+ * The command word at the start of a message. find_msgcmd() picks it
+ * once, and then it is both the index into xymond_stats[] and what
+ * do_message() uses to pick the handler. The order must match the
+ * xymond_stats[] table.
+ */
+enum msgcmd_t { MC_EXTCOMBO, MC_COMBODATA, MC_COMBO, MC_MODIFY, MC_STATUS, MC_DATA, MC_CLIENTSUBMIT, MC_CLIENTCONFIG,
+		MC_SUMMARY, MC_NOTES, MC_USERMSG, MC_ENABLE, MC_DISABLE, MC_CONFIG, MC_DOWNLOAD, MC_FLUSH, MC_RELOAD, MC_ROTATE,
+		MC_QUERY, MC_XYMONDLOG, MC_HOBBITDLOG, MC_XYMONDXLOG, MC_HOBBITDXLOG,
+		MC_XYMONDBOARD, MC_HOBBITDBOARD, MC_XYMONDXBOARD, MC_HOBBITDXBOARD, MC_HOSTINFO, MC_HISTSYNC,
+		MC_XYMONDACK, MC_HOBBITDACK, MC_ACK, MC_ACKINFO, MC_DROP, MC_RENAME, MC_DUMMY, MC_PING, MC_PROXYPING,
+		MC_NOTIFY, MC_SCHEDULE, MC_CLIENT, MC_CLIENTLOG, MC_GHOSTLIST, MC_MULTISRCLIST, MC_SENDERSTATS,
+		MC_XYMONDSTATS, MC_TIMEOUTS, MC_UNKNOWN };
+
 xymond_statistics_t xymond_stats[] = {
 	{ "extcombo", },
 	{ "combodata", },
@@ -312,6 +359,7 @@ xymond_statistics_t xymond_stats[] = {
 	{ "rename", },
 	{ "dummy", },
 	{ "ping", },
+	{ "proxyping", },
 	{ "notify", },
 	{ "schedule", },
 	{ "client", },
@@ -319,6 +367,7 @@ xymond_statistics_t xymond_stats[] = {
 	{ "ghostlist", },
 	{ "multisrclist", },
 	{ "senderstats", },
+	{ "xymondstats", },
 	{ "Timeouts", },
 	{ NULL, }
 };
@@ -381,6 +430,9 @@ enum filtertype_t { FILTER_XMH, FILTER_PAGEPATH, FILTER_TEST, FILTER_FIELD, FILT
 #define COMPARE_EQ	(1 << 4)
 #define COMPARE_NE	(1 << 5)
 #define COMPARE_INTVL	(1 << 29)
+#define FILTER_INHOSTSET	(1 << 30)	/* Already checked through a cached host set */
+
+#define MAX_TESTLIST 8		/* Tests matched by a test-filter we will look up directly in each host */
 
 typedef struct hostfilter_rec_t {
 	enum filtertype_t filtertype;
@@ -390,17 +442,50 @@ typedef struct hostfilter_rec_t {
 	enum boardfield_t boardfield;	/* Only for filtertype == FILTER_FIELD(TIME) */
 	unsigned int flags;	/* Private filter flags */
 	xtreePos_t handle;
+	char *wantedstr;	/* The pattern text, only for filtertype == FILTER_XMH and FILTER_PAGEPATH */
+	unsigned char *testmatch; int testmatchsize;	/* Result of wantedptn for each test id */
+	struct testinfo_t **testlist; int testlistcount;	/* The matching tests, or -1 if more than MAX_TESTLIST */
 } hostfilter_rec_t;
 
 
 #define CHANNELTERMINATOR "\n@@\n"
 #define CHANNELTERMINATORLEN 4		/* Length NOT including the terminating '\0' */
 
+/* Channels where several messages are combined into one post */
+unsigned int batchchannels = 0;
+size_t batchsize = 32768;	/* Post the batch when it holds this many bytes ... */
+int batchlatency = 100;		/* ... or when the oldest message in it is this old (milliseconds) */
+
+/* Threads that decompress and split up messages, see received_message() */
+static int parsethreads = 0;
+static int parsequeued = 0;	/* Only changed by the main thread */
+static unsigned long parsejobcount = 0, parsequeuefull = 0;
+
 /* Statistics counters */
 unsigned long msgs_total = 0;
 unsigned long msgs_total_last = 0;
 time_t last_stats_time = 0;
 
+/*
+ * Latency histograms (in microseconds) for the stages of handling a message,
+ * with --latency-stats. The stages nest: "message" includes "status", which
+ * includes "post", which includes "semwait".
+ */
+enum latstage_t { LAT_SELECT, LAT_DECOMPRESS, LAT_MESSAGE, LAT_STATUS, LAT_POST, LAT_SEMWAIT, LAT_CHECKPOINT, LAT_COUNT };
+static char *latstagenames[LAT_COUNT] = { "select", "decompress", "message", "status", "post", "semwait", "checkpoint" };
+static histogram_t *lathist[LAT_COUNT];
+static int latencystats = 0;
+static struct timespec selectstart;
+
+#define LATENCY_START(t) do { if (latencystats) getntimer(&(t)); } while (0)
+#define LATENCY_END(stage, t) do { if (latencystats) histogram_add(lathist[stage], ntimerus(&(t), NULL)); } while (0)
+
+/* Channel messages per second, over the last full minute */
+#define CHANNELRATE_INTERVAL 60
+static unsigned long chnratecount[C_LAST];
+static double chnrate[C_LAST];
+static time_t nextchnrate = 0;
+
 /* List of scheduled (future) tasks */
 typedef struct scheduletask_t {
 	int id;
@@ -412,31 +497,73 @@ typedef struct scheduletask_t {
 scheduletask_t *schedulehead = NULL;
 int nextschedid = 1;
 
-void update_statistics(char *cmd, int viabfq)
+/*
+ * Hash table for find_msgcmd(), with the index of each command in
+ * xymond_stats[]. The multiplier was picked so the current commands all
+ * get a slot of their own, so a lookup is one hash of the command word
+ * and one compare. A command added later that collides still works; it
+ * just ends up in the next free slot.
+ */
+#define MSGCMD_HASHBITS 7
+#define MSGCMD_HASHSIZE (1 << MSGCMD_HASHBITS)
+static signed char msgcmd_hash[MSGCMD_HASHSIZE];
+
+static unsigned int msgcmd_hashval(char *cmd, int len)
 {
+	unsigned int h = 0;
 	int i;
 
-	dbgprintf("-> update_statistics\n");
+	for (i = 0; (i < len); i++) h = (h * 31) + (unsigned char)cmd[i];
+	return ((h * 12853U) & 0xFFFFFFFFU) >> (32 - MSGCMD_HASHBITS);
+}
 
-	if (!cmd) {
-		dbgprintf("No command for update_statistics\n");
-		return;
+void setup_msgcmd(void)
+{
+	int i;
+	unsigned int h;
+
+	memset(msgcmd_hash, -1, sizeof(msgcmd_hash));
+	for (i = 0; (i < MC_TIMEOUTS); i++) {
+		h = msgcmd_hashval(xymond_stats[i].cmd, strlen(xymond_stats[i].cmd));
+		while (msgcmd_hash[h] != -1) h = ((h + 1) & (MSGCMD_HASHSIZE - 1));
+		msgcmd_hash[h] = i;
+	}
+}
+
+enum msgcmd_t find_msgcmd(char *msg)
+{
+	/* The command word is the lowercase letters up to the first space, "+", "/" etc. */
+	int len;
+	unsigned int h;
+
+	for (len = 0; ((msg[len] >= 'a') && (msg[len] <= 'z')); len++) ;
+	if (len == 0) return MC_UNKNOWN;
+
+	for (h = msgcmd_hashval(msg, len); (msgcmd_hash[h] != -1); h = ((h + 1) & (MSGCMD_HASHSIZE - 1))) {
+		char *cmd = xymond_stats[(int)msgcmd_hash[h]].cmd;
+
+		if ((strncmp(cmd, msg, len) == 0) && (cmd[len] == '\0')) return msgcmd_hash[h];
 	}
 
+	return MC_UNKNOWN;
+}
+
+void update_statistics(enum msgcmd_t cmd, char *msg, int viabfq)
+{
+	dbgprintf("-> update_statistics\n");
+
 	msgs_total++;
 
-	i = 0;
-	while (xymond_stats[i].cmd && strncmp(xymond_stats[i].cmd, cmd, strlen(xymond_stats[i].cmd))) { i++; }
 	if (viabfq)
-		xymond_stats[i].bfqcount++;
+		xymond_stats[cmd].bfqcount++;
 	else {
-		xymond_stats[i].netcount++;
+		xymond_stats[cmd].netcount++;
 	}
 
-	if (!xymond_stats[i].cmd) {
-		char *eoln = strchr(cmd, '\n');
+	if ((cmd == MC_UNKNOWN) && msg) {
+		char *eoln = strchr(msg, '\n');
 		if (eoln) *eoln = '\0';
-		errprintf("Bogus message %s\n", cmd);
+		errprintf("Bogus message %s\n", msg);
 		if (eoln) *eoln = '\n';
 	}
 
@@ -530,6 +657,65 @@ char *generate_stats(void)
 	sprintf(msgline, "user   channel messages: %10ld (%d readers)\n", userchn->msgcount, clients);
 	addtobuffer(statsbuf, msgline);
 
+	{
+		xymond_channel_t *chnlist[] = { statuschn, stachgchn, pagechn, datachn, noteschn, enadischn, clientchn, clichgchn, userchn, NULL };
+		int c, r, anyring = 0;
+
+		if (parsethreads) {
+			sprintf(msgline, "\nParse threads: %d, %lu messages queued, queue full %lu times, %d pending\n",
+				parsethreads, parsejobcount, parsequeuefull, parsequeued);
+			addtobuffer(statsbuf, msgline);
+		}
+
+		if (bfring) {
+			sprintf(msgline, "\nBackfeed ring: %lu messages posted, %lu refused (ring full), %lu KB pending; %d messages per turn\n",
+				bfring->posted, bfring->full, (bfring->reserved - bfring->tail) / 1024, bfqbudget);
+			addtobuffer(statsbuf, msgline);
+		}
+
+		if (batchchannels) addtobuffer(statsbuf, "\nBatched channel posts:\n");
+		for (c = 0; (chnlist[c]); c++) {
+			if (!chnlist[c]->batchbuf) continue;
+
+			sprintf(msgline, "- %-6s : %10lu posts for %10lu messages\n", 
+				channelnames[chnlist[c]->channelid], chnlist[c]->batchposts, chnlist[c]->msgcount);
+			addtobuffer(statsbuf, msgline);
+		}
+
+		for (c = 0; (chnlist[c]); c++) {
+			xymond_ring_t *ring = chnlist[c]->ring;
+
+			if (!ring) continue;
+
+			if (!anyring) {
+				addtobuffer(statsbuf, "\nRing channel readers:\n");
+				anyring = 1;
+			}
+			for (r = 0; (r < RING_MAXREADERS); r++) {
+				if (ring->readers[r].pid == 0) continue;
+
+				sprintf(msgline, "- %-6s pid %-8d: %10lu msgs, %10lu dropped, lag %lu KB\n",
+					channelnames[chnlist[c]->channelid], (int)ring->readers[r].pid,
+					ring->readers[r].msgs, ring->readers[r].drops,
+					(ring->head - ring->readers[r].tail) / 1024);
+				addtobuffer(statsbuf, msgline);
+			}
+		}
+	}
+
+	if (latencystats) {
+		addtobuffer(statsbuf, "\nLatency (microseconds):   count        p50        p99        max\n");
+		for (i = 0; (i < LAT_COUNT); i++) {
+			sprintf(msgline, "- %-10s : %10llu %10llu %10llu %10llu\n", lathist[i]->name, lathist[i]->count,
+				histogram_percentile(lathist[i], 50.0), histogram_percentile(lathist[i], 99.0), lathist[i]->max);
+			addtobuffer(statsbuf, msgline);
+		}
+	}
+
+	sprintf(msgline, "\nMessage scratch memory: %lu allocations, %lu of them from the heap, %lu KB arena\n",
+		msgarena->allocs, msgarena->heapallocs, (unsigned long)(msgarena->blocksz / 1024));
+	addtobuffer(statsbuf, msgline);
+
 	ghandle = xtreeFirst(rbghosts);
 	if (ghandle != xtreeEnd(rbghosts)) addtobuffer(statsbuf, "\n\nGhost reports (last 10m):\n");
 	for (; (ghandle != xtreeEnd(rbghosts)); ghandle = xtreeNext(rbghosts, ghandle)) {
@@ -563,6 +749,110 @@ char *generate_stats(void)
 	return STRBUF(statsbuf);
 }
 
+static void latency_wait(int waiting)
+{
+	/* Called by conn_process() around the wait for network I/O */
+	if (waiting) getntimer(&selectstart);
+	else histogram_add(lathist[LAT_SELECT], ntimerus(&selectstart, NULL));
+}
+
+static void update_channelrates(time_t now)
+{
+	xymond_channel_t *chnlist[] = { statuschn, stachgchn, pagechn, datachn, noteschn, enadischn, clientchn, clichgchn, userchn, NULL };
+	int c;
+
+	if (now < nextchnrate) return;
+
+	for (c = 0; (chnlist[c]); c++) {
+		enum msgchannels_t id = chnlist[c]->channelid;
+
+		if (nextchnrate) chnrate[id] = (double)(chnlist[c]->msgcount - chnratecount[id]) / (CHANNELRATE_INTERVAL + (now - nextchnrate));
+		chnratecount[id] = chnlist[c]->msgcount;
+	}
+
+	nextchnrate = now + CHANNELRATE_INTERVAL;
+}
+
+void generate_xymondstats(strbuffer_t *resp)
+{
+	/*
+	 * The "xymondstats" response. One record per line, fields separated by "|":
+	 *   xymondstats|FORMATVERSION|NOW|UPTIME|LATENCYSTATS(0/1)
+	 *   messages|TOTAL|NET|BFQ
+	 *   channel|NAME|MSGS|MSGS/SEC|READERS|LAGMSGS|LAGBYTES|DROPS
+	 *   latency|STAGE|COUNT|SUM|MIN|MAX|P50|P90|P99|P99.9
+	 *   buckets|STAGE|LOW:COUNT LOW:COUNT ...
+	 * Latencies are in microseconds. The lag and drops are only known for
+	 * ring channels (the sum over all readers); they are "-" for the others.
+	 */
+	xymond_channel_t *chnlist[] = { statuschn, stachgchn, pagechn, datachn, noteschn, enadischn, clientchn, clichgchn, userchn, NULL };
+	unsigned long net_total = 0, bfq_total = 0;
+	char msgline[1024];
+	int i, c, r;
+
+	snprintf(msgline, sizeof(msgline), "xymondstats|1|%ld|%ld|%d\n", 
+		 (long)getcurrenttime(NULL), (long)(gettimer() - boottimer), latencystats);
+	addtobuffer(resp, msgline);
+
+	for (i = 0; (xymond_stats[i].cmd); i++) {
+		net_total += xymond_stats[i].netcount;
+		bfq_total += xymond_stats[i].bfqcount;
+	}
+	snprintf(msgline, sizeof(msgline), "messages|%lu|%lu|%lu\n", msgs_total, net_total, bfq_total);
+	addtobuffer(resp, msgline);
+
+	for (c = 0; (chnlist[c]); c++) {
+		xymond_channel_t *chn = chnlist[c];
+
+		if (chn->ring) {
+			unsigned long lagmsgs = 0, lagbytes = 0, drops = 0;
+			int readers = 0;
+
+			for (r = 0; (r < RING_MAXREADERS); r++) {
+				if (chn->ring->readers[r].pid == 0) continue;
+
+				readers++;
+				lagmsgs += (chn->ring->msgseq - chn->ring->readers[r].lastseq);
+				lagbytes += (chn->ring->head - chn->ring->readers[r].tail);
+				drops += chn->ring->readers[r].drops;
+			}
+			snprintf(msgline, sizeof(msgline), "channel|%s|%lu|%.2f|%d|%lu|%lu|%lu\n",
+				 channelnames[chn->channelid], chn->msgcount, chnrate[chn->channelid], readers,
+				 lagmsgs, lagbytes, drops);
+		}
+		else {
+			snprintf(msgline, sizeof(msgline), "channel|%s|%lu|%.2f|%d|-|-|-\n",
+				 channelnames[chn->channelid], chn->msgcount, chnrate[chn->channelid], 
+				 semctl(chn->semid, CLIENTCOUNT, GETVAL));
+		}
+		addtobuffer(resp, msgline);
+	}
+
+	if (!latencystats) return;
+
+	for (i = 0; (i < LAT_COUNT); i++) {
+		histogram_t *h = lathist[i];
+		int b;
+
+		snprintf(msgline, sizeof(msgline), "latency|%s|%llu|%llu|%llu|%llu|%llu|%llu|%llu|%llu\n",
+			 h->name, h->count, h->sum, (h->count ? h->min : 0), h->max,
+			 histogram_percentile(h, 50.0), histogram_percentile(h, 90.0),
+			 histogram_percentile(h, 99.0), histogram_percentile(h, 99.9));
+		addtobuffer(resp, msgline);
+
+		addtobuffer(resp, "buckets|");
+		addtobuffer(resp, h->name);
+		addtobuffer(resp, "|");
+		for (b = 0; (b < HISTOGRAM_BUCKETS); b++) {
+			if (h->buckets[b] == 0) continue;
+
+			snprintf(msgline, sizeof(msgline), "%llu:%lu ", histogram_bucketlow(b), h->buckets[b]);
+			addtobuffer(resp, msgline);
+		}
+		addtobuffer(resp, "\n");
+	}
+}
+
 
 char *totalclientmsg(clientmsg_list_t *msglist)
 {
@@ -600,6 +890,7 @@ xymond_hostlist_t *create_hostlist_t(char *hostname, char *ip)
 	if (strcmp(hostname, "summary") == 0) hitem->hosttype = H_SUMMARY;
 	else hitem->hosttype = H_NORMAL;
 	xtreeAdd(rbhosts, hitem->hostname, hitem);
+	hostsetgeneration++;
 
 	return hitem;
 }
@@ -612,38 +903,59 @@ testinfo_t *create_testinfo(char *name)
 	newrec->name = strdup(name);
 	dbgprintf(" -- create_testinfo for %s\n", name);
 	newrec->clientsave = clientsavedisk;
+	newrec->id = ++lasttestid;
 	xtreeAdd(rbtests, newrec->name, newrec);
 
 	return newrec;
 }
 
-void posttochannel(xymond_channel_t *channel, char *channelmarker, 
-		   char *msg, char *sender, char *hostname, xymond_log_t *log, char *readymsg)
+xymond_log_t *host_findlog(xymond_hostlist_t *hrec, testinfo_t *test)
 {
-	struct sembuf s;
-	int clients;
-	int n;
-	struct timeval tstamp;
-	struct timezone tz;
-	int semerr = 0;
-	unsigned int bufsz = channel->maxsize;	/* only master ever posts */
-	size_t bufmax = bufsz - CHANNELTERMINATORLEN - 1;	/* Terminating \0 */
-	size_t originalsize, byteswritten = 0;
-	void *hi;
-	char *pagepath, *classname, *osname;
-	time_t timeroffset = (getcurrenttime(NULL) - gettimer());
+	/* Returns the first log in hrec->logs for this test */
+	if ((test->id <= 0) || (test->id >= hrec->logindexsize)) return NULL;
+	return hrec->logindex[test->id];
+}
 
-	dbgprintf("-> posttochannel\n");
+void host_reindexlog(xymond_hostlist_t *hrec, testinfo_t *test)
+{
+	/* Must be called when a log for this test has been linked into or out of the hrec->logs list */
+	xymond_log_t *lwalk;
 
-	/* First see how many users are on this channel */
-	clients = semctl(channel->semid, CLIENTCOUNT, GETVAL);
-	if (clients == 0) {
-		dbgprintf("Dropping %s message - no readers on %s channel\n", channelmarker, channelnames[channel->channelid]);
-		return;
+	if (test->id <= 0) return;
+
+	if (test->id >= hrec->logindexsize) {
+		int newsize = ((lasttestid / 16) + 1) * 16;
+
+		hrec->logindex = (xymond_log_t **)realloc(hrec->logindex, newsize * sizeof(xymond_log_t *));
+		memset(hrec->logindex + hrec->logindexsize, 0, (newsize - hrec->logindexsize) * sizeof(xymond_log_t *));
+		hrec->logindexsize = newsize;
 	}
 
+	/* A new log is linked in at the head of the list, so this is usually a short walk */
+	for (lwalk = hrec->logs; (lwalk && (lwalk->test != test)); lwalk = lwalk->next) ;
+	hrec->logindex[test->id] = lwalk;
+}
+
+void log_setcolor(xymond_log_t *log, int color)
+{
+	/* Keeps the per-host color counts in sync. log->color must already be counted */
+	log->host->colorcount[log->color]--;
+	log->color = color;
+	log->host->colorcount[color]++;
+}
+
+static int waitboard(xymond_channel_t *channel, char *channelmarker)
+{
+	/* 
+	 * Wait for BOARDBUSY to go low, i.e. the readers are done with the previous message.
+	 * Returns 0 if we may write to channelbuf, -1 if not.
+	 */
+	struct sembuf s;
+	int n;
+	int semerr = 0;
+	struct timespec waitstart;
+
 	/* 
-	 * Wait for BOARDBUSY to go low.
 	 * We need a loop here, because if we catch a signal
 	 * while waiting on the semaphore, then we need to
 	 * re-start the semaphore wait. Otherwise we may
@@ -651,6 +963,7 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 	 * (GOCLIENT goes up while a worker waits for it 
 	 *  to go to 0).
 	 */
+	LATENCY_START(waitstart);
 	gotalarm = 0; alarm(5);
 	do {
 		s.sem_num = BOARDBUSY; s.sem_op = 0; s.sem_flg = 0;
@@ -661,7 +974,8 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 		}
 	} while ((n == -1) && (semerr == EINTR) && running && !gotalarm);
 	alarm(0);
-	if (!running) return;
+	LATENCY_END(LAT_SEMWAIT, waitstart);
+	if (!running) return -1;
 
 	/* Check if the alarm fired */
 	if (gotalarm) {
@@ -670,22 +984,143 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 			  semctl(channel->semid, BOARDBUSY, GETNCNT),
 			  semctl(channel->semid, BOARDBUSY, GETPID),
 			  semctl(channel->semid, CLIENTCOUNT, GETVAL));
-		return;
+		return -1;
 	}
 
 	/* Check if we failed to grab the semaphore */
 	if (n == -1) {
 		errprintf("Dropping %s message due to semaphore error\n", channelmarker);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void postboard(xymond_channel_t *channel)
+{
+	/* Tell the readers that a new message is waiting in channelbuf */
+	struct sembuf s;
+	int clients;
+	int n;
+
+	clients = semctl(channel->semid, CLIENTCOUNT, GETVAL); /* Get it again, maybe changed since last check */
+	dbgprintf("Posting message %u to %d readers\n", channel->seq, clients);
+	/* Up BOARDBUSY */
+	s.sem_num = BOARDBUSY; 
+	s.sem_op = (clients - semctl(channel->semid, BOARDBUSY, GETVAL)); 
+	if (s.sem_op <= 0) {
+		errprintf("How did this happen? clients=%d, s.sem_op=%d\n", clients, s.sem_op);
+		s.sem_op = clients;
+	}
+	s.sem_flg = 0;
+	n = semop(channel->semid, &s, 1);
+
+	/* Make sure GOCLIENT is 0 */
+	n = semctl(channel->semid, GOCLIENT, GETVAL);
+	if (n > 0) {
+		errprintf("Oops ... GOCLIENT is high (%d)\n", n);
+	}
+
+	s.sem_num = GOCLIENT; s.sem_op = clients; s.sem_flg = 0; 		/* Up GOCLIENT */
+	n = semop(channel->semid, &s, 1);
+}
+
+static void flushbatch(xymond_channel_t *channel, int force)
+{
+	/* Post the batched messages, if there are any and the oldest one has waited long enough */
+	if ((channel->batchbuf == NULL) || (channel->batchcount == 0)) return;
+
+	if (!force) {
+		struct timespec now;
+		long waitms;
+
+		getntimer(&now);
+		waitms = (now.tv_sec - channel->batchstart.tv_sec)*1000 + (now.tv_nsec - channel->batchstart.tv_nsec)/1000000;
+		if (waitms < batchlatency) return;
+	}
+
+	dbgprintf("Posting batch of %d messages (%zu bytes) on %s channel\n", 
+		  channel->batchcount, channel->batchlen, channelnames[channel->channelid]);
+	if (channel->ring) {
+		ring_post(channel, channel->batchbuf, channel->batchlen);
+	}
+	else if (waitboard(channel, channelnames[channel->channelid]) == 0) {
+		memcpy(channel->channelbuf, channel->batchbuf, channel->batchlen);
+		*(channel->channelbuf + channel->batchlen) = '\0';
+		postboard(channel);
+	}
+	channel->batchposts++;
+	channel->batchlen = 0;
+	channel->batchcount = 0;
+}
+
+static char *status_hostfields(xymond_hostlist_t *host)
+{
+	/*
+	 * The class and page paths of a host only change when hosts.cfg is
+	 * reloaded or a client reports its class, and both bump hostsetgeneration.
+	 * So keep them formatted instead of looking them up for every status.
+	 */
+	if (!host->chnfields || (host->chnfieldsgen != hostsetgeneration)) {
+		void *hi = hostinfo(host->hostname);
+		char *pagepath = (hi ? xmh_item(hi, XMH_ALLPAGEPATHS) : "");
+		char *classname = (hi ? xmh_item(hi, XMH_CLASS) : "");
+
+		if (!pagepath) pagepath = "";
+		if (!classname) classname = "";
+		if (host->chnfields) xfree(host->chnfields);
+		host->chnfields = (char *)malloc(strlen(classname) + strlen(pagepath) + 2);
+		sprintf(host->chnfields, "%s|%s", classname, pagepath);
+		host->chnfieldsgen = hostsetgeneration;
+	}
+
+	return host->chnfields;
+}
+
+void posttochannel(xymond_channel_t *channel, char *channelmarker, 
+		   char *msg, char *sender, char *hostname, xymond_log_t *log, char *readymsg)
+{
+	int clients;
+	struct timeval tstamp;
+	struct timezone tz;
+	char *outbuf;
+	unsigned int bufsz = channel->maxsize;	/* only master ever posts */
+	size_t bufmax = bufsz - CHANNELTERMINATORLEN - 1;	/* Terminating \0 */
+	size_t originalsize, byteswritten = 0;
+	char *body = NULL;	/* Status and stachg messages: Appended to the header in outbuf */
+	size_t bodylen = 0;
+	void *hi;
+	char *pagepath, *classname, *osname;
+	time_t timeroffset = (getcurrenttime(NULL) - gettimer());
+	struct timespec poststart;
+
+	dbgprintf("-> posttochannel\n");
+	LATENCY_START(poststart);
+
+	/* First see how many users are on this channel */
+	clients = (channel->ring ? ring_readercount(channel) : semctl(channel->semid, CLIENTCOUNT, GETVAL));
+	if (clients == 0) {
+		dbgprintf("Dropping %s message - no readers on %s channel\n", channelmarker, channelnames[channel->channelid]);
 		return;
 	}
 
+	if (channel->batchbuf) {
+		/* Batching: Format the message at the end of the current batch */
+		outbuf = channel->batchbuf + channel->batchlen;
+	}
+	else {
+		/* With the ring transport there is nothing to wait for; channelbuf is just our scratch space */
+		if (!channel->ring && (waitboard(channel, channelmarker) != 0)) return;
+		outbuf = channel->channelbuf;
+	}
+
 	/* All clear, post the message */
 	if (channel->seq == 999999) channel->seq = 0;
 	channel->seq++;
 	channel->msgcount++;
 	gettimeofday(&tstamp, &tz);
 	if (readymsg) {
-		byteswritten = snprintf(channel->channelbuf, bufmax,
+		byteswritten = snprintf(outbuf, bufmax,
 			    "@@%s#%u/%s|%d.%06d|%s|%s", 
 			    channelmarker, channel->seq, 
 			    (hostname ? hostname : "*"), 
@@ -697,20 +1132,15 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 			p = strchr(overmsg, '\n'); if (p) *p = '\0';
 			errprintf("Oversize %s msg from %s truncated (n=%d, limit %d)\nFirst line: %s\n", 
 				   channelmarker, sender, byteswritten, bufsz, overmsg);
-			*(channel->channelbuf + bufmax) = '\0';
+			*(outbuf + bufmax) = '\0';
 			byteswritten = bufmax;
 		}
 	}
 	else {
 		switch(channel->channelid) {
 		  case C_STATUS:
-			hi = hostinfo(hostname);
-			pagepath = (hi ? xmh_item(hi, XMH_ALLPAGEPATHS) : "");
-			classname = (hi ? xmh_item(hi, XMH_CLASS) : "");
-			if (!classname) classname = "";
-
-			byteswritten = snprintf(channel->channelbuf, bufmax,
-				"@@%s#%u/%s|%d.%06d|%s|%s|%s|%s|%d|%s|%s|%s|%d|%d|%s|%d|%s|%d|%s|%s|%d|%s\n%s", 
+			byteswritten = snprintf(outbuf, bufmax,
+				"@@%s#%u/%s|%d.%06d|%s|%s|%s|%s|%d|%s|%s|%s|%d|%d|%s|%d|%s|%d|%s|%d|%s\n", 
 				channelmarker, channel->seq, hostname, 		/*  0 */
 				(int) tstamp.tv_sec, (int) tstamp.tv_usec,	/*  1 */
 				sender, 					/*  2 */
@@ -725,23 +1155,15 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 				(int)log->acktime, nlencode(log->ackmsg),	/* 11+12 */
 				(int)log->enabletime, nlencode(log->dismsg),	/* 13+14 */
 				(int)(log->host->clientmsgtstamp + timeroffset), /* 15 */
-				classname,					/* 16 */
-				pagepath,					/* 17 */
+				status_hostfields(log->host),			/* 16+17 */
 				(int)log->flapping,				/* 18 */
-				(log->modifiers ? log->modifierbuf : ""),	/* 19 */
-				msg);						/* 20 */
-
-			if (byteswritten > bufmax) {
-				errprintf("Oversize status msg from %s for %s:%s truncated (n=%d, limit=%d)\n", 
-					sender, hostname, log->test->name, byteswritten, bufsz);
-				*(channel->channelbuf + bufmax) = '\0';
-				byteswritten = bufmax;
-			}
+				(log->modifiers ? log->modifierbuf : ""));	/* 19 */
+			body = msg;						/* 20 */
 			break;
 
 		  case C_STACHG:
-			byteswritten = snprintf(channel->channelbuf, bufmax,
-				"@@%s#%u/%s|%d.%06d|%s|%s|%s|%s|%d|%s|%s|%d|%d|%s|%d|%d|%s\n%s", 
+			byteswritten = snprintf(outbuf, bufmax,
+				"@@%s#%u/%s|%d.%06d|%s|%s|%s|%s|%d|%s|%s|%d|%d|%s|%d|%d|%s\n", 
 				channelmarker, channel->seq, hostname, 		/*  0 */
 				(int) tstamp.tv_sec, (int) tstamp.tv_usec,	/*  1 */
 				sender,						/*  2 */ 
@@ -755,19 +1177,12 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 				(int)log->enabletime, nlencode(log->dismsg),	/* 10+11 */
 				log->downtimeactive,				/* 12 */
 				(int) (log->host->clientmsgtstamp + timeroffset), /* 13 */
-				(log->modifiers ? log->modifierbuf : ""),	/* 14 */
-				msg);						/* 15 */
-
-			if (byteswritten > bufmax) {
-				errprintf("Oversize stachg msg from %s for %s:%s truncated (n=%d, limit=%d)\n", 
-					sender, hostname, log->test->name, byteswritten, bufsz);
-				*(channel->channelbuf + bufmax) = '\0';
-				byteswritten = bufmax;
-			}
+				(log->modifiers ? log->modifierbuf : ""));	/* 14 */
+			body = msg;						/* 15 */
 			break;
 
 		  case C_CLICHG:
-			byteswritten = snprintf(channel->channelbuf, bufmax,
+			byteswritten = snprintf(outbuf, bufmax,
 				"@@%s#%u/%s|%d.%06d|%s|%s|%d\n%s",
 				channelmarker, channel->seq, hostname, (int) tstamp.tv_sec, (int) tstamp.tv_usec,
 				sender, hostname, (int) (log->host->clientmsgtstamp + timeroffset), 
@@ -775,14 +1190,14 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 			if (byteswritten > bufmax) {
 				errprintf("Oversize clichg msg from %s for %s truncated (n=%d, limit=%d)\n", 
 					sender, hostname, byteswritten, bufsz);
-				*(channel->channelbuf + bufmax) = '\0';
+				*(outbuf + bufmax) = '\0';
 				byteswritten = bufmax;
 			}
 			break;
 
 		  case C_PAGE:
 			if (strcmp(channelmarker, "ack") == 0) {
-				byteswritten = snprintf(channel->channelbuf, bufmax,
+				byteswritten = snprintf(outbuf, bufmax,
 					"@@%s#%u/%s|%d.%06d|%s|%s|%s|%s|%d\n%s", 
 					channelmarker, channel->seq, hostname, (int) tstamp.tv_sec, (int) tstamp.tv_usec,
 					sender, hostname, 
@@ -797,7 +1212,7 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 				if (!classname) classname = "";
 				if (!osname) osname = "";
 
-				byteswritten = snprintf(channel->channelbuf, bufmax,
+				byteswritten = snprintf(outbuf, bufmax,
 					"@@%s#%u/%s|%d.%06d|%s|%s|%s|%s|%d|%s|%s|%d|%s|%s|%s|%s|%s|%s\n%s", 
 					channelmarker, channel->seq, hostname, (int) tstamp.tv_sec, (int) tstamp.tv_usec,
 					sender, hostname, 
@@ -814,7 +1229,7 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 			if (byteswritten > bufmax) {
 				errprintf("Oversize page/ack/notify msg from %s for %s:%s truncated (n=%d, limit=%d)\n", 
 					sender, hostname, (log->test->name ? log->test->name : "<none>"), byteswritten, bufsz);
-				*(channel->channelbuf + bufmax) = '\0';
+				*(outbuf + bufmax) = '\0';
 				byteswritten = bufmax;
 			}
 			break;
@@ -826,7 +1241,7 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 
 		  case C_NOTES:
 		  case C_USER:
-			byteswritten = snprintf(channel->channelbuf, bufmax,
+			byteswritten = snprintf(outbuf, bufmax,
 				"@@%s#%u/%s|%d.%06d|%s|%s\n%s", 
 				channelmarker, channel->seq, hostname, (int) tstamp.tv_sec, (int) tstamp.tv_usec,
 				sender, hostname, msg);
@@ -834,7 +1249,7 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 				errprintf("Oversize %s msg from %s for %s truncated (n=%d, limit=%d)\n", 
 					((channel->channelid == C_NOTES) ? "notes" : "user"), 
 					sender, hostname, byteswritten, bufsz);
-				*(channel->channelbuf + bufmax) = '\0';
+				*(outbuf + bufmax) = '\0';
 				byteswritten = bufmax;
 			}
 			break;
@@ -844,14 +1259,14 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 				char *dism = "";
 
 				if (log->dismsg) dism = nlencode(log->dismsg);
-				byteswritten = snprintf(channel->channelbuf, bufmax,
+				byteswritten = snprintf(outbuf, bufmax,
 						"@@%s#%u/%s|%d.%06d|%s|%s|%s|%d|%s",
 						channelmarker, channel->seq, hostname, (int) tstamp.tv_sec, (int)tstamp.tv_usec,
 						sender, hostname, log->test->name, (int) log->enabletime, dism);
 				if (byteswritten > bufmax) {
 					errprintf("Oversize enadis msg from %s for %s:%s truncated (n=%d, limit=%d)\n", 
 							sender, hostname, log->test->name, byteswritten, bufsz);
-					*(channel->channelbuf + bufmax) = '\0';
+					*(outbuf + bufmax) = '\0';
 					byteswritten = bufmax;
 				}
 			}
@@ -863,35 +1278,69 @@ void posttochannel(xymond_channel_t *channel, char *channelmarker,
 		}
 	}
 
+	if (body) {
+		/*
+		 * The header is in outbuf, now add the message body. It is copied
+		 * only once: Into outbuf, or straight into the ring.
+		 */
+		bodylen = strlen(body);
+		if ((byteswritten + bodylen) > bufmax) {
+			errprintf("Oversize %s msg from %s for %s:%s truncated (n=%zu, limit=%d)\n", 
+				channelmarker, sender, hostname, log->test->name, byteswritten + bodylen, bufsz);
+			if (byteswritten > bufmax) byteswritten = bufmax;
+			bodylen = bufmax - byteswritten;
+		}
+
+		if (channel->ring && !channel->batchbuf) {
+			struct iovec iov[3];
+
+			iov[0].iov_base = outbuf; iov[0].iov_len = byteswritten;
+			iov[1].iov_base = body; iov[1].iov_len = bodylen;
+			iov[2].iov_base = (char *)CHANNELTERMINATOR; iov[2].iov_len = CHANNELTERMINATORLEN;
+			dbgprintf("Posting message %u to %s ring\n", channel->seq, channelnames[channel->channelid]);
+			ring_postv(channel, iov, 3);
+			LATENCY_END(LAT_POST, poststart);
+			dbgprintf("<- posttochannel\n");
+			return;
+		}
+
+		memcpy(outbuf+byteswritten, body, bodylen);
+		byteswritten += bodylen;
+	}
+
 	/* Terminate the message */
 		// We don't actually need to do this now since we're memcpy'ing directly over the end
-		// *(channel->channelbuf + bufmax) = '\0';
+		// *(outbuf + bufmax) = '\0';
 		// byteswritten = bufmax;
-	memcpy(channel->channelbuf+byteswritten, CHANNELTERMINATOR, CHANNELTERMINATORLEN);
-	*(channel->channelbuf + byteswritten + CHANNELTERMINATORLEN) = '\0';
+	memcpy(outbuf+byteswritten, CHANNELTERMINATOR, CHANNELTERMINATORLEN);
+	*(outbuf + byteswritten + CHANNELTERMINATORLEN) = '\0';
 
-	/* Let the readers know it is there.  */
-	clients = semctl(channel->semid, CLIENTCOUNT, GETVAL); /* Get it again, maybe changed since last check */
-	dbgprintf("Posting message %u to %d readers\n", channel->seq, clients);
-	/* Up BOARDBUSY */
-	s.sem_num = BOARDBUSY; 
-	s.sem_op = (clients - semctl(channel->semid, BOARDBUSY, GETVAL)); 
-	if (s.sem_op <= 0) {
-		errprintf("How did this happen? clients=%d, s.sem_op=%d\n", clients, s.sem_op);
-		s.sem_op = clients;
-	}
-	s.sem_flg = 0;
-	n = semop(channel->semid, &s, 1);
+	if (channel->batchbuf) {
+		size_t reclen = byteswritten + CHANNELTERMINATORLEN;
 
-	/* Make sure GOCLIENT is 0 */
-	n = semctl(channel->semid, GOCLIENT, GETVAL);
-	if (n > 0) {
-		errprintf("Oops ... GOCLIENT is high (%d)\n", n);
-	}
+		if (channel->batchlen && ((channel->batchlen + reclen) > channel->maxsize)) {
+			/* No room for this one together with those already queued. Send those first. */
+			flushbatch(channel, 1);
+			memmove(channel->batchbuf, outbuf, reclen+1);
+		}
 
-	s.sem_num = GOCLIENT; s.sem_op = clients; s.sem_flg = 0; 		/* Up GOCLIENT */
-	n = semop(channel->semid, &s, 1);
+		if (channel->batchcount == 0) getntimer(&channel->batchstart);
+		channel->batchlen += reclen;
+		channel->batchcount++;
+
+		/* Control messages (no hostname) go out right away, as does a full batch */
+		flushbatch(channel, ((hostname == NULL) || (channel->batchlen >= batchsize)));
+	}
+	else if (channel->ring) {
+		/* Append it to the ring. Readers pick it up at their own pace. */
+		dbgprintf("Posting message %u to %s ring\n", channel->seq, channelnames[channel->channelid]);
+		ring_post(channel, outbuf, byteswritten + CHANNELTERMINATORLEN);
+	}
+	else {
+		postboard(channel);
+	}
 
+	LATENCY_END(LAT_POST, poststart);
 	dbgprintf("<- posttochannel\n");
 
 	return;
@@ -911,6 +1360,19 @@ void posttoall(char *msg)
 	posttochannel(userchn, msg, NULL, "xymond", NULL, NULL, "");
 }
 
+void flushallbatches(void)
+{
+	flushbatch(statuschn, 0);
+	flushbatch(stachgchn, 0);
+	flushbatch(pagechn, 0);
+	flushbatch(datachn, 0);
+	flushbatch(noteschn, 0);
+	flushbatch(enadischn, 0);
+	flushbatch(clientchn, 0);
+	flushbatch(clichgchn, 0);
+	flushbatch(userchn, 0);
+}
+
 
 void *buildsenderlist(char *senderlist)
 {
@@ -1000,6 +1462,7 @@ char *log_ghost(char *hostname, char *sender, char *msg)
 				if (found) {
 					result = candname;
 					xmh_set_item(hrec, XMH_CLIENTALIAS, hostname);
+					hostsetgeneration++;
 					errprintf("Matched ghost '%s' to host '%s'\n", hostname, result);
 				}
 			}
@@ -1086,8 +1549,7 @@ xymond_log_t *find_log(hostfilter_rec_t *filter, xymond_hostlist_t **host)
 
 	if (!hrec || !trec) return NULL;
 
-	for (lwalk = hrec->logs; (lwalk && (lwalk->test != trec)); lwalk = lwalk->next);
-	return lwalk;
+	return host_findlog(hrec, trec);
 }
 
 char *check_downtime(char *hostname, char *testname)
@@ -1183,11 +1645,90 @@ int accept_test(void *hrec, char *testname)
 }
 
 
-void get_hts(char *msg, char *sender, char *origin,
-	     xymond_hostlist_t **host, testinfo_t **test, char **grouplist, xymond_log_t **log, 
-	     int *color, char **downcause, int *alltests, int createhost, int createlog)
+/*
+ * All status logs are kept in a min-heap ordered by their validtime, so
+ * check_purple_status() only has to look at the logs that have expired.
+ * Acks and disables extend the validtime, so their expiry is handled 
+ * through this as well.
+ */
+static xymond_log_t **expiryheap = NULL;
+static int expiryheapcount = 0, expiryheapsize = 0;
+
+static void expiry_place(xymond_log_t *log, int idx)
 {
-	/*
+	expiryheap[idx] = log;
+	log->expiryidx = idx+1;
+}
+
+static void expiry_up(int idx)
+{
+	xymond_log_t *log = expiryheap[idx];
+
+	while (idx > 0) {
+		int parent = (idx-1) / 2;
+
+		if (expiryheap[parent]->validtime <= log->validtime) break;
+		expiry_place(expiryheap[parent], idx);
+		idx = parent;
+	}
+	expiry_place(log, idx);
+}
+
+static void expiry_down(int idx)
+{
+	xymond_log_t *log = expiryheap[idx];
+
+	while (1) {
+		int child = 2*idx + 1;
+
+		if (child >= expiryheapcount) break;
+		if (((child+1) < expiryheapcount) && (expiryheap[child+1]->validtime < expiryheap[child]->validtime)) child++;
+		if (log->validtime <= expiryheap[child]->validtime) break;
+		expiry_place(expiryheap[child], idx);
+		idx = child;
+	}
+	expiry_place(log, idx);
+}
+
+void expiry_update(xymond_log_t *log)
+{
+	/* Must be called whenever the validtime of a log changes */
+	if (log->expiryidx == 0) {
+		if (expiryheapcount == expiryheapsize) {
+			expiryheapsize = (expiryheapsize ? 2*expiryheapsize : 1024);
+			expiryheap = (xymond_log_t **)realloc(expiryheap, expiryheapsize * sizeof(xymond_log_t *));
+		}
+		expiry_place(log, expiryheapcount++);
+		expiry_up(expiryheapcount-1);
+	}
+	else {
+		expiry_up(log->expiryidx-1);
+		expiry_down(log->expiryidx-1);
+	}
+}
+
+void expiry_remove(xymond_log_t *log)
+{
+	int idx = log->expiryidx - 1;
+
+	if (idx < 0) return;
+
+	log->expiryidx = 0;
+	expiryheapcount--;
+	if (idx == expiryheapcount) return;
+
+	/* Move the last entry into the hole */
+	expiry_place(expiryheap[expiryheapcount], idx);
+	expiry_up(idx);
+	expiry_down(expiryheap[idx]->expiryidx-1);
+}
+
+
+void get_hts(char *msg, char *sender, char *origin,
+	     xymond_hostlist_t **host, testinfo_t **test, char **grouplist, xymond_log_t **log, 
+	     int *color, char **downcause, int *alltests, int createhost, int createlog)
+{
+	/*
 	 * This routine takes care of finding existing status log records, or
 	 * (if they don't exist) creating new ones for an incoming status.
 	 *
@@ -1203,6 +1744,7 @@ void get_hts(char *msg, char *sender, char *origin,
 	int is_summary = 0;
 	char *owalk = NULL;
 	xymond_log_t *lwalk = NULL;
+	static char *lastgrouplist = NULL;
 
 	dbgprintf("-> get_hts\n");
 
@@ -1217,11 +1759,11 @@ void get_hts(char *msg, char *sender, char *origin,
 	hosttest = hostname = testname = colstr = grp = NULL;
 	p = strchr(msg, '\n');
 	if (p == NULL) {
-		firstline = strdup(msg);
+		firstline = xarena_strdup(msgarena, msg);
 	}
 	else {
 		*p = '\0';
-		firstline = strdup(msg); 
+		firstline = xarena_strdup(msgarena, msg); 
 		*p = '\n';
 	}
 
@@ -1304,7 +1846,11 @@ void get_hts(char *msg, char *sender, char *origin,
 	}
 
 	if (hwalk && twalk && owalk) {
-		for (lwalk = hwalk->logs; (lwalk && ((lwalk->test != twalk) || (lwalk->origin != owalk))); lwalk = lwalk->next);
+		lwalk = host_findlog(hwalk, twalk);
+		if (lwalk && (lwalk->origin != owalk)) {
+			/* Several logs for this test, from different origins */
+			for (lwalk = hwalk->logs; (lwalk && ((lwalk->test != twalk) || (lwalk->origin != owalk))); lwalk = lwalk->next);
+		}
 		if (createlog && (lwalk == NULL)) {
 			dbgprintf(" -- get_hts creating new log record: host %s, test %s, color %s, group %s, origin %s\n", hostname, testname, colstr, grp, origin);
 			lwalk = (xymond_log_t *)calloc(1, sizeof(xymond_log_t));
@@ -1312,12 +1858,15 @@ void get_hts(char *msg, char *sender, char *origin,
 			lwalk->lastchange[0] = getcurrenttime(NULL);
 			lwalk->color = lwalk->oldcolor = NO_COLOR;
 			lwalk->host = hwalk;
+			hwalk->colorcount[NO_COLOR]++;
 			lwalk->test = twalk;
 			lwalk->modifiers = NULL;
 			lwalk->modifierbuf = NULL;
 			lwalk->origin = owalk;
 			lwalk->next = hwalk->logs;
 			hwalk->logs = lwalk;
+			host_reindexlog(hwalk, twalk);
+			expiry_update(lwalk);
 			if (strcmp(testname, xgetenv("PINGCOLUMN")) == 0) hwalk->pinglog = lwalk;
 		}
 	}
@@ -1337,9 +1886,11 @@ done:
 		}
 	}
 
-	if (grouplist && grp) *grouplist = strdup(grp);
-
-	xfree(firstline);
+	if (grouplist && grp) {
+		/* Valid until the next call; handle_status() takes its own reference */
+		strpool_release(lastgrouplist);
+		*grouplist = lastgrouplist = strpool_get(grp);
+	}
 
 	*host = hwalk;
 	*test = twalk;
@@ -1349,10 +1900,23 @@ done:
 }
 
 
+void log_changed(xymond_log_t *log)
+{
+	/* With binary checkpoints, only the logs that changed go into the journal */
+	if ((checkpointformat != CHK_BINARY) || log->dirty) return;
+
+	log->dirty = 1;
+	log->dirtynext = dirtylogs;
+	dirtylogs = log;
+}
+
+
 void clear_cookie(xymond_log_t *log)
 {
 	if (!log->cookie) return;
 
+	log_changed(log);
+
 	xtreeDelete(rbcookies, log->cookie);
 #ifndef HAVE_BINARY_TREE
 	xfree(log->cookie);
@@ -1447,6 +2011,110 @@ static int isset_noflap(void *hinfo, char *testname, char *hostname)
 	return 1;
 }
 
+/*
+ * Status message bodies. With --status-compression they are kept compressed
+ * in log->zmessage, and log->message is NULL. log_message() expands them
+ * when needed into a scratch buffer, which stays valid until a message
+ * from another log is expanded or the log is updated.
+ */
+static strbuffer_t *expandbuf = NULL, *compressbuf = NULL;
+static xymond_log_t *expandedlog = NULL;
+
+static unsigned char *log_message(xymond_log_t *log)
+{
+	enum compressiontype_t ctype;
+	char ctypename[20];
+	size_t expandedsz;
+	char *cbegin;
+
+	if (log->message || !log->zmessage) return log->message;
+	if (log == expandedlog) return (unsigned char *)STRBUF(expandbuf);
+
+	cbegin = strchr(log->zmessage, '\n');
+	if (!cbegin || (sscanf(log->zmessage, "compress:%19s %zu", ctypename, &expandedsz) != 2)) return NULL;
+	ctype = parse_compressiontype(ctypename);
+	cbegin++;
+
+	if (!expandbuf) expandbuf = newstrbuffer(expandedsz+1);
+	else if (STRBUFSZ(expandbuf) <= expandedsz) strbuffergrow(expandbuf, expandedsz + 1 - STRBUFSZ(expandbuf));
+	clearstrbuffer(expandbuf);
+	if (!uncompress_message(ctype, cbegin, log->zmsgsz - (cbegin - log->zmessage), expandedsz, expandbuf, NULL) ||
+	    (STRBUFLEN(expandbuf) != expandedsz)) {
+		errprintf("Cannot expand the %s-compressed status message for %s.%s\n", 
+			  ctypename, log->host->hostname, log->test->name);
+		expandedlog = NULL;
+		return NULL;
+	}
+
+	*(STRBUF(expandbuf) + expandedsz) = '\0';
+	expandedlog = log;
+	return (unsigned char *)STRBUF(expandbuf);
+}
+
+static void store_log_message(xymond_log_t *log, unsigned char *msg, int msglen)
+{
+	if (log == expandedlog) expandedlog = NULL;
+
+	if ((statuscompression != COMP_PLAIN) && (msglen >= statuscompressmin)) {
+		/* Worst case size of the compressed data, see compress_message_to_strbuffer() */
+		size_t maxsz = msglen + (msglen / 16) + 64 + 3 + 30;
+
+		if (!compressbuf) compressbuf = newstrbuffer(maxsz);
+		else if (STRBUFSZ(compressbuf) < maxsz) strbuffergrow(compressbuf, maxsz - STRBUFSZ(compressbuf));
+		clearstrbuffer(compressbuf);
+
+		if (compress_message_to_strbuffer(statuscompression, msg, msglen, compressbuf, NULL) && (STRBUFLEN(compressbuf) < msglen)) {
+			if (log->message) xfree(log->message);
+			log->message = NULL;
+			log->msgsz = 0;
+			if (log->zmessage) xfree(log->zmessage);
+			log->zmsgsz = STRBUFLEN(compressbuf);
+			log->zmessage = (char *)malloc(log->zmsgsz);
+			memcpy(log->zmessage, STRBUF(compressbuf), log->zmsgsz);
+			return;
+		}
+
+		/* Does not compress, so keep it as it is */
+	}
+
+	if (log->zmessage) {
+		xfree(log->zmessage);
+		log->zmessage = NULL;
+		log->zmsgsz = 0;
+	}
+
+	/*
+	 * Note here:
+	 * - log->msgsz is the buffer size INCLUDING the final \0.
+	 * - msglen is the message length WITHOUT the final \0.
+	 */
+	if ((log->message == NULL) || (log->msgsz == 0)) {
+		/* No buffer - get one */
+		log->message = (unsigned char *)malloc(msglen+1);
+		memcpy(log->message, msg, msglen+1);
+		log->msgsz = msglen+1;
+	}
+	else if (log->msgsz > msglen) {
+		/* Message - including \0 - fits into the existing buffer. */
+		memcpy(log->message, msg, msglen+1);
+	}
+	else {
+		/* Message does not fit into existing buffer. Grow it. */
+		log->message = (unsigned char *)realloc(log->message, msglen+1);
+		memcpy(log->message, msg, msglen+1);
+		log->msgsz = msglen+1;
+	}
+}
+
+static void clear_log_message(xymond_log_t *log)
+{
+	if (log == expandedlog) expandedlog = NULL;
+	if (log->message) xfree(log->message);
+	if (log->zmessage) xfree(log->zmessage);
+	log->message = log->zmessage = NULL;
+	log->msgsz = log->zmsgsz = 0;
+}
+
 void handle_status(unsigned char *msg, char *sender, char *hostname, char *testname, char *grouplist, 
 		   xymond_log_t *log, int newcolor, char *downcause, int modifyonly)
 {
@@ -1456,8 +2124,10 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 	enum alertstate_t oldalertstatus, newalertstatus;
 	int delayval = 0;
 	void *hinfo = hostinfo(hostname);
+	struct timespec statusstart;
 
 	dbgprintf("->handle_status\n");
+	LATENCY_START(statusstart);
 
 	if (msg == NULL) {
 		errprintf("handle_status got a NULL message for %s.%s, sender %s, color %s\n", 
@@ -1488,6 +2158,7 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 	// }
 
 	issummary = (log->host->hosttype == H_SUMMARY);
+	log_changed(log);
 
 	if (strncmp(msg, "status+", 7) == 0) {
 		validity = durationvalue(msg+7);
@@ -1706,6 +2377,7 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 			*/
 			log->validtime = now + 60;
 		}
+		expiry_update(log);
 
 		/* 
 		 * If we have an existing status, check if the sender has changed.
@@ -1726,8 +2398,7 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 				}
 			}
 		}
-		if (log->sender) xfree(log->sender);
-		log->sender = strdup(sender);
+		strpool_update(&log->sender, sender);
 	}
 
 
@@ -1778,13 +2449,12 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 
 
 	log->oldcolor = log->color;
-	log->color = newcolor;
+	log_setcolor(log, newcolor);
 	oldalertstatus = decide_alertstate(log->oldcolor);
 	newalertstatus = decide_alertstate(newcolor);
 
 	/* grouplist and log->grouplist can point to the same address.. */
-	if (log->grouplist && log->grouplist != grouplist) xfree(log->grouplist);
-	if (grouplist && !log->grouplist) log->grouplist = strdup(grouplist);
+	strpool_update(&log->grouplist, grouplist);
 
 	if (log->acklist) {
 		ackinfo_t *awalk;
@@ -1802,30 +2472,11 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 		}
 	}
 
-	if (msg != log->message) { /* They can be the same when called from handle_enadis() or check_purple_status() */
+	/* They can be the same when called from handle_enadis() or check_purple_status() */
+	if ((msg != log->message) && ((log != expandedlog) || (msg != (unsigned char *)STRBUF(expandbuf)))) {
 		char *p, *eoln = NULL;
 
-		/*
-		 * Note here:
-		 * - log->msgsz is the buffer size INCLUDING the final \0.
-		 * - msglen is the message length WITHOUT the final \0.
-		 */
-		if ((log->message == NULL) || (log->msgsz == 0)) {
-			/* No buffer - get one */
-			log->message = (unsigned char *)malloc(msglen+1);
-			memcpy(log->message, msg, msglen+1);
-			log->msgsz = msglen+1;
-		}
-		else if (log->msgsz > msglen) {
-			/* Message - including \0 - fits into the existing buffer. */
-			memcpy(log->message, msg, msglen+1);
-		}
-		else {
-			/* Message does not fit into existing buffer. Grow it. */
-			log->message = (unsigned char *)realloc(log->message, msglen+1);
-			memcpy(log->message, msg, msglen+1);
-			log->msgsz = msglen+1;
-		}
+		store_log_message(log, msg, msglen);
 
 		/* Isolate the first line and get at the test flags. They are immediately after the color */
 		if (log->line1 == NULL) log->line1 = malloc(MAXLINE1SIZE * sizeof(unsigned char) + 1);
@@ -1841,14 +2492,7 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 
 			if (flagend) {
 				*flagend = '\0';
-				if (log->testflags == NULL)
-					log->testflags = strdup(flagstart);
-				else if (strlen(log->testflags) >= strlen(flagstart))
-					strcpy(log->testflags, flagstart);
-				else {
-					log->testflags = realloc(log->testflags, strlen(flagstart));
-					strcpy(log->testflags, flagstart);
-				}
+				strpool_update(&log->testflags, flagstart);
 				*flagend = ']';
 			}
 		}
@@ -1955,6 +2599,7 @@ void handle_status(unsigned char *msg, char *sender, char *hostname, char *testn
 		posttochannel(statuschn, channelnames[C_STATUS], msg, sender, hostname, log, NULL);
 	}
 
+	LATENCY_END(LAT_STATUS, statusstart);
 	dbgprintf("<-handle_status\n");
 	return;
 }
@@ -2057,7 +2702,7 @@ void handle_modify(char *msg, xymond_log_t *log, int color, time_t now)
 	 * Modify messages always get sent to handle_status for evaluation.
 	 * It's possible a status change will result, or just a new status message.
 	 */
-	handle_status(log->message, log->sender,  
+	handle_status(log_message(log), log->sender,  
 		log->host->hostname, log->test->name, log->grouplist, log, log->color, NULL, (isnewcause ? 2 : 1) );
 
 	dbgprintf("<-handle_modify\n");
@@ -2210,17 +2855,19 @@ void handle_enadis(int enabled, conn_t *msg, char *sender, int viabfq)
 					xfree(log->dismsg);
 					log->dismsg = NULL;
 				}
+				log_changed(log);
 				posttochannel(enadischn, channelnames[C_ENADIS], msg->buf, sender, log->host->hostname, log, NULL);
 			}
 		}
 		else {
-			for (log = hwalk->logs; (log && (log->test != twalk)); log = log->next) ;
+			log = host_findlog(hwalk, twalk);
 			if (log) {
 				log->enabletime = 0;
 				if (log->dismsg) {
 					xfree(log->dismsg);
 					log->dismsg = NULL;
 				}
+				log_changed(log);
 				posttochannel(enadischn, channelnames[C_ENADIS], msg->buf, sender, log->host->hostname, log, NULL);
 			}
 		}
@@ -2232,20 +2879,22 @@ void handle_enadis(int enabled, conn_t *msg, char *sender, int viabfq)
 			for (log = hwalk->logs; (log); log = log->next) {
 				log->enabletime = expires;
 				log->validtime = (expires == DISABLED_UNTIL_OK) ? INT_MAX : log->validtime;
+				expiry_update(log);
 				if (txtstart) {
 					if (log->dismsg) xfree(log->dismsg);
 					log->dismsg = strdup(txtstart);
 				}
 				posttochannel(enadischn, channelnames[C_ENADIS], msg->buf, sender, log->host->hostname, log, NULL);
 				/* Trigger an immediate status update */
-				handle_status(log->message, sender, log->host->hostname, log->test->name, log->grouplist, log, COL_BLUE, NULL, 0);
+				handle_status(log_message(log), sender, log->host->hostname, log->test->name, log->grouplist, log, COL_BLUE, NULL, 0);
 			}
 		}
 		else {
-			for (log = hwalk->logs; (log && (log->test != twalk)); log = log->next) ;
+			log = host_findlog(hwalk, twalk);
 			if (log) {
 				log->enabletime = expires;
 				log->validtime = (expires == DISABLED_UNTIL_OK) ? INT_MAX : log->validtime;
+				expiry_update(log);
 				if (txtstart) {
 					if (log->dismsg) xfree(log->dismsg);
 					log->dismsg = strdup(txtstart);
@@ -2253,7 +2902,7 @@ void handle_enadis(int enabled, conn_t *msg, char *sender, int viabfq)
 				posttochannel(enadischn, channelnames[C_ENADIS], msg->buf, sender, log->host->hostname, log, NULL);
 
 				/* Trigger an immediate status update */
-				handle_status(log->message, sender, log->host->hostname, log->test->name, log->grouplist, log, COL_BLUE, NULL, 0);
+				handle_status(log_message(log), sender, log->host->hostname, log->test->name, log->grouplist, log, COL_BLUE, NULL, 0);
 			}
 		}
 
@@ -2274,9 +2923,11 @@ void handle_ack(char *msg, char *sender, xymond_log_t *log, int duration)
 
 	dbgprintf("->handle_ack\n");
 
+	log_changed(log);
 	log->acktime = getcurrenttime(NULL)+duration*60;
 	if (log->color > log->maxackedcolor) log->maxackedcolor = log->color;
 	if (log->validtime < log->acktime) log->validtime = log->acktime;
+	expiry_update(log);
 
 	p = msg;
 	p += strspn(p, " \t");			/* Skip the space ... */
@@ -2352,6 +3003,7 @@ void handle_ackinfo(char *msg, char *sender, xymond_log_t *log)
 			newack->next = log->acklist;
 			log->acklist = newack;
 		}
+		log_changed(log);
 
 		if (ackinfologfd) {
 			char timestamp[25];
@@ -2545,15 +3197,23 @@ void free_log_t(xymond_log_t *zombie)
 		xfree(modtmp);
 	}
 	if (zombie->modifierbuf) xfree(zombie->modifierbuf);
-	if (zombie->sender) xfree(zombie->sender);
-	if (zombie->message) xfree(zombie->message);
+	strpool_release(zombie->sender);
+	clear_log_message(zombie);
 	if (zombie->line1) xfree(zombie->line1);
 	if (zombie->dismsg) xfree(zombie->dismsg);
 	if (zombie->ackmsg) xfree(zombie->ackmsg);
-	if (zombie->grouplist) xfree(zombie->grouplist);
+	strpool_release(zombie->grouplist);
 	if (zombie->lastchange) xfree(zombie->lastchange);
-	if (zombie->testflags) xfree(zombie->testflags);
+	strpool_release(zombie->testflags);
 	flush_acklist(zombie, 1);
+	expiry_remove(zombie);
+	if (zombie->host) zombie->host->colorcount[zombie->color]--;
+	if (zombie->dirty) {
+		xymond_log_t **dwalk;
+
+		for (dwalk = &dirtylogs; (*dwalk && (*dwalk != zombie)); dwalk = &((*dwalk)->dirtynext)) ;
+		if (*dwalk) *dwalk = zombie->dirtynext;
+	}
 	xfree(zombie);
 	dbgprintf("<- free_log_t\n");
 }
@@ -2638,6 +3298,9 @@ void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, cha
 	else hwalk = xtreeData(rbhosts, hosthandle);
 	dbgprintf(" - hwalk: %p\n", hwalk);
 	if (hwalk == NULL) { errprintf("- droptest given with null host data\n"); goto done; }
+
+	/* The checkpoint journal only records updates, so the next binary checkpoint must be a full one */
+	checkpointfull = 1;
 	
 	switch (cmd) {
 	  case CMD_DROPTEST:
@@ -2647,7 +3310,7 @@ void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, cha
 		dbgprintf(" - twalk: %p\n", twalk);
 		if (twalk == NULL) { errprintf("- droptest given with null test data\n"); goto done; }
 
-		for (lwalk = hwalk->logs; (lwalk && (lwalk->test != twalk)); lwalk = lwalk->next) ;
+		lwalk = host_findlog(hwalk, twalk);
 		if (lwalk == NULL) { errprintf("- droptest given with test data but no log record\n"); goto done; }
 		if (lwalk == hwalk->pinglog) hwalk->pinglog = NULL;
 		if (lwalk == hwalk->logs) {
@@ -2658,6 +3321,7 @@ void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, cha
 			for (plog = hwalk->logs; (plog->next != lwalk); plog = plog->next) ;
 			plog->next = lwalk->next;
 		}
+		host_reindexlog(hwalk, twalk);
 		free_log_t(lwalk);
 		break;
 
@@ -2691,7 +3355,10 @@ void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, cha
 		xfree(hwalk->hostname);
 		xfree(hwalk->ip);
 #endif
+		if (hwalk->logindex) xfree(hwalk->logindex);
+		if (hwalk->chnfields) xfree(hwalk->chnfields);
 		xfree(hwalk);
+		hostsetgeneration++;
 		break;
 
 	  case CMD_RENAMEHOST:
@@ -2699,6 +3366,8 @@ void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, cha
 		xfree(hwalk->hostname);
 		hwalk->hostname = strdup(n1);
 		xtreeAdd(rbhosts, hwalk->hostname, hwalk);
+		hostsetgeneration++;
+		if (!hostinfo(n1)) renamedghosts = 1;
 		break;
 
 	  case CMD_RENAMETEST:
@@ -2706,7 +3375,7 @@ void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, cha
 		if (testhandle == xtreeEnd(rbtests)) goto done;
 		twalk = xtreeData(rbtests, testhandle);
 
-		for (lwalk = hwalk->logs; (lwalk && (lwalk->test != twalk)); lwalk = lwalk->next) ;
+		lwalk = host_findlog(hwalk, twalk);
 		if (lwalk == NULL) goto done;
 
 		if (lwalk == hwalk->pinglog) hwalk->pinglog = NULL;
@@ -2719,6 +3388,8 @@ void handle_dropnrename(enum droprencmd_t cmd, char *sender, char *hostname, cha
 			newt = xtreeData(rbtests, testhandle);
 		}
 		lwalk->test = newt;
+		host_reindexlog(hwalk, twalk);
+		host_reindexlog(hwalk, newt);
 		break;
 	}
 
@@ -2953,7 +3624,9 @@ char *timestr(time_t tstamp)
 	char *p;
 
 	if (tstamp < DISABLED_UNTIL_OK) {
+		/* Reset the result buffers */
 		residx = -1;
+		return NULL;
 	}
 	else if (tstamp == DISABLED_UNTIL_OK) {
 		return "Until OK";
@@ -3028,6 +3701,7 @@ hostfilter_rec_t *setup_filter(char *buf, char **fields, int *acklevel, int *hav
 				newrec->filtertype = FILTER_XMH;
 				newrec->field = fld;
 				newrec->wantedptn = compileregex(xmhval);
+				newrec->wantedstr = strdup(xmhval);
 			}
 			xfree(xmhfld); xfree(xmhval);
 		}
@@ -3035,12 +3709,14 @@ hostfilter_rec_t *setup_filter(char *buf, char **fields, int *acklevel, int *hav
 			newrec = (hostfilter_rec_t *)calloc(1, sizeof(hostfilter_rec_t));
 			newrec->filtertype = FILTER_PAGEPATH;
 			newrec->wantedptn = compileregex(tok+5);
+			newrec->wantedstr = strdup(tok+5);
 		}
 		else if ((strncmp(tok, "host=", 5) == 0) && (*(tok+5))) {
 			newrec = (hostfilter_rec_t *)calloc(1, sizeof(hostfilter_rec_t));
 			newrec->filtertype = FILTER_XMH;
 			newrec->field = XMH_HOSTNAME;
 			newrec->wantedptn = compileregex(tok+5);
+			newrec->wantedstr = strdup(tok+5);
 			newrec->handle = xtreeFind(rbhosts, tok+5);
 		}
 		else if ((strncmp(tok, "net=", 4) == 0) && (*(tok+4))) {
@@ -3048,12 +3724,14 @@ hostfilter_rec_t *setup_filter(char *buf, char **fields, int *acklevel, int *hav
 			newrec->filtertype = FILTER_XMH;
 			newrec->field = XMH_NET;
 			newrec->wantedptn = compileregex(tok+4);
+			newrec->wantedstr = strdup(tok+4);
 		}
 		else if ((strncmp(tok, "ip=", 3) == 0) && (*(tok+3))) {
 			newrec = (hostfilter_rec_t *)calloc(1, sizeof(hostfilter_rec_t));
 			newrec->filtertype = FILTER_XMH;
 			newrec->field = XMH_IP;
 			newrec->wantedptn = compileregex(tok+3);
+			newrec->wantedstr = strdup(tok+3);
 		}
 		else if ((strncmp(tok, "lastchange", 10) == 0) && (*(tok+10))) {
 			int skipchar;
@@ -3176,6 +3854,9 @@ hostfilter_rec_t *setup_filter(char *buf, char **fields, int *acklevel, int *hav
 		else if (strncmp(tok, "fields=", 7) == 0) {
 			*fields = tok+7;
 		}
+		else if (strncmp(tok, "format=", 7) == 0) {
+			/* Output format, handled by board_start() */
+		}
 		else {
 			/* Might be an old-style HOST.TEST request */
 			char *hname, *tname, *hostip = NULL;
@@ -3191,6 +3872,7 @@ hostfilter_rec_t *setup_filter(char *buf, char **fields, int *acklevel, int *hav
 				newrec->filtertype = FILTER_XMH;
 				newrec->field = XMH_HOSTNAME;
 				newrec->wantedptn = compileregex(hname);
+				newrec->wantedstr = strdup(hname);
 				newrec->handle = xtreeFind(rbhosts, hname);
 
 				newrec->next = (hostfilter_rec_t *)calloc(1, sizeof(hostfilter_rec_t));
@@ -3285,10 +3967,77 @@ void clear_filter(hostfilter_rec_t *filter)
 	while (fwalk) {
 		zombie = fwalk; fwalk = fwalk->next;
 		if (zombie->wantedptn) freeregex(zombie->wantedptn);
+		if (zombie->wantedstr) xfree(zombie->wantedstr);
+		if (zombie->testmatch) xfree(zombie->testmatch);
+		if (zombie->testlist) xfree(zombie->testlist);
 		xfree(zombie);
 	}
 }
 
+static void build_testmatch(hostfilter_rec_t *fwalk)
+{
+	/*
+	 * Run the test-name pattern once against all of the tests we know,
+	 * so matching a status log is a table lookup instead of a regex.
+	 */
+	xtreePos_t handle;
+	testinfo_t *twalk;
+
+	fwalk->testmatchsize = lasttestid + 1;
+	fwalk->testmatch = (unsigned char *)calloc(fwalk->testmatchsize, sizeof(unsigned char));
+	fwalk->testlist = (testinfo_t **)calloc(MAX_TESTLIST, sizeof(testinfo_t *));
+	fwalk->testlistcount = 0;
+
+	for (handle = xtreeFirst(rbtests); (handle != xtreeEnd(rbtests)); handle = xtreeNext(rbtests, handle)) {
+		twalk = xtreeData(rbtests, handle);
+		if (!twalk || (twalk->id <= 0) || (twalk->id >= fwalk->testmatchsize)) continue;
+		if (!matchregex(twalk->name, fwalk->wantedptn)) continue;
+
+		fwalk->testmatch[twalk->id] = 1;
+		if ((fwalk->testlistcount >= 0) && (fwalk->testlistcount < MAX_TESTLIST))
+			fwalk->testlist[fwalk->testlistcount++] = twalk;
+		else
+			fwalk->testlistcount = -1;
+	}
+}
+
+static int match_testname(testinfo_t *test, hostfilter_rec_t *fwalk)
+{
+	if (!fwalk->testmatch) build_testmatch(fwalk);
+
+	/* The fake board tests have no id */
+	if ((test->id > 0) && (test->id < fwalk->testmatchsize)) return fwalk->testmatch[test->id];
+	return matchregex(test->name, fwalk->wantedptn);
+}
+
+static int match_hostcfg_filter(void *hinfo, hostfilter_rec_t *fwalk)
+{
+	/* Match the filters that only look at the hosts.cfg data */
+	int matched = 1;
+	char *val;
+
+	switch (fwalk->filtertype) {
+	  case FILTER_XMH:
+		val = xmh_item(hinfo, fwalk->field);
+		matched = (val ? matchregex(val, fwalk->wantedptn) : 0);
+		break;
+
+	  case FILTER_PAGEPATH:
+		matched = 0;
+		val = xmh_item_multi(hinfo, XMH_PAGEPATH);
+		while (val && !matched) {
+			matched = matchregex(val, fwalk->wantedptn);
+			val = xmh_item_multi(NULL, XMH_PAGEPATH);
+		}
+		break;
+
+	  default:
+		break;
+	}
+
+	return matched;
+}
+
 int match_host_filter(void *hinfo, hostfilter_rec_t *filter, int matchontests, char ***tags)
 {
 	int matched = 1, downcount, matchcount;
@@ -3307,17 +4056,8 @@ int match_host_filter(void *hinfo, hostfilter_rec_t *filter, int matchontests, c
 	while (fwalk && matched) {
 		switch (fwalk->filtertype) {
 		  case FILTER_XMH:
-			val = xmh_item(hinfo, fwalk->field);
-			matched = (val ? matchregex(val, fwalk->wantedptn) : 0);
-			break;
-
 		  case FILTER_PAGEPATH:
-			matched = 0;
-			val = xmh_item_multi(hinfo, XMH_PAGEPATH);
-			while (val && !matched) {
-				matched = matchregex(val, fwalk->wantedptn);
-				val = xmh_item_multi(NULL, XMH_PAGEPATH);
-			}
+			if (!(fwalk->flags & FILTER_INHOSTSET)) matched = match_hostcfg_filter(hinfo, fwalk);
 			break;
 
 		  case FILTER_TAG:
@@ -3341,10 +4081,9 @@ int match_host_filter(void *hinfo, hostfilter_rec_t *filter, int matchontests, c
 		  case FILTER_DOWN:
 			/* Want only hosts that are down */
 			hosthandle = xtreeFind(rbhosts, xmh_item(hinfo, XMH_HOSTNAME));
-			hwalk = xtreeData(rbhosts, hosthandle);
-			if (!hwalk) continue;
-			for (lwalk = hwalk->logs, downcount = 0, matchcount = 0; (lwalk); lwalk = lwalk->next) {
-				if (matchregex(lwalk->test->name, fwalk->wantedptn)) {
+			hwalk = ((hosthandle != xtreeEnd(rbhosts)) ? xtreeData(rbhosts, hosthandle) : NULL);
+			for (lwalk = (hwalk ? hwalk->logs : NULL), downcount = 0, matchcount = 0; (lwalk); lwalk = lwalk->next) {
+				if (match_testname(lwalk->test, fwalk)) {
 					matchcount++;
 					if (lwalk->color == COL_RED) {
 						downcount++;
@@ -3363,10 +4102,9 @@ int match_host_filter(void *hinfo, hostfilter_rec_t *filter, int matchontests, c
 		  case FILTER_NOTDOWN:
 			/* Dont want hosts where a service is down. Any test matching the pattern and is red will trigger this host not being matched */
 			hosthandle = xtreeFind(rbhosts, xmh_item(hinfo, XMH_HOSTNAME));
-			hwalk = xtreeData(rbhosts, hosthandle);
-			if (!hwalk) continue;
-			for (lwalk = hwalk->logs, downcount = 0, matchcount = 0; (lwalk); lwalk = lwalk->next) {
-				if (matchregex(lwalk->test->name, fwalk->wantedptn)) {
+			hwalk = ((hosthandle != xtreeEnd(rbhosts)) ? xtreeData(rbhosts, hosthandle) : NULL);
+			for (lwalk = (hwalk ? hwalk->logs : NULL), downcount = 0, matchcount = 0; (lwalk); lwalk = lwalk->next) {
+				if (match_testname(lwalk->test, fwalk)) {
 					matchcount++;
 					if (lwalk->color == COL_RED) {
 						downcount++;
@@ -3405,7 +4143,7 @@ int match_test_filter(xymond_log_t *log, hostfilter_rec_t *filter)
 	while (fwalk && matched) {
 		switch (fwalk->filtertype) {
 		  case FILTER_TEST:
-			matched = matchregex(log->test->name, fwalk->wantedptn);
+			matched = match_testname(log->test, fwalk);
 			break;
 
 		  case FILTER_COLOR:
@@ -3440,7 +4178,7 @@ int match_test_filter(xymond_log_t *log, hostfilter_rec_t *filter)
 
 		  case FILTER_FIELD:
 			switch (fwalk->boardfield) {
-			  case F_MSG: testedstr = log->message; break;
+			  case F_MSG: testedstr = log_message(log); break;
 			  case F_ACKMSG: testedstr = log->ackmsg; break;
 			  case F_DISMSG: testedstr = log->dismsg; break;
 			  default: errprintf("Unknown FILTER_FIELD field given\n"); testedstr = NULL; break;
@@ -3458,6 +4196,169 @@ int match_test_filter(xymond_log_t *log, hostfilter_rec_t *filter)
 	return matched;
 }
 
+/*
+ * The hosts matching the hosts.cfg part of a board filter (host=, page=,
+ * net=, ip= and XMH_ filters) only change when hosts.cfg is reloaded or
+ * hosts come and go. So we keep the result of these filters for each set
+ * of patterns we have seen, and repeated board requests for the same page
+ * or class can skip the regex matching for all of the other hosts.
+ */
+typedef struct hostset_t {
+	char *key;
+	unsigned long generation;
+	int count;
+	xymond_hostlist_t **hosts;	/* In the same order as rbhosts */
+} hostset_t;
+
+#define MAX_HOSTSETS 1000
+
+static void *rbhostsets = NULL;
+static int hostsetcount = 0;
+
+static void flush_hostsets(void)
+{
+	xtreePos_t handle;
+	hostset_t *hset;
+
+	if (!rbhostsets) return;
+
+	for (handle = xtreeFirst(rbhostsets); (handle != xtreeEnd(rbhostsets)); handle = xtreeNext(rbhostsets, handle)) {
+		hset = xtreeData(rbhostsets, handle);
+		xfree(hset->key);
+		if (hset->hosts) xfree(hset->hosts);
+		xfree(hset);
+	}
+
+	xtreeDestroy(rbhostsets);
+	rbhostsets = NULL;
+	hostsetcount = 0;
+}
+
+hostset_t *find_hostset(hostfilter_rec_t *filter, int havehostfilter)
+{
+	strbuffer_t *key;
+	hostfilter_rec_t *fwalk;
+	xtreePos_t handle;
+	hostset_t *hset;
+	xymond_hostlist_t *hwalk;
+	char l[30];
+	int hostssz = 0;
+
+	key = newstrbuffer(0);
+	for (fwalk = filter; (fwalk); fwalk = fwalk->next) {
+		if (((fwalk->filtertype != FILTER_XMH) && (fwalk->filtertype != FILTER_PAGEPATH)) || !fwalk->wantedstr) continue;
+
+		snprintf(l, sizeof(l), "%d:%d:", fwalk->filtertype, fwalk->field);
+		addtobuffer_many(key, l, fwalk->wantedstr, "\n", NULL);
+	}
+
+	if (STRBUFLEN(key) == 0) {
+		/* No hosts.cfg filters, so all hosts are candidates */
+		freestrbuffer(key);
+		return NULL;
+	}
+
+	if (!rbhostsets) rbhostsets = xtreeNew(strcmp);
+	handle = xtreeFind(rbhostsets, STRBUF(key));
+	if (handle != xtreeEnd(rbhostsets)) {
+		hset = xtreeData(rbhostsets, handle);
+		freestrbuffer(key);
+	}
+	else {
+		if (hostsetcount >= MAX_HOSTSETS) flush_hostsets();
+		if (!rbhostsets) rbhostsets = xtreeNew(strcmp);
+
+		hset = (hostset_t *)calloc(1, sizeof(hostset_t));
+		hset->key = grabstrbuffer(key);
+		hset->generation = hostsetgeneration - 1;
+		xtreeAdd(rbhostsets, hset->key, hset);
+		hostsetcount++;
+	}
+
+	if (hset->generation != hostsetgeneration) {
+		dbgprintf("Building host set for filter %s", hset->key);
+
+		if (hset->hosts) xfree(hset->hosts);
+		hset->hosts = NULL;
+		hset->count = 0;
+
+		for (handle = xtreeFirst(rbhosts); (handle != xtreeEnd(rbhosts)); handle = xtreeNext(rbhosts, handle)) {
+			hwalk = xtreeData(rbhosts, handle);
+			if (!hwalk) continue;
+
+			if (hwalk->hosttype != H_NORMAL) {
+				/* If there is a hostname filter, drop the "summary" 'hosts' */
+				if (havehostfilter) continue;
+			}
+			else {
+				void *hinfo = hostinfo(hwalk->hostname);
+				int matched = 1;
+
+				if (!hinfo) continue;
+				for (fwalk = filter; (fwalk && matched); fwalk = fwalk->next) {
+					if (fwalk->wantedstr) matched = match_hostcfg_filter(hinfo, fwalk);
+				}
+				if (!matched) continue;
+			}
+
+			if (hset->count == hostssz) {
+				hostssz += 64;
+				hset->hosts = (xymond_hostlist_t **)realloc(hset->hosts, hostssz * sizeof(xymond_hostlist_t *));
+			}
+			hset->hosts[hset->count++] = hwalk;
+		}
+
+		hset->generation = hostsetgeneration;
+	}
+
+	/* These filters need not be checked again for each host */
+	for (fwalk = filter; (fwalk); fwalk = fwalk->next) {
+		if (fwalk->wantedstr) fwalk->flags |= FILTER_INHOSTSET;
+	}
+
+	return hset;
+}
+
+int match_board_host(xymond_hostlist_t *hwalk, hostfilter_rec_t *filter)
+{
+	/* 
+	 * Quick check if a host has any status logs that can match the test-
+	 * and color-filters, using the host color counts and the log index.
+	 * Does not know about the fake "info", "trends" and "clientlog" logs.
+	 */
+	hostfilter_rec_t *fwalk;
+	int i, found;
+
+	for (fwalk = filter; (fwalk); fwalk = fwalk->next) {
+		switch (fwalk->filtertype) {
+		  case FILTER_COLOR:
+			for (i = 0, found = 0; ((i <= COL_COUNT) && !found); i++) {
+				found = ((fwalk->wantedvalue & (1 << i)) && (hwalk->colorcount[i] > 0));
+			}
+			if (!found) return 0;
+			break;
+
+		  case FILTER_DOWN:
+			if (hwalk->colorcount[COL_RED] == 0) return 0;
+			break;
+
+		  case FILTER_TEST:
+			if (!fwalk->testmatch) build_testmatch(fwalk);
+			if (fwalk->testlistcount < 0) break;	/* Too many tests, look at the logs */
+			for (i = 0, found = 0; ((i < fwalk->testlistcount) && !found); i++) {
+				found = (host_findlog(hwalk, fwalk->testlist[i]) != NULL);
+			}
+			if (!found) return 0;
+			break;
+
+		  default:
+			break;
+		}
+	}
+
+	return 1;
+}
+
 
 strbuffer_t *generate_outbuf(strbuffer_t **prebuf, boardfield_t *boardfields, xymond_hostlist_t *hwalk, xymond_log_t *lwalk, int acklevel)
 {
@@ -3495,7 +4396,7 @@ strbuffer_t *generate_outbuf(strbuffer_t **prebuf, boardfield_t *boardfields, xy
 		  case F_LINE1: addtobuffer(buf, lwalk->line1); break;
 		  case F_ACKMSG: if (lwalk->ackmsg) addtobuffer(buf, nlencode(lwalk->ackmsg)); break;
 		  case F_DISMSG: if (lwalk->dismsg) addtobuffer(buf, nlencode(lwalk->dismsg)); break;
-		  case F_MSG: addtobuffer(buf, nlencode(lwalk->message)); break;
+		  case F_MSG: addtobuffer(buf, nlencode(log_message(lwalk))); break;
 		  case F_CLIENT: addtobuffer(buf, (hwalk->clientmsgs ? "Y" : "N")); break;
 		  case F_CLIENTTSTAMP: snprintf(l, sizeof(l), "%ld", (hwalk->clientmsgs ? (long) (hwalk->clientmsgtstamp + timeroffset) : 0)); addtobuffer(buf, l); break;
 
@@ -3540,6 +4441,68 @@ strbuffer_t *generate_outbuf(strbuffer_t **prebuf, boardfield_t *boardfields, xy
 }
 
 
+void generate_binary_outbuf(strbuffer_t *buf, binboard_writer_t *w, boardfield_t *boardfields, xymond_hostlist_t *hwalk, xymond_log_t *lwalk, int acklevel)
+{
+	/* Same as generate_outbuf(), but in the binary format. Strings are sent as-is, without nlencode() */
+	int f_idx;
+	enum boardfield_t f_type;
+	void *hinfo = NULL;
+	char l[1024];
+
+	binboard_row(w, buf);
+
+	for (f_idx = 0, f_type = boardfields[0].field; ((f_type != F_NONE) && (f_type != F_LAST)); f_type = boardfields[++f_idx].field) {
+		switch (f_type) {
+		  case F_IP: binboard_addname(w, buf, hwalk->ip); break;
+		  case F_HOSTNAME: binboard_addname(w, buf, hwalk->hostname); break;
+		  case F_TESTNAME: binboard_addname(w, buf, lwalk->test->name); break;
+		  case F_COLOR: binboard_addint(w, buf, lwalk->color); break;
+		  case F_FLAGS: binboard_addname(w, buf, lwalk->testflags); break;
+		  case F_LASTCHANGE: binboard_addint(w, buf, lwalk->lastchange[0]); break;
+		  case F_LOGTIME: binboard_addint(w, buf, lwalk->logtime); break;
+		  case F_VALIDTIME: binboard_addint(w, buf, lwalk->validtime); break;
+		  case F_ACKTIME: binboard_addint(w, buf, lwalk->acktime); break;
+		  case F_DISABLETIME: binboard_addint(w, buf, lwalk->enabletime); break;
+		  case F_SENDER: binboard_addname(w, buf, lwalk->sender); break;
+		  case F_COOKIE: binboard_addstr(w, buf, lwalk->cookie); break;
+		  case F_LINE1: binboard_addstr(w, buf, lwalk->line1); break;
+		  case F_ACKMSG: binboard_addstr(w, buf, lwalk->ackmsg); break;
+		  case F_DISMSG: binboard_addstr(w, buf, lwalk->dismsg); break;
+		  case F_MSG: binboard_addstr(w, buf, log_message(lwalk)); break;
+		  case F_CLIENT: binboard_addname(w, buf, (hwalk->clientmsgs ? "Y" : "N")); break;
+		  case F_CLIENTTSTAMP: binboard_addint(w, buf, (hwalk->clientmsgs ? (getcurrenttime(NULL) - gettimer() + hwalk->clientmsgtstamp) : 0)); break;
+
+		  case F_ACKLIST:
+			flush_acklist(lwalk, 0);
+			binboard_addstr(w, buf, acklist_string(lwalk, acklevel));
+			break;
+
+		  case F_HOSTINFO:
+			hinfo = hostinfo(hwalk->hostname);
+			binboard_addstr(w, buf, (hinfo ? xmh_item(hinfo, boardfields[f_idx].xmhfield) : NULL));
+			break;
+
+		  case F_FLAPINFO:
+			snprintf(l, sizeof(l), "%d/%ld/%ld/%s/%s", 
+				 lwalk->flapping, 
+				 lwalk->lastchange[0], (flapcount > 0) ? lwalk->lastchange[flapcount-1] : 0,
+				 colnames[lwalk->oldflapcolor], colnames[lwalk->currflapcolor]);
+			binboard_addstr(w, buf, l);
+			break;
+
+		  case F_STATS: binboard_addint(w, buf, lwalk->statuschangecount); break;
+		  case F_MODIFIERS: binboard_addstr(w, buf, (lwalk->modifiers ? lwalk->modifierbuf : NULL)); break;
+
+		  case F_MATCHEDTAG:
+		  case F_NONE:
+		  case F_LAST:
+			binboard_addstr(w, buf, NULL);
+			break;
+		}
+	}
+}
+
+
 strbuffer_t *generate_hostinfo_outbuf(strbuffer_t **prebuf, boardfield_t *boardfields, void *hinfo, char **tags)
 {
 	int f_idx, tagi;
@@ -3587,6 +4550,8 @@ void get_sender(conn_t *msg, char *msgtext, char *prestring)
 	char *msgfrom;
 
 	if (msg->certcn) {
+		if (msg->sender && (strcmp(msg->sender, msg->certcn) == 0)) return;
+		if (msg->sender) xfree(msg->sender);
 		msg->sender = strdup(msg->certcn);
 		return;
 	}
@@ -3597,9 +4562,12 @@ void get_sender(conn_t *msg, char *msgtext, char *prestring)
 	if (msgfrom) {
 		char *tokr, *s;
 
-		if (msg->sender) xfree(msg->sender);
 		s = strtok_r(msgfrom + strlen(prestring), " \r\n\t", &tokr);
-		msg->sender = strdup(s ? s : "");
+		if (!s) s = "";
+		/* Combo messages usually have the same sender for all of the parts */
+		if (msg->sender && (strcmp(msg->sender, s) == 0)) return;
+		if (msg->sender) xfree(msg->sender);
+		msg->sender = strdup(s);
 	}
 	else {
 		if (!msg->sender) msg->sender = strdup("");
@@ -3607,79 +4575,434 @@ void get_sender(conn_t *msg, char *msgtext, char *prestring)
 }
 
 
-void do_message(conn_t *msg, char *origin, int viabfq)
+/*
+ * Expand a "compress:TYPE SIZE" message. Returns a new buffer with the 
+ * uncompressed message, or NULL with the reason in errtxt. This may run
+ * in a parse thread, so it must not touch any global state - zstream is
+ * the thread's own zlib stream (NULL in the main thread).
+ */
+static char *expand_message(conn_t *msg, void *zstream, size_t *expandedlen, char *errtxt, size_t errtxtsz)
 {
-	static int nesting = 0;
-	xymond_hostlist_t *h;
-	testinfo_t *t;
-	xymond_log_t *log;
-	int color;
-	char *downcause;
-	char *grouplist;
-	time_t now, timeroffset;
-	char *msgfrom;
+	char *p = NULL;
+	strbuffer_t *expbuf = NULL, *tmpbuf;
+	enum compressiontype_t compressiontype = COMP_UNKNOWN;
+	unsigned char *cbegin;
+	size_t expandedsz = 0;
+	char whytxt[150];
+
+	compressiontype = parse_compressiontype(msg->buf+9);
+	if (compressiontype == COMP_UNKNOWN) {
+		snprintf(errtxt, errtxtsz, "Unsupported/unknown compression type in message; skipping\n");
+		return NULL;
+	}
+	p = strchr(msg->buf, ' ');		// skip to size
+	if (!p) {
+		snprintf(errtxt, errtxtsz, "Garbled %s-compressed message: No size\n", comptype2str(compressiontype));
+		return NULL;
+	}
+	expandedsz = (size_t)atol(p+1); dbgprintf(" - compressed message; expecting %zu bytes\n", expandedsz);
 
-	nesting++;
-	if (debug) {
-		char *eoln = strchr(msg->buf, '\n');
+	*whytxt = '\0';
+	cbegin = strchr(msg->buf, '\n');
+	if (cbegin) {
+		ptrdiff_t len;
+		cbegin++;
+		len = msg->buflen - (cbegin - msg->buf); // dbgprintf(" - data length: %td\n", len);
 
-		if (eoln) *eoln = '\0';
-		dbgprintf("-> do_message/%d (%d bytes): %s\n", nesting, msg->buflen, msg->buf);
-		if (eoln) *eoln = '\n';
+		// expbuf = uncompress_buffer(cbegin, len, NULL);
+		tmpbuf = newstrbuffer(expandedsz + 2048); // safety
+		// (void)uncompress_to_my_buffer(cbegin, len, expbuf);
+		expbuf = uncompress_message_r(compressiontype, cbegin, len, expandedsz, tmpbuf, zstream, whytxt, sizeof(whytxt));
+		if (!expbuf) freestrbuffer(tmpbuf);
 	}
 
-	if (strncmp(msg->buf, "compress:", 9) == 0) {
-		char *p = NULL;
-		strbuffer_t *expbuf = NULL;
-		enum compressiontype_t compressiontype = COMP_UNKNOWN;
-		unsigned char *cbegin;
-		size_t expandedsz = 0;
+	if (!expbuf || (STRBUFLEN(expbuf) != expandedsz)) {
+		snprintf(errtxt, errtxtsz, "Garbled %s-compressed message: expected %zu bytes, but expanded to %zu bytes\n%s",
+			  comptype2str(compressiontype), expandedsz, (expbuf ? STRBUFLEN(expbuf) : 0), whytxt);
+		if (expbuf != NULL) freestrbuffer(expbuf);
+		return NULL;
+	}
 
-		p = msg->buf+9; if (!p) goto done;
-		compressiontype = parse_compressiontype(p);
-		if (compressiontype == COMP_UNKNOWN) {
-			errprintf("Unsupported/unknown compression type in message; skipping\n");
-			goto done;
+	dbgprintf(" - compressed msg found, %zu bytes\n", expandedsz);
+	*expandedlen = expandedsz;
+	return grabstrbuffer(expbuf);
+}
+
+
+/*
+ * The xymondboard and xymondxboard responses are generated a chunk at a
+ * time while the client reads them, so a large board is never held in
+ * memory at once and the client gets the first data right away. The
+ * cursor has the list of hosts that may be in the response, and the
+ * index of the next one to do. If hosts come or go while the response
+ * is being sent, the list is rebuilt and we continue after the last
+ * host that was done.
+ */
+#define BOARD_CHUNKSIZE (64*1024)
+
+typedef struct boardcursor_t {
+	enum { BOARD_TEXT, BOARD_XML, BOARD_BINARY } format;
+	hostfilter_rec_t *filter;
+	boardfield_t *fields;
+	binboard_writer_t *writer;	/* Only for BOARD_BINARY. Has the string table for the whole response */
+	int columns;
+	int acklevel, havehostfilter, fakematch;
+	time_t *dummytimes;
+	xymond_hostlist_t **hosts;
+	int hostcount, hostidx;
+	unsigned long generation;
+	char *lasthost;		/* Name of the last host done, if the list must be rebuilt */
+} boardcursor_t;
+
+static testinfo_t trendstest, infotest, clienttest;
+static xymond_log_t trendslogrec, infologrec, clientlogrec;
+static int faketestinit = 0;
+
+static void board_findhosts(boardcursor_t *cursor)
+{
+	hostset_t *hostset;
+	xtreePos_t hosthandle;
+	xymond_hostlist_t *hwalk;
+	int hostssz = 0;
+
+	cursor->hostcount = cursor->hostidx = 0;
+
+	hostset = find_hostset(cursor->filter, cursor->havehostfilter);
+	if (hostset) {
+		hostssz = hostset->count + 1;
+		cursor->hosts = (xymond_hostlist_t **)realloc(cursor->hosts, hostssz * sizeof(xymond_hostlist_t *));
+		memcpy(cursor->hosts, hostset->hosts, hostset->count * sizeof(xymond_hostlist_t *));
+		cursor->hostcount = hostset->count;
+	}
+	else {
+		for (hosthandle = xtreeFirst(rbhosts); (hosthandle != xtreeEnd(rbhosts)); hosthandle = xtreeNext(rbhosts, hosthandle)) {
+			hwalk = xtreeData(rbhosts, hosthandle);
+			if (!hwalk) {
+				errprintf("host-tree has a record with no data\n");
+				continue;
+			}
+
+			if (cursor->hostcount == hostssz) {
+				hostssz += 1024;
+				cursor->hosts = (xymond_hostlist_t **)realloc(cursor->hosts, hostssz * sizeof(xymond_hostlist_t *));
+			}
+			cursor->hosts[cursor->hostcount++] = hwalk;
 		}
-		p = strchr(msg->buf, ' '); if (!++p) goto done;		// skip to size
-		expandedsz = (size_t)atol(p); dbgprintf(" - compressed message; expecting %zu bytes\n", expandedsz);
+	}
 
-		cbegin = strchr(msg->buf, '\n');
-		if (cbegin) {
-			ptrdiff_t len;
-			cbegin++;
-			len = msg->buflen - (cbegin - msg->buf); // dbgprintf(" - data length: %td\n", len);
+	/* Skip the hosts we have already done. The list is in the rbhosts order */
+	if (cursor->lasthost) {
+		while ((cursor->hostidx < cursor->hostcount) && (strcasecmp(cursor->hosts[cursor->hostidx]->hostname, cursor->lasthost) <= 0))
+			cursor->hostidx++;
+	}
+
+	cursor->generation = hostsetgeneration;
+}
+
+static void board_texthost(strbuffer_t *response, boardcursor_t *cursor, xymond_hostlist_t *hwalk)
+{
+	xymond_log_t *lwalk, *firstlog;
+
+	/* Skip hosts without any logs for the wanted tests or colors */
+	if (((hwalk->hosttype != H_NORMAL) || !cursor->fakematch) && !match_board_host(hwalk, cursor->filter)) return;
 
-			// expbuf = uncompress_buffer(cbegin, len, NULL);
-			expbuf = newstrbuffer(expandedsz + 2048); // safety
-			// (void)uncompress_to_my_buffer(cbegin, len, expbuf);
-			expbuf = uncompress_message(compressiontype, cbegin, len, expandedsz, expbuf, NULL);
+	firstlog = hwalk->logs;
+
+	if (hwalk->hosttype == H_NORMAL) {
+		void *hinfo = hostinfo(hwalk->hostname);
+
+		if (!hinfo) {
+			errprintf("Hostname '%s' in tree, but no host-info\n", hwalk->hostname);
+			return;
+		}
+
+		/* Host/pagename filter */
+		if (!match_host_filter(hinfo, cursor->filter, 0, NULL)) return;
+
+		/* Handle NOINFO, NOCLIENT and NOTRENDS here */
+		if (hwalk->clientmsgs && !xmh_item(hinfo, XMH_FLAG_NOCLIENT)) {
+			clientlogrec.next = firstlog;
+			firstlog = &clientlogrec;
+		}
+		if (!xmh_item(hinfo, XMH_FLAG_NOINFO)) {
+			infologrec.next = firstlog;
+			firstlog = &infologrec;
 		}
+		if (!xmh_item(hinfo, XMH_FLAG_NOTRENDS)) {
+			trendslogrec.next = firstlog;
+			firstlog = &trendslogrec;
+		}
+	}
 
-		if (expbuf && (STRBUFLEN(expbuf) == expandedsz)) {
-			char *origbuf, *origbufp;
-			size_t origbuflen, origbufsz;
+	clientlogrec.host = trendslogrec.host = infologrec.host = hwalk;
 
-			dbgprintf(" - compressed msg found, %zu bytes\n", expandedsz);
-			origbuf = msg->buf; origbuflen = msg->buflen; origbufsz = msg->bufsz; origbufp = msg->bufp;
+	for (lwalk = firstlog; (lwalk); lwalk = lwalk->next) {
+		if (!match_test_filter(lwalk, cursor->filter)) continue;
 
-			msg->buflen = msg->bufsz = STRBUFLEN(expbuf);
-			msg->buf = grabstrbuffer(expbuf);
-			msg->bufp = msg->buf + msg->buflen; *(msg->bufp) = '\0';
+		if ((lwalk->message == NULL) && (lwalk->zmessage == NULL)) {
+			errprintf("%s.%s has a NULL message\n", (lwalk->host->hostname ? lwalk->host->hostname : "<no host>"), (lwalk->test->name ? lwalk->test->name : "<no test>"));
+			lwalk->message = strdup("No data");
+			lwalk->msgsz = strlen(lwalk->message) + 1;
+		}
 
-			do_message(msg, origin, viabfq);
+		if (cursor->format == BOARD_BINARY)
+			generate_binary_outbuf(response, cursor->writer, cursor->fields, hwalk, lwalk, cursor->acklevel);
+		else
+			response = generate_outbuf(&response, cursor->fields, hwalk, lwalk, cursor->acklevel);
+	}
+}
 
-			xfree(msg->buf); // uncompress gives us a new buffer each time
-			msg->buf=origbuf; msg->buflen=origbuflen; msg->bufsz=origbufsz; msg->bufp=origbufp;
+static void board_xmlhost(strbuffer_t *response, boardcursor_t *cursor, xymond_hostlist_t *hwalk)
+{
+	xymond_log_t *lwalk;
+	time_t now = getcurrenttime(NULL);
 
-			goto done;
+	/* Skip hosts without any logs for the wanted tests or colors */
+	if (!match_board_host(hwalk, cursor->filter)) return;
+
+	if (hwalk->hosttype == H_NORMAL) {
+		void *hinfo;
+		hinfo = hostinfo(hwalk->hostname);
+
+		if (!hinfo) {
+			errprintf("Hostname '%s' in tree, but no host-info\n", hwalk->hostname);
+			return;
 		}
-		else {
-			errprintf("Garbled %s-compressed message: expected %zu bytes, but expanded to %zu bytes\n",
-				  comptype2str(compressiontype), expandedsz, (expbuf ? STRBUFLEN(expbuf) : 0));
-			if (expbuf != NULL) freestrbuffer(expbuf);
+
+		/* Host/pagename filter */
+		if (!match_host_filter(hinfo, cursor->filter, 0, NULL)) return;
+	}
+
+	for (lwalk = hwalk->logs; (lwalk); lwalk = lwalk->next) {
+		char *msgtext, *eoln;
+
+		if (!match_test_filter(lwalk, cursor->filter)) continue;
+
+		msgtext = log_message(lwalk);
+		if (msgtext == NULL) {
+			errprintf("%s.%s has a NULL message\n", lwalk->host->hostname, lwalk->test->name);
+			msgtext = lwalk->message = strdup("No data");
+			lwalk->msgsz = strlen(lwalk->message) + 1;
+		}
+
+		eoln = strchr(msgtext, '\n');
+		if (eoln) *eoln = '\0';
+
+		addtobuffer_many(response, 
+			"  <ServerStatus>\n",
+			"    <ServerName>", hwalk->hostname, "</ServerName>\n",
+			"    <Type>", lwalk->test->name, "</Type>\n",
+			"    <Status>", colorname(lwalk->color), "</Status>\n",
+			"    <TestFlags>", (lwalk->testflags ? lwalk->testflags : ""), "</TestFlags>\n",
+			"    <LastChange>", timestr(lwalk->lastchange[0]), "</LastChange>\n",
+			"    <LogTime>", timestr(lwalk->logtime), "</LogTime>\n",
+			"    <ValidTime>", timestr(lwalk->validtime), "</ValidTime>\n",
+			"    <AckTime>", timestr(lwalk->acktime), "</AckTime>\n",
+			"    <DisableTime>", timestr(lwalk->enabletime), "</DisableTime>\n",
+			"    <Sender>", lwalk->sender, "</Sender>\n",
+			NULL);
+		timestr(-999);
+
+		if (lwalk->cookie && (lwalk->cookieexpires > now))
+			addtobuffer_many(response, "    <Cookie>", lwalk->cookie, "</Cookie>\n", NULL);
+		else
+			addtobuffer(response, "    <Cookie>N/A</Cookie>\n");
+
+		addtobuffer_many(response, 
+			"    <MessageSummary><![CDATA[", msgtext, "]]></MessageSummary>\n",
+			"  </ServerStatus>\n",
+			NULL);
+		if (eoln) *eoln = '\n';
+	}
+}
+
+void board_free(conn_t *msg)
+{
+	boardcursor_t *cursor = msg->board;
+
+	if (!cursor) return;
+
+	clear_filter(cursor->filter);
+	if (cursor->fields) xfree(cursor->fields);
+	if (cursor->dummytimes) xfree(cursor->dummytimes);
+	if (cursor->writer) binboard_freewriter(cursor->writer);
+	if (cursor->hosts) xfree(cursor->hosts);
+	if (cursor->lasthost) xfree(cursor->lasthost);
+	xfree(cursor);
+	msg->board = NULL;
+}
+
+int board_fill(conn_t *msg)
+{
+	/* Put the next chunk of the board into the message buffer. Returns 0 when there is no more */
+	boardcursor_t *cursor = msg->board;
+	strbuffer_t *response;
+
+	if (!cursor) return 0;
+
+	if (cursor->generation != hostsetgeneration) board_findhosts(cursor);
+
+	response = newstrbuffer(BOARD_CHUNKSIZE + 4096);
+	if (cursor->format != BOARD_XML) {
+		clientlogrec.lastchange = infologrec.lastchange = trendslogrec.lastchange = cursor->dummytimes;
+	}
+	if (!cursor->lasthost && (cursor->hostidx == 0)) {
+		if (cursor->format == BOARD_XML) {
+			addtobuffer(response, "<?xml version='1.0' encoding='ISO-8859-1'?>\n");
+			addtobuffer(response, "<StatusBoard>\n");
+		}
+		else if (cursor->format == BOARD_BINARY) {
+			binboard_header(cursor->writer, response, cursor->columns);
+		}
+	}
+
+	while ((cursor->hostidx < cursor->hostcount) && (STRBUFLEN(response) < BOARD_CHUNKSIZE)) {
+		xymond_hostlist_t *hwalk = cursor->hosts[cursor->hostidx++];
+
+		/* If there is a hostname filter, drop the "summary" 'hosts' */
+		if (cursor->havehostfilter && (hwalk->hosttype != H_NORMAL)) continue;
+
+		if (cursor->format == BOARD_XML)
+			board_xmlhost(response, cursor, hwalk);
+		else
+			board_texthost(response, cursor, hwalk);
+	}
+
+	if (cursor->hostidx < cursor->hostcount) {
+		if (cursor->lasthost) xfree(cursor->lasthost);
+		cursor->lasthost = strdup(cursor->hosts[cursor->hostidx-1]->hostname);
+	}
+	else {
+		if (cursor->format == BOARD_XML) addtobuffer(response, "</StatusBoard>\n");
+		else if (cursor->format == BOARD_BINARY) binboard_end(cursor->writer, response);
+		board_free(msg);
+	}
+
+	if (msg->buf) xfree(msg->buf);
+	msg->buflen = STRBUFLEN(response);
+	msg->bufp = msg->buf = grabstrbuffer(response);
+
+	return (msg->buflen > 0);
+}
+
+void board_start(conn_t *msg, int format)
+{
+	boardcursor_t *cursor;
+	char *fields = NULL;
+
+	if (format == BOARD_TEXT) {
+		/* "format=binary" asks for the binary layout described in lib/binboard.c */
+		char *p = strstr(msg->buf, " format=binary");
+
+		if (p && ((*(p+14) == '\0') || isspace((int)*(p+14)))) format = BOARD_BINARY;
+	}
+
+	cursor = (boardcursor_t *)calloc(1, sizeof(boardcursor_t));
+	cursor->format = format;
+	cursor->acklevel = -1;
+	cursor->filter = setup_filter(msg->buf, &fields, &cursor->acklevel, &cursor->havehostfilter);
+
+	if (format != BOARD_XML) {
+		if (!fields) fields = "hostname,testname,color,flags,lastchange,logtime,validtime,acktime,disabletime,sender,cookie,line1";
+		cursor->fields = setup_fields(fields);
+
+		if (format == BOARD_BINARY) {
+			for (cursor->columns = 0; (cursor->fields[cursor->columns].field != F_NONE); cursor->columns++) ;
+			cursor->writer = binboard_newwriter();
+		}
+
+		/* Setup fake log-records for the "clientlog", "info" and "trends" data. */
+		cursor->dummytimes = (time_t *)calloc((flapcount > 0) ? flapcount : 1, sizeof(time_t));
+
+		if (!faketestinit) {
+			memset(&clienttest, 0, sizeof(clienttest));
+			clienttest.name = xgetenv("CLIENTCOLUMN");
+			memset(&clientlogrec, 0, sizeof(clientlogrec));
+			clientlogrec.test = &clienttest;
+
+			memset(&infotest, 0, sizeof(infotest));
+			infotest.name = xgetenv("INFOCOLUMN");
+			memset(&infologrec, 0, sizeof(infologrec));
+			infologrec.test = &infotest;
+
+			memset(&trendstest, 0, sizeof(trendstest));
+			trendstest.name = xgetenv("TRENDSCOLUMN");
+			memset(&trendslogrec, 0, sizeof(trendslogrec));
+			trendslogrec.test = &trendstest;
+
+			clientlogrec.color = infologrec.color = trendslogrec.color = COL_GREEN;
+			clientlogrec.message = infologrec.message = trendslogrec.message = "";
+			clientlogrec.sender = infologrec.sender = trendslogrec.sender = "xymond";
+			faketestinit = 1;
+		}
+		clientlogrec.lastchange = infologrec.lastchange = trendslogrec.lastchange = cursor->dummytimes;
+
+		/* If one of the fake logs can match, all normal hosts have a candidate log */
+		cursor->fakematch = (match_test_filter(&clientlogrec, cursor->filter) || match_test_filter(&infologrec, cursor->filter) || match_test_filter(&trendslogrec, cursor->filter));
+	}
+	else {
+		cursor->dummytimes = NULL;
+	}
+
+	board_findhosts(cursor);
+
+	msg->board = cursor;
+	msg->doingwhat = RESPONDING;
+	board_fill(msg);
+}
+
+
+void do_message(conn_t *msg, char *origin, int viabfq)
+{
+	static int nesting = 0;
+	xymond_hostlist_t *h;
+	testinfo_t *t;
+	xymond_log_t *log;
+	int color;
+	char *downcause;
+	char *grouplist;
+	time_t now, timeroffset;
+	char *msgfrom;
+	enum msgcmd_t msgcmd;
+	static struct timespec msgstart;
+
+	nesting++;
+	if (nesting == 1) LATENCY_START(msgstart);
+	if (debug) {
+		char *eoln = strchr(msg->buf, '\n');
+
+		if (eoln) *eoln = '\0';
+		dbgprintf("-> do_message/%d (%d bytes): %s\n", nesting, msg->buflen, msg->buf);
+		if (eoln) *eoln = '\n';
+	}
+
+	if (strncmp(msg->buf, "compress:", 9) == 0) {
+		char *expanded, errtxt[300];
+		size_t expandedsz;
+		char *origbuf, *origbufp;
+		size_t origbuflen, origbufsz;
+		struct timespec expandstart;
+
+		LATENCY_START(expandstart);
+		expanded = expand_message(msg, NULL, &expandedsz, errtxt, sizeof(errtxt));
+		LATENCY_END(LAT_DECOMPRESS, expandstart);
+		if (!expanded) {
+			errprintf("%s", errtxt);
 			goto done;
 		}
+
+		origbuf = msg->buf; origbuflen = msg->buflen; origbufsz = msg->bufsz; origbufp = msg->bufp;
+
+		msg->buflen = msg->bufsz = expandedsz;
+		msg->buf = expanded;
+		msg->bufp = msg->buf + msg->buflen; *(msg->bufp) = '\0';
+
+		do_message(msg, origin, viabfq);
+
+		xfree(msg->buf); // uncompress gives us a new buffer each time
+		msg->buf=origbuf; msg->buflen=origbuflen; msg->bufsz=origbufsz; msg->bufp=origbufp;
+
+		goto done;
 	}
 
 	/* Handle size:#### messages that have made it through (likely via compression) */
@@ -3787,9 +5110,10 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 	}
 
 	/* Count statistics */
-	update_statistics(msg->buf, viabfq);
+	msgcmd = find_msgcmd(msg->buf);
+	update_statistics(msgcmd, msg->buf, viabfq);
 
-	if (strncmp(msg->buf, "extcombo ", 9) == 0) {
+	if (msgcmd == MC_EXTCOMBO) {
 		char *ofsline, *origbuf, *p, *ofsstr, *tokr = NULL;
 		off_t startofs, endofs;
 
@@ -3836,15 +5160,23 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 
 		msg->buf = origbuf;
 	}
-	else if (strncmp(msg->buf, "combo\n", 6) == 0) {
+	else if ((msgcmd == MC_COMBO) && (msg->buf[5] == '\n')) {
 		char *currmsg, *nextmsg;
+		int partidx = 0;
 
-		currmsg = msg->buf+6;
+		currmsg = (msg->comboparts ? msg->comboparts[0] : (char *)msg->buf+6);
 		do {
 			int validsender = 1;
 
-			nextmsg = strstr(currmsg, "\n\nstatus");
-			if (nextmsg) { *(nextmsg+1) = '\0'; nextmsg += 2; }
+			if (msg->comboparts) {
+				/* Already split up by a parse thread */
+				partidx++;
+				nextmsg = ((partidx < msg->combopartcount) ? msg->comboparts[partidx] : NULL);
+			}
+			else {
+				nextmsg = strstr(currmsg, "\n\nstatus");
+				if (nextmsg) { *(nextmsg+1) = '\0'; nextmsg += 2; }
+			}
 
 			/* Pick out the real sender of this message */
 			get_sender(msg, currmsg, "\nStatus message received from ");
@@ -3879,13 +5211,13 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 						p = currmsg + strcspn(currmsg, "\r\n");
 						if ((*p == '\r') || (*p == '\n')) { savech = *p; *p = '\0'; }
 						else p = NULL;
-						line1 = strdup(currmsg); if (p) *p = savech;
+						line1 = xarena_strdup(msgarena, currmsg); if (p) *p = savech;
 
 						p = strtok(line1, " \t"); /* Skip the status keyword */
-						if (!p) { errprintf("BUG: Didn't get a line1 parsing client 'status' msg\n"); xfree (line1); break; }
+						if (!p) { errprintf("BUG: Didn't get a line1 parsing client 'status' msg\n"); break; }
 
 						hostname = strtok(NULL, " \t"); /* Actually, HOSTNAME.COLLECTORID */
-						if (!hostname) { errprintf("BUG: Didn't get a hostname parsing client msg\n"); xfree(line1); break; }
+						if (!hostname) { errprintf("BUG: Didn't get a hostname parsing client msg\n"); break; }
 
 						p = strtok(NULL, " \t"); /* Skip the client keyword */
 						if (p != NULL) clientos = strtok(NULL, " \t"); /* Get the SERVEROSTYPE */
@@ -3897,13 +5229,12 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 
 						dbgprintf(" found a client message for %s, collector '%s', os '%s', class '%s'\n", h->hostname, collectorid, clientos, clientclass);
 						handle_client(currmsg, msg->sender, h->hostname, (collectorid ? collectorid : ""), (clientos ? clientos : "") , (clientclass ? clientclass : ""));
-						xfree(line1);
 					}
 					break;
 
 				  default:
 					/* Count individual status-messages also */
-					update_statistics(currmsg, viabfq);
+					update_statistics(find_msgcmd(currmsg), currmsg, viabfq);
 
 					if (h && t && log && (color != -1)) {
 						handle_status(currmsg, msg->sender, h->hostname, t->name, grouplist, log, color, downcause, 0);
@@ -3915,7 +5246,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			currmsg = nextmsg;
 		} while (currmsg);
 	}
-	else if (strncmp(msg->buf, "combodata\n", 10) == 0) {
+	else if ((msgcmd == MC_COMBODATA) && (msg->buf[9] == '\n')) {
 		char *currmsg, *nextmsg;
 
 		char *hostname = NULL, *testname = NULL;
@@ -3938,13 +5269,13 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			btest = strrchr(bhost, '.');
 			if (btest) {
 				*btest = '\0';
-				hostname = strdup(bhost);
+				hostname = xarena_strdup(msgarena, bhost);
 				uncommafy(hostname);	/* For BB compatibility */
 				*btest = '.';
-				testname = strdup(btest+1);
+				testname = xarena_strdup(msgarena, btest+1);
 
-				if (*hostname == '\0') { errprintf("Invalid data message from %s - blank hostname\n", msg->sender); xfree(hostname); hostname = NULL; }
-				if (*testname == '\0') { errprintf("Invalid data message from %s - blank testname\n", msg->sender); xfree(testname); testname = NULL; }
+				if (*hostname == '\0') { errprintf("Invalid data message from %s - blank hostname\n", msg->sender); hostname = NULL; }
+				if (*testname == '\0') { errprintf("Invalid data message from %s - blank testname\n", msg->sender); testname = NULL; }
 			}
 			else {
 				errprintf("Invalid data message - no testname in '%s'\n", bhost);
@@ -3974,7 +5305,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 					handle_data(currmsg, msg->sender, origin, hname, testname);
 				}
 
-				xfree(hostname); xfree(testname);
+				hostname = testname = NULL;
 
 				// MEMUNDEFINE(hostip);
 			}
@@ -3982,7 +5313,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			currmsg = nextmsg;
 		} while (currmsg);
 	}
-	else if (strncmp(msg->buf, "modify", 6) == 0) {
+	else if (msgcmd == MC_MODIFY) {
 		char *currmsg, *nextmsg;
 
 		currmsg = msg->buf;
@@ -3998,7 +5329,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			currmsg = nextmsg;
 		} while (currmsg);
 	}
-	else if (strncmp(msg->buf, "status", 6) == 0) {
+	else if (msgcmd == MC_STATUS) {
 		get_sender(msg, msg->buf, "\nStatus message received from ");
 
 		if (statussenders) {
@@ -4030,13 +5361,13 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 				p = msg->buf + strcspn(msg->buf, "\r\n");
 				if ((*p == '\r') || (*p == '\n')) { savech = *p; *p = '\0'; }
 				else p = NULL;
-				line1 = strdup(msg->buf); if (p) *p = savech;
+				line1 = xarena_strdup(msgarena, msg->buf); if (p) *p = savech;
 
 				p = strtok(line1, " \t"); /* Skip the status keyword */
-				if (!p) { errprintf("BUG: Didn't get a line1 parsing client 'status' msg\n"); xfree(line1); break; }
+				if (!p) { errprintf("BUG: Didn't get a line1 parsing client 'status' msg\n"); break; }
 
 				hostname = strtok(NULL, " \t"); /* Actually, HOSTNAME.COLLECTORID */
-				if (!hostname) { errprintf("BUG: Didn't get a hostname parsing client msg\n"); xfree(line1); break; }
+				if (!hostname) { errprintf("BUG: Didn't get a hostname parsing client msg\n"); break; }
 
 				p = strtok(NULL, " \t"); /* Skip the client keyword */
 				if (p) clientos = strtok(NULL, " \t"); /* Get the SERVEROSTYPE */
@@ -4048,7 +5379,6 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 
 				dbgprintf(" found a client message for %s, collector '%s', os '%s', class '%s'\n", h->hostname, collectorid, clientos, clientclass);
 				handle_client(msg->buf, msg->sender, h->hostname, (collectorid ? collectorid : ""), (clientos ? clientos : "") , (clientclass ? clientclass : ""));
-				xfree(line1);
 			}
 			break;
 
@@ -4059,7 +5389,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			break;
 		}
 	}
-	else if (strncmp(msg->buf, "data", 4) == 0) {
+	else if (msgcmd == MC_DATA) {
 		char *hostname = NULL, *testname = NULL;
 		char *bhost, *ehost, *btest;
 		char savechar;
@@ -4073,13 +5403,13 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 		btest = strrchr(bhost, '.');
 		if (btest) {
 			*btest = '\0';
-			hostname = strdup(bhost);
+			hostname = xarena_strdup(msgarena, bhost);
 			uncommafy(hostname);	/* For BB compatibility */
 			*btest = '.';
-			testname = strdup(btest+1);
+			testname = xarena_strdup(msgarena, btest+1);
 
-			if (*hostname == '\0') { errprintf("Invalid data message from %s - blank hostname\n", msg->sender); xfree(hostname); hostname = NULL; }
-			if (*testname == '\0') { errprintf("Invalid data message from %s - blank testname\n", msg->sender); xfree(testname); testname = NULL; }
+			if (*hostname == '\0') { errprintf("Invalid data message from %s - blank hostname\n", msg->sender); hostname = NULL; }
+			if (*testname == '\0') { errprintf("Invalid data message from %s - blank testname\n", msg->sender); testname = NULL; }
 		}
 		else {
 			errprintf("Invalid data message - no testname in '%s'\n", bhost);
@@ -4106,18 +5436,16 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			else {
 				handle_data(msg->buf, msg->sender, origin, hname, testname);
 			}
-
-			xfree(hostname); xfree(testname);
 		}
 	}
-	else if (strncmp(msg->buf, "summary", 7) == 0) {
+	else if (msgcmd == MC_SUMMARY) {
 		/* Summaries are always allowed. Or should we ? */
 		get_hts(msg->buf, msg->sender, origin, &h, &t, NULL, &log, &color, NULL, NULL, 1, 1);
 		if (h && t && log && (color != -1)) {
 			handle_status(msg->buf, msg->sender, h->hostname, t->name, NULL, log, color, NULL, 0);
 		}
 	}
-	else if ((strncmp(msg->buf, "notes", 5) == 0) || (strncmp(msg->buf, "usermsg", 7) == 0)) {
+	else if ((msgcmd == MC_NOTES) || (msgcmd == MC_USERMSG)) {
 		char *id = NULL;
 
 		{
@@ -4169,13 +5497,13 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 
 		xfree(id);
 	}
-	else if (strncmp(msg->buf, "enable", 6) == 0) {
+	else if (msgcmd == MC_ENABLE) {
 		handle_enadis(1, msg, msg->sender, viabfq);
 	}
-	else if (strncmp(msg->buf, "disable", 7) == 0) {
+	else if (msgcmd == MC_DISABLE) {
 		handle_enadis(0, msg, msg->sender, viabfq);
 	}
-	else if (strncmp(msg->buf, "config hosts.cfg", 16) == 0) {
+	else if ((msgcmd == MC_CONFIG) && (strncmp(msg->buf, "config hosts.cfg", 16) == 0)) {
 		char *conffn, *p;
 
 		if (viabfq || !oksender(statussenders, NULL, msg->sender, msg->buf)) goto done;
@@ -4192,7 +5520,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 		}
 		xfree(conffn);
 	}
-	else if (strncmp(msg->buf, "config", 6) == 0) {
+	else if (msgcmd == MC_CONFIG) {
 		char *conffn, *p;
 
 		if (viabfq || !oksender(statussenders, NULL, msg->sender, msg->buf)) goto done;
@@ -4207,7 +5535,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 		}
 		xfree(conffn);
 	}
-	else if (allow_downloads && (strncmp(msg->buf, "download", 8) == 0)) {
+	else if (allow_downloads && (msgcmd == MC_DOWNLOAD)) {
 		char *fn, *p;
 
 		if (viabfq || !oksender(statussenders, NULL, msg->sender, msg->buf)) goto done;
@@ -4222,20 +5550,20 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 		}
 		xfree(fn);
 	}
-	else if (strncmp(msg->buf, "flush filecache", 15) == 0) {
+	else if ((msgcmd == MC_FLUSH) && (strncmp(msg->buf, "flush filecache", 15) == 0)) {
 		flush_filecache();
 	}
-	else if ( (strcmp(msg->buf, "reload") == 0) || (strcmp(msg->buf, "rotate") == 0) ) {
+	else if ( ((msgcmd == MC_RELOAD) || (msgcmd == MC_ROTATE)) && (msg->buf[6] == '\0') ) {
 		posttoall(msg->buf);
 	}
-	else if (strncmp(msg->buf, "query ", 6) == 0) {
+	else if ((msgcmd == MC_QUERY) && (msg->buf[5] == ' ')) {
 		get_hts(msg->buf, msg->sender, origin, &h, &t, NULL, &log, &color, NULL, NULL, 0, 0);
 		if (viabfq || !oksender(statussenders, (h ? hostinfo(h->hostname) : NULL), msg->sender, msg->buf)) goto done;
 
 		if (log) {
 			xfree(msg->buf);
 			msg->doingwhat = RESPONDING;
-			if (log->message) {
+			if (log->message || log->zmessage) {
 				unsigned char *bol, *eoln;
 				int msgcol;
 				char response[500];
@@ -4261,7 +5589,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			}
 		}
 	}
-	else if ((strncmp(msg->buf, "xymondlog ", 10) == 0) || (strncmp(msg->buf, "hobbitdlog ", 11) == 0)) {
+	else if (((msgcmd == MC_XYMONDLOG) && (msg->buf[9] == ' ')) || ((msgcmd == MC_HOBBITDLOG) && (msg->buf[10] == ' '))) {
 		/* 
 		 * Request for a single status log
 		 * xymondlog HOST.TEST [fields=FIELDLIST]
@@ -4283,7 +5611,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			strbuffer_t *logdata;
 
 			flush_acklist(log, 0);
-			if (log->message == NULL) {
+			if (log_message(log) == NULL) {
 				errprintf("%s.%s has a NULL message\n", log->host->hostname, log->test->name);
 				log->message = strdup("No data");
 				log->msgsz = strlen(log->message) + 1;
@@ -4291,7 +5619,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 
 			xfree(msg->buf);
 			logdata = generate_outbuf(NULL, logfields, h, log, acklevel);
-			addtobuffer(logdata, msg_data(log->message, 0));
+			addtobuffer(logdata, msg_data(log_message(log), 0));
 
 			msg->doingwhat = RESPONDING;
 			msg->buflen = STRBUFLEN(logdata);
@@ -4301,7 +5629,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 		clear_filter(logfilter);
 		xfree(logfields);
 	}
-	else if ((strncmp(msg->buf, "xymondxlog ", 11) == 0) || (strncmp(msg->buf, "hobbitdxlog ", 12) == 0)) {
+	else if (((msgcmd == MC_XYMONDXLOG) && (msg->buf[10] == ' ')) || ((msgcmd == MC_HOBBITDXLOG) && (msg->buf[11] == ' '))) {
 		/* 
 		 * Request for a single status log in XML format
 		 * xymondxlog HOST.TEST
@@ -4314,7 +5642,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			strbuffer_t *response = newstrbuffer(0);
 
 			flush_acklist(log, 0);
-			if (log->message == NULL) {
+			if (log_message(log) == NULL) {
 				errprintf("%s.%s has a NULL message\n", log->host->hostname, log->test->name);
 				log->message = strdup("No data");
 				log->msgsz = strlen(log->message) + 1;
@@ -4352,7 +5680,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 				addtobuffer(response, "  <DisMsg>N/A</DisMsg>\n");
 
 			addtobuffer_many(response, 
-				"  <Message><![CDATA[", msg_data(log->message, 0), "]]></Message>\n",
+				"  <Message><![CDATA[", msg_data(log_message(log), 0), "]]></Message>\n",
 				"</ServerStatus>\n",
 				NULL);
 
@@ -4361,221 +5689,25 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			msg->bufp = msg->buf = grabstrbuffer(response);
 		}
 	}
-	else if ((strncmp(msg->buf, "xymondboard", 11) == 0) || (strncmp(msg->buf, "hobbitdboard", 12) == 0)) {
+	else if ((msgcmd == MC_XYMONDBOARD) || (msgcmd == MC_HOBBITDBOARD)) {
 		/* 
 		 * Request for a summmary of all known status logs
 		 *
 		 */
-		xtreePos_t hosthandle;
-		xymond_hostlist_t *hwalk;
-		xymond_log_t *lwalk, *firstlog;
-		time_t *dummytimes;
-		static testinfo_t trendstest, infotest, clienttest;
-		static xymond_log_t trendslogrec, infologrec, clientlogrec;
-		static int faketestinit = 0;
-		hostfilter_rec_t *logfilter;
-		boardfield_t *logfields;
-		char *fields = NULL;
-		int acklevel = -1, havehostfilter = 0;
-		strbuffer_t *response;
-		static size_t lastboardsize = 0;
-
 		if (viabfq || !oksender(wwwsenders, NULL, msg->sender, msg->buf)) goto done;
 
-		logfilter = setup_filter(msg->buf, &fields, &acklevel, &havehostfilter);
-		if (!fields) fields = "hostname,testname,color,flags,lastchange,logtime,validtime,acktime,disabletime,sender,cookie,line1";
-		logfields = setup_fields(fields);
-
-		response = newstrbuffer(lastboardsize);
-
-		/* Setup fake log-records for the "clientlog", "info" and "trends" data. */
-		dummytimes = (time_t *)calloc((flapcount > 0) ? flapcount : 1, sizeof(time_t));
-
-		if (!faketestinit) {
-			memset(&clienttest, 0, sizeof(clienttest));
-			clienttest.name = xgetenv("CLIENTCOLUMN");
-			memset(&clientlogrec, 0, sizeof(clientlogrec));
-			clientlogrec.test = &clienttest;
-
-			memset(&infotest, 0, sizeof(infotest));
-			infotest.name = xgetenv("INFOCOLUMN");
-			memset(&infologrec, 0, sizeof(infologrec));
-			infologrec.test = &infotest;
-
-			memset(&trendstest, 0, sizeof(trendstest));
-			trendstest.name = xgetenv("TRENDSCOLUMN");
-			memset(&trendslogrec, 0, sizeof(trendslogrec));
-			trendslogrec.test = &trendstest;
-
-			clientlogrec.color = infologrec.color = trendslogrec.color = COL_GREEN;
-			clientlogrec.message = infologrec.message = trendslogrec.message = "";
-			clientlogrec.sender = infologrec.sender = trendslogrec.sender = "xymond";
-			faketestinit = 1;
-		}
-		clientlogrec.lastchange = infologrec.lastchange = trendslogrec.lastchange = dummytimes;
-
-
-		for (hosthandle = xtreeFirst(rbhosts); (hosthandle != xtreeEnd(rbhosts)); hosthandle = xtreeNext(rbhosts, hosthandle)) {
-			hwalk = xtreeData(rbhosts, hosthandle);
-			if (!hwalk) {
-				errprintf("host-tree has a record with no data\n");
-				continue;
-			}
-
-			/* If there is a hostname filter, drop the "summary" 'hosts' */
-			if (havehostfilter && (hwalk->hosttype != H_NORMAL)) continue;
-
-			firstlog = hwalk->logs;
-
-			if (hwalk->hosttype == H_NORMAL) {
-				void *hinfo = hostinfo(hwalk->hostname);
-
-				if (!hinfo) {
-					errprintf("Hostname '%s' in tree, but no host-info\n", hwalk->hostname);
-					continue;
-				}
-
-				/* Host/pagename filter */
-				if (!match_host_filter(hinfo, logfilter, 0, NULL)) continue;
-
-				/* Handle NOINFO, NOCLIENT and NOTRENDS here */
-				if (hwalk->clientmsgs && !xmh_item(hinfo, XMH_FLAG_NOCLIENT)) {
-					clientlogrec.next = firstlog;
-					firstlog = &clientlogrec;
-				}
-				if (!xmh_item(hinfo, XMH_FLAG_NOINFO)) {
-					infologrec.next = firstlog;
-					firstlog = &infologrec;
-				}
-				if (!xmh_item(hinfo, XMH_FLAG_NOTRENDS)) {
-					trendslogrec.next = firstlog;
-					firstlog = &trendslogrec;
-				}
-			}
-
-			clientlogrec.host = trendslogrec.host = infologrec.host = hwalk;
-
-			for (lwalk = firstlog; (lwalk); lwalk = lwalk->next) {
-				if (!match_test_filter(lwalk, logfilter)) continue;
-
-				if (lwalk->message == NULL) {
-					errprintf("%s.%s has a NULL message\n", (lwalk->host->hostname ? lwalk->host->hostname : "<no host>"), (lwalk->test->name ? lwalk->test->name : "<no test>"));
-					lwalk->message = strdup("No data");
-					lwalk->msgsz = strlen(lwalk->message) + 1;
-				}
-
-				response = generate_outbuf(&response, logfields, hwalk, lwalk, acklevel);
-			}
-		}
-
-		if (STRBUFLEN(response) > lastboardsize) lastboardsize = STRBUFLEN(response);
-
-		xfree(msg->buf);
-		msg->doingwhat = RESPONDING;
-		msg->buflen = STRBUFLEN(response);
-		msg->bufp = msg->buf = grabstrbuffer(response);
-
-		clear_filter(logfilter);
-		xfree(logfields);
-		xfree(dummytimes);
+		board_start(msg, BOARD_TEXT);
 	}
-	else if ((strncmp(msg->buf, "xymondxboard", 12) == 0) || (strncmp(msg->buf, "hobbitdxboard", 13) == 0)) {
+	else if ((msgcmd == MC_XYMONDXBOARD) || (msgcmd == MC_HOBBITDXBOARD)) {
 		/* 
 		 * Request for a summmary of all known status logs in XML format
 		 *
 		 */
-		xtreePos_t hosthandle;
-		xymond_hostlist_t *hwalk;
-		xymond_log_t *lwalk;
-		hostfilter_rec_t *logfilter;
-		char *fields = NULL;
-		int acklevel = -1, havehostfilter = 0;
-		static size_t lastboardsize = 0;
-		strbuffer_t *response;
-
 		if (viabfq || !oksender(wwwsenders, NULL, msg->sender, msg->buf)) goto done;
 
-		logfilter = setup_filter(msg->buf, &fields, &acklevel, &havehostfilter);
-		response = newstrbuffer(lastboardsize);
-
-		addtobuffer(response, "<?xml version='1.0' encoding='ISO-8859-1'?>\n");
-		addtobuffer(response, "<StatusBoard>\n");
-
-		for (hosthandle = xtreeFirst(rbhosts); (hosthandle != xtreeEnd(rbhosts)); hosthandle = xtreeNext(rbhosts, hosthandle)) {
-			hwalk = xtreeData(rbhosts, hosthandle);
-			if (!hwalk) {
-				errprintf("host-tree has a record with no data\n");
-				continue;
-			}
-
-			/* If there is a hostname filter, drop the "summary" 'hosts' */
-			if (havehostfilter && (hwalk->hosttype != H_NORMAL)) continue;
-
-			if (hwalk->hosttype == H_NORMAL) {
-				void *hinfo;
-				hinfo = hostinfo(hwalk->hostname);
-
-				if (!hinfo) {
-					errprintf("Hostname '%s' in tree, but no host-info\n", hwalk->hostname);
-					continue;
-				}
-
-				/* Host/pagename filter */
-				if (!match_host_filter(hinfo, logfilter, 0, NULL)) continue;
-			}
-
-			for (lwalk = hwalk->logs; (lwalk); lwalk = lwalk->next) {
-				char *eoln;
-
-				if (!match_test_filter(lwalk, logfilter)) continue;
-
-				if (lwalk->message == NULL) {
-					errprintf("%s.%s has a NULL message\n", lwalk->host->hostname, lwalk->test->name);
-					lwalk->message = strdup("No data");
-					lwalk->msgsz = strlen(lwalk->message) + 1;
-				}
-
-				eoln = strchr(lwalk->message, '\n');
-				if (eoln) *eoln = '\0';
-
-				addtobuffer_many(response, 
-					"  <ServerStatus>\n",
-					"    <ServerName>", hwalk->hostname, "</ServerName>\n",
-					"    <Type>", lwalk->test->name, "</Type>\n",
-					"    <Status>", colorname(lwalk->color), "</Status>\n",
-					"    <TestFlags>", (lwalk->testflags ? lwalk->testflags : ""), "</TestFlags>\n",
-					"    <LastChange>", timestr(lwalk->lastchange[0]), "</LastChange>\n",
-					"    <LogTime>", timestr(lwalk->logtime), "</LogTime>\n",
-					"    <ValidTime>", timestr(lwalk->validtime), "</ValidTime>\n",
-					"    <AckTime>", timestr(lwalk->acktime), "</AckTime>\n",
-					"    <DisableTime>", timestr(lwalk->enabletime), "</DisableTime>\n",
-					"    <Sender>", lwalk->sender, "</Sender>\n",
-					NULL);
-				timestr(-999);
-
-				if (lwalk->cookie && (lwalk->cookieexpires > now))
-					addtobuffer_many(response, "    <Cookie>", lwalk->cookie, "</Cookie>\n", NULL);
-				else
-					addtobuffer(response, "    <Cookie>N/A</Cookie>\n");
-
-				addtobuffer_many(response, 
-					"    <MessageSummary><![CDATA[", lwalk->message, "]]></MessageSummary>\n",
-					"  </ServerStatus>\n",
-					NULL);
-				if (eoln) *eoln = '\n';
-			}
-		}
-		addtobuffer(response, "</StatusBoard>\n");
-
-		xfree(msg->buf);
-		msg->doingwhat = RESPONDING;
-		msg->buflen = STRBUFLEN(response);
-		msg->bufp = msg->buf = grabstrbuffer(response);
-		if (msg->buflen > lastboardsize) lastboardsize = msg->buflen;
-
-		clear_filter(logfilter);
+		board_start(msg, BOARD_XML);
 	}
-	else if (strncmp(msg->buf, "hostinfo", 8) == 0) {
+	else if (msgcmd == MC_HOSTINFO) {
 		/* 
 		 * Request for host configuration info
 		 *
@@ -4639,7 +5771,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 		msg->bufp = msg->buf = grabstrbuffer(response);
 		if (msg->buflen > lastboardsize) lastboardsize = msg->buflen;
 	}
-	else if ((strncmp(msg->buf, "histsync", 8) == 0)) {
+	else if (msgcmd == MC_HISTSYNC) {
 		/* 
 		 * Mark one or many status logs as in need of a re-sync.
 		 * This causes a spurious stachg post to be sent, and a
@@ -4685,7 +5817,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 		clear_filter(logfilter);
 	}
 
-	else if ((strncmp(msg->buf, "xymondack", 9) == 0) || (strncmp(msg->buf, "hobbitdack", 10) == 0) || (strncmp(msg->buf, "ack ack_event", 13) == 0)) {
+	else if ((msgcmd == MC_XYMONDACK) || (msgcmd == MC_HOBBITDACK) || ((msgcmd == MC_ACK) && (strncmp(msg->buf, "ack ack_event", 13) == 0))) {
 		/* xymondack COOKIE DURATION TEXT */
 		char *p, *cookie, *durstr, *tok, *mcopy;
 		int duration;
@@ -4735,7 +5867,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 		}
 		xfree(mcopy);
 	}
-	else if (strncmp(msg->buf, "ackinfo ", 8) == 0) {
+	else if ((msgcmd == MC_ACKINFO) && (msg->buf[7] == ' ')) {
 		/* ackinfo HOST.TEST\nlevel\nvaliduntil\nackedby\nmsg */
 		int ackall = 0;
 
@@ -4755,7 +5887,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			}
 		}
 	}
-	else if (strncmp(msg->buf, "drop ", 5) == 0) {
+	else if ((msgcmd == MC_DROP) && (msg->buf[4] == ' ')) {
 		char *hostname = NULL, *testname = NULL;
 		char *p;
 
@@ -4772,7 +5904,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			handle_dropnrename(CMD_DROPTEST, msg->sender, hostname, testname, NULL);
 		}
 	}
-	else if (strncmp(msg->buf, "rename ", 7) == 0) {
+	else if ((msgcmd == MC_RENAME) && (msg->buf[6] == ' ')) {
 		char *hostname = NULL, *n1 = NULL, *n2 = NULL;
 		char *p;
 
@@ -4792,10 +5924,10 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			handle_dropnrename(CMD_RENAMETEST, msg->sender, hostname, n1, n2);
 		}
 	}
-	else if (strncmp(msg->buf, "dummy", 5) == 0) {
+	else if (msgcmd == MC_DUMMY) {
 		/* Do nothing */
 	}
-	else if (strncmp(msg->buf, "ping", 4) == 0) {
+	else if (msgcmd == MC_PING) {
 		/* Tell them we're here */
 		char id[128];
 
@@ -4807,7 +5939,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 		msg->bufp = msg->buf = strdup(id);
 		msg->buflen = strlen(msg->buf);
 	}
-	else if (strncmp(msg->buf, "proxyping", 9) == 0) {
+	else if (msgcmd == MC_PROXYPING) {
 		/* A proxyping was sent directly to us */
 		char id[128];
 
@@ -4819,12 +5951,12 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 		msg->bufp = msg->buf = strdup(id);
 		msg->buflen = strlen(msg->buf);
 	}
-	else if (strncmp(msg->buf, "notify", 6) == 0) {
+	else if (msgcmd == MC_NOTIFY) {
 		if (!viabfq && !oksender(maintsenders, NULL, msg->sender, msg->buf)) goto done;
 		get_hts(msg->buf, msg->sender, origin, &h, &t, NULL, &log, &color, NULL, NULL, 0, 0);
 		if (h && t) handle_notify(msg->buf, msg->sender, h->hostname, t->name);
 	}
-	else if (strncmp(msg->buf, "schedule", 8) == 0) {
+	else if (msgcmd == MC_SCHEDULE) {
 		char *cmd;
 
 		/*
@@ -4891,7 +6023,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			}
 		}
 	}
-	else if ((strncmp(msg->buf, "client", 6) == 0) && (strncmp(msg->buf, "clientlog", 9) != 0)) {
+	else if ((msgcmd == MC_CLIENT) || (msgcmd == MC_CLIENTSUBMIT) || (msgcmd == MC_CLIENTCONFIG)) {
 		/* "client[/COLLECTORID] HOSTNAME.CLIENTOS CLIENTCLASS" */
 		/* or "clientsubmit[/COLLECTORID] HOSTNAME.CLIENTOS CLIENTCLASS" (same as client, but don't send config back) */
 		/* or "clientconfig[/COLLECTORID] HOSTNAME.CLIENTOS CLIENTCLASS" (same as client, but don't handle msg, only send config back) */
@@ -4918,7 +6050,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 		else {
 			p = NULL;
 		}
-		line1 = strdup(msg->buf); if (p) *p = savech;
+		line1 = xarena_strdup(msgarena, msg->buf); if (p) *p = savech;
 
 		/* check for special handling -- no response, or respond only */
 		if (strncmp(line1, "clientsubmit", 12) == 0) send_clientconfig = 0;
@@ -4964,7 +6096,12 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 				}
 
 				if (hinfo) {
-					if (clientos) xmh_set_item(hinfo, XMH_OS, clientos);
+					char *oldos = xmh_item(hinfo, XMH_OS);
+
+					if (clientos && (!oldos || (strcmp(oldos, clientos) != 0))) {
+						xmh_set_item(hinfo, XMH_OS, clientos);
+						hostsetgeneration++;
+					}
 					if (clientclass && !collectorid) {
 						/*
 						 * If the default client sends an explicit class,
@@ -4973,8 +6110,10 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 						 */
 						char *forcedclass = xmh_item(hinfo, XMH_CLASS);
 
-						if (!forcedclass) 
+						if (!forcedclass) {
 							xmh_set_item(hinfo, XMH_CLASS, clientclass);
+							hostsetgeneration++;
+						}
 						else 
 							clientclass = forcedclass;
 					}
@@ -4995,10 +6134,8 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 				msg->buflen = strlen(msg->buf);
 			}
 		}
-
-		xfree(line1);
 	}
-	else if (strncmp(msg->buf, "clientlog ", 10) == 0) {
+	else if ((msgcmd == MC_CLIENTLOG) && (msg->buf[9] == ' ')) {
 		char *hostname, *p;
 		xtreePos_t hosthandle;
 		if (viabfq || !oksender(wwwsenders, NULL, msg->sender, msg->buf)) goto done;
@@ -5059,7 +6196,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			}
 		}
 	}
-	else if (strncmp(msg->buf, "ghostlist", 9) == 0) {
+	else if (msgcmd == MC_GHOSTLIST) {
 		/* NB: inverted */
 		if (!viabfq && oksender(wwwsenders, NULL, msg->sender, msg->buf)) {
 			xtreePos_t ghandle;
@@ -5085,7 +6222,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 		}
 	}
 
-	else if (strncmp(msg->buf, "multisrclist", 12) == 0) {
+	else if (msgcmd == MC_MULTISRCLIST) {
 		/* NB: inverted */
 		if (!viabfq && oksender(wwwsenders, NULL, msg->sender, msg->buf)) {
 			xtreePos_t mhandle;
@@ -5110,7 +6247,7 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 			msg->bufp = msg->buf;
 		}
 	}
-	else if (strncmp(msg->buf, "senderstats", 11) == 0) {
+	else if (msgcmd == MC_SENDERSTATS) {
 		xtreePos_t handle;
 		senderstats_t *rec;
 		strbuffer_t *resp;
@@ -5133,8 +6270,29 @@ void do_message(conn_t *msg, char *origin, int viabfq)
 		if (!msg->buf) msg->buf = strdup("");
 		msg->bufp = msg->buf;
 	}
+	else if (msgcmd == MC_XYMONDSTATS) {
+		strbuffer_t *resp;
+
+		if (viabfq || !oksender(wwwsenders, NULL, msg->sender, msg->buf)) goto done;
+
+		resp = newstrbuffer(0);
+		generate_xymondstats(resp);
+
+		msg->doingwhat = RESPONDING;
+		xfree(msg->buf);
+		msg->buflen = STRBUFLEN(resp);
+		msg->buf = grabstrbuffer(resp);
+		if (!msg->buf) msg->buf = strdup("");
+		msg->bufp = msg->buf;
+	}
 
 done:
+	/* The scratch memory is only needed until the outermost message has been handled */
+	if (nesting == 1) {
+		xarena_reset(msgarena);
+		LATENCY_END(LAT_MESSAGE, msgstart);
+	}
+
 	dbgprintf("<- do_message/%d\n", nesting);
 	nesting--;
 }
@@ -5189,7 +6347,7 @@ void save_checkpoint(void)
 				(int)lwalk->logtime, (int) lwalk->lastchange[0], (int) lwalk->validtime, 
 				(int) lwalk->enabletime, (int) lwalk->acktime, 
 				(lwalk->cookie ? lwalk->cookie : ""), (int) lwalk->cookieexpires,
-				nlencode(lwalk->message));
+				nlencode(log_message(lwalk)));
 			if (lwalk->dismsg) msgstr = nlencode(lwalk->dismsg); else msgstr = "";
 			if (iores >= 0) iores = fprintf(fd, "|%s", msgstr);
 			if (lwalk->ackmsg) msgstr = nlencode(lwalk->ackmsg); else msgstr = "";
@@ -5233,23 +6391,479 @@ void save_checkpoint(void)
 }
 
 
-void load_checkpoint(char *fn)
+static void checkpoint_log(chkwriter_t *w, xymond_log_t *lwalk, time_t now)
 {
-	FILE *fd;
-	strbuffer_t *inbuf;
-	char *item, *eoln;
-	int i, err;
+	int disabled, acked;
+	ackinfo_t *awalk;
+
+	/* Expired disables and acks are left out, like the text checkpoint does */
+	disabled = (lwalk->dismsg && ((lwalk->enabletime >= now) || (lwalk->enabletime == DISABLED_UNTIL_OK)));
+	acked = (lwalk->ackmsg && (lwalk->acktime >= now));
+
+	chk_begin(w, CHK_REC_LOG);
+	chk_addstr(w, lwalk->origin);
+	chk_addstr(w, lwalk->host->hostname);
+	chk_addstr(w, lwalk->test->name);
+	chk_addstr(w, lwalk->sender);
+	chk_addint(w, lwalk->color);
+	chk_addstr(w, lwalk->testflags);
+	chk_addint(w, lwalk->oldcolor);
+	chk_addint(w, lwalk->logtime);
+	chk_addint(w, lwalk->lastchange[0]);
+	chk_addint(w, lwalk->validtime);
+	chk_addint(w, (disabled ? lwalk->enabletime : 0));
+	chk_addint(w, (acked ? lwalk->acktime : 0));
+	chk_addstr(w, lwalk->cookie);
+	chk_addint(w, lwalk->cookieexpires);
+	chk_addstr(w, log_message(lwalk));
+	chk_addstr(w, (disabled ? lwalk->dismsg : NULL));
+	chk_addstr(w, (acked ? lwalk->ackmsg : NULL));
+	chk_addint(w, lwalk->redstart);
+	chk_addint(w, lwalk->yellowstart);
+	chk_end(w);
+
+	for (awalk = lwalk->acklist; (awalk); awalk = awalk->next) {
+		if ((awalk->cleartime < now) || (awalk->validuntil < now)) continue;
+
+		chk_begin(w, CHK_REC_ACK);
+		chk_addstr(w, lwalk->host->hostname);
+		chk_addstr(w, lwalk->test->name);
+		chk_addint(w, awalk->received);
+		chk_addint(w, awalk->validuntil);
+		chk_addint(w, awalk->cleartime);
+		chk_addint(w, awalk->level);
+		chk_addstr(w, awalk->ackedby);
+		chk_addstr(w, awalk->msg);
+		chk_end(w);
+	}
+}
+
+static void checkpoint_tasks(chkwriter_t *w)
+{
+	scheduletask_t *swalk;
+
+	chk_begin(w, CHK_REC_TASKRESET);
+	chk_end(w);
+
+	for (swalk = schedulehead; (swalk); swalk = swalk->next) {
+		chk_begin(w, CHK_REC_TASK);
+		chk_addint(w, swalk->id);
+		chk_addint(w, swalk->executiontime);
+		chk_addstr(w, swalk->sender);
+		chk_addstr(w, swalk->command);
+		chk_end(w);
+	}
+}
+
+static void clear_dirtylogs(void)
+{
+	while (dirtylogs) {
+		xymond_log_t *lwalk = dirtylogs;
+
+		dirtylogs = lwalk->dirtynext;
+		lwalk->dirty = 0;
+		lwalk->dirtynext = NULL;
+	}
+}
+
+void save_checkpoint_binary(int forcefull)
+{
+	/*
+	 * Binary checkpoints are written by xymond itself, without forking.
+	 * A full snapshot is written every checkpointfullinterval times; in between
+	 * we only append the logs that have changed to the journal file.
+	 */
+	char *tempfn, *journalfn;
+	chkwriter_t *w;
+	xtreePos_t hosthandle;
+	xymond_hostlist_t *hwalk;
+	xymond_log_t *lwalk;
+	time_t now = getcurrenttime(NULL);
+	int count = 0;
+
+	if (checkpointfn == NULL) return;
+
+	dbgprintf("-> save_checkpoint_binary\n");
+
+	journalfn = (char *)malloc(strlen(checkpointfn) + 10);
+	sprintf(journalfn, "%s.journal", checkpointfn);
+
+	if (!forcefull && !checkpointfull && checkpointjournal && (checkpointsincefull < checkpointfullinterval)) {
+		for (lwalk = dirtylogs; (lwalk); lwalk = lwalk->dirtynext) {
+			checkpoint_log(checkpointjournal, lwalk, now);
+			count++;
+		}
+		checkpoint_tasks(checkpointjournal);
+
+		if (chk_flush(checkpointjournal, 1) == 0) {
+			clear_dirtylogs();
+			checkpointsincefull++;
+			dbgprintf("Wrote %d changed logs to checkpoint journal\n", count);
+		}
+		else {
+			/* Start over with a new snapshot next time */
+			chk_close(checkpointjournal, 0);
+			checkpointjournal = NULL;
+			checkpointfull = 1;
+		}
+
+		xfree(journalfn);
+		dbgprintf("<- save_checkpoint_binary\n");
+		return;
+	}
+
+	checkpointgeneration = ((checkpointgeneration < now) ? now : checkpointgeneration+1);
+
+	tempfn = (char *)malloc(strlen(checkpointfn) + 20);
+	sprintf(tempfn, "%s.%d", checkpointfn, (int)now);
+	w = chk_create(tempfn, CHK_SNAPSHOT, checkpointgeneration, checkpointcompression);
+	if (w == NULL) {
+		xfree(tempfn);
+		xfree(journalfn);
+		return;
+	}
+
+	for (hosthandle = xtreeFirst(rbhosts); (hosthandle != xtreeEnd(rbhosts)); hosthandle = xtreeNext(rbhosts, hosthandle)) {
+		hwalk = xtreeData(rbhosts, hosthandle);
+
+		for (lwalk = hwalk->logs; (lwalk); lwalk = lwalk->next) {
+			checkpoint_log(w, lwalk, now);
+			count++;
+		}
+	}
+	checkpoint_tasks(w);
+
+	if (chk_close(w, 1) != 0) {
+		unlink(tempfn);
+	}
+	else if (rename(tempfn, checkpointfn) == -1) {
+		errprintf("I/O error while renaming the checkpoint file: %s\n", strerror(errno));
+		unlink(tempfn);
+	}
+	else {
+		/* The old journal belongs to the previous snapshot, so start a new one */
+		if (checkpointjournal) chk_close(checkpointjournal, 0);
+		checkpointjournal = chk_create(journalfn, CHK_JOURNAL, checkpointgeneration, checkpointcompression);
+		if (checkpointjournal && (chk_flush(checkpointjournal, 1) != 0)) {
+			chk_close(checkpointjournal, 0);
+			checkpointjournal = NULL;
+		}
+
+		clear_dirtylogs();
+		checkpointsincefull = 0;
+		checkpointfull = (checkpointjournal == NULL);
+		dbgprintf("Wrote %d logs to checkpoint snapshot\n", count);
+	}
+
+	xfree(tempfn);
+	xfree(journalfn);
+	dbgprintf("<- save_checkpoint_binary\n");
+}
+
+
+typedef struct restorelog_t {
+	char *originname, *hostname, *testname, *sender, *testflags, *statusmsg, *disablemsg, *ackmsg, *cookie;
+	int color, oldcolor;
+	time_t logtime, lastchange, validtime, enabletime, acktime, cookieexpires, yellowstart, redstart;
+} restorelog_t;
+
+static int restore_log(restorelog_t *rec)
+{
+	/*
+	 * Set up a status log from a checkpoint record. If we already have 
+	 * the log (when replaying a checkpoint journal), it is replaced.
+	 */
 	char *hostip = NULL;
+	char *hostname = rec->hostname, *testname = rec->testname;
 	xtreePos_t hosthandle, testhandle, originhandle;
+	xymond_hostlist_t *hitem;
+	testinfo_t *t;
+	char *origin, *eoln;
+	xymond_log_t *log, *ltail;
+	time_t validtime = rec->validtime;
+
+	/* Only load hosts we know; they may have been dropped while we were offline */
+	hostname = knownhost(hostname, &hostip, ghosthandling);
+	if (hostname == NULL) return 0;
+
+	/* Ignore the "client", "info" and "trends" data, since we generate on the fly now. */
+	if (strcmp(testname, xgetenv("INFOCOLUMN")) == 0) return 0;
+	if (strcmp(testname, xgetenv("TRENDSCOLUMN")) == 0) return 0;
+	if (strcmp(testname, xgetenv("CLIENTCOLUMN")) == 0) return 0;
+
+	/* Rename the now-forgotten internal statuses */
+	if (strcmp(hostname, getenv("MACHINEDOTS")) == 0) {
+		if (strcmp(testname, "bbgen") == 0) testname = "xymongen";
+		else if (strcmp(testname, "bbtest") == 0) testname = "xymonnet";
+		else if (strcmp(testname, "hobbitd") == 0) testname = "xymond";
+	}
+
+	dbgprintf("Status: Host=%s, test=%s\n", hostname, testname);
+
+	hosthandle = xtreeFind(rbhosts, hostname);
+	if (hosthandle == xtreeEnd(rbhosts)) {
+		/* New host */
+		hitem = create_hostlist_t(hostname, hostip);
+		hostcount++;
+	}
+	else {
+		hitem = xtreeData(rbhosts, hosthandle);
+	}
+
+	testhandle = xtreeFind(rbtests, testname);
+	if (testhandle == xtreeEnd(rbtests)) {
+		t = create_testinfo(testname);
+	}
+	else t = xtreeData(rbtests, testhandle);
+
+	originhandle = xtreeFind(rborigins, rec->originname);
+	if (originhandle == xtreeEnd(rborigins)) {
+		origin = strdup(rec->originname);
+		xtreeAdd(rborigins, origin, origin);
+	}
+	else origin = xtreeData(rborigins, originhandle);
+
+	log = host_findlog(hitem, t);
+	if (log) {
+		clear_cookie(log);
+		strpool_release(log->testflags);
+		strpool_release(log->sender);
+		clear_log_message(log);
+		if (log->line1) xfree(log->line1);
+		if (log->dismsg) xfree(log->dismsg);
+		if (log->ackmsg) xfree(log->ackmsg);
+		flush_acklist(log, 1);
+	}
+	else {
+		log = (xymond_log_t *) calloc(1, sizeof(xymond_log_t));
+		log->lastchange = (time_t *)calloc((flapcount > 0) ? flapcount : 1, sizeof(time_t));
+		for (ltail = hitem->logs; (ltail && ltail->next); ltail = ltail->next) ;
+		if (ltail) ltail->next = log; else hitem->logs = log;
+		log->test = t;
+		log->host = hitem;
+		log->color = NO_COLOR;
+		hitem->colorcount[NO_COLOR]++;
+		host_reindexlog(hitem, t);
+	}
+
+	if (strcmp(testname, xgetenv("PINGCOLUMN")) == 0) hitem->pinglog = log;
+
+	/* Fixup validtime in case of ack'ed or disabled tests */
+	if (validtime < rec->acktime) validtime = rec->acktime;
+	if (validtime < rec->enabletime) validtime = rec->enabletime;
+
+	log->test = t;
+	log->host = hitem;
+	log->origin = origin;
+	log_setcolor(log, rec->color);
+	log->oldcolor = rec->oldcolor;
+	log->activealert = (decide_alertstate(rec->color) == A_ALERT);
+	log->histsynced = 0;
+	log->testflags = ( (rec->testflags && strlen(rec->testflags)) ? strpool_get(rec->testflags) : NULL);
+	log->sender = strpool_get(rec->sender ? rec->sender : "");
+	log->logtime = rec->logtime;
+	log->lastchange[0] = rec->lastchange;
+	log->validtime = validtime;
+	log->enabletime = rec->enabletime;
+	if (log->enabletime == DISABLED_UNTIL_OK) log->validtime = INT_MAX;
+	expiry_update(log);
+	log->acktime = rec->acktime;
+	log->redstart = rec->redstart;
+	log->yellowstart = rec->yellowstart;
+	store_log_message(log, rec->statusmsg, strlen(rec->statusmsg));
+	log->line1 = malloc(MAXLINE1SIZE * sizeof(unsigned char) + 1);
+	eoln = strchr(rec->statusmsg, '\n'); if (eoln) *eoln = '\0';
+	snprintf(log->line1, MAXLINE1SIZE, "%s", msg_data(rec->statusmsg, 0));
+	if (eoln) *eoln = '\n';
+
+	log->dismsg = ((rec->disablemsg && strlen(rec->disablemsg)) ? strdup(rec->disablemsg) : NULL);
+	log->ackmsg = ((rec->ackmsg && strlen(rec->ackmsg)) ? strdup(rec->ackmsg) : NULL);
+
+	if (rec->cookie && *rec->cookie) {
+		log->cookie = strdup(rec->cookie);
+		log->cookieexpires = rec->cookieexpires;
+		xtreeAdd(rbcookies, log->cookie, log);
+	}
+	else {
+		log->cookie = NULL;
+		log->cookieexpires = 0;
+	}
+
+	return 1;
+}
+
+static void restore_ack(char *hostname, char *testname, ackinfo_t *newack)
+{
+	xtreePos_t hosthandle, testhandle;
 	xymond_hostlist_t *hitem = NULL;
 	testinfo_t *t = NULL;
-	char *origin = NULL;
-	xymond_log_t *ltail = NULL;
-	char *originname, *hostname, *testname, *sender, *testflags, *statusmsg, *disablemsg, *ackmsg, *cookie; 
-	time_t logtime, lastchange, validtime, enabletime, acktime, cookieexpires, yellowstart, redstart;
-	int color = COL_GREEN, oldcolor = COL_GREEN;
+	xymond_log_t *log = NULL;
+
+	hosthandle = xtreeFind(rbhosts, hostname);
+	if (hosthandle != xtreeEnd(rbhosts)) hitem = xtreeData(rbhosts, hosthandle);
+	testhandle = xtreeFind(rbtests, testname);
+	if (testhandle != xtreeEnd(rbtests)) t = xtreeData(rbtests, testhandle);
+
+	if (hitem && t) log = host_findlog(hitem, t);
+
+	if (log && newack->msg) {
+		newack->next = log->acklist;
+		log->acklist = newack;
+	}
+	else {
+		if (newack->ackedby) xfree(newack->ackedby);
+		if (newack->msg) xfree(newack->msg);
+		xfree(newack);
+	}
+}
+
+static void restore_task(scheduletask_t *newtask)
+{
+	if (newtask->id && (newtask->executiontime > getcurrenttime(NULL)) && newtask->sender && newtask->command) {
+		newtask->next = schedulehead;
+		schedulehead = newtask;
+	}
+	else {
+		if (newtask->sender) xfree(newtask->sender);
+		if (newtask->command) xfree(newtask->command);
+		xfree(newtask);
+	}
+}
+
+static int load_checkpoint_records(chkreader_t *r)
+{
+	int rectype, count = 0;
+
+	while ((rectype = chk_next(r)) != 0) {
+		switch (rectype) {
+		  case CHK_REC_LOG:
+			{
+				restorelog_t rec;
+
+				if ((chk_fieldcount(r) < 19) || !chk_str(r, 1) || !chk_str(r, 2) || !chk_str(r, 14)) {
+					errprintf("Invalid status record in checkpoint file\n");
+					break;
+				}
+
+				rec.originname = chk_str(r, 0); if (!rec.originname) rec.originname = "";
+				rec.hostname = chk_str(r, 1);
+				rec.testname = chk_str(r, 2);
+				rec.sender = chk_str(r, 3);
+				rec.color = chk_int(r, 4);
+				rec.testflags = chk_str(r, 5);
+				rec.oldcolor = chk_int(r, 6);
+				rec.logtime = chk_int(r, 7);
+				rec.lastchange = chk_int(r, 8);
+				rec.validtime = chk_int(r, 9);
+				rec.enabletime = chk_int(r, 10);
+				rec.acktime = chk_int(r, 11);
+				rec.cookie = chk_str(r, 12);
+				rec.cookieexpires = chk_int(r, 13);
+				rec.statusmsg = chk_str(r, 14);
+				rec.disablemsg = chk_str(r, 15);
+				rec.ackmsg = chk_str(r, 16);
+				rec.redstart = chk_int(r, 17);
+				rec.yellowstart = chk_int(r, 18);
+				if ((rec.color < 0) || (rec.color >= COL_COUNT)) break;
+				if ((rec.oldcolor < 0) || (rec.oldcolor > COL_COUNT)) rec.oldcolor = NO_COLOR;
+
+				count += restore_log(&rec);
+			}
+			break;
+
+		  case CHK_REC_ACK:
+			if ((chk_fieldcount(r) >= 8) && chk_str(r, 0) && chk_str(r, 1)) {
+				ackinfo_t *newack = (ackinfo_t *)calloc(1, sizeof(ackinfo_t));
+
+				newack->received = chk_int(r, 2);
+				newack->validuntil = chk_int(r, 3);
+				newack->cleartime = chk_int(r, 4);
+				newack->level = chk_int(r, 5);
+				newack->ackedby = strdup(chk_str(r, 6) ? chk_str(r, 6) : "");
+				newack->msg = (chk_str(r, 7) ? strdup(chk_str(r, 7)) : NULL);
+				restore_ack(chk_str(r, 0), chk_str(r, 1), newack);
+			}
+			break;
+
+		  case CHK_REC_TASKRESET:
+			while (schedulehead) {
+				scheduletask_t *zombie = schedulehead;
+
+				schedulehead = schedulehead->next;
+				xfree(zombie->sender);
+				xfree(zombie->command);
+				xfree(zombie);
+			}
+			break;
+
+		  case CHK_REC_TASK:
+			if (chk_fieldcount(r) >= 4) {
+				scheduletask_t *newtask = (scheduletask_t *)calloc(1, sizeof(scheduletask_t));
+
+				newtask->id = chk_int(r, 0);
+				newtask->executiontime = chk_int(r, 1);
+				newtask->sender = (chk_str(r, 2) ? strdup(chk_str(r, 2)) : NULL);
+				newtask->command = (chk_str(r, 3) ? strdup(chk_str(r, 3)) : NULL);
+				restore_task(newtask);
+			}
+			break;
+
+		  default:
+			dbgprintf("Ignoring unknown checkpoint record type %d\n", rectype);
+			break;
+		}
+	}
+
+	return count;
+}
+
+static void load_checkpoint_binary(char *fn)
+{
+	chkreader_t *r;
+	char *journalfn;
+	unsigned long long generation;
+	int count;
+
+	r = chk_open(fn);
+	if (r == NULL) return;
+
+	generation = chk_generation(r);
+	count = load_checkpoint_records(r);
+	chk_closeread(r);
+	dbgprintf("Loaded %d status logs\n", count);
+
+	/* Apply the changes saved after the snapshot was made */
+	journalfn = (char *)malloc(strlen(fn) + 10);
+	sprintf(journalfn, "%s.journal", fn);
+	if (access(journalfn, R_OK) == 0) {
+		r = chk_open(journalfn);
+		if (r && (chk_kind(r) == CHK_JOURNAL) && (chk_generation(r) == generation)) {
+			count = load_checkpoint_records(r);
+			dbgprintf("Loaded %d status logs from checkpoint journal\n", count);
+		}
+		else if (r) {
+			errprintf("Checkpoint journal %s does not match %s, ignored\n", journalfn, fn);
+		}
+		if (r) chk_closeread(r);
+	}
+	xfree(journalfn);
+}
+
+
+void load_checkpoint(char *fn)
+{
+	FILE *fd;
+	strbuffer_t *inbuf;
+	char *item;
+	int i, err;
+	restorelog_t rec;
 	int count = 0;
 
+	if (chk_isbinary(fn)) {
+		load_checkpoint_binary(fn);
+		return;
+	}
+
 	fd = fopen(fn, "r");
 	if (fd == NULL) {
 		errprintf("Cannot access checkpoint file %s for restore\n", fn);
@@ -5259,10 +6873,9 @@ void load_checkpoint(char *fn)
 	inbuf = newstrbuffer(0);
 	initfgets(fd);
 	while (unlimfgets(inbuf, fd)) {
-		originname = hostname = testname = sender = testflags = statusmsg = disablemsg = ackmsg = cookie = NULL;
-		logtime = lastchange = validtime = enabletime = acktime = cookieexpires = yellowstart = redstart = 0;
+		memset(&rec, 0, sizeof(rec));
+		rec.color = rec.oldcolor = COL_GREEN;
 		err = 0;
-		eoln = NULL;
 
 		if ((strncmp(STRBUF(inbuf), "@@XYMONDCHK-V1|.task.|", 22) == 0) || (strncmp(STRBUF(inbuf), "@@HOBBITDCHK-V1|.task.|", 23) == 0)) {
 			scheduletask_t *newtask = (scheduletask_t *)calloc(1, sizeof(scheduletask_t));
@@ -5281,39 +6894,21 @@ void load_checkpoint(char *fn)
 				item = gettok(NULL, "|\n"); i++;
 			}
 
-			if (newtask->id && (newtask->executiontime > getcurrenttime(NULL)) && newtask->sender && newtask->command) {
-				newtask->next = schedulehead;
-				schedulehead = newtask;
-			}
-			else {
-				if (newtask->sender) xfree(newtask->sender);
-				if (newtask->command) xfree(newtask->command);
-				xfree(newtask);
-			}
-
+			restore_task(newtask);
 			continue;
 		}
 
 		if ((strncmp(STRBUF(inbuf), "@@XYMONDCHK-V1|.acklist.|", 25) == 0) || (strncmp(STRBUF(inbuf), "@@HOBBITDCHK-V1|.acklist.|", 26) == 0)) {
-			xymond_log_t *log = NULL;
 			ackinfo_t *newack = (ackinfo_t *)calloc(1, sizeof(ackinfo_t));
 
-			hitem = NULL;
-
 			item = gettok(STRBUF(inbuf), "|\n"); i = 0;
 			while (item) {
 
 				switch (i) {
 				  case 0: break;
 				  case 1: break;
-				  case 2: 
-					hosthandle = xtreeFind(rbhosts, item); 
-					hitem = xtreeData(rbhosts, hosthandle);
-					break;
-				  case 3: 
-					testhandle = xtreeFind(rbtests, item);
-					t = (testhandle == xtreeEnd(rbtests)) ? NULL : xtreeData(rbtests, testhandle);
-					break;
+				  case 2: rec.hostname = item; break;
+				  case 3: rec.testname = item; break;
 				  case 4: newack->received = atoi(item); break;
 				  case 5: newack->validuntil = atoi(item); break;
 				  case 6: newack->cleartime = atoi(item); break;
@@ -5322,16 +6917,11 @@ void load_checkpoint(char *fn)
 				  case 9: newack->msg = strdup(item); break;
 				  default: break;
 				}
-				item = gettok(NULL, "|\n"); i++;
-			}
-
-			if (hitem && t) {
-				for (log = hitem->logs; (log && (log->test != t)); log = log->next) ;
+				item = gettok(NULL, "|\n"); i++;
 			}
 
-			if (log && newack->msg) {
-				newack->next = log->acklist;
-				log->acklist = newack;
+			if (rec.hostname && rec.testname) {
+				restore_ack(rec.hostname, rec.testname, newack);
 			}
 			else {
 				if (newack->ackedby) xfree(newack->ackedby);
@@ -5348,25 +6938,25 @@ void load_checkpoint(char *fn)
 		while (item && !err) {
 			switch (i) {
 			  case 0: err = ((strcmp(item, "@@XYMONDCHK-V1") != 0) && (strcmp(item, "@@HOBBITDCHK-V1") != 0) && (strcmp(item, "@@BBGENDCHK-V1") != 0)); break;
-			  case 1: originname = item; break;
-			  case 2: if (strlen(item)) hostname = item; else err=1; break;
-			  case 3: if (strlen(item)) testname = item; else err=1; break;
-			  case 4: sender = item; break;
-			  case 5: color = parse_color(item); if (color == -1) err = 1; break;
-			  case 6: testflags = item; break;
-			  case 7: oldcolor = parse_color(item); if (oldcolor == -1) oldcolor = NO_COLOR; break;
-			  case 8: logtime = atoi(item); break;
-			  case 9: lastchange = atoi(item); break;
-			  case 10: validtime = atoi(item); break;
-			  case 11: enabletime = atoi(item); break;
-			  case 12: acktime = atoi(item); break;
-			  case 13: cookie = item; break;
-			  case 14: cookieexpires = atoi(item); break;
-			  case 15: if (strlen(item)) statusmsg = item; else err=1; break;
-			  case 16: disablemsg = item; break;
-			  case 17: ackmsg = item; break;
-			  case 18: redstart = atoi(item); break;
-			  case 19: yellowstart = atoi(item); break;
+			  case 1: rec.originname = item; break;
+			  case 2: if (strlen(item)) rec.hostname = item; else err=1; break;
+			  case 3: if (strlen(item)) rec.testname = item; else err=1; break;
+			  case 4: rec.sender = item; break;
+			  case 5: rec.color = parse_color(item); if (rec.color == -1) err = 1; break;
+			  case 6: rec.testflags = item; break;
+			  case 7: rec.oldcolor = parse_color(item); if (rec.oldcolor == -1) rec.oldcolor = NO_COLOR; break;
+			  case 8: rec.logtime = atoi(item); break;
+			  case 9: rec.lastchange = atoi(item); break;
+			  case 10: rec.validtime = atoi(item); break;
+			  case 11: rec.enabletime = atoi(item); break;
+			  case 12: rec.acktime = atoi(item); break;
+			  case 13: rec.cookie = item; break;
+			  case 14: rec.cookieexpires = atoi(item); break;
+			  case 15: if (strlen(item)) rec.statusmsg = item; else err=1; break;
+			  case 16: rec.disablemsg = item; break;
+			  case 17: rec.ackmsg = item; break;
+			  case 18: rec.redstart = atoi(item); break;
+			  case 19: rec.yellowstart = atoi(item); break;
 			  default: err = 1;
 			}
 
@@ -5380,113 +6970,10 @@ void load_checkpoint(char *fn)
 
 		if (err) continue;
 
-		/* Only load hosts we know; they may have been dropped while we were offline */
-		hostname = knownhost(hostname, &hostip, ghosthandling);
-		if (hostname == NULL) continue;
-
-		/* Ignore the "client", "info" and "trends" data, since we generate on the fly now. */
-		if (strcmp(testname, xgetenv("INFOCOLUMN")) == 0) continue;
-		if (strcmp(testname, xgetenv("TRENDSCOLUMN")) == 0) continue;
-		if (strcmp(testname, xgetenv("CLIENTCOLUMN")) == 0) continue;
-
-		/* Rename the now-forgotten internal statuses */
-		if (strcmp(hostname, getenv("MACHINEDOTS")) == 0) {
-			if (strcmp(testname, "bbgen") == 0) testname = "xymongen";
-			else if (strcmp(testname, "bbtest") == 0) testname = "xymonnet";
-			else if (strcmp(testname, "hobbitd") == 0) testname = "xymond";
-		}
-
-		dbgprintf("Status: Host=%s, test=%s\n", hostname, testname); count++;
-
-		hosthandle = xtreeFind(rbhosts, hostname);
-		if (hosthandle == xtreeEnd(rbhosts)) {
-			/* New host */
-			hitem = create_hostlist_t(hostname, hostip);
-			hostcount++;
-		}
-		else {
-			hitem = xtreeData(rbhosts, hosthandle);
-		}
-
-		testhandle = xtreeFind(rbtests, testname);
-		if (testhandle == xtreeEnd(rbtests)) {
-			t = create_testinfo(testname);
-		}
-		else t = xtreeData(rbtests, testhandle);
-
-		originhandle = xtreeFind(rborigins, originname);
-		if (originhandle == xtreeEnd(rborigins)) {
-			origin = strdup(originname);
-			xtreeAdd(rborigins, origin, origin);
-		}
-		else origin = xtreeData(rborigins, originhandle);
-
-		if (hitem->logs == NULL) {
-			ltail = hitem->logs = (xymond_log_t *) calloc(1, sizeof(xymond_log_t));
-		}
-		else {
-			ltail->next = (xymond_log_t *)calloc(1, sizeof(xymond_log_t));
-			ltail = ltail->next;
-		}
-
-		if (strcmp(testname, xgetenv("PINGCOLUMN")) == 0) hitem->pinglog = ltail;
-
-		/* Fixup validtime in case of ack'ed or disabled tests */
-		if (validtime < acktime) validtime = acktime;
-		if (validtime < enabletime) validtime = enabletime;
-
-		ltail->test = t;
-		ltail->host = hitem;
-		ltail->origin = origin;
-		ltail->color = color;
-		ltail->oldcolor = oldcolor;
-		ltail->activealert = (decide_alertstate(color) == A_ALERT);
-		ltail->histsynced = 0;
-		ltail->testflags = ( (testflags && strlen(testflags)) ? strdup(testflags) : NULL);
-		ltail->sender = strdup(sender);
-		ltail->logtime = logtime;
-		ltail->lastchange = (time_t *)calloc((flapcount > 0) ? flapcount : 1, sizeof(time_t));
-		ltail->lastchange[0] = lastchange;
-		ltail->validtime = validtime;
-		ltail->enabletime = enabletime;
-		if (ltail->enabletime == DISABLED_UNTIL_OK) ltail->validtime = INT_MAX;
-		ltail->acktime = acktime;
-		ltail->redstart = redstart;
-		ltail->yellowstart = yellowstart;
-		nldecode(statusmsg);
-		ltail->message = strdup(statusmsg);
-		ltail->msgsz = strlen(statusmsg)+1;
-		ltail->line1 = malloc(MAXLINE1SIZE * sizeof(unsigned char) + 1);
-		eoln = strchr(ltail->message, '\n'); if (eoln) *eoln = '\0';
-		snprintf(ltail->line1, MAXLINE1SIZE, "%s", msg_data(ltail->message, 0));
-		if (eoln) *eoln = '\n';
-
-		if (disablemsg && strlen(disablemsg)) {
-			nldecode(disablemsg);
-			ltail->dismsg = strdup(disablemsg);
-		}
-		else 
-			ltail->dismsg = NULL;
-
-		if (ackmsg && strlen(ackmsg)) {
-			nldecode(ackmsg);
-			ltail->ackmsg = strdup(ackmsg);
-		}
-		else 
-			ltail->ackmsg = NULL;
-
-		if (cookie && *cookie) {
-			ltail->cookie = strdup(cookie);
-			ltail->cookieexpires = cookieexpires;
-			xtreeAdd(rbcookies, ltail->cookie, ltail);
-		}
-		else {
-			ltail->cookie = NULL;
-			ltail->cookieexpires = 0;
-		}
-
-		ltail->acklist = NULL;
-		ltail->next = NULL;
+		nldecode(rec.statusmsg);
+		if (rec.disablemsg) nldecode(rec.disablemsg);
+		if (rec.ackmsg) nldecode(rec.ackmsg);
+		count += restore_log(&rec);
 	}
 
 	fclose(fd);
@@ -5497,85 +6984,81 @@ void load_checkpoint(char *fn)
 
 void check_purple_status(void)
 {
-	xtreePos_t hosthandle;
 	xymond_hostlist_t *hwalk;
 	xymond_log_t *lwalk;
 	time_t now = getcurrenttime(NULL);
 
 	dbgprintf("-> check_purple_status\n");
-	for (hosthandle = xtreeFirst(rbhosts); (hosthandle != xtreeEnd(rbhosts)); hosthandle = xtreeNext(rbhosts, hosthandle)) {
-		hwalk = xtreeData(rbhosts, hosthandle);
+	while (expiryheapcount && (expiryheap[0]->validtime < now)) {
+		lwalk = expiryheap[0];
+		hwalk = lwalk->host;
 
-		lwalk = hwalk->logs;
-		while (lwalk) {
-			if (lwalk->validtime < now) {
-				dbgprintf("Purple log from %s %s\n", hwalk->hostname, lwalk->test->name);
-				if (hwalk->hosttype == H_SUMMARY) {
-					/*
-					 * A summary has gone stale. Drop it.
-					 */
-					xymond_log_t *tmp;
+		dbgprintf("Purple log from %s %s\n", hwalk->hostname, lwalk->test->name);
+		if (hwalk->hosttype == H_SUMMARY) {
+			/*
+			 * A summary has gone stale. Drop it.
+			 */
+			xymond_log_t *tmp;
 
-					if (lwalk == hwalk->logs) {
-						tmp = hwalk->logs;
-						hwalk->logs = lwalk->next;
-						lwalk = lwalk->next;
-					}
-					else {
-						for (tmp = hwalk->logs; (tmp->next != lwalk); tmp = tmp->next);
-						tmp->next = lwalk->next;
-						tmp = lwalk;
-						lwalk = lwalk->next;
-					}
-					free_log_t(tmp);
-				}
-				else {
-					char *cause;
-					int newcolor = COL_PURPLE;
-					void *hinfo = hostinfo(hwalk->hostname);
+			if (lwalk == hwalk->logs) {
+				hwalk->logs = lwalk->next;
+			}
+			else {
+				for (tmp = hwalk->logs; (tmp->next != lwalk); tmp = tmp->next);
+				tmp->next = lwalk->next;
+			}
+			host_reindexlog(hwalk, lwalk->test);
+			free_log_t(lwalk);
+			checkpointfull = 1;
+		}
+		else {
+			char *cause;
+			int newcolor = COL_PURPLE;
+			void *hinfo = hostinfo(hwalk->hostname);
 
-					/*
-					 * See if this is a host where the "conn" test shows it is down.
-					 * If yes, then go CLEAR, instead of PURPLE.
-					 */
-					if (hwalk->pinglog && hinfo && (xmh_item(hinfo, XMH_FLAG_NOCLEAR) == NULL)) {
-						switch (hwalk->pinglog->color) {
-						  case COL_RED:
-						  case COL_YELLOW:
-						  case COL_BLUE:
-						  case COL_CLEAR: /* if the "route:" tag is involved */
-							newcolor = COL_CLEAR;
-							break;
-
-						  default:
-							newcolor = COL_PURPLE;
-							break;
-						}
-					}
+			/*
+			 * See if this is a host where the "conn" test shows it is down.
+			 * If yes, then go CLEAR, instead of PURPLE.
+			 */
+			if (hwalk->pinglog && hinfo && (xmh_item(hinfo, XMH_FLAG_NOCLEAR) == NULL)) {
+				switch (hwalk->pinglog->color) {
+				  case COL_RED:
+				  case COL_YELLOW:
+				  case COL_BLUE:
+				  case COL_CLEAR: /* if the "route:" tag is involved */
+					newcolor = COL_CLEAR;
+					break;
 
-					/* Tests on dialup hosts go clear, not purple */
-					if ((newcolor == COL_PURPLE) && hinfo && xmh_item(hinfo, XMH_FLAG_DIALUP)) {
-						newcolor = COL_CLEAR;
-					}
+				  default:
+					newcolor = COL_PURPLE;
+					break;
+				}
+			}
 
-					cause = check_downtime(hwalk->hostname, lwalk->test->name);
-					if (lwalk) lwalk->downtimeactive = (cause != NULL);
-					if (cause) {
-						newcolor = COL_BLUE;
-						/* If the status is not disabled, use downcause as the disable text */
-						if (!lwalk->dismsg) lwalk->dismsg = strdup(cause);                                         
-					}
+			/* Tests on dialup hosts go clear, not purple */
+			if ((newcolor == COL_PURPLE) && hinfo && xmh_item(hinfo, XMH_FLAG_DIALUP)) {
+				newcolor = COL_CLEAR;
+			}
 
-					handle_status(lwalk->message, "xymond", 
-						hwalk->hostname, lwalk->test->name, lwalk->grouplist, lwalk, newcolor, NULL, 0);
-					lwalk = lwalk->next;
-				}
+			cause = check_downtime(hwalk->hostname, lwalk->test->name);
+			lwalk->downtimeactive = (cause != NULL);
+			if (cause) {
+				newcolor = COL_BLUE;
+				/* If the status is not disabled, use downcause as the disable text */
+				if (!lwalk->dismsg) lwalk->dismsg = strdup(cause);                                         
 			}
-			else {
-				lwalk = lwalk->next;
+
+			handle_status(log_message(lwalk), "xymond", 
+				hwalk->hostname, lwalk->test->name, lwalk->grouplist, lwalk, newcolor, NULL, 0);
+
+			if (lwalk->validtime < now) {
+				/* handle_status() did not update it, so look at it again in a minute */
+				lwalk->validtime = now + 60;
+				expiry_update(lwalk);
 			}
 		}
 	}
+
 	dbgprintf("<- check_purple_status\n");
 }
 
@@ -5611,6 +7094,289 @@ void sig_handler(int signum)
 }
 
 
+/*
+ * Parse threads. With --parse-threads=N, messages that never get a response
+ * are handed to a pool of threads that decompress them and split up "combo"
+ * messages, which is where most of the CPU time goes when clients compress
+ * their messages. Only the main thread touches the hosts and status logs,
+ * so it picks up the finished messages and handles them in the order they
+ * arrived. Messages that need a response are handled by the main thread 
+ * directly, after all messages queued before them.
+ */
+typedef struct parsejob_t {
+	conn_t msg;
+	int viabfq;
+	enum { PARSE_QUEUED, PARSE_BUSY, PARSE_DONE } state;
+	char *errtxt;
+	struct parsejob_t *next;
+} parsejob_t;
+
+enum parsekind_t { PARSE_NOW, PARSE_INORDER, PARSE_THREAD };
+
+static int parsequeuemax = 0;
+static pthread_t *parsetids = NULL;
+static pthread_mutex_t parselock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parsework = PTHREAD_COND_INITIALIZER;	/* Workers wait for jobs */
+static pthread_cond_t parsedone = PTHREAD_COND_INITIALIZER;	/* Main thread waits for the oldest job */
+static parsejob_t *parsehead = NULL, *parsetail = NULL;		/* All jobs, oldest first */
+static parsejob_t *parsenext = NULL;				/* Oldest job not yet picked up by a worker */
+static int parsestop = 0;
+
+static enum parsekind_t parse_kind(char *buf)
+{
+	if ((strncmp(buf, "compress:", 9) == 0) || (strncmp(buf, "combo\n", 6) == 0)) return PARSE_THREAD;
+	if ((strncmp(buf, "status", 6) == 0) || (strncmp(buf, "data", 4) == 0)) return PARSE_INORDER;
+
+	return PARSE_NOW;
+}
+
+static void parse_message(parsejob_t *job, void *zstream)
+{
+	conn_t *msg = &job->msg;
+
+	if (strncmp(msg->buf, "compress:", 9) == 0) {
+		char *expanded, errtxt[300];
+		size_t expandedsz;
+		struct timespec expandstart;
+
+		LATENCY_START(expandstart);
+		expanded = expand_message(msg, zstream, &expandedsz, errtxt, sizeof(errtxt));
+		LATENCY_END(LAT_DECOMPRESS, expandstart);
+		if (!expanded) {
+			job->errtxt = strdup(errtxt);
+			return;
+		}
+
+		xfree(msg->buf);
+		msg->buf = expanded;
+		msg->buflen = msg->bufsz = expandedsz;
+		msg->bufp = msg->buf + msg->buflen; *(msg->bufp) = '\0';
+	}
+
+	if (strncmp(msg->buf, "combo\n", 6) == 0) {
+		char *currmsg, *nextmsg;
+		int partsz = 0;
+
+		/* Same split as do_message() would do */
+		currmsg = msg->buf+6;
+		do {
+			nextmsg = strstr(currmsg, "\n\nstatus");
+			if (nextmsg) { *(nextmsg+1) = '\0'; nextmsg += 2; }
+
+			if (msg->combopartcount == partsz) {
+				partsz += 64;
+				msg->comboparts = (char **)realloc(msg->comboparts, partsz*sizeof(char *));
+			}
+			msg->comboparts[msg->combopartcount++] = currmsg;
+
+			currmsg = nextmsg;
+		} while (currmsg);
+	}
+}
+
+static void *parse_worker(void *arg)
+{
+	void *zstream = uncompress_stream_init();
+	parsejob_t *job;
+
+	pthread_mutex_lock(&parselock);
+	while (!parsestop) {
+		if (!parsenext) {
+			pthread_cond_wait(&parsework, &parselock);
+			continue;
+		}
+
+		job = parsenext;
+		job->state = PARSE_BUSY;
+		for (parsenext = job->next; (parsenext && (parsenext->state != PARSE_QUEUED)); parsenext = parsenext->next) ;
+		pthread_mutex_unlock(&parselock);
+
+		parse_message(job, zstream);
+
+		pthread_mutex_lock(&parselock);
+		job->state = PARSE_DONE;
+		if (job == parsehead) pthread_cond_signal(&parsedone);
+	}
+	pthread_mutex_unlock(&parselock);
+
+	if (zstream) uncompress_stream_done(zstream);
+
+	return NULL;
+}
+
+/*
+ * Handle the finished jobs at the head of the queue, waiting for 
+ * unfinished ones until no more than "maxpending" jobs are left.
+ */
+static void apply_parsejobs(int maxpending)
+{
+	parsejob_t *job;
+
+	pthread_mutex_lock(&parselock);
+	while (parsehead) {
+		if (parsehead->state != PARSE_DONE) {
+			if (parsequeued <= maxpending) break;
+			pthread_cond_wait(&parsedone, &parselock);
+			continue;
+		}
+
+		job = parsehead;
+		parsehead = job->next;
+		if (!parsehead) parsetail = NULL;
+		parsequeued--;
+		pthread_mutex_unlock(&parselock);
+
+		if (job->errtxt) {
+			errprintf("%s", job->errtxt);
+			xfree(job->errtxt);
+		}
+		else {
+			do_message(&job->msg, "", job->viabfq);
+		}
+
+		if (job->msg.comboparts) xfree(job->msg.comboparts);
+		if (job->msg.buf) xfree(job->msg.buf);
+		if (job->msg.sender) xfree(job->msg.sender);
+		if (job->msg.certcn) xfree(job->msg.certcn);
+		xfree(job);
+
+		pthread_mutex_lock(&parselock);
+	}
+	pthread_mutex_unlock(&parselock);
+}
+
+/*
+ * A complete message has arrived. Messages from the network hand over
+ * their buffer if they are queued, backfeed and scheduled messages are 
+ * copied.
+ */
+static void received_message(conn_t *msg, int viabfq)
+{
+	enum parsekind_t kind;
+	parsejob_t *job;
+
+	if (!viabfq) netmsgcount++;
+
+	if (parsethreads == 0) {
+		do_message(msg, "", viabfq);
+		return;
+	}
+
+	kind = parse_kind(msg->buf);
+	if ((kind == PARSE_NOW) || ((kind == PARSE_INORDER) && (parsequeued == 0))) {
+		/* Everything that arrived before this must be done first */
+		apply_parsejobs(0);
+		do_message(msg, "", viabfq);
+		return;
+	}
+
+	if (parsequeued >= parsequeuemax) {
+		parsequeuefull++;
+		apply_parsejobs(parsequeuemax - 1);
+	}
+
+	job = (parsejob_t *)calloc(1, sizeof(parsejob_t));
+	job->msg = *msg;
+	job->msg.comboparts = NULL;
+	job->msg.combopartcount = 0;
+	job->msg.sender = strdup(msg->sender ? msg->sender : "");
+	job->msg.doingwhat = NOTALK;
+	job->viabfq = viabfq;
+	job->state = ((kind == PARSE_THREAD) ? PARSE_QUEUED : PARSE_DONE);
+	if (viabfq) {
+		job->msg.buf = (unsigned char *)malloc(msg->buflen + 1);
+		memcpy(job->msg.buf, msg->buf, msg->buflen);
+		*(job->msg.buf + msg->buflen) = '\0';
+		job->msg.bufsz = msg->buflen;
+		job->msg.certcn = (msg->certcn ? strdup(msg->certcn) : NULL);
+	}
+	else {
+		/* The connection gets a fresh buffer if it needs one */
+		msg->buf = msg->bufp = NULL;
+		msg->buflen = msg->bufsz = 0;
+		msg->certcn = NULL;
+	}
+	job->msg.bufp = job->msg.buf + job->msg.buflen;
+	msg->doingwhat = NOTALK;
+
+	pthread_mutex_lock(&parselock);
+	if (parsetail) parsetail->next = job; else parsehead = job;
+	parsetail = job;
+	parsequeued++;
+	parsejobcount++;
+	if (job->state == PARSE_QUEUED) {
+		if (!parsenext) parsenext = job;
+		pthread_cond_signal(&parsework);
+	}
+	pthread_mutex_unlock(&parselock);
+}
+
+static void backfeed_message(char *buf, size_t sz)
+{
+	/* A message from the backfeed queue or ring. The buffer is only ours until we return. */
+	conn_t msg;
+
+	backfeedcount++;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.buf = buf;
+	msg.msgsz = sz + 1;
+	msg.bufsz = msg.buflen = sz;
+	msg.bufp = msg.buf + msg.buflen;
+	msg.doingwhat = RECEIVING;
+	msg.sender = strdup("BFQ");
+
+	received_message(&msg, 1);
+	xfree(msg.sender);
+}
+
+static int start_parsethreads(void)
+{
+	sigset_t allsigs, oldsigs;
+	int i;
+
+	if (parsethreads <= 0) return 0;
+
+	/* Limit the memory held by queued messages */
+	parsequeuemax = 100*parsethreads;
+	parsetids = (pthread_t *)calloc(parsethreads, sizeof(pthread_t));
+
+	/* Signals must go to the main thread */
+	sigfillset(&allsigs);
+	pthread_sigmask(SIG_SETMASK, &allsigs, &oldsigs);
+	for (i = 0; (i < parsethreads); i++) {
+		int err = pthread_create(&parsetids[i], NULL, parse_worker, NULL);
+
+		if (err != 0) {
+			errprintf("Cannot start parse thread: %s\n", strerror(err));
+			parsethreads = i;
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+	return parsethreads;
+}
+
+static void stop_parsethreads(void)
+{
+	int i;
+
+	if (parsethreads <= 0) return;
+
+	apply_parsejobs(0);
+
+	pthread_mutex_lock(&parselock);
+	parsestop = 1;
+	pthread_cond_broadcast(&parsework);
+	pthread_mutex_unlock(&parselock);
+
+	for (i = 0; (i < parsethreads); i++) pthread_join(parsetids[i], NULL);
+	xfree(parsetids);
+	parsethreads = 0;
+}
+
+
 enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t id, void *userdata)
 {
 	int n = 0;
@@ -5667,7 +7433,7 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 		if (n < 0) {
 			if (conn->buf && conn->buflen) {
 				*(conn->bufp) = '\0';
-				do_message(conn, "", 0);
+				received_message(conn, 0);
 			}
 			else {
 				conn->doingwhat = NOTALK;
@@ -5678,7 +7444,7 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 			// dbgprintf("Got the entire message, preparing response\n");
 			conn->bufp += n;
 			*(conn->bufp) = '\0';
-			do_message(conn, "", 0);
+			received_message(conn, 0);
 		}
 		else {
 			*(conn->bufp + n) = '\0';
@@ -5716,7 +7482,7 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 
 						dbgprintf("Expect message of size %zu, currently have %zu\n", conn->msgsz, conn->buflen);
 						if (conn->buflen >= conn->msgsz)
-							do_message(conn, "", 0);
+							received_message(conn, 0);
 					}
 				}
 			}
@@ -5740,7 +7506,7 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 			}
 			else if ((n == 0) && (connection->connstate == CONN_PLAINTEXT)) {
 				/* No more data */
-				do_message(conn, "", 0);
+				received_message(conn, 0);
 			}
 
 			/* Grow the input buffer - within reason ... */
@@ -5796,7 +7562,7 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 				conn->doingwhat = RECEIVING;
 				return CONN_CBRESULT_STARTTLS;
 			}
-			else
+			else if ((n < 0) || !board_fill(conn))
 				conn->doingwhat = NOTALK;
 		}
 		break;
@@ -5807,6 +7573,7 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 			xfree(conn->sender);
 			if (conn->certcn) xfree(conn->certcn);
 			if (conn->buf) xfree(conn->buf);
+			board_free(conn);
 			xfree(conn);
 			conn = connection->userdata = NULL;
 		}
@@ -5822,7 +7589,7 @@ enum conn_cbresult_t server_callback(tcpconn_t *connection, enum conn_callback_t
 		/* NB: With the new networking code, there may be a better way */
 		/*     to track and report different types of failures here -jc */
 		errprintf("Discarding timed-out partial msg from %s\n", conn->sender);		
-		update_statistics("Timeouts", 0);
+		update_statistics(MC_TIMEOUTS, NULL, 0);
 		conn_close_connection(connection, NULL);
 		break;
 	}
@@ -5878,6 +7645,11 @@ int main(int argc, char *argv[])
 	rbmultisrc = xtreeNew(strcasecmp);
 	rbsenders = xtreeNew(strcmp);
 
+	/* Lookup table for the message commands */
+	setup_msgcmd();
+
+	msgarena = xarena_new(64*1024);
+
 	/* For wildcard notify's */
 	create_testinfo("*");
 
@@ -5941,6 +7713,39 @@ int main(int argc, char *argv[])
 			char *p = strchr(argv[argi], '=') + 1;
 			checkpointinterval = atoi(p);
 		}
+		else if (argnmatch(argv[argi], "--checkpoint-format=")) {
+			char *p = strchr(argv[argi], '=') + 1;
+			if (strcmp(p, "binary") == 0) checkpointformat = CHK_BINARY;
+			else if (strcmp(p, "text") == 0) checkpointformat = CHK_TEXT;
+			else {
+				errprintf("Unknown checkpoint format '%s'\n", p);
+				return 1;
+			}
+		}
+		else if (argnmatch(argv[argi], "--checkpoint-compression=")) {
+			char *p = strchr(argv[argi], '=') + 1;
+			checkpointcompression = parse_compressiontype(p);
+			if (checkpointcompression == COMP_UNKNOWN) {
+				errprintf("Unknown checkpoint compression type '%s'\n", p);
+				return 1;
+			}
+		}
+		else if (argnmatch(argv[argi], "--status-compression=")) {
+			char *p = strchr(argv[argi], '=') + 1;
+			statuscompression = parse_compressiontype(p);
+			if (statuscompression == COMP_UNKNOWN) {
+				errprintf("Unknown status compression type '%s'\n", p);
+				return 1;
+			}
+		}
+		else if (argnmatch(argv[argi], "--status-compression-min=")) {
+			char *p = strchr(argv[argi], '=') + 1;
+			statuscompressmin = atoi(p);
+		}
+		else if (argnmatch(argv[argi], "--checkpoint-full-interval=")) {
+			char *p = strchr(argv[argi], '=') + 1;
+			checkpointfullinterval = atoi(p);
+		}
 		else if (argnmatch(argv[argi], "--reload-interval=")) {
 			char *p = strchr(argv[argi], '=') + 1;
 			reloadinterval = atoi(p);
@@ -6073,9 +7878,17 @@ int main(int argc, char *argv[])
 
 			if (anypos || clientsavedisk) clientsavemem = 1;
 		}
+		else if (strcmp(argv[argi], "--latency-stats") == 0) {
+			latencystats = 1;
+		}
 		else if (strcmp(argv[argi], "--no-download") == 0) {
 			 allow_downloads = 0;
 		}
+		else if (argnmatch(argv[argi], "--bfq-ring")) {
+			char *p = strchr(argv[argi], '=');
+			bfringslots = (p ? atoi(p+1) : BFRING_DEFAULTSLOTS);
+			if (bfringslots < 2) { errprintf("Invalid backfeed ring size: %s\n", argv[argi]); return -1; }
+		}
 		else if (strncmp(argv[argi], "--bfq", 5) == 0) {
 			 create_backfeedqueue = 1;
 			 if (strncmp(argv[argi], "--bfq=", 6) == 0) {
@@ -6087,6 +7900,32 @@ int main(int argc, char *argv[])
 		else if (strcmp(argv[argi], "--no-bfq") == 0) {
 			 create_backfeedqueue = 0;
 		}
+		else if (argnmatch(argv[argi], "--ring-channels=")) {
+			char *p = strchr(argv[argi], '=');
+			if (channelmask(p+1, &ringchannels) != 0) return 1;
+		}
+		else if (argnmatch(argv[argi], "--batch-channels=")) {
+			char *p = strchr(argv[argi], '=');
+			if (channelmask(p+1, &batchchannels) != 0) return 1;
+		}
+		else if (argnmatch(argv[argi], "--batch-size=")) {
+			char *p = strchr(argv[argi], '=');
+			batchsize = 1024*atol(p+1);
+		}
+		else if (argnmatch(argv[argi], "--batch-latency=")) {
+			char *p = strchr(argv[argi], '=');
+			batchlatency = atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--parse-threads=")) {
+			char *p = strchr(argv[argi], '=');
+			parsethreads = atoi(p+1);
+			if (parsethreads < 0) parsethreads = 0;
+		}
+		else if (argnmatch(argv[argi], "--ring-slots=")) {
+			char *p = strchr(argv[argi], '=');
+			ringslots = atoi(p+1);
+			if (ringslots < 2) { errprintf("Invalid ring size %d, must be at least 2\n", ringslots); return 1; }
+		}
 		else if (standardoption(argv[argi])) {
 			if (showhelp) {
 				printf("Options:\n");
@@ -6134,6 +7973,8 @@ int main(int argc, char *argv[])
 
 	tcpcheckinterval = atoi(xgetenv("XYMONDTCPINTERVAL"));
 	bfqchunksize = atoi(xgetenv("BFQCHUNKSIZE"));
+	if (bfqchunksize < 1) bfqchunksize = 1;
+	bfqbudget = bfqchunksize;
 	nexttcpcheck = getcurrenttime(NULL) + tcpcheckinterval;
 	nextcheckpoint = getcurrenttime(NULL) + checkpointinterval;
 	nextpurpleupdate = getcurrenttime(NULL) + 600;	/* Wait 10 minutes the first time */
@@ -6214,6 +8055,21 @@ int main(int argc, char *argv[])
 	userchn  = setup_channel(C_USER, CHAN_MASTER);
 	if (userchn == NULL) { errprintf("Cannot setup user channel\n"); return 1; }
 
+	if (batchchannels) {
+		xymond_channel_t *chnlist[] = { statuschn, stachgchn, pagechn, datachn, noteschn, enadischn, clientchn, clichgchn, userchn, NULL };
+		int c;
+
+		for (c = 0; (chnlist[c]); c++) {
+			if ((batchchannels & (1 << chnlist[c]->channelid)) == 0) continue;
+
+			/* Room for a full batch, plus one message being formatted at the end of it */
+			chnlist[c]->batchbuf = (char *)malloc(2*(chnlist[c]->maxsize + 1));
+			if (chnlist[c]->batchbuf == NULL) { errprintf("Cannot allocate %s channel batch buffer\n", channelnames[chnlist[c]->channelid]); return 1; }
+			logprintf("Batching %s channel messages, up to %zu bytes or %d ms\n", 
+				  channelnames[chnlist[c]->channelid], batchsize, batchlatency);
+		}
+	}
+
 	/* Can create and loop over multiple bfq's */
 	if (create_backfeedqueue) {
 		int i;
@@ -6232,6 +8088,12 @@ int main(int argc, char *argv[])
 		bf_bufsz -= sizeof(long); /* leave space for msgp at the beginning */
 	}
 
+	if (bfringslots) {
+		logprintf("Setting up backfeed ring\n");
+		bfring = setup_bfring(CHAN_MASTER, bfringslots);
+		if (bfring == NULL) { errprintf("Cannot setup backfeed ring\n"); return 1; }
+	}
+
 	logprintf("Setting up logfiles\n");
 	setvbuf(stdout, NULL, _IONBF, 0);
 	setvbuf(stderr, NULL, _IONBF, 0);
@@ -6264,6 +8126,16 @@ int main(int argc, char *argv[])
 		if (dbgfd == NULL) errprintf("Cannot open debug file %s: %s\n", fname, strerror(errno));
 	}
 
+	if (latencystats) {
+		int i;
+
+		for (i = 0; (i < LAT_COUNT); i++) lathist[i] = histogram_new(latstagenames[i]);
+		conn_register_waithandler(latency_wait);
+		logprintf("Collecting latency statistics\n");
+	}
+
+	if (start_parsethreads() > 0) logprintf("Started %d parse threads\n", parsethreads);
+
 	logprintf("Setup complete\n");
 	do {
 		/*
@@ -6280,15 +8152,15 @@ int main(int argc, char *argv[])
 		 *
 		 * Then do the network I/O.
 		 */
-		fd_set fdread, fdwrite;
-		int maxfd, n;
-		struct timeval tmo;
+		int n;
 
 		time_t now = getcurrenttime(NULL);
 		int childstat;
 		int backfeeddata;
 		int bfqempty = -1;
 		int bfqexiting = 0;
+		int bfqdone = 0, bfqpending = 0;
+		unsigned long netbefore;
 
 		/* Pickup any finished child processes to avoid zombies */
 		while (wait3(&childstat, WNOHANG, NULL) > 0) ;
@@ -6305,7 +8177,6 @@ int main(int argc, char *argv[])
 		}
 
 		if ((reloadconfig || (now >= nextreload)) && hostsfn) {
-			xtreePos_t hosthandle;
 			int loadresult;
 
 			logprintf("Reloading hostnames\n");
@@ -6315,37 +8186,58 @@ int main(int argc, char *argv[])
 			flush_filecache();
 
 			if (loadresult == 0) {
-				/* Scan our list of hosts and weed out those we do not know about any more */
-				logprintf("Rescanning host tree\n");
-				hosthandle = xtreeFirst(rbhosts);
-				while (hosthandle != xtreeEnd(rbhosts)) {
-					xymond_hostlist_t *hwalk;
+				int added, removed, changed;
+				char *hostname;
+				enum hostchange_t change;
+				xtreePos_t hosthandle;
+				char **dropnames = NULL;
+				int dropcount = 0, dropsz = 0, i;
+
+				hostlist_changes(&added, &removed, &changed);
+				logprintf("hosts.cfg changes: %d added, %d removed, %d changed\n", added, removed, changed);
+
+				/*
+				 * Only the hosts that were removed must go. Collect them first, since dropping
+				 * them changes rbhosts. Ghosts were never in hosts.cfg so they are not in the
+				 * list of changes; if we accept those, look for them in all of rbhosts. The
+				 * same goes for hosts renamed to a name that is not in hosts.cfg.
+				 */
+				if ((ghosthandling == GH_ALLOW) || renamedghosts) {
+					renamedghosts = 0;
+					for (hosthandle = xtreeFirst(rbhosts); (hosthandle != xtreeEnd(rbhosts)); hosthandle = xtreeNext(rbhosts, hosthandle)) {
+						xymond_hostlist_t *hwalk = xtreeData(rbhosts, hosthandle);
 
-					hwalk = xtreeData(rbhosts, hosthandle);
+						if ((hwalk->hosttype == H_SUMMARY) || !hwalk->hostname || hostinfo(hwalk->hostname)) continue;
 
-					if (hwalk->hosttype == H_SUMMARY) {
-						/* Leave the summaries as-is */
-						hosthandle = xtreeNext(rbhosts, hosthandle);
-					}
-					else if (hwalk->hostname == NULL) {
-						errprintf("Null hostname record in state; can't remove, moving on\n");
-						hosthandle = xtreeNext(rbhosts, hosthandle);
-					}
-					else if (hostinfo(hwalk->hostname) == NULL) {
-						/* Remove all state info about this host. This will NOT remove files. */
-						// dbgprintf("Host info record for '%s' is now empty; removing...\n", hwalk->hostname);
-						handle_dropnrename(CMD_DROPSTATE, "xymond", hwalk->hostname, NULL, NULL);
-
-						/* Must restart tree-walk after deleting node from the tree */
-						// dbgprintf("Restarting hostinfo scan from the beginning...\n");
-						hosthandle = xtreeFirst(rbhosts);
+						if (dropcount == dropsz) {
+							dropsz += 256;
+							dropnames = (char **)realloc(dropnames, dropsz * sizeof(char *));
+						}
+						dropnames[dropcount++] = strdup(hwalk->hostname);
 					}
-					else {
-						// dbgprintf(" - record %s present...\n", hwalk->hostname);
-						hosthandle = xtreeNext(rbhosts, hosthandle);
+				}
+				else {
+					for (hostname = hostchange_walk(1, &change); (hostname); hostname = hostchange_walk(0, &change)) {
+						if ((change != HOST_REMOVED) || (xtreeFind(rbhosts, hostname) == xtreeEnd(rbhosts)) || hostinfo(hostname)) continue;
+
+						if (dropcount == dropsz) {
+							dropsz += 256;
+							dropnames = (char **)realloc(dropnames, dropsz * sizeof(char *));
+						}
+						dropnames[dropcount++] = strdup(hostname);
 					}
 				}
 
+				/* Remove all state info about these hosts. This will NOT remove files. */
+				for (i = 0; (i < dropcount); i++) {
+					handle_dropnrename(CMD_DROPSTATE, "xymond", dropnames[i], NULL, NULL);
+					xfree(dropnames[i]);
+				}
+				if (dropnames) xfree(dropnames);
+
+				/* Cached host sets and status fields only need rebuilding if a host changed */
+				if (added || removed || changed) hostsetgeneration++;
+
 				posttoall("reload");
 			}
 
@@ -6353,11 +8245,12 @@ int main(int argc, char *argv[])
 			load_clientconfig();
 		}
 
-		if (do_purples && (now >= nextpurpleupdate)) {
-			nextpurpleupdate = getcurrenttime(NULL) + purplecheckinterval;
+		if (do_purples && (now >= nextpurpleupdate) && expiryheapcount && (expiryheap[0]->validtime < now)) {
 			check_purple_status();
 		}
 
+		update_channelrates(now);
+
 		if ((last_stats_time + statsinterval) <= now) {
 			char *buf;
 			xymond_hostlist_t *h;
@@ -6379,11 +8272,24 @@ int main(int argc, char *argv[])
 			flush_errbuf();
 		}
 
-		if (now > nextcheckpoint) {
+		if ((now > nextcheckpoint) && (checkpointformat == CHK_BINARY)) {
+			struct timespec chkstart;
+
+			/* No fork needed, we only write what has changed since last time */
+			nextcheckpoint = now + checkpointinterval;
+			LATENCY_START(chkstart);
+			save_checkpoint_binary(0);
+			LATENCY_END(LAT_CHECKPOINT, chkstart);
+		}
+		else if (now > nextcheckpoint) {
 			pid_t childpid;
+			struct timespec chkstart;
 
+			/* The child does the work, so we only see how long the fork takes */
 			nextcheckpoint = now + checkpointinterval;
+			LATENCY_START(chkstart);
 			childpid = fork();
+			if (childpid > 0) LATENCY_END(LAT_CHECKPOINT, chkstart);
 			if (childpid == -1) {
 				errprintf("Could not fork checkpoint child:%s\n", strerror(errno));
 			}
@@ -6394,9 +8300,26 @@ int main(int argc, char *argv[])
 			}
 		}
 
+		/*
+		 * Backfeed messages are handled in portions of "bfqbudget" messages,
+		 * then TCP gets its turn. The portions grow while the network is
+		 * quiet and shrink again when it gets busy.
+		 */
+		while (bfring && (bfqdone < bfqbudget)) {
+			char *bmsg;
+			size_t bsz;
+
+			bmsg = bfring_receive(bfring, &bsz);
+			if (!bmsg) break;
+
+			backfeed_message(bmsg, bsz);
+			bfring_release(bfring);
+			bfqdone++;
+		}
+		if (bfqdone >= bfqbudget) bfqexiting = bfqpending = 1;
+
 		while (create_backfeedqueue && !bfqexiting) {
 			ssize_t sz;
-			conn_t msg;
 			static int qnumber = 0;
 
 			if (qnumber > bfqchannels) qnumber = 0;
@@ -6425,18 +8348,9 @@ int main(int argc, char *argv[])
 				else errprintf("Skipping backfeed queue message due to error: %s\n", strerror(errno));
 			}
 			else if (backfeeddata) {
-				backfeedcount++;
-
-				msg.buf = bf_buf;
-				msg.msgsz = sz + 1;
-				msg.bufsz = msg.buflen = sz;
-				msg.bufp = msg.buf + msg.buflen;
-				msg.doingwhat = RECEIVING;
-				msg.sender = strdup("BFQ");
-				msg.certcn = NULL;
-
-				do_message(&msg, "", 1);
+				backfeed_message(bf_buf, sz);
 				*bf_buf = '\0';
+				if (++bfqdone >= bfqbudget) bfqexiting = bfqpending = 1;
 
 				if (backfeedcount >= bfqchkcount) {
 					dbgprintf("bfq count for this loop: %d, exceeds %d\n", backfeedcount, bfqchkcount);
@@ -6449,30 +8363,35 @@ int main(int argc, char *argv[])
 		}
 
 		/*
-		 * Do the select() with a static 2 second timeout. 
+		 * Wait for network I/O with a short timeout, and handle it.
 		 * This is long enough that we will suspend activity for
 		 * some time if there's nothing to do, but short enough for
 		 * us to attend to the housekeeping stuff without undue delay.
+		 * conn_process() also picks up new connections.
 		 */
-		maxfd = conn_fdset(&fdread, &fdwrite);
-		tmo.tv_sec = 0; tmo.tv_usec = 50000;
-		n = select(maxfd+1, &fdread, &fdwrite, NULL, &tmo);
+		netbefore = netmsgcount;
+		n = conn_process(bfqpending ? 0 : (parsequeued ? 1 : 50));
+		if (bfqpending) {
+			if (netmsgcount != netbefore) bfqbudget = ((bfqbudget / 2) < bfqchunksize) ? bfqchunksize : (bfqbudget / 2);
+			else if (bfqbudget < BFQBUDGETMAX*bfqchunksize) bfqbudget *= 2;
+		}
 		if (n < 0) {
 			/* Ignore EINTR, just carry on. All other errors are fatal. */
 			if (errno != EINTR) {
-				errprintf("Fatal error in select: %s\n", strerror(errno));
+				errprintf("Fatal error waiting for network I/O: %s\n", strerror(errno));
 				running = 0;
 				continue;
-					}
-				}
-
-		conn_process_active(&fdread, &fdwrite);
+			}
+		}
 
 		/* Purge the old and dead connections */
 		conn_trimactive();
 
-		/* Pick up new connections */
-		conn_process_listeners(&fdread);
+		/* Handle the messages the parse threads have finished */
+		if (parsequeued) apply_parsejobs(INT_MAX);
+
+		/* Post any batched channel messages that have waited long enough */
+		if (batchchannels) flushallbatches();
 
 		/* When should we next try to handle TCP by? */
 		nexttcpcheck = getcurrenttime(NULL) + tcpcheckinterval;
@@ -6499,7 +8418,7 @@ int main(int argc, char *argv[])
 					task.sender = runtask->sender;
 					task.buf = task.bufp = runtask->command;
 					task.buflen = strlen(runtask->command); task.bufsz = task.buflen+1;
-					do_message(&task, "", 1);
+					received_message(&task, 1);
 
 					errprintf("Ran scheduled task %d from %s: %s\n", 
 						  runtask->id, runtask->sender, runtask->command);
@@ -6513,6 +8432,9 @@ int main(int argc, char *argv[])
 		}
 	} while (running);
 
+	/* Handle what is left in the parse queue */
+	stop_parsethreads();
+
 	/* Tell the workers we to shutdown also */
 	running = 1;   /* Kludge, but it's the only way to get posttochannel to do something. */
 	posttoall("shutdown");
@@ -6531,10 +8453,15 @@ int main(int argc, char *argv[])
 	close_channel(userchn, CHAN_MASTER);
 
 	if (backfeedqueue >= 0) close_feedback_queue(backfeedqueue, CHAN_MASTER);
+	close_bfring(bfring, CHAN_MASTER);
 	if (bf_buf) xfree(bf_buf);
 
 	logprintf("Saving final checkpoint file\n");
-	save_checkpoint();
+	if (checkpointformat == CHK_BINARY) {
+		save_checkpoint_binary(1);
+		if (checkpointjournal) chk_close(checkpointjournal, 1);
+	}
+	else save_checkpoint();
 	if (pidfn) unlink(pidfn);
 
 #ifdef DEBUG_FOR_VALGRIND
@@ -126,6 +126,13 @@ static int checksumsize = 0;
  */
 static int initialdelay = 0;
 
+/* Message filters. stdfilter is set when any of the others are, so control messages always get through */
+static pcre *msgfilter = NULL; 
+static pcre *msgexfilter = NULL; 
+static pcre *metafilter = NULL; 
+static pcre *metaexfilter = NULL;
+static pcre *stdfilter = NULL;
+
 void addnetpeer(char *peername)
 {
 	xymon_peer_t *newpeer;
@@ -450,6 +457,112 @@ void shutdownconnection(xymon_peer_t *peer)
 }
 
 
+static int acceptmessage(char *msg)
+{
+	/* Reject messages first and check the meta line regexes first (since they're quicker) */
+	int deny = 0;
+	int accept = 1;
+
+	if (!stdfilter) return 1;
+
+	deny =  (metaexfilter && matchregex(msg, metaexfilter)) ? 1 :
+		( msgexfilter && matchregex(msg,  msgexfilter)) ? 1 : 0;
+
+	/* accept only becomes 0 if we haven't denied and it and we have filters that don't match */
+	if (!deny && (metafilter || msgfilter)) accept =
+		(  metafilter && matchregex(msg,   metafilter)) ? 1 :
+		(   msgfilter && matchregex(msg,    msgfilter)) ? 1 : 0;
+
+	/* if deny'd, then accept=0... and if we're here then stdfilter exists */
+	/* (meaning deny by default) */
+	return ((!deny && accept) || matchregex(msg, stdfilter));
+}
+
+static void queuemessage(char *inbuf, size_t msgsz)
+{
+	/* The message is at inbuf+checksumsize; the space in front is for the checksum */
+
+	/*
+	 * See if they want us to rotate logs. We pass this on to
+	 * the worker module as well, but must handle our own logfile.
+	 */
+	if (strncmp(inbuf+checksumsize, "@@logrotate", 11) == 0) {
+		dologswitch = 1;
+	}
+
+	/*
+	 * Are we shutting down via channel command? Flag for closing.
+	 */
+	if (strncmp(inbuf+checksumsize, "@@shutdown", 10) == 0) {
+		logprintf("xymond_channel: received shutdown message\n");
+		running = 0;
+	}
+
+	if (checksumsize > 0) {
+		char *sep1 = inbuf + checksumsize + strcspn(inbuf+checksumsize, "#|\n");
+
+		if (*sep1 == '#') {
+			/* 
+			 * Add md5 hash of the message. I.e. transform the header line from
+			 *   "@@%s#%u/%s|%d.%06d| channelmarker, seq, hostname, tstamp.tv_sec, tstamp.tv_usec
+			 * to
+			 *   "@@%s:%s#%u/%s|%d.%06d| channelmarker, hashstr, seq, hostname, tstamp.tv_sec, tstamp.tv_usec
+			 */
+			char *hashstr = md5hash(inbuf+checksumsize);
+			int hlen = sep1 - (inbuf + checksumsize);
+
+			memmove(inbuf, inbuf+checksumsize, hlen);
+			*(inbuf + hlen) = ':';
+			memcpy(inbuf+hlen+1, hashstr, strlen(hashstr));
+		}
+		else {
+			/* No sequence number (control message). Skip checksum for these */
+			memmove(inbuf, inbuf+checksumsize, msgsz+1);
+		}
+	}
+
+
+	/*
+	 * Put the new message on our outbound queue.
+	 */
+	if (addmessage(inbuf, msgsz) != 0) {
+		/* Failed to queue message */
+		errprintf("Failed to queue message, moving on\n");
+	}
+}
+
+static int queuebatch(char *inbuf, size_t msgsz, int dofilter)
+{
+	/*
+	 * xymond may post several messages at once, each one ending with
+	 * the "\n@@\n" marker. Split them up and queue them one by one,
+	 * so filters, checksums and per-host routing work as usual.
+	 * This is done in place: the space in front of each message used
+	 * for the checksum is the tail of the previous (already queued) one.
+	 * Returns the number of messages queued.
+	 */
+	char *msg = inbuf + checksumsize;
+	char *eob = msg + msgsz;
+	int count = 0;
+
+	while (msg < eob) {
+		char *eom = strstr(msg, "\n@@\n");
+		char savech;
+
+		eom = (eom ? eom + 4 : eob);
+		savech = *eom; *eom = '\0';
+		if (!dofilter || acceptmessage(msg)) {
+			queuemessage(msg - checksumsize, (eom - msg));
+			count++;
+		}
+		*eom = savech;
+		msg = eom;
+	}
+
+	return count;
+}
+
+
 void sig_handler(int signum)
 {
 	switch (signum) {
@@ -484,8 +597,6 @@ int main(int argc, char *argv[])
 	int cnid = -1;
 	char *inbuf = NULL;
 	size_t msgsz = 0;
-	pcre *msgfilter = NULL; pcre *msgexfilter = NULL; pcre *metafilter = NULL; pcre *metaexfilter = NULL;
-	pcre *stdfilter = NULL;
 
 	int argi;
 	struct sigaction sa;
@@ -743,7 +854,7 @@ int main(int argc, char *argv[])
 		 * queued data to the worker.
 		 */
 		struct sembuf s;
-		int n, gotmsg;
+		int n, gotmsg = 0, prefilter;
 		time_t msgtimeout, currenttime;
 
 		if (deadpid != 0) {
@@ -768,7 +879,23 @@ int main(int argc, char *argv[])
 
 
 	    /* Only do our semaphore work if we're still connected to a channel */
-	    if (running) {
+	    if (running && channel->ring) {
+		/*
+		 * Ring transport. xymond does not wait for us, so there is
+		 * no hurry - filtering is done on our own copy of the message.
+		 * Wait up to 1 second for a message if our queue is empty, so
+		 * we notice signals in a timely manner.
+		 */
+		n = ring_receive(channel, inbuf+checksumsize, 1024*shbufsz(cnid) + 1, ((pendingcount > 0) ? 0 : 1000));
+		if (n == -1) {
+			logprintf("xymond_channel: %s channel closed by xymond\n", channelnames[cnid]);
+			running = 0;
+		}
+		else if ((n > 0) && queuebatch(inbuf, n, 1)) {
+			gotmsg = 1;			/* since we received something from xymond, don't dally too long */
+		}
+	    }
+	    else if (running) {
 
 		s.sem_num = GOCLIENT; s.sem_op  = -1; s.sem_flg = ((pendingcount > 0) ? IPC_NOWAIT : 0);
 		n = semop(channel->semid, &s, 1);
@@ -785,34 +912,19 @@ int main(int argc, char *argv[])
 			 * message arriving. Copy the message to our own buffer queue.
 			 */
 
-			/* See if we're filtering messages */
-			if (!stdfilter || filterlater) {
+			/* See if we're filtering messages. A batch of messages must be filtered one by one, after copying */
+			if (stdfilter && !filterlater) {
+				char *eom = strstr(channel->channelbuf, "\n@@\n");
+				prefilter = !(eom && *(eom+4));
+			}
+			else prefilter = 0;
+
+			if (!prefilter || acceptmessage(channel->channelbuf)) {
 				msgsz = strlen(channel->channelbuf);
 				memcpy(inbuf+checksumsize, channel->channelbuf, msgsz+1); /* Include \0 */
 			}
 			else {
-				/* If we're filtering, then reject messages first and check the */
-				/* meta line regexes first (since they're quicker) */
-				int deny = 0;
-				int accept = 1;
-
-				deny =  (metaexfilter && matchregex(channel->channelbuf, metaexfilter)) ? 1 :
-					( msgexfilter && matchregex(channel->channelbuf,  msgexfilter)) ? 1 : 0;
-
-				/* accept only becomes 0 if we haven't denied and it and we have filters that don't match */
-				if (!deny && (metafilter || msgfilter)) accept =
-					(  metafilter && matchregex(channel->channelbuf,   metafilter)) ? 1 :
-					(   msgfilter && matchregex(channel->channelbuf,    msgfilter)) ? 1 : 0;
-
-				/* if deny'd, then accept=0... and if we're here then stdfilter exists */
-				/* (meaning deny by default) */
-				if ((!deny && accept) || matchregex(channel->channelbuf, stdfilter)) {
-					msgsz = strlen(channel->channelbuf);
-					memcpy(inbuf+checksumsize, channel->channelbuf, msgsz+1); /* Include \0 */
-				}
-				else {
-					msgsz = 0; *inbuf = '\0';
-				}
+				msgsz = 0; *inbuf = '\0';
 			}
 
 			/* 
@@ -850,78 +962,8 @@ int main(int argc, char *argv[])
 				errprintf("Tried to down BOARDBUSY: %s\n", strerror(errno));
 			}
 
-			/* If we postponed filtering after we handled the semaphore logic, do it now */
-			/* This logic is subtly different since we must now clear the buffer if we don't want it */
-			if (filterlater) {
-
-				/* If we're filtering now, then reject messages first and check the */
-				/* meta line regexes first (since they're quicker) */
-				int deny = 0;
-				int accept = 1;
-
-				deny =  (metaexfilter && matchregex(inbuf, metaexfilter)) ? 1 :
-					( msgexfilter && matchregex(inbuf,  msgexfilter)) ? 1 : 0;
-
-				if (!deny && (metafilter || msgfilter)) accept =
-					(  metafilter && matchregex(inbuf,   metafilter)) ? 1 :
-					(   msgfilter && matchregex(inbuf,    msgfilter)) ? 1 : 0;
-
-				/* if deny'd, then accept=0... and if we're here then stdfilter exists */
-				/* (meaning deny by default) */
-				/* INVERT of this: --> if ((!deny && accept) || matchregex(channel->channelbuf, stdfilter)) */
-
-				if ((deny || !accept) && !matchregex(inbuf, stdfilter)) { msgsz = 0; *inbuf = '\0'; }
-			}
-
-
-			if (msgsz) {
-				/*
-				 * See if they want us to rotate logs. We pass this on to
-				 * the worker module as well, but must handle our own logfile.
-				 */
-				if (strncmp(inbuf+checksumsize, "@@logrotate", 11) == 0) {
-					dologswitch = 1;
-				}
-
-				/*
-				 * Are we shutting down via channel command? Flag for closing.
-				 */
-				if (strncmp(inbuf+checksumsize, "@@shutdown", 10) == 0) {
-					logprintf("xymond_channel: received shutdown message\n");
-					running = 0;
-				}
-
-				if (checksumsize > 0) {
-					char *sep1 = inbuf + checksumsize + strcspn(inbuf+checksumsize, "#|\n");
-
-					if (*sep1 == '#') {
-						/* 
-						 * Add md5 hash of the message. I.e. transform the header line from
-						 *   "@@%s#%u/%s|%d.%06d| channelmarker, seq, hostname, tstamp.tv_sec, tstamp.tv_usec
-						 * to
-						 *   "@@%s:%s#%u/%s|%d.%06d| channelmarker, hashstr, seq, hostname, tstamp.tv_sec, tstamp.tv_usec
-						 */
-						char *hashstr = md5hash(inbuf+checksumsize);
-						int hlen = sep1 - (inbuf + checksumsize);
-
-						memmove(inbuf, inbuf+checksumsize, hlen);
-						*(inbuf + hlen) = ':';
-						memcpy(inbuf+hlen+1, hashstr, strlen(hashstr));
-					}
-					else {
-						/* No sequence number (control message). Skip checksum for these */
-						memmove(inbuf, inbuf+checksumsize, msgsz+1);
-					}
-				}
-
-
-				/*
-				 * Put the new message on our outbound queue.
-				 */
-				if (addmessage(inbuf, msgsz) != 0) {
-					/* Failed to queue message */
-					errprintf("Failed to queue message, moving on\n");
-				}
+			/* If we postponed filtering after we handled the semaphore logic, it is done now */
+			if (msgsz && queuebatch(inbuf, msgsz, !prefilter)) {
 				gotmsg = 1;			/* since we received something from xymond, don't dally too long */
 			}
 		}
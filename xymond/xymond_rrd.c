@@ -184,6 +184,7 @@ int main(int argc, char *argv[])
 	char *exthandler = NULL;
 	char *extids = NULL;
 	char *processor = NULL;
+	char *journalfn = NULL;
 	time_t now;
 	struct sockaddr_un ctlsockaddr;
 	int ctlsocket;
@@ -191,7 +192,10 @@ int main(int argc, char *argv[])
 	int force_backfeedqueue = 0;
 	int comboflushtime;
 	int checkctltime;
+	int statusreporttime;
 	struct timespec *timeout = NULL;
+	struct timespec wakeuptimeout = { 1, 0 };
+	int journaling = 0;
 
 	libxymon_init(argv[0]);
 
@@ -241,10 +245,26 @@ int main(int argc, char *argv[])
 		else if (strcmp(argv[argi], "--no-rrd") == 0) {
 			no_rrd = 1;
 		}
-		else if (strcmp(argv[argi], "--cachemultiplier=") == 0) {
+		else if (argnmatch(argv[argi], "--cachemultiplier=")) {
 			cacheflushsz = atoi(argv[argi]+18);
 			if (cacheflushsz == 0) cacheflushsz = 1;
 		}
+		else if (argnmatch(argv[argi], "--journal=")) {
+			char *p = strchr(argv[argi], '=');
+			journalfn = strdup(p+1);
+		}
+		else if (argnmatch(argv[argi], "--writers=")) {
+			char *p = strchr(argv[argi], '=');
+			rrdwriters = atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--writer-queue=")) {
+			char *p = strchr(argv[argi], '=');
+			rrdwriterqueue = atoi(p+1);
+		}
+		else if (argnmatch(argv[argi], "--flush-rate=")) {
+			char *p = strchr(argv[argi], '=');
+			rrdflushrate = atoi(p+1);
+		}
 		else if (net_worker_option(argv[argi])) {
 			/* Handled in the subroutine */
 		}
@@ -297,6 +317,7 @@ int main(int argc, char *argv[])
 	reloadtime = now + 600;
 	comboflushtime = now + 23;
 	checkctltime = now + 4;
+	statusreporttime = now + 300;
 
 
 	memset(&sa, 0, sizeof(sa));
@@ -334,12 +355,29 @@ int main(int argc, char *argv[])
 		ctlsocket = -1;
 	}
 
-	/* Load the RRD definitions */
+	/* Load the RRD definitions, and setup the lookup of the update handlers */
 	load_rrddefs();
+	setup_rrdhandlers();
 
 	/* If we are passing data to an external processor, create the pipe to it */
 	setup_extprocessor(processor);
 
+	/*
+	 * Replay the updates cached by a previous xymond_rrd that did not get
+	 * to write them. This waits for a previous xymond_rrd to finish flushing
+	 * its cache, so we need not hold back our own cache flushing afterwards.
+	 */
+	if (journalfn) {
+		if (!use_rrd_cache || no_rrd) errprintf("Not using a journal, the RRD update cache is not used\n");
+		else if (rrdjournal_open(journalfn) == 0) {
+			releasecachedelay = 0;
+			journaling = 1;
+		}
+	}
+
+	/* Start the RRD writer threads, if we use them */
+	start_rrdwriters();
+
 	while (running) {
 		char *eoln, *restofmsg = NULL;
 		char *metadata[MAX_META+1];
@@ -385,8 +423,19 @@ int main(int argc, char *argv[])
 		}
 
 
+		/* Log any failed updates from the RRD writers, write the files that are due, and send off old rrdcached updates */
+		collect_rrdwriters();
+		rrdflush_run();
+		rrdcached_sendupdates(0);
+		rrdjournal_sync(0);
+		if (statusreporttime < now) {
+			report_rrdstatus();
+			statusreporttime = now + 300;
+		}
+
 		/* Get next message */
-		msg = get_xymond_message(C_LAST, argv[0], &seq, timeout);
+		/* When journaling or scheduling flushes, wake up when idle, so the journal and the files get written */
+		msg = get_xymond_message(C_LAST, argv[0], &seq, ((timeout || !(journaling || (rrdflushrate > 0))) ? timeout : &wakeuptimeout));
 		if (msg == NULL) {
 			running = 0;
 			continue;
@@ -484,6 +533,8 @@ int main(int argc, char *argv[])
 		}
 		else if (strncmp(metadata[0], "@@idle", 6) == 0) {
 			dbgprintf("Got an 'idle' message\n");
+			rrdcached_sendupdates(1);
+			rrdjournal_sync(1);
 			combo_end();
 			if (usebackfeedqueue) combo_start_local(); else combo_start();
 			continue;
@@ -503,6 +554,8 @@ int main(int argc, char *argv[])
 			char hostdir[PATH_MAX];
 			hostname = metadata[3];
 
+			/* Finish the queued updates before the files go away */
+			drain_rrdwriters();
 			sprintf(hostdir, "%s/%s", rrddir, basename(hostname));
 			dropdirectory(hostdir, 1);
 		}
@@ -520,6 +573,7 @@ int main(int argc, char *argv[])
 
 			hostname = metadata[3];
 			newhostname = metadata[4];
+			drain_rrdwriters();
 			sprintf(oldhostdir, "%s/%s", rrddir, hostname);
 			sprintf(newhostdir, "%s/%s", rrddir, newhostname);
 			rename(oldhostdir, newhostdir);
@@ -531,23 +585,31 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* Finish the queued updates; the remaining cache is flushed below without threads */
+	stop_rrdwriters();
+
 	/* Close out any modify's waiting to be sent */
 	combo_end();
 	if (usebackfeedqueue) sendmessage_finish_local();
 
 	/* Close the external processor */
 	shutdown_extprocessor();
+
+	/* The journal is complete on disk, in case the flush does not finish */
+	rrdjournal_sync(1);
 	
 	flushpid = fork();
 	if (flushpid == -1) {
 		errprintf("Could not fork cacheflush child:%s\n", strerror(errno));
 		rrdcacheflushall();
+		rrdjournal_close();
 		errprintf("Cache flush completed\n");
 	}
 	else if (flushpid == 0) {
 		/* Flush all cached updates to disk */
 		errprintf("Shutting down, flushing cached updates to disk\n");
 		rrdcacheflushall();
+		rrdjournal_close();
 		errprintf("Cache flush completed\n");
 		_exit(0);
 	}
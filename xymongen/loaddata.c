@@ -484,6 +484,8 @@ state_t *load_state(dispsummary_t **sumhead)
 	state_t		*newstate, *topstate;
 	dispsummary_t	*newsum, *topsum;
 	char 		*board = NULL;
+	size_t		boardlen = 0;
+	binboard_reader_t *bb = NULL;
 	char		*nextline;
 	int		done;
 	logdata_t	log;
@@ -507,8 +509,10 @@ state_t *load_state(dispsummary_t **sumhead)
 				fd = fopen(dumpfn, "r");
 				if (fd) {
 					board = (char *)malloc(st.st_size + 1); *board = '\0';
-					if (fread(board, 1, st.st_size, fd)) {
+					boardlen = fread(board, 1, st.st_size, fd);
+					if (boardlen) {
 						fclose(fd);
+						*(board + boardlen) = '\0';
 						xymondresult = XYMONSEND_OK;
 					}
 				}
@@ -518,14 +522,16 @@ state_t *load_state(dispsummary_t **sumhead)
 			char *bcmd;
 
 			bcmd = (char *)malloc(1024 + (filter ? strlen(filter) : 0));
-			sprintf(bcmd, "xymondboard fields=hostname,testname,color,flags,lastchange,logtime,validtime,acktime,disabletime,sender,cookie,line1,acklist %s", (filter ? filter: ""));
+			sprintf(bcmd, "xymondboard format=binary fields=hostname,testname,color,flags,lastchange,logtime,validtime,acktime,disabletime,sender,cookie,line1,acklist %s", (filter ? filter: ""));
 			xymondresult = sendmessage(bcmd, NULL, XYMON_TIMEOUT, sres);
+			boardlen = getsendreturnlen(sres);
 			board = getsendreturnstr(sres, 1);
 			xfree(bcmd);
 		}
 	}
 	else {
-		xymondresult = sendmessage("xymondboard fields=hostname,testname", NULL, XYMON_TIMEOUT, sres);
+		xymondresult = sendmessage("xymondboard format=binary fields=hostname,testname", NULL, XYMON_TIMEOUT, sres);
+		boardlen = getsendreturnlen(sres);
 		board = getsendreturnstr(sres, 1);
 	}
 
@@ -552,49 +558,79 @@ state_t *load_state(dispsummary_t **sumhead)
 	topstate = NULL;
 	topsum = NULL;
 
+	/*
+	 * xymond sends the binary format, unless it is an older version that
+	 * ignores "format=binary". A BOARDDUMP file may hold either one.
+	 */
+	if (binboard_isbinary(board, boardlen)) bb = binboard_open(board, boardlen);
+
 	done = 0; nextline = board;
 	while (!done) {
 		char *bol = nextline;
-		char *onelog, *acklist;
+		char *onelog = NULL, *acklist = NULL;
 		char *p;
 		int i;
 
-		nextline = strchr(nextline, '\n');
-		if (nextline) { *nextline = '\0'; nextline++; } else done = 1;
+		memset(&log, 0, sizeof(log));
 
-		if (strlen(bol) == 0) {
-			done = 1;
-			continue;
+		if (bb) {
+			/* The strings point into the board buffer, so there is nothing to copy or decode */
+			if (!binboard_next(bb)) {
+				done = 1;
+				continue;
+			}
+
+			log.hostname = binboard_str(bb, 0);
+			log.testname = binboard_str(bb, 1);
+			log.color = binboard_int(bb, 2);
+			log.testflags = binboard_str(bb, 3);
+			log.lastchange = binboard_int(bb, 4);
+			log.logtime = binboard_int(bb, 5);
+			log.validtime = binboard_int(bb, 6);
+			log.acktime = binboard_int(bb, 7);
+			log.disabletime = binboard_int(bb, 8);
+			log.sender = binboard_str(bb, 9);
+			log.cookie = (binboard_str(bb, 10) ? atoi(binboard_str(bb, 10)) : 0);
+			log.msg = binboard_str(bb, 11);
+			acklist = binboard_str(bb, 12);
 		}
+		else {
+			nextline = strchr(nextline, '\n');
+			if (nextline) { *nextline = '\0'; nextline++; } else done = 1;
 
-		memset(&log, 0, sizeof(log));
-		onelog = strdup(bol);
-		acklist = NULL;
-		p = gettok(onelog, "|"); i = 0;
-		while (p) {
-			switch (i) {
-			  /* hostname|testname|color|testflags|lastchange|logtime|validtime|acktime|disabletime|sender|cookie|1st line of message|acklist */
-			  case  0: log.hostname = p; break;
-			  case  1: log.testname = p; break;
-			  case  2: log.color = parse_color(p); break;
-			  case  3: log.testflags = p; break;
-			  case  4: log.lastchange = atoi(p); break;
-			  case  5: log.logtime = atoi(p); break;
-			  case  6: log.validtime = atoi(p); break;
-			  case  7: log.acktime = atoi(p); break;
-			  case  8: log.disabletime = atoi(p); break;
-			  case  9: log.sender = p; break;
-			  case 10: log.cookie = atoi(p); break;
-			  case 11: log.msg = p; break;
-			  case 12: acklist = p; break;
+			if (strlen(bol) == 0) {
+				done = 1;
+				continue;
 			}
 
-			p = gettok(NULL, "|");
-			i++;
+			onelog = strdup(bol);
+			p = gettok(onelog, "|"); i = 0;
+			while (p) {
+				switch (i) {
+				  /* hostname|testname|color|testflags|lastchange|logtime|validtime|acktime|disabletime|sender|cookie|1st line of message|acklist */
+				  case  0: log.hostname = p; break;
+				  case  1: log.testname = p; break;
+				  case  2: log.color = parse_color(p); break;
+				  case  3: log.testflags = p; break;
+				  case  4: log.lastchange = atoi(p); break;
+				  case  5: log.logtime = atoi(p); break;
+				  case  6: log.validtime = atoi(p); break;
+				  case  7: log.acktime = atoi(p); break;
+				  case  8: log.disabletime = atoi(p); break;
+				  case  9: log.sender = p; break;
+				  case 10: log.cookie = atoi(p); break;
+				  case 11: log.msg = p; break;
+				  case 12: acklist = p; break;
+				}
+
+				p = gettok(NULL, "|");
+				i++;
+			}
 		}
+
 		if (!log.hostname || !log.testname) {
 			errprintf("Found incomplete or corrupt log line (%s|%s); skipping\n", textornull(log.hostname), textornull(log.testname) );
-			xfree(onelog);
+			if (onelog) xfree(onelog);
 			continue;
 		}
 		if (!log.msg) log.msg = "";
@@ -632,8 +668,9 @@ state_t *load_state(dispsummary_t **sumhead)
 				}
 			}
 		}
-		xfree(onelog);
+		if (onelog) xfree(onelog);
 	}
+	if (bb) binboard_close(bb);
 
 	generate_compactitems(&topstate);
 